@@ -8,6 +8,7 @@
 #include "FileReader.hpp"
 #include "FileWriter.hpp"
 
+#include <atomic>
 #include <mutex>
 
 namespace core {
@@ -52,6 +53,8 @@ public:
         uint32_t camera_index,
         const protos::CameraExtrinsics& extrinsics);
     void SetCompression(const protos::CompressionSettings& compression);
+    void SetVertexFormat(int32_t format);
+    void SetMeshLod(float max_error_mm, uint32_t max_triangles);
     void PlaybackSettings(uint32_t dejitter_queue_msec);
     void SetLighting(
         uint64_t guid,
@@ -84,6 +87,17 @@ protected:
 
     std::shared_ptr<DejitterQueue> PlaybackQueue;
 
+    // XrcapVertexFormat for meshes passed to the application
+    std::atomic<int32_t> VertexFormat = ATOMIC_VAR_INIT(XrcapVertexFormat_Float);
+
+    // Simplified meshes passed to the application, if LodMaxErrorMm > 0
+    std::mutex LodLock;
+    float LodMaxErrorMm = 0.f;
+    int LodMaxTriangles = 0;
+
+    // Used from the playback thread
+    DepthMeshLod MeshLod;
+
     // Frame data pinned for application
     std::mutex FrameLock;
     std::shared_ptr<DecodedBatch> PinnedBatch;
@@ -12,9 +12,12 @@
 #include <zdepth_lossy.hpp> // zdepth
 #include <core.hpp> // core
 #include <DepthMesh.hpp> // depth_mesh
+#include <DepthMeshDelta.hpp> // depth_mesh
+#include <DepthMeshLod.hpp> // depth_mesh
 #include <tbb/tbb.h> // tbb
 
 #include <functional>
+#include <thread>
 
 namespace core {
 
@@ -24,6 +27,10 @@ namespace core {
 
 static const int kMaxQueuedDecodes = 60;
 
+// Maximum number of row bands to split each depth mesh into for parallel
+// meshing.  Fewer bands are used on machines with fewer cores
+static const int kMaxMeshBands = 8;
+
 
 //------------------------------------------------------------------------------
 // DecodedFrame
@@ -53,6 +60,28 @@ struct DecodedFrame
     std::vector<float> XyzuvVertices;
     int IndicesCount = 0;
     std::vector<uint32_t> Indices;
+
+    // Compact copy of the mesh vertices, if requested by the application
+    CompactVertices Compact;
+
+    // If the mesh was generated by DepthMeshDelta, then the vertices and
+    // indices are in this snapshot in its block layout instead of above.
+    // The snapshot is shared with other frames from the same mesh update
+    std::shared_ptr<const DepthMeshSnapshot> MeshSnapshot;
+
+    const float* GetXyzuvVertices() const
+    {
+        return MeshSnapshot ? MeshSnapshot->Coordinates.data() : XyzuvVertices.data();
+    }
+    const uint32_t* GetIndices() const
+    {
+        return MeshSnapshot ? MeshSnapshot->Indices.data() : Indices.data();
+    }
+
+    // Simplified mesh, if requested by the application
+    bool HasLod = false;
+    std::vector<float> LodXyzuvVertices;
+    std::vector<uint32_t> LodIndices;
 };
 
 
@@ -88,6 +117,9 @@ struct DecodePipelineData
     DecodePipelineCallback Callback;
     std::shared_ptr<FrameInfo> Input;
 
+    // XrcapVertexFormat to generate the mesh in
+    int32_t VertexFormat = XrcapVertexFormat_Float;
+
     // Outputs
     std::shared_ptr<DecodedFrame> Output;
 };
@@ -167,6 +199,9 @@ struct MeshDecompressorElement : public DecodePipelineElement
     TemporalDepthFilter TemporalFilter;
     DepthEdgeFilter EdgeFilter;
 
+    // Incremental mesh, if requested
+    std::unique_ptr<DepthMeshDelta> MeshDelta;
+
     bool Run(std::shared_ptr<DecodePipelineData> data) override;
 };
 
@@ -288,4 +288,53 @@ struct ChunkFrameHeader
 #pragma pack(pop)
 
 
+//------------------------------------------------------------------------------
+// FileChunkIterator
+
+/*
+    Walks the chunks of a recording held in memory, for example from
+    MappedReadOnlySmallFile.  Stops at the end of the data or at the first
+    chunk that extends past it.
+*/
+class FileChunkIterator
+{
+public:
+    FileChunkIterator(const uint8_t* data, unsigned bytes)
+        : Data(data)
+        , Bytes(bytes)
+    {
+    }
+
+    // Returns false if there are no more complete chunks.
+    // Otherwise header and payload point to the next chunk
+    bool Next(const FileChunkHeader*& header, const uint8_t*& payload);
+
+    // Returns true if the data ended partway through a chunk
+    bool IsTruncated() const
+    {
+        return Truncated;
+    }
+
+protected:
+    const uint8_t* Data = nullptr;
+    unsigned Bytes = 0;
+    unsigned Offset = 0;
+    bool Truncated = false;
+};
+
+// Frame chunk with pointers to its image and depth data
+struct FileFrameChunk
+{
+    const ChunkFrameHeader* Header = nullptr;
+    const uint8_t* Image = nullptr; // Header->ImageBytes
+    const uint8_t* Depth = nullptr; // Header->DepthBytes
+};
+
+// Returns false if the chunk is not a frame or its data does not fit
+bool ParseFrameChunk(
+    const FileChunkHeader* header,
+    const uint8_t* payload,
+    FileFrameChunk& frame);
+
+
 } // namespace core
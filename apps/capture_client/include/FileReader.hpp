@@ -39,6 +39,9 @@ public:
     void Pause(bool pause);
     void SetLoopRepeat(bool loop_repeat);
 
+    // XrcapVertexFormat to generate meshes in
+    void SetVertexFormat(int32_t format);
+
     void GetPlaybackState(XrcapPlayback& playback_state);
 
 protected:
@@ -54,6 +57,7 @@ protected:
 
     std::atomic<bool> Paused = ATOMIC_VAR_INIT(false);
     std::atomic<bool> LoopRepeat = ATOMIC_VAR_INIT(false);
+    std::atomic<int32_t> VertexFormat = ATOMIC_VAR_INIT(XrcapVertexFormat_Float);
 
     std::shared_ptr<protos::MessageBatchInfo> BatchInfo;
     uint64_t VideoEpochUsec = 0;
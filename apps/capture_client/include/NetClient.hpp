@@ -169,6 +169,9 @@ public:
 
     std::shared_ptr<DejitterQueue> PlaybackQueue;
 
+    // XrcapVertexFormat to generate meshes in
+    std::atomic<int32_t> VertexFormat = ATOMIC_VAR_INIT(XrcapVertexFormat_Float);
+
 protected:
     virtual tonk::SDKConnection* OnIncomingConnection(
         const TonkAddress& address ///< Address of the client requesting a connection
@@ -107,6 +107,7 @@ typedef enum XrcapVideo_t {
     XrcapVideo_Lossless = 0,
     XrcapVideo_H264     = 1,
     XrcapVideo_H265     = 2,
+    XrcapVideo_NearLossless = 3,
     XrcapVideo_Count
 } XrcapVideo;
 
@@ -124,6 +125,15 @@ typedef enum XrcapLensModel_t {
 
 XRCAP_EXPORT const char* xrcap_lens_model_str(int32_t model);
 
+typedef enum XrcapVertexFormat_t {
+    XrcapVertexFormat_Float   = 0, // XyzuvVertices only
+    XrcapVertexFormat_Compact = 1, // Also provide CompactVertices
+    XrcapVertexFormat_Delta   = 2, // XyzuvVertices in blocks with versions
+    XrcapVertexFormat_Count
+} XrcapVertexFormat;
+
+XRCAP_EXPORT const char* xrcap_vertex_format_str(int32_t format);
+
 
 //------------------------------------------------------------------------------
 // Compression
@@ -133,7 +143,7 @@ typedef struct XrcapCompression_t {
     // RGB video settings
     uint32_t ColorBitrate; ///< 4000000 = 4 Mbps
     uint8_t ColorQuality; ///< 1-51 (1=best)
-    uint8_t ColorVideo; ///< enum XrcapVideo
+    uint8_t ColorVideo; ///< enum XrcapVideo: H264 or H265 only
 
     // Depth video settings
     uint8_t DepthVideo; ///< enum XrcapVideo
@@ -326,6 +336,45 @@ typedef struct XrcapPerspective_t {
     // ProcAmp color enhancements for this frame
     float Brightness;
     float Saturation;
+
+#define XRCAP_COMPACT_STRIDE 5
+#define XRCAP_COMPACT_POSITION_SCALE (1.f / 4000.f)
+
+    // XyzuvVertices in a 10 byte format, if enabled by xrcap_set_vertex_format().
+    // Otherwise CompactCount = 0.
+    // Represented as repeated uint16_t: x,y,z,u,v
+    // Position in meters = XRCAP_COMPACT_POSITION_SCALE * (int16_t)(x,y,z)
+    // Texture coordinate = (u,v) / 65535
+    uint32_t CompactCount; // Number of vertices
+    uint16_t* CompactVertices;
+
+#define XRCAP_MESH_BLOCK_FLOATS 320
+#define XRCAP_MESH_BLOCK_INDICES 384
+
+    // Block layout of the mesh, if enabled by xrcap_set_vertex_format().
+    // Otherwise MeshBlockCount = 0.
+    // Block b owns XRCAP_MESH_BLOCK_FLOATS floats of XyzuvVertices starting
+    // at b * XRCAP_MESH_BLOCK_FLOATS and XRCAP_MESH_BLOCK_INDICES indices
+    // starting at b * XRCAP_MESH_BLOCK_INDICES, of which the first
+    // MeshBlockIndexCounts[b] are used and the rest are degenerate.
+    // MeshVertexVersions[b] and MeshIndexVersions[b] are the MeshVersion in
+    // which the block last changed.  Versions are only comparable between
+    // frames with the same MeshStreamId.
+    // In this mode frames with the same MeshStreamId and MeshVersion share
+    // the same vertices and indices, so they must not be modified.
+    uint32_t MeshStreamId;
+    uint32_t MeshVersion;
+    uint32_t MeshBlockCount;
+    const uint32_t* MeshBlockIndexCounts;
+    const uint32_t* MeshVertexVersions;
+    const uint32_t* MeshIndexVersions;
+
+    // Simplified mesh with the same vertex format as XyzuvVertices,
+    // if enabled by xrcap_set_mesh_lod().  Otherwise LodIndicesCount = 0.
+    uint32_t LodIndicesCount;
+    uint32_t* LodIndices;
+    uint32_t LodFloatsCount;
+    float* LodXyzuvVertices;
 } XrcapPerspective;
 
 
@@ -533,6 +582,42 @@ XRCAP_EXPORT void xrcap_set_compression(
     const XrcapCompression* compression);
 
 
+//------------------------------------------------------------------------------
+// Vertex Format
+
+/*
+    Select XrcapVertexFormat for XrcapPerspective meshes.
+
+    XrcapVertexFormat_Compact also writes each vertex in 10 bytes instead of
+    20, in the same meshing pass as the float vertices.  This halves the
+    memory bandwidth and GPU upload volume per frame for the renderer.
+    The float vertices are still provided for CPU-side processing.
+
+    XrcapVertexFormat_Delta generates the mesh in 8x8 pixel blocks with
+    stable vertex numbering, and only re-meshes blocks whose depth changed.
+    Renderers can upload only the blocks that changed since the last frame
+    they uploaded, using the MeshBlock* fields of XrcapPerspective.
+    Vertices without depth are zeroes and are not used by any triangle.
+*/
+XRCAP_EXPORT void xrcap_set_vertex_format(int32_t format);
+
+
+//------------------------------------------------------------------------------
+// Mesh Level of Detail
+
+/*
+    Also provide a simplified mesh in the Lod* fields of XrcapPerspective,
+    for exports with a size cap or for viewers far from the subject.
+    Smooth regions of the mesh are merged into larger triangles.
+
+    max_error_mm: Maximum depth error of merged regions in millimeters.
+    Set to 0 to disable.
+    max_triangles: If non-zero, the error is increased until each
+    perspective has at most this many triangles, where possible.
+*/
+XRCAP_EXPORT void xrcap_set_mesh_lod(float max_error_mm, uint32_t max_triangles);
+
+
 //------------------------------------------------------------------------------
 // C Boilerplate
 
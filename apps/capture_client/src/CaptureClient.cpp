@@ -63,6 +63,7 @@ void CaptureClient::Connect(
     LastMode = -1;
 
     Client = std::make_shared<NetClient>();
+    Client->VertexFormat = VertexFormat.load();
 
     const bool result = Client->Initialize(
         PlaybackQueue,
@@ -88,6 +89,33 @@ void CaptureClient::PlayFrame(std::shared_ptr<DecodedBatch>& batch)
 
     batch->EpochUsec = TimeConverter.Convert(batch->VideoBootUsec);
 
+    DepthLodParams lod_params;
+    {
+        std::lock_guard<std::mutex> locker(LodLock);
+        lod_params.MaxErrorMm = LodMaxErrorMm;
+        lod_params.MaxTriangles = LodMaxTriangles;
+    }
+
+    // Simplify meshes here too, also only once per frame
+    if (lod_params.MaxErrorMm > 0.f) {
+        for (auto& image : batch->Frames) {
+            if (image->HasLod || image->FloatsCount <= 0) {
+                continue;
+            }
+
+            MeshLod.Generate(
+                image->Depth.data(),
+                image->DepthWidth,
+                image->DepthHeight,
+                image->GetXyzuvVertices(),
+                image->MeshSnapshot ? DepthLodLayout::Blocks : DepthLodLayout::Packed,
+                lod_params,
+                image->LodXyzuvVertices,
+                image->LodIndices);
+            image->HasLod = true;
+        }
+    }
+
     {
         std::lock_guard<std::mutex> locker(FrameLock);
         LatestBatch = batch;
@@ -196,6 +224,12 @@ void CaptureClient::GetFrame(XrcapFrame* output_frame)
 
     PinnedBatch = LatestBatch;
 
+    bool lod_enabled;
+    {
+        std::lock_guard<std::mutex> lod_locker(LodLock);
+        lod_enabled = LodMaxErrorMm > 0.f;
+    }
+
     output_frame->Valid = 1;
     output_frame->FrameNumber = FrameNumber++;
     output_frame->ExposureEpochUsec = PinnedBatch->EpochUsec;
@@ -214,11 +248,35 @@ void CaptureClient::GetFrame(XrcapFrame* output_frame)
         perspective.ChromaWidth = image->ChromaWidth;        
         perspective.ChromaHeight = image->ChromaHeight;
 
-        perspective.Indices = image->Indices.data();
+        // Read-only: Delta meshes are shared between frames
+        perspective.Indices = const_cast<uint32_t*>( image->GetIndices() );
         perspective.IndicesCount = image->IndicesCount;
-        perspective.XyzuvVertices = image->XyzuvVertices.data();
+        perspective.XyzuvVertices = const_cast<float*>( image->GetXyzuvVertices() );
         perspective.FloatsCount = image->FloatsCount;
 
+        static_assert(XRCAP_COMPACT_STRIDE == kCompactVertexShorts, "Update this");
+        perspective.CompactVertices = image->Compact.Vertices.data();
+        perspective.CompactCount = image->Compact.VertexCount;
+
+        static_assert(XRCAP_MESH_BLOCK_FLOATS == DepthMeshDelta::kBlockFloats, "Update this");
+        static_assert(XRCAP_MESH_BLOCK_INDICES == DepthMeshDelta::kBlockIndices, "Update this");
+        const DepthMeshSnapshot* snapshot = image->MeshSnapshot.get();
+        perspective.MeshStreamId = snapshot ? snapshot->StreamId : 0;
+        perspective.MeshVersion = snapshot ? snapshot->Version : 0;
+        perspective.MeshBlockCount = snapshot ? snapshot->BlockCount : 0;
+        perspective.MeshBlockIndexCounts = snapshot ? snapshot->BlockIndexCounts.data() : nullptr;
+        perspective.MeshVertexVersions = snapshot ? snapshot->VertexVersions.data() : nullptr;
+        perspective.MeshIndexVersions = snapshot ? snapshot->IndexVersions.data() : nullptr;
+
+        perspective.LodIndicesCount = 0;
+        perspective.LodFloatsCount = 0;
+        if (image->HasLod && lod_enabled) {
+            perspective.LodIndicesCount = static_cast<uint32_t>( image->LodIndices.size() );
+            perspective.LodFloatsCount = static_cast<uint32_t>( image->LodXyzuvVertices.size() );
+        }
+        perspective.LodIndices = image->LodIndices.data();
+        perspective.LodXyzuvVertices = image->LodXyzuvVertices.data();
+
         auto& frame_header = image->Info->FrameHeader;
         for (int i = 0; i < 3; ++i) {
             perspective.Accelerometer[i] = frame_header.Accelerometer[i];
@@ -372,6 +430,15 @@ void CaptureClient::SetExtrinsics(
 
 void CaptureClient::SetCompression(const protos::CompressionSettings& compression)
 {
+    // Lossless and NearLossless are depth-only codecs
+    if (compression.ColorVideo != protos::VideoType_H264 &&
+        compression.ColorVideo != protos::VideoType_H265)
+    {
+        spdlog::error("Invalid color video {}: Must be H264 or H265",
+            xrcap_video_str(compression.ColorVideo));
+        return;
+    }
+
     std::lock_guard<std::mutex> locker(ApiLock);
 
     if (!Client) {
@@ -389,6 +456,44 @@ void CaptureClient::SetCompression(const protos::CompressionSettings& compressio
     }
 }
 
+void CaptureClient::SetVertexFormat(int32_t format)
+{
+    if (format < 0 || format >= XrcapVertexFormat_Count) {
+        spdlog::error("Invalid vertex format {}", format);
+        return;
+    }
+    spdlog::info("Vertex format: {}", xrcap_vertex_format_str(format));
+    VertexFormat = format;
+
+    // Frames already being decoded keep the previous format
+    std::lock_guard<std::mutex> locker(ApiLock);
+
+    if (Client) {
+        Client->VertexFormat = format;
+    }
+    if (Reader) {
+        Reader->SetVertexFormat(format);
+    }
+}
+
+void CaptureClient::SetMeshLod(float max_error_mm, uint32_t max_triangles)
+{
+    std::lock_guard<std::mutex> locker(LodLock);
+
+    if (max_error_mm < 0.f) {
+        max_error_mm = 0.f;
+    }
+    if (LodMaxErrorMm == max_error_mm &&
+        LodMaxTriangles == static_cast<int>( max_triangles ))
+    {
+        return;
+    }
+
+    spdlog::info("Mesh LOD: max_error_mm={} max_triangles={}", max_error_mm, max_triangles);
+    LodMaxErrorMm = max_error_mm;
+    LodMaxTriangles = static_cast<int>( max_triangles );
+}
+
 void CaptureClient::PlaybackSettings(uint32_t dejitter_queue_msec)
 {
     std::lock_guard<std::mutex> locker(ApiLock);
@@ -468,6 +573,7 @@ bool CaptureClient::PlaybackReadFile(const char* file_path)
 
     Reader.reset();
     Reader = std::make_unique<FileReader>();
+    Reader->SetVertexFormat(VertexFormat);
     return Reader->Open(PlaybackQueue, file_path);
 }
 
@@ -197,6 +197,11 @@ bool MeshDecompressorElement::Run(std::shared_ptr<DecodePipelineData> data)
     {
         if (!LosslessDepth) {
             LosslessDepth = std::make_unique<lossless::DepthCompressor>();
+
+            // Tiled frames decompress in parallel
+            LosslessDepth->SetParallelFor([](int count, const std::function<void(int)>& task) {
+                tbb::parallel_for(0, count, task);
+            });
         }
         LossyDepth.reset();
 
@@ -247,6 +252,7 @@ bool MeshDecompressorElement::Run(std::shared_ptr<DecodePipelineData> data)
             output->DepthWidth, output->DepthHeight,
             color_width, color_height);
         Mesher.reset();
+        MeshDelta.reset();
     }
     DepthWidth = output->DepthWidth;
     ColorWidth = color_width;
@@ -254,6 +260,14 @@ bool MeshDecompressorElement::Run(std::shared_ptr<DecodePipelineData> data)
     if (!Mesher) {
         Mesher = std::make_unique<DepthMesher>();
         Mesher->Initialize(*data->Input->Calibration);
+
+        // Mesh bands in parallel, one band per core.
+        // On a single core banding only adds seam work, so mesh serially
+        const int cpu_cores = static_cast<int>( std::thread::hardware_concurrency() );
+        Mesher->SetBandCount(std::min(kMaxMeshBands, std::max(1, cpu_cores)));
+        Mesher->SetParallelFor([](int count, const std::function<void(int)>& task) {
+            tbb::parallel_for(0, count, task);
+        });
     }
 
     std::shared_ptr<protos::CameraExtrinsics> extrinsics = data->Input->Extrinsics;
@@ -270,19 +284,54 @@ bool MeshDecompressorElement::Run(std::shared_ptr<DecodePipelineData> data)
 
     const bool face_painting_fix = false; // Only do this on the server side
 
-    Mesher->GenerateCoordinates(
+    if (data->VertexFormat != XrcapVertexFormat_Delta)
+    {
+        MeshDelta.reset();
+
+        if (data->VertexFormat == XrcapVertexFormat_Compact) {
+            Mesher->GenerateCoordinates(
+                output->Depth.data(),
+                nullptr,
+                output->XyzuvVertices,
+                output->Compact,
+                face_painting_fix,
+                cull_depth);
+        } else {
+            Mesher->GenerateCoordinates(
+                output->Depth.data(),
+                nullptr,
+                output->XyzuvVertices,
+                face_painting_fix,
+                cull_depth);
+        }
+        output->FloatsCount = static_cast<int>( output->XyzuvVertices.size() );
+
+        Mesher->GenerateTriangleIndices(
+            output->Depth.data(),
+            output->Indices);
+        output->IndicesCount = static_cast<int>( output->Indices.size() );
+
+        return true;
+    }
+
+    // Only re-mesh the parts of the depth image that changed
+    if (!MeshDelta) {
+        MeshDelta = std::make_unique<DepthMeshDelta>();
+    }
+
+    MeshDelta->UpdateCoordinates(
+        *Mesher,
         output->Depth.data(),
         nullptr,
-        //nullptr,
-        output->XyzuvVertices,
         face_painting_fix,
         cull_depth);
-    output->FloatsCount = static_cast<int>( output->XyzuvVertices.size() );
+    MeshDelta->UpdateTriangles(output->Depth.data());
 
-    Mesher->GenerateTriangleIndices(
-        output->Depth.data(),
-        output->Indices);
-    output->IndicesCount = static_cast<int>( output->Indices.size() );
+    // The application may still hold older frames, so hand out a snapshot.
+    // Only the blocks that changed since a released snapshot are copied
+    output->MeshSnapshot = MeshDelta->GetSnapshot();
+    output->FloatsCount = static_cast<int>( output->MeshSnapshot->Coordinates.size() );
+    output->IndicesCount = static_cast<int>( output->MeshSnapshot->Indices.size() );
 
     return true;
 }
@@ -52,4 +52,51 @@ const char* FileChunkVideoToString(unsigned chunk_video)
 }
 
 
+//------------------------------------------------------------------------------
+// FileChunkIterator
+
+bool FileChunkIterator::Next(const FileChunkHeader*& header, const uint8_t*& payload)
+{
+    if (Bytes < Offset + kFileChunkHeaderBytes) {
+        Truncated = Offset < Bytes;
+        return false;
+    }
+
+    const FileChunkHeader* chunk = reinterpret_cast<const FileChunkHeader*>( Data + Offset );
+    if (kFileChunkHeaderBytes + chunk->Length > Bytes - Offset) {
+        Truncated = true;
+        return false;
+    }
+
+    header = chunk;
+    payload = Data + Offset + kFileChunkHeaderBytes;
+    Offset += kFileChunkHeaderBytes + chunk->Length;
+    return true;
+}
+
+bool ParseFrameChunk(
+    const FileChunkHeader* header,
+    const uint8_t* payload,
+    FileFrameChunk& frame)
+{
+    if (header->Type != FileChunk_Frame ||
+        header->Length < sizeof(ChunkFrameHeader))
+    {
+        return false;
+    }
+
+    const ChunkFrameHeader* frame_header = reinterpret_cast<const ChunkFrameHeader*>( payload );
+    const uint64_t frame_bytes = sizeof(ChunkFrameHeader) +
+        static_cast<uint64_t>( frame_header->ImageBytes ) + frame_header->DepthBytes;
+    if (frame_bytes > header->Length) {
+        return false;
+    }
+
+    frame.Header = frame_header;
+    frame.Image = payload + sizeof(ChunkFrameHeader);
+    frame.Depth = frame.Image + frame_header->ImageBytes;
+    return true;
+}
+
+
 } // namespace core
@@ -76,6 +76,11 @@ void FileReader::SetLoopRepeat(bool loop_repeat)
     LoopRepeat = loop_repeat;
 }
 
+void FileReader::SetVertexFormat(int32_t format)
+{
+    VertexFormat = format;
+}
+
 void FileReader::Loop()
 {
     while (!Terminated)
@@ -98,6 +103,8 @@ void FileReader::Loop()
                 const FileChunkHeader* header = reinterpret_cast<const FileChunkHeader*>( file_data );
                 if (kFileChunkHeaderBytes + header->Length <= remaining)
                 {
+                    FileFrameChunk frame;
+
                     if (header->Type == FileChunk_Calibration &&
                         header->Length == sizeof(ChunkCalibration))
                     {
@@ -184,10 +191,9 @@ void FileReader::Loop()
 
                         ++VideoFrameNumber;
                     }
-                    else if (header->Type == FileChunk_Frame &&
-                        header->Length > sizeof(ChunkFrameHeader))
+                    else if (ParseFrameChunk(header, file_data + kFileChunkHeaderBytes, frame))
                     {
-                        const ChunkFrameHeader* frame_header = reinterpret_cast<const ChunkFrameHeader*>( file_data + kFileChunkHeaderBytes );
+                        const ChunkFrameHeader* frame_header = frame.Header;
 
                         const GuidCameraIndex camera_guid = frame_header->CameraGuid;
 
@@ -220,16 +226,14 @@ void FileReader::Loop()
                             frame_info->FrameHeader.FrameNumber = frame_header->FrameNumber;
                             frame_info->FrameHeader.BackReference = frame_header->BackReference;
 
-                            const uint8_t* image_data = file_data + kFileChunkHeaderBytes + sizeof(ChunkFrameHeader);
                             frame_info->StreamedImage.Data.resize(frame_header->ImageBytes);
-                            memcpy(frame_info->StreamedImage.Data.data(), image_data, frame_header->ImageBytes);
+                            memcpy(frame_info->StreamedImage.Data.data(), frame.Image, frame_header->ImageBytes);
                             frame_info->StreamedImage.Complete = true;
                             frame_info->StreamedImage.ExpectedBytes = frame_header->ImageBytes;
                             frame_info->StreamedImage.ReceivedBytes = frame_header->ImageBytes;
 
-                            const uint8_t* depth_data = image_data + frame_header->ImageBytes;
                             frame_info->StreamedDepth.Data.resize(frame_header->DepthBytes);
-                            memcpy(frame_info->StreamedDepth.Data.data(), depth_data, frame_header->DepthBytes);
+                            memcpy(frame_info->StreamedDepth.Data.data(), frame.Depth, frame_header->DepthBytes);
                             frame_info->StreamedDepth.Complete = true;
                             frame_info->StreamedDepth.ExpectedBytes = frame_header->DepthBytes;
                             frame_info->StreamedDepth.ReceivedBytes = frame_header->DepthBytes;
@@ -274,6 +278,7 @@ void FileReader::OnFrame(const std::shared_ptr<FrameInfo>& input_frame)
     if (index < (int)DecodingFrames.size()) {
         std::shared_ptr<DecodePipelineData> data = std::make_shared<DecodePipelineData>();
         data->Input = input_frame;
+        data->VertexFormat = VertexFormat;
         data->Callback = [this](std::shared_ptr<DecodedFrame> decoded) {
             PlaybackQueue->Insert(decoded);
         };
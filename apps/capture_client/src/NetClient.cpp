@@ -268,6 +268,7 @@ void CaptureConnection::OnFrame(std::shared_ptr<FrameInfo> frame)
 
     std::shared_ptr<DecodePipelineData> data = std::make_shared<DecodePipelineData>();
     data->Input = frame;
+    data->VertexFormat = Client->VertexFormat;
     data->Callback = [this](std::shared_ptr<DecodedFrame> decoded) {
         Client->PlaybackQueue->Insert(decoded);
     };
@@ -109,12 +109,13 @@ XRCAP_EXPORT const char* xrcap_camera_code_str(int32_t camera_code)
 // XrcapVideo
 XRCAP_EXPORT const char* xrcap_video_str(int32_t video_code)
 {
-    static_assert(XrcapVideo_Count == 3, "Update this");
+    static_assert(XrcapVideo_Count == 4, "Update this");
     switch (video_code)
     {
     case XrcapVideo_Lossless: return "Lossless";
     case XrcapVideo_H264: return "H.264";
     case XrcapVideo_H265: return "H.265";
+    case XrcapVideo_NearLossless: return "Near-Lossless";
     default: break;
     }
     return "(Invalid XrcapVideo)";
@@ -136,6 +137,20 @@ XRCAP_EXPORT const char* xrcap_lens_model_str(int32_t model)
     return "(Invalid XrcapLensModel)";
 }
 
+// XrcapVertexFormat
+XRCAP_EXPORT const char* xrcap_vertex_format_str(int32_t format)
+{
+    static_assert(XrcapVertexFormat_Count == 3, "Update this");
+    switch (format)
+    {
+    case XrcapVertexFormat_Float: return "Float";
+    case XrcapVertexFormat_Compact: return "Compact";
+    case XrcapVertexFormat_Delta: return "Delta";
+    default: break;
+    }
+    return "(Invalid XrcapVertexFormat)";
+}
+
 
 
 //------------------------------------------------------------------------------
@@ -235,6 +250,16 @@ XRCAP_EXPORT void xrcap_set_compression(
     m_Client.SetCompression(*protos_compression);
 }
 
+XRCAP_EXPORT void xrcap_set_vertex_format(int32_t format)
+{
+    m_Client.SetVertexFormat(format);
+}
+
+XRCAP_EXPORT void xrcap_set_mesh_lod(float max_error_mm, uint32_t max_triangles)
+{
+    m_Client.SetMeshLod(max_error_mm, max_triangles);
+}
+
 XRCAP_EXPORT void xrcap_reset()
 {
     m_Client.Reset();
@@ -0,0 +1,107 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+#include "DepthRecording.hpp"
+
+#include <zdepth_lossless.hpp> // zdepth
+#include <zdepth_lossy.hpp>
+#include <core_mmap.hpp>
+#include <core_logging.hpp>
+
+#include <map>
+#include <memory>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// ReadRecordedDepth
+
+bool ReadRecordedDepth(
+    const char* file_path,
+    int max_frames,
+    const RecordedDepthCallback& callback)
+{
+    MappedReadOnlySmallFile file;
+    if (!file.Read(file_path)) {
+        spdlog::error("Failed to read file: {}", file_path);
+        return false;
+    }
+
+    // Decoders and decoded frame count for each camera
+    std::map<GuidCameraIndex, std::unique_ptr<lossless::DepthCompressor>> lossless_decoders;
+    std::map<GuidCameraIndex, std::unique_ptr<lossy::DepthCompressor>> lossy_decoders;
+    std::map<GuidCameraIndex, int> frame_counts;
+
+    std::vector<uint8_t> compressed;
+    std::vector<uint16_t> depth;
+
+    FileChunkIterator chunks(file.GetData(), file.GetDataBytes());
+    const FileChunkHeader* header = nullptr;
+    const uint8_t* payload = nullptr;
+
+    while (chunks.Next(header, payload))
+    {
+        FileFrameChunk frame;
+        if (!ParseFrameChunk(header, payload, frame)) {
+            continue;
+        }
+
+        const unsigned depth_bytes = frame.Header->DepthBytes;
+        const GuidCameraIndex camera_guid = frame.Header->CameraGuid;
+
+        int& frame_count = frame_counts[camera_guid];
+        if (max_frames > 0 && frame_count >= max_frames) {
+            continue;
+        }
+
+        RecordedDepthFrame decoded;
+        decoded.CameraGuid = camera_guid;
+        decoded.Depth = &depth;
+
+        compressed.assign(frame.Depth, frame.Depth + depth_bytes);
+
+        if (lossless::IsDepthFrame(frame.Depth, depth_bytes))
+        {
+            auto& decoder = lossless_decoders[camera_guid];
+            if (!decoder) {
+                decoder = std::make_unique<lossless::DepthCompressor>();
+            }
+            const lossless::DepthResult result = decoder->Decompress(compressed, decoded.Width, decoded.Height, depth);
+            if (result != lossless::DepthResult::Success) {
+                spdlog::warn("Skipping lossless depth frame: {}", lossless::DepthResultString(result));
+                continue;
+            }
+            decoded.Lossless = true;
+            decoded.Keyframe = (compressed[1] & lossless::DepthFlags_Keyframe) != 0;
+        }
+        else if (lossy::IsDepthFrame(frame.Depth, depth_bytes))
+        {
+            auto& decoder = lossy_decoders[camera_guid];
+            if (!decoder) {
+                decoder = std::make_unique<lossy::DepthCompressor>();
+            }
+            const lossy::DepthResult result = decoder->Decompress(compressed, decoded.Width, decoded.Height, depth);
+            if (result != lossy::DepthResult::Success) {
+                spdlog::warn("Skipping lossy depth frame: {}", lossy::DepthResultString(result));
+                continue;
+            }
+            decoded.Keyframe = (compressed[1] & lossy::DepthFlags_Keyframe) != 0;
+        }
+        else
+        {
+            continue;
+        }
+
+        ++frame_count;
+        callback(decoded);
+    }
+
+    if (chunks.IsTruncated()) {
+        spdlog::warn("File truncated: {}", file_path);
+    }
+
+    return true;
+}
+
+
+} // namespace core
@@ -0,0 +1,49 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Depth Recording
+
+    Decodes the depth frames of each camera in a recorded .xrcap file.
+    Shared by the depth codec tools.
+*/
+
+#pragma once
+
+#include "FileFormat.hpp"
+
+#include <functional>
+#include <vector>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// ReadRecordedDepth
+
+// One decoded depth frame
+struct RecordedDepthFrame
+{
+    GuidCameraIndex CameraGuid;
+
+    // Zdepth lossless (true) or lossy (false)
+    bool Lossless = false;
+
+    // I-frame (true) or P-frame (false)
+    bool Keyframe = false;
+
+    int Width = 0, Height = 0;
+    const std::vector<uint16_t>* Depth = nullptr;
+};
+
+using RecordedDepthCallback = std::function<void(const RecordedDepthFrame& frame)>;
+
+// Calls the callback for each depth frame in the file that decodes.
+// max_frames: Maximum frames decoded for each camera, or 0 for no limit.
+// Returns false if the file cannot be read
+bool ReadRecordedDepth(
+    const char* file_path,
+    int max_frames,
+    const RecordedDepthCallback& callback);
+
+
+} // namespace core
@@ -0,0 +1,624 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Depth Codec Benchmark
+
+    Measures the depth codecs on real recordings so that proposed codec
+    changes can be compared objectively and regressions can be tracked.
+
+    Depth frames are read from recorded .xrcap files (one sequence for each
+    camera) or from raw dumps of 16-bit depth frames, and then compressed
+    with each codec over a set of keyframe intervals:
+
+        lossless:           Zdepth lossless with default settings.
+        lossless_motion:    Zdepth lossless with the capture server motion
+                            search and tile settings.
+        near_lossless:      Zdepth near-lossless with two quantization units
+                            of error allowed in each range band.
+        lossy:              Zdepth lossy (H.264).  Reported unavailable if no
+                            video encoder works on this machine.
+        rvl, rvl_zstd:      Quantization + RVL, with and without Zstd.
+
+    The report is written as JSON with the compression ratio, bitrate,
+    encode and decode times, reconstruction error and the lossless encoder
+    stage times (quantize, predict, pack, zstd) for each combination.
+*/
+
+#include "DepthRecording.hpp"
+
+#include <zdepth_lossless.hpp> // zdepth
+#include <zdepth_lossy.hpp>
+#include <core.hpp>
+#include <core_mmap.hpp>
+#include <core_logging.hpp>
+
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+
+#include <map>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+using namespace core;
+
+// RVL reference codec from the zdepth tests
+#include "rvl.inl"
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Raw dumps default to the NFOV 2x2 binned depth mode
+static const int kDefaultRawWidth = 320;
+static const int kDefaultRawHeight = 288;
+
+// Frames read from each sequence
+static const int kDefaultMaxFrames = 300;
+
+// Bitrates are reported at this framerate
+static const int kReportFramerate = 30;
+
+// Capture server lossless motion settings
+static const int kMotionTiles = 4;
+static const int kMotionReferenceFrames = 2;
+static const int kMotionSearchRange = 4;
+static const int kMotionSearchBudget = 12;
+
+
+//------------------------------------------------------------------------------
+// Datatypes
+
+// Depth frames from one camera
+struct DepthSequence
+{
+    std::string Name;
+    int Width = 0, Height = 0;
+    std::vector<std::vector<uint16_t>> Frames;
+};
+
+// Measurements for one codec on one sequence at one keyframe interval
+struct CodecResult
+{
+    std::string Codec;
+    int KeyframeInterval = 0;
+    bool Available = true;
+
+    int Frames = 0;
+    uint64_t OriginalBytes = 0;
+    uint64_t CompressedBytes = 0;
+    uint64_t EncodeUsec = 0, MaxEncodeUsec = 0;
+    uint64_t DecodeUsec = 0;
+
+    // Reconstruction error against the lossless quantized depth
+    int MaxErrorMM = 0;
+    uint64_t ErrorSumMM = 0, ErrorCount = 0;
+
+    // Lossless encoder stage times summed over frames
+    bool HasStages = false;
+    lossless::DepthEncoderTimes Stages;
+};
+
+struct BenchmarkSettings
+{
+    std::vector<int> KeyframeIntervals;
+    int RawWidth = kDefaultRawWidth;
+    int RawHeight = kDefaultRawHeight;
+    int MaxFrames = kDefaultMaxFrames;
+};
+
+
+//------------------------------------------------------------------------------
+// Input
+
+static bool EndsWith(const std::string& s, const char* suffix)
+{
+    const size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+// Read the depth frames of each camera in an .xrcap recording
+static bool ReadRecording(
+    const char* file_path,
+    int max_frames,
+    std::vector<DepthSequence>& sequences)
+{
+    std::map<GuidCameraIndex, DepthSequence> cameras;
+
+    const bool success = ReadRecordedDepth(file_path, max_frames, [&](const RecordedDepthFrame& frame)
+    {
+        DepthSequence& sequence = cameras[frame.CameraGuid];
+        if (!sequence.Frames.empty() &&
+            (sequence.Width != frame.Width || sequence.Height != frame.Height))
+        {
+            spdlog::warn("Skipping depth frame: Resolution changed");
+            return;
+        }
+        sequence.Width = frame.Width;
+        sequence.Height = frame.Height;
+        sequence.Frames.push_back(*frame.Depth);
+    });
+    if (!success) {
+        return false;
+    }
+
+    for (auto& camera : cameras)
+    {
+        DepthSequence& sequence = camera.second;
+        if (sequence.Frames.empty()) {
+            continue;
+        }
+        sequence.Name = std::string(file_path) + "#" +
+            std::to_string(camera.first.ServerGuid) + ":" +
+            std::to_string(camera.first.CameraIndex);
+
+        spdlog::info("Read {} depth frames {}x{} from {}",
+            sequence.Frames.size(), sequence.Width, sequence.Height, sequence.Name);
+        sequences.push_back(std::move(sequence));
+    }
+
+    return true;
+}
+
+// Raw dumps are headerless concatenated width x height 16-bit frames
+static bool ReadRawDump(
+    const char* file_path,
+    const BenchmarkSettings& settings,
+    std::vector<DepthSequence>& sequences)
+{
+    MappedReadOnlySmallFile file;
+    if (!file.Read(file_path)) {
+        spdlog::error("Failed to read file: {}", file_path);
+        return false;
+    }
+
+    const int n = settings.RawWidth * settings.RawHeight;
+    const unsigned frame_bytes = n * 2;
+    const unsigned file_bytes = file.GetDataBytes();
+    if (file_bytes < frame_bytes || file_bytes % frame_bytes != 0) {
+        spdlog::error("Raw dump size {} is not a multiple of {}x{} frames: {}",
+            file_bytes, settings.RawWidth, settings.RawHeight, file_path);
+        return false;
+    }
+
+    DepthSequence sequence;
+    sequence.Name = file_path;
+    sequence.Width = settings.RawWidth;
+    sequence.Height = settings.RawHeight;
+
+    const uint8_t* data = file.GetData();
+    const int count = std::min(static_cast<int>( file_bytes / frame_bytes ), settings.MaxFrames);
+    sequence.Frames.resize(count);
+    for (int i = 0; i < count; ++i) {
+        sequence.Frames[i].resize(n);
+        memcpy(sequence.Frames[i].data(), data + i * frame_bytes, frame_bytes);
+    }
+
+    spdlog::info("Read {} depth frames {}x{} from {}",
+        count, sequence.Width, sequence.Height, sequence.Name);
+    sequences.push_back(std::move(sequence));
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Codecs
+
+// Accumulate the error of a decoded frame against the quantized original
+static void MeasureError(
+    const std::vector<uint16_t>& original,
+    const std::vector<uint16_t>& decoded,
+    CodecResult& result)
+{
+    const size_t n = original.size();
+    for (size_t i = 0; i < n && i < decoded.size(); ++i)
+    {
+        const uint16_t quantized = lossless::AzureKinectQuantizeDepth(original[i]);
+        if (quantized == 0) {
+            continue;
+        }
+        const int expected = lossless::AzureKinectDequantizeDepth(quantized);
+        const int error = std::abs(expected - static_cast<int>( decoded[i] ));
+        if (result.MaxErrorMM < error) {
+            result.MaxErrorMM = error;
+        }
+        result.ErrorSumMM += error;
+        result.ErrorCount++;
+    }
+}
+
+static void AddFrame(
+    CodecResult& result,
+    const DepthSequence& sequence,
+    size_t compressed_bytes,
+    uint64_t encode_usec,
+    uint64_t decode_usec)
+{
+    result.Frames++;
+    result.OriginalBytes += sequence.Width * sequence.Height * 2;
+    result.CompressedBytes += compressed_bytes;
+    result.EncodeUsec += encode_usec;
+    if (result.MaxEncodeUsec < encode_usec) {
+        result.MaxEncodeUsec = encode_usec;
+    }
+    result.DecodeUsec += decode_usec;
+}
+
+enum class LosslessMode
+{
+    Default,
+    Motion,
+    NearLossless,
+};
+
+static void RunLossless(
+    const DepthSequence& sequence,
+    LosslessMode mode,
+    CodecResult& result)
+{
+    lossless::DepthCompressor encoder, decoder;
+
+    if (mode == LosslessMode::Motion) {
+        encoder.SetTileCount(kMotionTiles);
+        encoder.SetMotionSearch(kMotionReferenceFrames, kMotionSearchRange, kMotionSearchBudget);
+    }
+    else if (mode == LosslessMode::NearLossless) {
+        int max_error_mm[lossless::kDepthRangeBands];
+        for (int i = 0; i < lossless::kDepthRangeBands; ++i) {
+            max_error_mm[i] = 2 * lossless::kDepthBandUnitMM[i];
+        }
+        encoder.SetMaxError(max_error_mm);
+    }
+    result.HasStages = true;
+
+    std::vector<uint8_t> compressed;
+    std::vector<uint16_t> decoded;
+
+    const int count = static_cast<int>( sequence.Frames.size() );
+    for (int i = 0; i < count; ++i)
+    {
+        const bool keyframe = (i % result.KeyframeInterval) == 0;
+        const std::vector<uint16_t>& frame = sequence.Frames[i];
+
+        const uint64_t t0 = GetTimeUsec();
+        encoder.Compress(sequence.Width, sequence.Height, frame.data(), compressed, keyframe);
+        const uint64_t t1 = GetTimeUsec();
+
+        int width = 0, height = 0;
+        const lossless::DepthResult decode_result = decoder.Decompress(compressed, width, height, decoded);
+        const uint64_t t2 = GetTimeUsec();
+
+        if (decode_result != lossless::DepthResult::Success) {
+            spdlog::error("{} decode failed: {}", result.Codec, lossless::DepthResultString(decode_result));
+            result.Available = false;
+            return;
+        }
+
+        const lossless::DepthEncoderTimes& times = encoder.GetEncoderTimes();
+        result.Stages.QuantizeUsec += times.QuantizeUsec;
+        result.Stages.PredictUsec += times.PredictUsec;
+        result.Stages.PackUsec += times.PackUsec;
+        result.Stages.ZstdUsec += times.ZstdUsec;
+        result.Stages.TotalUsec += times.TotalUsec;
+
+        AddFrame(result, sequence, compressed.size(), t1 - t0, t2 - t1);
+        MeasureError(frame, decoded, result);
+    }
+}
+
+static void RunLossy(
+    const DepthSequence& sequence,
+    CodecResult& result)
+{
+    lossy::DepthCompressor encoder, decoder;
+
+    std::vector<uint8_t> compressed;
+    std::vector<uint16_t> decoded;
+
+    const int count = static_cast<int>( sequence.Frames.size() );
+    for (int i = 0; i < count; ++i)
+    {
+        const bool keyframe = (i % result.KeyframeInterval) == 0;
+        const std::vector<uint16_t>& frame = sequence.Frames[i];
+
+        const uint64_t t0 = GetTimeUsec();
+        encoder.Compress(sequence.Width, sequence.Height, false, kReportFramerate, frame.data(), compressed, keyframe);
+        const uint64_t t1 = GetTimeUsec();
+
+        if (compressed.empty()) {
+            spdlog::warn("Lossy depth encoder is not available");
+            result.Available = false;
+            return;
+        }
+
+        int width = 0, height = 0;
+        const lossy::DepthResult decode_result = decoder.Decompress(compressed, width, height, decoded);
+        const uint64_t t2 = GetTimeUsec();
+
+        if (decode_result != lossy::DepthResult::Success) {
+            spdlog::warn("Lossy depth decoder failed: {}", lossy::DepthResultString(decode_result));
+            result.Available = false;
+            return;
+        }
+
+        AddFrame(result, sequence, compressed.size(), t1 - t0, t2 - t1);
+        MeasureError(frame, decoded, result);
+    }
+}
+
+// RVL is intra-only so the keyframe interval does not apply
+static void RunRvl(
+    const DepthSequence& sequence,
+    bool zstd,
+    CodecResult& result)
+{
+    const int n = sequence.Width * sequence.Height;
+    std::vector<uint16_t> quantized(n), decoded;
+    std::vector<uint8_t> compressed(n * 3), recompressed, decompressed;
+
+    for (const std::vector<uint16_t>& frame : sequence.Frames)
+    {
+        const uint64_t t0 = GetTimeUsec();
+        lossless::QuantizeDepthImage(sequence.Width, sequence.Height, frame.data(), quantized);
+        compressed.resize(n * 3);
+        compressed.resize(CompressRVL((short*)quantized.data(), (char*)compressed.data(), n));
+        size_t compressed_bytes = compressed.size();
+        if (zstd) {
+            lossless::ZstdCompress(compressed, recompressed);
+            compressed_bytes = recompressed.size();
+        }
+        const uint64_t t1 = GetTimeUsec();
+
+        const char* rvl_data = (const char*)compressed.data();
+        if (zstd) {
+            lossless::ZstdDecompress(recompressed.data(), (int)recompressed.size(), (int)compressed.size(), decompressed);
+            rvl_data = (const char*)decompressed.data();
+        }
+        DecompressRVL((char*)rvl_data, (short*)quantized.data(), n);
+        lossless::DequantizeDepthImage(sequence.Width, sequence.Height, quantized.data(), decoded);
+        const uint64_t t2 = GetTimeUsec();
+
+        AddFrame(result, sequence, compressed_bytes, t1 - t0, t2 - t1);
+        MeasureError(frame, decoded, result);
+    }
+}
+
+static CodecResult RunCodec(
+    const DepthSequence& sequence,
+    const std::string& codec,
+    int keyframe_interval)
+{
+    CodecResult result;
+    result.Codec = codec;
+    result.KeyframeInterval = keyframe_interval;
+
+    if (codec == "lossless") {
+        RunLossless(sequence, LosslessMode::Default, result);
+    } else if (codec == "lossless_motion") {
+        RunLossless(sequence, LosslessMode::Motion, result);
+    } else if (codec == "near_lossless") {
+        RunLossless(sequence, LosslessMode::NearLossless, result);
+    } else if (codec == "lossy") {
+        RunLossy(sequence, result);
+    } else if (codec == "rvl") {
+        RunRvl(sequence, false, result);
+    } else if (codec == "rvl_zstd") {
+        RunRvl(sequence, true, result);
+    }
+
+    return result;
+}
+
+
+//------------------------------------------------------------------------------
+// Report
+
+using JsonWriterT = rapidjson::PrettyWriter<rapidjson::StringBuffer>;
+
+static double Mean(uint64_t sum, int count)
+{
+    return count > 0 ? sum / static_cast<double>( count ) : 0.0;
+}
+
+static void WriteResult(JsonWriterT& writer, const CodecResult& result)
+{
+    writer.StartObject();
+    writer.Key("codec");
+    writer.String(result.Codec.c_str());
+    writer.Key("keyframe_interval");
+    writer.Int(result.KeyframeInterval);
+    writer.Key("available");
+    writer.Bool(result.Available);
+
+    if (result.Available && result.Frames > 0)
+    {
+        const double ratio = result.OriginalBytes / static_cast<double>( result.CompressedBytes );
+        const double mbps = Mean(result.CompressedBytes, result.Frames) * 8.0 * kReportFramerate / 1000000.0;
+
+        writer.Key("frames");
+        writer.Int(result.Frames);
+        writer.Key("original_bytes");
+        writer.Uint64(result.OriginalBytes);
+        writer.Key("compressed_bytes");
+        writer.Uint64(result.CompressedBytes);
+        writer.Key("ratio");
+        writer.Double(ratio);
+        writer.Key("mbps");
+        writer.Double(mbps);
+        writer.Key("encode_usec_mean");
+        writer.Double(Mean(result.EncodeUsec, result.Frames));
+        writer.Key("encode_usec_max");
+        writer.Uint64(result.MaxEncodeUsec);
+        writer.Key("decode_usec_mean");
+        writer.Double(Mean(result.DecodeUsec, result.Frames));
+        writer.Key("max_error_mm");
+        writer.Int(result.MaxErrorMM);
+        writer.Key("mean_error_mm");
+        writer.Double(result.ErrorCount > 0 ? result.ErrorSumMM / static_cast<double>( result.ErrorCount ) : 0.0);
+
+        if (result.HasStages)
+        {
+            writer.Key("stages_usec_mean");
+            writer.StartObject();
+            writer.Key("quantize");
+            writer.Double(Mean(result.Stages.QuantizeUsec, result.Frames));
+            writer.Key("predict");
+            writer.Double(Mean(result.Stages.PredictUsec, result.Frames));
+            writer.Key("pack");
+            writer.Double(Mean(result.Stages.PackUsec, result.Frames));
+            writer.Key("zstd");
+            writer.Double(Mean(result.Stages.ZstdUsec, result.Frames));
+            writer.Key("total");
+            writer.Double(Mean(result.Stages.TotalUsec, result.Frames));
+            writer.EndObject();
+        }
+
+        spdlog::info("{} interval={}: ratio={:.2f}:1 {:.2f} Mbps encode={:.3f} msec decode={:.3f} msec max_error={} mm",
+            result.Codec, result.KeyframeInterval, ratio, mbps,
+            Mean(result.EncodeUsec, result.Frames) / 1000.0,
+            Mean(result.DecodeUsec, result.Frames) / 1000.0,
+            result.MaxErrorMM);
+    }
+
+    writer.EndObject();
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+static const char* kCodecs[] = {
+    "lossless",
+    "lossless_motion",
+    "near_lossless",
+    "lossy",
+    "rvl",
+    "rvl_zstd",
+};
+
+static void PrintUsage()
+{
+    spdlog::info("Please provide arguments:");
+    spdlog::info("    depth_codec_benchmark [options] OUTPUT.json INPUT [INPUT2 ...]");
+    spdlog::info("Inputs ending in .xrcap are recordings; others are raw 16-bit depth frames.");
+    spdlog::info("Options:");
+    spdlog::info("    -k N        Add a keyframe interval (default: 1 and 30)");
+    spdlog::info("    -s WxH      Raw dump frame size (default: {}x{})", kDefaultRawWidth, kDefaultRawHeight);
+    spdlog::info("    -n N        Maximum frames per sequence (default: {})", kDefaultMaxFrames);
+}
+
+int main(int argc, char* argv[])
+{
+    SetupAsyncDiskLog("depth_codec_benchmark.txt");
+
+    BenchmarkSettings settings;
+
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        const std::string option = argv[arg];
+        const char* value = argv[arg + 1];
+        if (option == "-k") {
+            const int interval = atoi(value);
+            if (interval < 1) {
+                spdlog::error("Keyframe interval must be at least 1");
+                return -1;
+            }
+            settings.KeyframeIntervals.push_back(interval);
+        } else if (option == "-s") {
+            if (sscanf(value, "%dx%d", &settings.RawWidth, &settings.RawHeight) != 2 ||
+                settings.RawWidth < 1 || settings.RawHeight < 1)
+            {
+                spdlog::error("Invalid raw frame size: {}", value);
+                return -1;
+            }
+        } else if (option == "-n") {
+            settings.MaxFrames = atoi(value);
+        } else {
+            spdlog::error("Unknown option: {}", option);
+            PrintUsage();
+            return -1;
+        }
+    }
+
+    if (argc - arg < 2) {
+        PrintUsage();
+        return -1;
+    }
+    if (settings.KeyframeIntervals.empty()) {
+        settings.KeyframeIntervals = { 1, 30 };
+    }
+
+    const char* output_path = argv[arg++];
+
+    std::vector<DepthSequence> sequences;
+    for (; arg < argc; ++arg)
+    {
+        const std::string input = argv[arg];
+        const bool success = EndsWith(input, ".xrcap") ?
+            ReadRecording(argv[arg], settings.MaxFrames, sequences) :
+            ReadRawDump(argv[arg], settings, sequences);
+        if (!success) {
+            return -1;
+        }
+    }
+    if (sequences.empty()) {
+        spdlog::error("No depth frames found");
+        return -1;
+    }
+
+    rapidjson::StringBuffer buffer;
+    JsonWriterT writer(buffer);
+
+    writer.StartObject();
+    writer.Key("framerate");
+    writer.Int(kReportFramerate);
+    writer.Key("sequences");
+    writer.StartArray();
+
+    for (const DepthSequence& sequence : sequences)
+    {
+        spdlog::info("Benchmarking {}", sequence.Name);
+
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(sequence.Name.c_str());
+        writer.Key("width");
+        writer.Int(sequence.Width);
+        writer.Key("height");
+        writer.Int(sequence.Height);
+        writer.Key("frames");
+        writer.Int(static_cast<int>( sequence.Frames.size() ));
+        writer.Key("results");
+        writer.StartArray();
+
+        for (const char* codec : kCodecs)
+        {
+            // RVL has no P-frames so it only runs once
+            const bool intra_only = strncmp(codec, "rvl", 3) == 0;
+            for (int interval : settings.KeyframeIntervals)
+            {
+                const CodecResult result = RunCodec(sequence, codec, intra_only ? 1 : interval);
+                WriteResult(writer, result);
+                if (intra_only || !result.Available) {
+                    break;
+                }
+            }
+        }
+
+        writer.EndArray();
+        writer.EndObject();
+    }
+
+    writer.EndArray();
+    writer.EndObject();
+
+    if (!WriteBufferToFile(output_path, buffer.GetString(), buffer.GetSize())) {
+        spdlog::error("Failed to write report file: {}", output_path);
+        return -1;
+    }
+
+    spdlog::info("Wrote benchmark report to {}", output_path);
+    return 0;
+}
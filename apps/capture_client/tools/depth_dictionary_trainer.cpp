@@ -0,0 +1,173 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Depth Dictionary Trainer
+
+    Builds a Zdepth lossless dictionary from the depth keyframes in recorded
+    .xrcap files.  The dictionary file can be loaded with
+    lossless::DepthDictionary::Load() and provided to the encoder with
+    SetDictionary() and to the decoder with AddDictionary().
+
+    Every few keyframes are held out of training, and the tool reports how
+    much smaller those keyframes compress with the new dictionary.
+*/
+
+#include "DepthRecording.hpp"
+
+#include <zdepth_lossless.hpp> // zdepth
+#include <core_mmap.hpp>
+#include <core_logging.hpp>
+
+#include <map>
+#include <memory>
+#include <cstdlib>
+using namespace core;
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Dictionary size for each stream
+static const int kDictionaryBytes = 32 * 1024;
+
+// One in this many keyframes of each camera is held out of training
+static const int kHoldoutInterval = 4;
+
+
+//------------------------------------------------------------------------------
+// Tools
+
+// Keyframe held out of training
+struct HeldOutFrame
+{
+    unsigned Source = 0;
+    int Width = 0, Height = 0;
+    std::vector<uint16_t> Depth;
+};
+
+static bool AddFile(
+    lossless::DepthDictionaryTrainer& trainer,
+    std::vector<HeldOutFrame>& held_out,
+    const char* file_path)
+{
+    // Trainer source for each camera
+    std::map<GuidCameraIndex, unsigned> sources;
+    std::map<unsigned, int> keyframe_counts;
+    int frame_count = 0, held_out_count = 0;
+
+    const bool success = ReadRecordedDepth(file_path, 0, [&](const RecordedDepthFrame& frame)
+    {
+        // Dictionaries are only used for lossless I-frames
+        if (!frame.Lossless || !frame.Keyframe) {
+            return;
+        }
+
+        auto it = sources.find(frame.CameraGuid);
+        if (it == sources.end()) {
+            const unsigned source = static_cast<unsigned>( sources.size() );
+            it = sources.emplace(frame.CameraGuid, source).first;
+        }
+        const unsigned source = it->second;
+
+        if (++keyframe_counts[source] % kHoldoutInterval == 0)
+        {
+            HeldOutFrame held;
+            held.Source = source;
+            held.Width = frame.Width;
+            held.Height = frame.Height;
+            held.Depth = *frame.Depth;
+            held_out.push_back(std::move(held));
+            ++held_out_count;
+            return;
+        }
+
+        trainer.AddFrame(source, frame.Width, frame.Height, frame.Depth->data(), frame.Keyframe);
+        ++frame_count;
+    });
+    if (!success) {
+        return false;
+    }
+
+    spdlog::info("Added {} depth keyframes from {} ({} held out)", frame_count, file_path, held_out_count);
+    return true;
+}
+
+// Compress the held out keyframes with and without the dictionary
+static void ReportHeldOut(
+    const std::vector<HeldOutFrame>& held_out,
+    std::shared_ptr<const lossless::DepthDictionary> dictionary)
+{
+    if (held_out.empty()) {
+        spdlog::warn("No keyframes were held out: Provide more than {} keyframes per camera to measure the dictionary", kHoldoutInterval - 1);
+        return;
+    }
+
+    uint64_t plain_bytes = 0, dictionary_bytes = 0;
+    std::vector<uint8_t> compressed;
+
+    for (const auto& frame : held_out)
+    {
+        lossless::DepthCompressor plain, with_dictionary;
+        with_dictionary.SetDictionary(dictionary);
+
+        plain.Compress(frame.Width, frame.Height, frame.Depth.data(), compressed, true);
+        plain_bytes += compressed.size();
+
+        with_dictionary.Compress(frame.Width, frame.Height, frame.Depth.data(), compressed, true);
+        dictionary_bytes += compressed.size();
+    }
+
+    spdlog::info("Held out keyframes: {} frames, {} bytes without dictionary, {} bytes with dictionary ({}% smaller)",
+        held_out.size(),
+        plain_bytes,
+        dictionary_bytes,
+        100.0 * (1.0 - dictionary_bytes / static_cast<double>( plain_bytes )));
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char* argv[])
+{
+    SetupAsyncDiskLog("depth_dictionary_trainer.txt");
+
+    if (argc < 4) {
+        spdlog::info("Please provide arguments:");
+        spdlog::info("    depth_dictionary_trainer OUTPUT_FILE DICTIONARY_ID INPUT.xrcap [INPUT2.xrcap ...]");
+        return -1;
+    }
+
+    const char* output_path = argv[1];
+    const uint32_t dictionary_id = static_cast<uint32_t>( strtoul(argv[2], nullptr, 10) );
+    if (dictionary_id == 0) {
+        spdlog::error("Dictionary ID must be non-zero");
+        return -1;
+    }
+
+    lossless::DepthDictionaryTrainer trainer;
+    std::vector<HeldOutFrame> held_out;
+    for (int i = 3; i < argc; ++i) {
+        if (!AddFile(trainer, held_out, argv[i])) {
+            return -1;
+        }
+    }
+
+    auto dictionary = std::make_shared<lossless::DepthDictionary>();
+    if (!trainer.Train(dictionary_id, kDictionaryBytes, *dictionary)) {
+        spdlog::error("Training failed: No lossless depth frames found");
+        return -1;
+    }
+
+    ReportHeldOut(held_out, dictionary);
+
+    std::vector<uint8_t> data;
+    dictionary->Save(data);
+    if (!WriteBufferToFile(output_path, data.data(), data.size())) {
+        spdlog::error("Failed to write dictionary file: {}", output_path);
+        return -1;
+    }
+
+    spdlog::info("Wrote dictionary ID={} ({} bytes) to {}", dictionary_id, data.size(), output_path);
+    return 0;
+}
@@ -62,6 +62,7 @@ void CaptureFrontend::Initialize()
     }
     NextSettings = Settings;
 
+    ApplyReplaySettings();
     ApplyNetworkSettings();
 
     Terminated = false;
@@ -110,6 +111,18 @@ void CaptureFrontend::UpdatePasswordHashFromUi()
     }
 }
 
+void CaptureFrontend::ApplyReplaySettings()
+{
+    ReplaySettings replay;
+    replay.FilePath = Settings.ReplayFile;
+    replay.CameraCount = Settings.ReplayCameraCount;
+    replay.Framerate = Settings.ReplayFramerate;
+    replay.JitterUsec = Settings.ReplayJitterUsec;
+    replay.DropRate = Settings.ReplayDropRate;
+    Capture.SetReplay(Settings.EnableReplay, replay);
+    Capture.SetReplayRecording(Settings.RecordReplayFile);
+}
+
 void CaptureFrontend::ApplyNetworkSettings()
 {
     std::lock_guard<std::mutex> locker(ServerLock);
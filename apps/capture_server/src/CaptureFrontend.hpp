@@ -98,6 +98,7 @@ protected:
     void OnImageBatch(std::shared_ptr<ImageBatch>& batch);
 
     void UpdatePasswordHashFromUi();
+    void ApplyReplaySettings();
     void ApplyNetworkSettings();
 };
 
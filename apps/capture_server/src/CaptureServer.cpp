@@ -392,6 +392,15 @@ void ViewerConnection::OnSetCompression(const protos::MessageSetCompression& msg
         NetLocalName, (unsigned)compression.ColorVideo, compression.ColorBitrate,
         (unsigned)compression.DepthVideo, (unsigned)compression.DenoisePercent);
 
+    // Lossless and NearLossless are depth-only codecs
+    if (compression.ColorVideo != protos::VideoType_H264 &&
+        compression.ColorVideo != protos::VideoType_H265)
+    {
+        spdlog::warn("{} Ignoring compression with invalid color video={}",
+            NetLocalName, (unsigned)compression.ColorVideo);
+        return;
+    }
+
     Capture->GetConfiguration()->SetCompression(compression);
 }
 
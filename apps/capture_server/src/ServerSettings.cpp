@@ -31,6 +31,13 @@ bool LoadFromFile(const std::string& file_path, ServerSettings& settings)
         settings.ServerName = node["name"].as<std::string>("Default");
         settings.ServerPasswordHash = node["password_hash"].as<std::string>("");
         settings.EnableMultiServers = node["multi_servers"].as<bool>(false);
+        settings.EnableReplay = node["replay"].as<bool>(false);
+        settings.ReplayFile = node["replay_file"].as<std::string>("");
+        settings.ReplayCameraCount = node["replay_cameras"].as<int>(3);
+        settings.ReplayFramerate = node["replay_fps"].as<int>(0);
+        settings.ReplayJitterUsec = node["replay_jitter_usec"].as<int>(2000);
+        settings.ReplayDropRate = node["replay_drop_rate"].as<float>(0.f);
+        settings.RecordReplayFile = node["record_replay_file"].as<std::string>("");
     } catch (YAML::ParserException& ex) {
         spdlog::error("YAML parse failed: {}", ex.what());
         return false;
@@ -55,6 +62,20 @@ bool SaveToFile(const ServerSettings& settings, const std::string& file_path)
     out << YAML::Value << settings.ServerPasswordHash;
     out << YAML::Key << "multi_servers";
     out << YAML::Value << settings.EnableMultiServers;
+    out << YAML::Key << "replay";
+    out << YAML::Value << settings.EnableReplay;
+    out << YAML::Key << "replay_file";
+    out << YAML::Value << settings.ReplayFile;
+    out << YAML::Key << "replay_cameras";
+    out << YAML::Value << settings.ReplayCameraCount;
+    out << YAML::Key << "replay_fps";
+    out << YAML::Value << settings.ReplayFramerate;
+    out << YAML::Key << "replay_jitter_usec";
+    out << YAML::Value << settings.ReplayJitterUsec;
+    out << YAML::Key << "replay_drop_rate";
+    out << YAML::Value << settings.ReplayDropRate;
+    out << YAML::Key << "record_replay_file";
+    out << YAML::Value << settings.RecordReplayFile;
     out << YAML::EndMap;
 
     if (!out.good()) {
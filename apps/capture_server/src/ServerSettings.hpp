@@ -25,6 +25,17 @@ struct ServerSettings
     std::string ServerName = "Default";
     std::string ServerPasswordHash = "";
     bool EnableMultiServers = false;
+
+    // Replay recorded or synthetic frames instead of opening the cameras
+    bool EnableReplay = false;
+    std::string ReplayFile = ""; // Empty for synthetic scene
+    int ReplayCameraCount = 3;
+    int ReplayFramerate = 0; // 0 = Capture mode default
+    int ReplayJitterUsec = 2000;
+    float ReplayDropRate = 0.f;
+
+    // Record camera frames for replay each time capture starts
+    std::string RecordReplayFile = ""; // Empty to disable
 };
 
 bool LoadFromFile(const std::string& file_path, ServerSettings& settings);
@@ -760,10 +760,19 @@ bool GltfBuffers::Serialize(const XrcapFrame& frame, const GltfParams& params)
 
     unsigned perspective_count = 0;
     for (unsigned perspective_index = 0; perspective_index < XRCAP_PERSPECTIVE_COUNT; ++perspective_index) {
-        const auto& perspective = frame.Perspectives[perspective_index];
+        XrcapPerspective perspective = frame.Perspectives[perspective_index];
         if (!perspective.Valid) {
             continue;
         }
+
+        // Export the simplified mesh instead, if provided
+        if (params.UseLod && perspective.LodIndicesCount > 0) {
+            perspective.Indices = perspective.LodIndices;
+            perspective.IndicesCount = perspective.LodIndicesCount;
+            perspective.XyzuvVertices = perspective.LodXyzuvVertices;
+            perspective.FloatsCount = perspective.LodFloatsCount;
+        }
+
         if (!SerializePerspective(json, perspective, params)) {
             spdlog::error("Perspective failed to serialize: guid={} camera={}", perspective.Guid, perspective.CameraIndex);
             continue;
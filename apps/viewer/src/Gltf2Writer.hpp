@@ -74,6 +74,9 @@ struct GltfParams
 
     // JPEG quality level 80..100
     int JpegQuality = 90;
+
+    // Export the simplified meshes from xrcap_set_mesh_lod() if available
+    bool UseLod = false;
 };
 
 // GLB is the binary version of glTF 2.0 that can contain textures and so on
@@ -12,6 +12,7 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <algorithm>
 #include <fstream>
 #include <ios>
 
@@ -32,6 +33,9 @@ void ViewerWindow::Initialize(const std::string& file_path)
         spdlog::warn("Failed to load settings from previous session");
     }
 
+    // Only upload the parts of each mesh that changed since the last frame
+    xrcap_set_vertex_format(XrcapVertexFormat_Delta);
+
     if (!file_path.empty()) {
         if (xrcap_playback_read_file(file_path.c_str())) {
             IsLivePlayback = false;
@@ -420,7 +424,7 @@ void ViewerWindow::SetupUI()
             "H264|H265",
             '|',
             ColorVideo - 1,
-            static_cast<int>( XrcapVideo_Count - 1 ),
+            static_cast<int>( XrcapVideo_H265 ),
             30,
             nk_vec2(400.f, 400.f));
 
@@ -428,7 +432,7 @@ void ViewerWindow::SetupUI()
         nk_label(ctx, "Depth Video: ", NK_TEXT_RIGHT);
         DepthVideo = nk_combo_separator(
             ctx,
-            "Lossless|H264|H265",
+            "Lossless|H264|H265|Near-Lossless",
             '|',
             DepthVideo,
             static_cast<int>( XrcapVideo_Count ),
@@ -571,6 +575,11 @@ void ViewerWindow::SetupUI()
         nk_layout_row_dynamic(ctx, 20, 1);
         nk_checkbox_label(ctx, "Show mesh", &ShowMeshCheckValue);
 
+        int track_drift = DriftTrackingEnabled ? 1 : 0;
+        nk_layout_row_dynamic(ctx, 20, 1);
+        nk_checkbox_label(ctx, "Track Calibration Drift", &track_drift);
+        DriftTrackingEnabled = (track_drift != 0);
+
         int queue_depth = PlaybackQueueDepth;
         nk_layout_row_dynamic(ctx, 30, 2);
         nk_property_int(ctx, "#PlayQueueMsec", 100, &queue_depth, 1000, 100, 100.f);
@@ -931,6 +940,11 @@ void ViewerWindow::SetupUI()
             }
             nk_checkbox_label(ctx, "Use Draco", &DracoCompressionEnabled);
             nk_property_int(ctx, "#jpeg", 80, &GltfJpegQuality, 100, 1, 1.f);
+
+            nk_layout_row_dynamic(ctx, 30, 2);
+            nk_checkbox_label(ctx, "Reduce Mesh", &MeshLodEnabled);
+            nk_property_int(ctx, "#triangles", 10000, &MeshLodMaxTriangles, 1000000, 10000, 1000.f);
+            xrcap_set_mesh_lod(MeshLodEnabled ? kMeshLodMaxErrorMm : 0.f, MeshLodMaxTriangles);
         }
         nk_end(ctx);
     }
@@ -1022,6 +1036,7 @@ void ViewerWindow::SaveGltf()
         params.OutputFilePath = path;
         params.EnableDraco = (DracoCompressionEnabled != 0);
         params.JpegQuality = GltfJpegQuality;
+        params.UseLod = (MeshLodEnabled != 0);
         if (WriteFrameToGlbFile(LastFrame, params)) {
             spdlog::info("SaveGltf: Success");
         } else {
@@ -1049,72 +1064,17 @@ void ViewerWindow::ResetLighting()
     LightingCalibrationRequested = false;
 }
 
-struct LoadedFrame
-{
-    std::vector<float> floats;
-    std::vector<uint8_t> y_plane;
-    std::vector<uint8_t> uv_plane;
-    VerticesInfo Info;
-};
-
 void ViewerWindow::LoadMeshAndTest()
 {
-    const std::string filename = "raw_mesh.bin";
-    std::ifstream file(filename.c_str(), std::ios::binary);
-    if (!file) {
-        spdlog::error("Failed to open {}", filename);
+    std::vector<std::shared_ptr<VerticesDump>> dumps;
+    if (!LoadVerticesDump("raw_mesh.bin", dumps)) {
         return;
     }
 
-    std::vector<std::shared_ptr<LoadedFrame>> frames;
-
-    while (!!file)
-    {
-        std::shared_ptr<LoadedFrame> frame = std::make_shared<LoadedFrame>();
-        auto& info = frame->Info;
-
-        uint32_t magic = 0;
-        uint32_t stride = 0;
-
-        file.read((char*)&magic, sizeof(magic));
-        if (!file || magic != 0x00112233) {
-            break;
-        }
-
-        file.read((char*)&info.Width, sizeof(info.Width));
-        file.read((char*)&info.Height, sizeof(info.Height));
-        file.read((char*)&info.ChromaWidth, sizeof(info.ChromaWidth));
-        file.read((char*)&info.ChromaHeight, sizeof(info.ChromaHeight));
-        file.read((char*)&info.FloatsCount, sizeof(info.FloatsCount));
-        file.read((char*)&stride, sizeof(stride));
-        file.read((char*)&info.Accelerometer[0], sizeof(info.Accelerometer));
-
-        if (!file || info.FloatsCount <= 0 || info.Width <= 0 || info.Height <= 0 || info.ChromaWidth <= 0 || info.ChromaHeight <= 0 || stride <= 0) {
-            break;
-        }
-
-        frame->floats.resize(info.FloatsCount);
-        file.read((char*)frame->floats.data(), info.FloatsCount * sizeof(float));
-
-        const unsigned y_bytes = info.Width * info.Height;
-        const unsigned uv_bytes = info.ChromaWidth * info.ChromaHeight * 2;
-
-        frame->y_plane.resize(y_bytes);
-        frame->uv_plane.resize(uv_bytes);
-        file.read((char*)frame->y_plane.data(), y_bytes);
-        file.read((char*)frame->uv_plane.data(), uv_bytes);
-
-        info.XyzuvVertices = frame->floats.data();
-        info.Y = frame->y_plane.data();
-        info.UV = frame->uv_plane.data();
-        info.Calibration = frame->Info.Calibration;
-        frames.push_back(frame);
-    }
-
     std::vector<VerticesInfo> vertices;
 
-    for (auto& frame : frames) {
-        vertices.push_back(frame->Info);
+    for (auto& dump : dumps) {
+        vertices.push_back(dump->Info);
     }
 
     std::vector<AlignmentTransform> extrinsics;
@@ -1371,42 +1331,32 @@ void ViewerWindow::Render()
     {
         EnableRawStorage = false;
 
-        const std::string filename = "raw_mesh.bin";
-        std::ofstream file(filename.c_str(), std::ios::binary);
-        if (!file) {
-            spdlog::error("Failed to open {}", filename);
-        }
-        else {
-            for (int i = 0; i < XRCAP_PERSPECTIVE_COUNT; ++i)
-            {
-                auto& perspective = LastFrame.Perspectives[i];
-                if (!perspective.Valid) {
-                    continue;
-                }
+        std::vector<VerticesInfo> vertices;
 
-                uint32_t magic = 0x00112233;
-                uint32_t stride = XRCAP_FLOAT_STRIDE;
-                uint32_t count = perspective.FloatsCount;
-                uint32_t width = perspective.Width;
-                uint32_t height = perspective.Height;
-                uint32_t cwidth = perspective.ChromaWidth;
-                uint32_t cheight = perspective.ChromaHeight;
-
-                file.write((char*)&magic, sizeof(magic));
-                file.write((char*)&width, sizeof(width));
-                file.write((char*)&height, sizeof(height));
-                file.write((char*)&cwidth, sizeof(cwidth));
-                file.write((char*)&cheight, sizeof(cheight));
-                file.write((char*)&count, sizeof(count));
-                file.write((char*)&stride, sizeof(stride));
-                file.write((char*)perspective.Accelerometer, sizeof(perspective.Accelerometer));
-                file.write((char*)perspective.XyzuvVertices, count * sizeof(float));
-                file.write((char*)perspective.Y, width * height);
-                file.write((char*)perspective.UV, cwidth * cheight * 2);
-
-                spdlog::debug("Stored perspective {} to {}", i, filename);
+        for (int i = 0; i < XRCAP_PERSPECTIVE_COUNT; ++i)
+        {
+            auto& perspective = LastFrame.Perspectives[i];
+            if (!perspective.Valid) {
+                continue;
+            }
+
+            VerticesInfo info;
+            info.XyzuvVertices = perspective.XyzuvVertices;
+            for (int j = 0; j < 3; ++j) {
+                info.Accelerometer[j] = perspective.Accelerometer[j];
             }
+            info.FloatsCount = perspective.FloatsCount;
+            info.Height = perspective.Height;
+            info.Width = perspective.Width;
+            info.ChromaWidth = perspective.ChromaWidth;
+            info.ChromaHeight = perspective.ChromaHeight;
+            info.Y = perspective.Y;
+            info.UV = perspective.UV;
+            info.Calibration = (CameraCalibration*)perspective.Calibration;
+            vertices.push_back(info);
         }
+
+        SaveVerticesDump("raw_mesh.bin", vertices);
     }
 }
 
@@ -1454,11 +1404,40 @@ void ViewerWindow::RenderMeshes()
 
             Matrix4 mvp = projection * view * model;
 
-            bool success = MeshRenderer[i].UpdateMesh(
-                perspective.XyzuvVertices,
-                perspective.FloatsCount,
-                perspective.Indices,
-                perspective.IndicesCount);
+            bool success;
+            if (perspective.LodIndicesCount > 0) {
+                success = MeshRenderer[i].UpdateMesh(
+                    perspective.LodXyzuvVertices,
+                    perspective.LodFloatsCount,
+                    perspective.LodIndices,
+                    perspective.LodIndicesCount);
+            } else if (perspective.MeshBlockCount > 0) {
+                MeshDeltaUpdate update;
+                update.StreamId = perspective.MeshStreamId;
+                update.Version = perspective.MeshVersion;
+                update.BlockCount = perspective.MeshBlockCount;
+                update.BlockFloats = XRCAP_MESH_BLOCK_FLOATS;
+                update.BlockIndices = XRCAP_MESH_BLOCK_INDICES;
+                update.Coordinates = perspective.XyzuvVertices;
+                update.Indices = perspective.Indices;
+                update.BlockIndexCounts = perspective.MeshBlockIndexCounts;
+                update.VertexVersions = perspective.MeshVertexVersions;
+                update.IndexVersions = perspective.MeshIndexVersions;
+                success = MeshRenderer[i].UpdateMeshDelta(update);
+            } else if (perspective.CompactCount > 0) {
+                success = MeshRenderer[i].UpdateCompactMesh(
+                    perspective.CompactVertices,
+                    perspective.CompactCount,
+                    XRCAP_COMPACT_POSITION_SCALE,
+                    perspective.Indices,
+                    perspective.IndicesCount);
+            } else {
+                success = MeshRenderer[i].UpdateMesh(
+                    perspective.XyzuvVertices,
+                    perspective.FloatsCount,
+                    perspective.Indices,
+                    perspective.IndicesCount);
+            }
             if (!success) {
                 spdlog::error("Failed to update mesh for camera {}", i);
                 return;
@@ -1539,12 +1518,16 @@ void ViewerWindow::CalibLoop()
     {
         std::this_thread::sleep_for(std::chrono::milliseconds(50));
 
-        if (!ExtrinsicsCalibrationRequested) {
-            continue;
+        // Drift tracking runs between calibrations
+        const bool calibration_requested = ExtrinsicsCalibrationRequested;
+        if (!calibration_requested) {
+            if (!DriftTrackingEnabled || GetTimeMsec() < DriftHoldoffMsec) {
+                continue;
+            }
+        } else {
+            CalibState = CalibrationState::Processing;
         }
 
-        CalibState = CalibrationState::Processing;
-
         std::vector<VerticesInfo> vertices;
         std::vector<PerspectiveMetadata> metadata;
 
@@ -1558,6 +1541,13 @@ void ViewerWindow::CalibLoop()
             FrameInUse = false;
         });
 
+        if (!calibration_requested) {
+            if (!LastFrame.Valid || LastFrame.FrameNumber == DriftFrameNumber) {
+                continue;
+            }
+            DriftFrameNumber = LastFrame.FrameNumber;
+        }
+
         std::vector<AlignmentTransform> extrinsics;
         unsigned existing_extrinsics_count = 0;
 
@@ -1599,7 +1589,16 @@ void ViewerWindow::CalibLoop()
             extrinsics.push_back(transform);
         }
 
-        if (!FullCalibrationRequested && existing_extrinsics_count == vertices.size()) {
+        if (!calibration_requested) {
+            if (existing_extrinsics_count != vertices.size() ||
+                !DriftTracker.Update(vertices, extrinsics))
+            {
+                continue;
+            }
+
+            // Give the server time to send back the new extrinsics
+            DriftHoldoffMsec = GetTimeMsec() + kDriftHoldoffMsec;
+        } else if (!FullCalibrationRequested && existing_extrinsics_count == vertices.size()) {
             if (!RefineExtrinsics(vertices, extrinsics)) {
                 spdlog::error("ICP registration failed");
                 ExtrinsicsCalibrationRequested = false;
@@ -1614,7 +1613,9 @@ void ViewerWindow::CalibLoop()
             }
         }
 
-        spdlog::info("Registration succeeded!");
+        if (calibration_requested) {
+            spdlog::info("Registration succeeded!");
+        }
 
         for (int i = 0; i < vertices.size(); ++i)
         {
@@ -1625,8 +1626,35 @@ void ViewerWindow::CalibLoop()
             xrcap_set_extrinsics(metadata[i].Guid, metadata[i].CameraIndex, &converted_extrinsics);
         }
 
-        ExtrinsicsCalibrationRequested = false;
-        CalibState = CalibrationState::Idle;
+        if (calibration_requested) {
+            ExtrinsicsCalibrationRequested = false;
+            CalibState = CalibrationState::Idle;
+        }
+    }
+}
+
+// Runs the tasks on a thread per CPU core
+static void LightingParallelFor(int count, const std::function<void(int)>& task)
+{
+    std::atomic<int> next_task(0);
+    auto worker = [&]() {
+        for (;;) {
+            const int i = next_task++;
+            if (i >= count) {
+                break;
+            }
+            task(i);
+        }
+    };
+
+    const int thread_count = std::min(count, std::max(1, static_cast<int>( std::thread::hardware_concurrency() )));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
     }
 }
 
@@ -1649,7 +1677,7 @@ void ViewerWindow::LightCalibLoop()
         }
 
         std::vector<float> brightness, saturation;
-        ExtractCloudLighting(clouds);
+        ExtractCloudLighting(clouds, LightingParallelFor);
         if (ColorNormalization(clouds, brightness, saturation)) {
             for (size_t i = 0; i < clouds.size() && i < brightness.size(); ++i) {
                 auto& metadata = clouds[i]->Input.Metadata;
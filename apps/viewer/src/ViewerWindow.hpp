@@ -9,6 +9,7 @@
 #include <VideoMeshRender.hpp> // glad
 #include <CameraExtrinsics.hpp> // depth_mesh
 #include <ColorNormalization.hpp> // depth_mesh
+#include <ExtrinsicsTracker.hpp> // depth_mesh
 #include <TrackballCamera.hpp>
 
 #include "ViewerSettings.hpp"
@@ -30,6 +31,12 @@ enum class CalibrationState
     Processing,
 };
 
+// Depth error allowed in simplified meshes before the triangle budget applies
+static const float kMeshLodMaxErrorMm = 4.f;
+
+// Pause drift tracking after an update until the server sends it back
+static const uint64_t kDriftHoldoffMsec = 1000;
+
 
 //------------------------------------------------------------------------------
 // ViewerWindow
@@ -78,6 +85,12 @@ protected:
     std::atomic<CalibrationState> CalibState = ATOMIC_VAR_INIT(CalibrationState::Idle);
     std::shared_ptr<std::thread> CalibThread;
 
+    // Follows small rig movements between calibrations
+    std::atomic<bool> DriftTrackingEnabled = ATOMIC_VAR_INIT(false);
+    ExtrinsicsTracker DriftTracker;
+    int32_t DriftFrameNumber = -1;
+    uint64_t DriftHoldoffMsec = 0;
+
     // Size of clipping cylinder in meters
     float ClipRadiusMeters = 1.5f;
     float ClipFloorMeters = -0.5f;
@@ -116,6 +129,10 @@ protected:
     int DracoCompressionEnabled = 0;
     int GltfJpegQuality = 90;
 
+    // Simplified meshes for rendering and export
+    int MeshLodEnabled = 0;
+    int MeshLodMaxTriangles = 100000;
+
 
     void ResetLighting();
 
@@ -41,7 +41,13 @@ public static class Xrcap
     public const int XRCAP_DIRECT_PORT = 28772;
     public const int XRCAP_RENDEZVOUS_PORT = 28773;
     public const int XRCAP_MAX_CAMERAS = 8;
-    public const int XRCAP_PERSPECTIVE_COUNT = 3;
+    public const int XRCAP_PERSPECTIVE_COUNT = 8;
+
+    public const int XRCAP_FLOAT_STRIDE = 5;
+    public const int XRCAP_COMPACT_STRIDE = 5;
+    public const float XRCAP_COMPACT_POSITION_SCALE = 1.0f / 4000.0f;
+    public const int XRCAP_MESH_BLOCK_FLOATS = 320;
+    public const int XRCAP_MESH_BLOCK_INDICES = 384;
 
     public enum XrCapState
     {
@@ -85,6 +91,13 @@ public static class Xrcap
         XrcapCameraCodes_SlowWarning = 5
     }
 
+    public enum XrcapVertexFormat
+    {
+        XrcapVertexFormat_Float = 0, // XyzuvVertices only
+        XrcapVertexFormat_Compact = 1, // Also provide CompactVertices
+        XrcapVertexFormat_Delta = 2 // XyzuvVertices in blocks with versions
+    }
+
     // Note that C# marshaller assumes char* returns are allocated with
     // CoTaskMemAlloc, which is not the case here.
 #if UNITY_IPHONE && !UNITY_EDITOR
@@ -170,18 +183,18 @@ public static class Xrcap
         // Check this first.  If Valid = 0, then do not render.
         public Int32 Valid;
 
-        // Number for this camera for this perspective
-        public Int32 CameraNumber;
-
+        // Image format is NV12, which is two channels.
         // Size of image and Y channel
         public Int32 Width, Height;
+
+        // Width * Height bytes in length
         public IntPtr Y;
 
         // Size of U, V channels
-        // Note: YUV channels follow eachother contiguously in memory.
         public Int32 ChromaWidth, ChromaHeight;
-        public IntPtr U;
-        public IntPtr V;
+
+        // ChromaWidth * ChromaHeight * 2 bytes in length
+        public IntPtr UV;
 
         // Number of indices (multiple of 3) for triangles to render
         public UInt32 IndicesCount;
@@ -190,6 +203,62 @@ public static class Xrcap
         // Vertices for mesh represented as repeated: x,y,z,u,v
         public UInt32 FloatsCount;
         public IntPtr XyzuvVertices;
+
+        // XrcapExtrinsics: Transform for how the mesh is oriented in the scene
+        public IntPtr Extrinsics;
+
+        // Accelerometer reading for extrinsics calibration
+        [MarshalAs(UnmanagedType.ByValArray, SizeConst = 3)]
+        public float[] Accelerometer;
+
+        // XrcapCameraCalibration: Pointer to calibration data
+        public IntPtr Calibration;
+
+        // Information needed for setting extrinsics
+        public UInt64 Guid;
+        public UInt32 CameraIndex;
+
+        // AWB and exposure settings for this frame
+        public UInt32 AutoWhiteBalanceUsec;
+        public UInt32 ExposureUsec;
+        public UInt32 ISOSpeed;
+
+        // ProcAmp color enhancements for this frame
+        public float Brightness;
+        public float Saturation;
+
+        // XyzuvVertices in a 10 byte format, if enabled by xrcap_set_vertex_format().
+        // Otherwise CompactCount = 0.
+        // Represented as repeated UInt16: x,y,z,u,v
+        // Position in meters = XRCAP_COMPACT_POSITION_SCALE * (Int16)(x,y,z)
+        // Texture coordinate = (u,v) / 65535
+        public UInt32 CompactCount; // Number of vertices
+        public IntPtr CompactVertices;
+
+        // Block layout of the mesh, if enabled by xrcap_set_vertex_format().
+        // Otherwise MeshBlockCount = 0.
+        // Block b owns XRCAP_MESH_BLOCK_FLOATS floats of XyzuvVertices starting
+        // at b * XRCAP_MESH_BLOCK_FLOATS and XRCAP_MESH_BLOCK_INDICES indices
+        // starting at b * XRCAP_MESH_BLOCK_INDICES, of which the first
+        // MeshBlockIndexCounts[b] are used and the rest are degenerate.
+        // MeshVertexVersions[b] and MeshIndexVersions[b] are the MeshVersion in
+        // which the block last changed.  Versions are only comparable between
+        // frames with the same MeshStreamId.
+        // In this mode frames with the same MeshStreamId and MeshVersion share
+        // the same vertices and indices, so they must not be modified.
+        public UInt32 MeshStreamId;
+        public UInt32 MeshVersion;
+        public UInt32 MeshBlockCount;
+        public IntPtr MeshBlockIndexCounts;
+        public IntPtr MeshVertexVersions;
+        public IntPtr MeshIndexVersions;
+
+        // Simplified mesh with the same vertex format as XyzuvVertices,
+        // if enabled by xrcap_set_mesh_lod().  Otherwise LodIndicesCount = 0.
+        public UInt32 LodIndicesCount;
+        public IntPtr LodIndices;
+        public UInt32 LodFloatsCount;
+        public IntPtr LodXyzuvVertices;
     }
 
 
@@ -200,6 +269,9 @@ public static class Xrcap
         // Check this first.  If Valid = 0, then do not render.
         public Int32 Valid;
 
+        // Time since video start in microseconds, guaranteed monotonic.
+        public UInt64 VideoStartUsec;
+
         // Number for this frame.
         // Increments once for each frame to display.
         public Int32 FrameNumber;
@@ -263,6 +335,29 @@ public static class Xrcap
     public static extern void xrcap_set_server_capture_mode(
         Int32 mode);
 
+    // Select XrcapVertexFormat for XrcapPerspective meshes.
+#if UNITY_IPHONE && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("xrcap", CallingConvention = CallingConvention.Cdecl)]
+#endif
+    public static extern void xrcap_set_vertex_format(
+        Int32 format);
+
+    // Also provide a simplified mesh in the Lod* fields of XrcapPerspective.
+    // max_error_mm: Maximum depth error of merged regions in millimeters.
+    // Set to 0 to disable.
+    // max_triangles: If non-zero, the error is increased until each
+    // perspective has at most this many triangles, where possible.
+#if UNITY_IPHONE && !UNITY_EDITOR
+    [DllImport("__Internal")]
+#else
+    [DllImport("xrcap", CallingConvention = CallingConvention.Cdecl)]
+#endif
+    public static extern void xrcap_set_mesh_lod(
+        float max_error_mm,
+        UInt32 max_triangles);
+
     // Blocks until shutdown is complete.
 #if UNITY_IPHONE && !UNITY_EDITOR
     [DllImport("__Internal")]
@@ -27,6 +27,15 @@
 
 #include <stdint.h>
 #include <vector>
+#include <functional>
+#include <memory>
+#include <map>
+
+// Zstd types, declared here to avoid exposing zstd.h to applications
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
 
 // Compiler-specific force inline keyword
 #if defined(_MSC_VER)
@@ -50,9 +59,56 @@ namespace lossless {
 // First byte of the file format
 static const uint8_t kDepthFormatMagic = 202; // 0xCA
 
+enum DepthFlags
+{
+    DepthFlags_Keyframe = 1,    // Frame is an I-frame
+    DepthFlags_Tiled = 2,       // Image is split into independent tiles
+    DepthFlags_Dictionary = 4,  // Streams are compressed with a dictionary
+    DepthFlags_Motion = 8,      // PrevFrame blocks have motion vectors
+    DepthFlags_NearLossless = 16, // Residuals are quantized within error bounds
+    DepthFlags_Cropped = 32,    // Only a rectangle of the image is coded
+};
+
 // Number of bytes in header
 static const int kDepthHeaderBytes = 40;
 
+// Number of bytes in tiled header, not including the tile table
+static const int kDepthTiledHeaderBytes = 10;
+
+// Number of bytes for each tile in the tile table
+static const int kDepthTileBytes = 32;
+
+// Number of bytes for the dictionary ID when DepthFlags_Dictionary is set
+static const int kDepthDictionaryIdBytes = 4;
+
+// Number of bytes added to the header and each tile table entry for the
+// Motion stream sizes when DepthFlags_Motion is set
+static const int kDepthMotionSizeBytes = 8;
+
+// Number of bytes for each motion vector in the Motion stream
+static const int kDepthMotionBytes = 3;
+
+// Largest number of previous frames that P-frames can reference
+static const int kMaxReferenceFrames = 4;
+
+// Largest motion vector component in pixels
+static const int kMaxMotionSearchRange = 64;
+
+// Number of range bands in the depth quantization table
+static const int kDepthRangeBands = 5;
+
+// Number of bytes for the error bounds when DepthFlags_NearLossless is set
+static const int kDepthErrorBoundBytes = kDepthRangeBands;
+
+// Number of bytes for the crop rectangle when DepthFlags_Cropped is set
+static const int kDepthCropBytes = 8;
+
+// Set in a Blocks byte of a near-lossless frame for blocks coded losslessly
+static const uint8_t kDepthBlockExactFlag = 0x80;
+
+// Number of steps between lossless and the largest near-lossless error
+static const int kNearLosslessLevels = 16;
+
 /*
     File format:
 
@@ -77,18 +133,104 @@ static const int kDepthHeaderBytes = 40;
 
     The compressed and uncompressed sizes are of packed data for Zstd.
 
-    Flags = 1 for I-frames and 0 for P-frames.
+    Flags & DepthFlags_Keyframe for I-frames, otherwise P-frames.
     The P-frames are able to use predictors that reference the previous frame.
     The decoder keeps track of the previously decoded Frame Number and rejects
     frames that cannot be decoded due to a missing previous frame.
-*/
 
+    Tiled file format (Flags & DepthFlags_Tiled):
+
+    0: <Format Magic = 202 (1 byte)>
+    1: <Flags (1 byte)>
+    2: <Frame Number (2 bytes)>
+    4: <Width (2 bytes)>
+    6: <Height (2 bytes)>
+    8: <Tile Count (2 bytes)>
+    10: <Tile Table (32 bytes per tile)>
+
+    Each tile table entry holds the eight sizes at offsets 8..40 of the
+    untiled header.  The compressed data for each tile follows the tile table
+    in order, with the same layout as the untiled format.
+
+    Dictionary (Flags & DepthFlags_Dictionary):
+
+    <Dictionary ID (4 bytes)>
+
+    When set, the Dictionary ID follows the header (and tile table for tiled
+    images) before the compressed data.  Each stream was compressed with the
+    matching stream dictionary from the DepthDictionary with that ID.  The
+    decoder must have been given the same dictionary with AddDictionary().
+    The encoder only sets this flag on I-frames.
+
+    The image is split into horizontal tiles along 8x8 block rows.
+    Tile i starts at block row (BlockRows * i / TileCount), and the last
+    tile extends to the bottom of the image.  Each tile has at least two
+    block rows.  Tiles are compressed as if they were separate images, so they
+    can be encoded and decoded in parallel.  P-frames may still reference
+    any part of the previous frame.
+
+    Motion (Flags & DepthFlags_Motion):
+
+    <Motion Uncompressed Bytes (4 bytes)>
+    <Motion Compressed Bytes (4 bytes)>
+
+    When set, these two sizes follow the Surfaces sizes in the header, so the
+    untiled header is 48 bytes and each tile table entry is 40 bytes.
+    The compressed Motion data follows the Surfaces data.
+
+    The Motion stream has one 3-byte motion vector for each block that uses
+    the PrevFrame predictor, in the same order as the Blocks stream:
+
+    <Reference (1 byte)> <Offset X (1 signed byte)> <Offset Y (1 signed byte)>
+
+    Reference 0 is the previous frame, 1 is the frame before that, and so on
+    up to kMaxReferenceFrames-1.  The PrevFrame predictor then samples that
+    frame at the block position plus the offset, which must lie inside the
+    image.  A keyframe discards all the reference frames.
+
+    Near-Lossless (Flags & DepthFlags_NearLossless):
+
+    <Error Bound for each range band (1 byte each, 5 bytes)>
+
+    When set, the error bounds follow the Dictionary ID (or the header and
+    tile table if there is no dictionary) before the compressed data.
+    Each bound is the largest error in quantized depth units for one band
+    of the quantization table below, from nearest to farthest.
+
+    Residuals are quantized as in JPEG-LS: The bound D is selected by the
+    band of the predicted value P, and the residual E = depth - P is coded as
+    Q = sign(E) * floor((|E| + D) / (2D + 1)).  The decoder reconstructs
+    P + Q * (2D + 1) clamped to [1, 2039], and that reconstruction is what
+    later pixels and frames predict from.  The Zeroes stream is exact.
+
+    The bound applies to the band of the original depth value.  When a
+    residual would cross into a band with a smaller bound, the whole block
+    is coded losslessly instead and its Blocks byte has kDepthBlockExactFlag
+    set.  Blocks in the first row or column of a tile have no Blocks byte
+    and are always lossless.
+
+    Cropped (Flags & DepthFlags_Cropped):
+
+    <Crop X (2 bytes)>
+    <Crop Y (2 bytes)>
+    <Crop Width (2 bytes)>
+    <Crop Height (2 bytes)>
+
+    When set, the crop rectangle follows the error bounds (or whichever of
+    the above comes last) before the compressed data.  Only the pixels inside
+    the rectangle are coded: The tile table, blocks and motion vectors all
+    describe the cropped image as if it were the whole image.  The decoder
+    produces a Width x Height image that is zero outside of the rectangle.
+    P-frames can only reference frames with the same crop rectangle.
+*/
 enum class DepthResult
 {
     FileTruncated,
     WrongFormat,
     Corrupted,
     MissingPFrame, // Missing previous referenced frame
+    MissingDictionary, // Dictionary ID was not provided to the decoder
+    BufferTooSmall, // Output buffer cannot hold the image
     Success
 };
 
@@ -152,8 +294,21 @@ DEPTH_INLINE void WriteU32_LE(void* data, uint32_t value)
 
 
 bool IsDepthFrame(const uint8_t* file_data, unsigned file_bytes);
+
+// Read the image size from the header, for example to size an output buffer.
+// Returns false if this is not a depth frame
+bool GetDepthDimensions(
+    const uint8_t* file_data,
+    unsigned file_bytes,
+    int& width,
+    int& height);
 bool IsKeyFrame(const uint8_t* file_data, unsigned file_bytes);
 
+// The block predictor search and residual coding use SSE4.1/AVX2/NEON when
+// the CPU supports them.  Output is bit-exact with the scalar version.
+// This allows disabling them for testing.
+void SetSimdEnabled(bool enabled);
+
 
 //------------------------------------------------------------------------------
 // Depth Quantization
@@ -200,6 +355,31 @@ uint16_t AzureKinectQuantizeDepth(uint16_t depth);
 // Reverse quantization back to original depth
 uint16_t AzureKinectDequantizeDepth(uint16_t quantized);
 
+// Largest valid quantized depth value
+static const int kMaxQuantizedDepth = 2039;
+
+// Millimetres for each quantized unit in each range band
+static const int kDepthBandUnitMM[kDepthRangeBands] = { 1, 2, 4, 8, 16 };
+
+// Get the range band 0..kDepthRangeBands-1 of a quantized depth value.
+// Values out of range are assigned to the nearest band
+DEPTH_INLINE int GetDepthRangeBand(int quantized)
+{
+    if (quantized < 550) {
+        return 0;
+    }
+    if (quantized < 925) {
+        return 1;
+    }
+    if (quantized < 1300) {
+        return 2;
+    }
+    if (quantized < 1675) {
+        return 3;
+    }
+    return 4;
+}
+
 // Quantize depth for a whole image
 void QuantizeDepthImage(
     int width,
@@ -226,6 +406,121 @@ bool ZstdDecompress(
     int uncompressed_bytes,
     std::vector<uint8_t>& uncompressed);
 
+// Zstd contexts that are kept between frames to avoid reallocating them.
+// Each context should only be used by one thread at a time.
+class ZstdContext
+{
+public:
+    ZstdContext() = default;
+    ~ZstdContext();
+
+    ZstdContext(ZstdContext&& other) noexcept;
+    ZstdContext& operator=(ZstdContext&& other) noexcept;
+    ZstdContext(const ZstdContext&) = delete;
+    ZstdContext& operator=(const ZstdContext&) = delete;
+
+    // Dictionary is optional.
+    // Returns the number of bytes written, or 0 on failure
+    size_t Compress(
+        const uint8_t* uncompressed_data,
+        size_t uncompressed_bytes,
+        uint8_t* compressed_data,
+        size_t compressed_capacity,
+        const ZSTD_CDict_s* dictionary = nullptr);
+
+    // Dictionary is optional
+    bool Decompress(
+        const uint8_t* compressed_data,
+        int compressed_bytes,
+        int uncompressed_bytes,
+        std::vector<uint8_t>& uncompressed,
+        const ZSTD_DDict_s* dictionary = nullptr);
+
+protected:
+    ZSTD_CCtx_s* CCtx = nullptr;
+    ZSTD_DCtx_s* DCtx = nullptr;
+};
+
+
+//------------------------------------------------------------------------------
+// DepthDictionary
+
+// Streams that are compressed separately with Zstd
+enum DepthStream
+{
+    DepthStream_Zeroes,
+    DepthStream_Blocks,
+    DepthStream_Edges,
+    DepthStream_Surfaces,
+
+    DepthStream_Count
+};
+
+/*
+    Dictionary File Format:
+
+    0: <Dictionary Magic = 0x445A4443 (4 bytes)>
+    4: <Dictionary ID (4 bytes)>
+    8: <Zeroes Dictionary Bytes (4 bytes)>
+    12: <Blocks Dictionary Bytes (4 bytes)>
+    16: <Edges Dictionary Bytes (4 bytes)>
+    20: <Surfaces Dictionary Bytes (4 bytes)>
+    24: Dictionary content for each stream in the same order.
+
+    The content for each stream is a raw Zstd dictionary.  A stream with
+    empty content is compressed without a dictionary.
+*/
+
+static const uint32_t kDepthDictionaryMagic = 0x445A4443;
+static const int kDepthDictionaryHeaderBytes = 8 + 4 * DepthStream_Count;
+
+// Set of Zstd dictionaries, one for each stream type.
+// After initialization this is read-only and can be shared between threads.
+class DepthDictionary
+{
+public:
+    DepthDictionary() = default;
+    ~DepthDictionary();
+
+    DepthDictionary(const DepthDictionary&) = delete;
+    DepthDictionary& operator=(const DepthDictionary&) = delete;
+
+    // ID must be non-zero.  Returns false on failure
+    bool Initialize(
+        uint32_t id,
+        const std::vector<uint8_t> content[DepthStream_Count]);
+
+    // Load from dictionary file data.  Returns false if data is invalid
+    bool Load(const uint8_t* data, size_t bytes);
+
+    // Write dictionary file data
+    void Save(std::vector<uint8_t>& data) const;
+
+    uint32_t GetId() const
+    {
+        return Id;
+    }
+
+    // Returns nullptr if there is no dictionary for the stream
+    const ZSTD_CDict_s* GetCompressDictionary(int stream) const
+    {
+        return CDicts[stream];
+    }
+    const ZSTD_DDict_s* GetDecompressDictionary(int stream) const
+    {
+        return DDicts[stream];
+    }
+
+protected:
+    uint32_t Id = 0;
+    std::vector<uint8_t> Content[DepthStream_Count];
+
+    ZSTD_CDict_s* CDicts[DepthStream_Count] = {};
+    ZSTD_DDict_s* DDicts[DepthStream_Count] = {};
+
+    void Clear();
+};
+
 
 //------------------------------------------------------------------------------
 // Pack12
@@ -257,12 +552,271 @@ void Unpack12(
     std::vector<uint16_t>& data);
 
 
+//------------------------------------------------------------------------------
+// Parallelism
+
+// Runs task(0) .. task(count - 1), possibly in parallel, and returns when
+// all of them have completed.  For example this can wrap tbb::parallel_for.
+using ParallelForCallback = std::function<void(int count, const std::function<void(int)>& task)>;
+
+
+//------------------------------------------------------------------------------
+// DepthReferences
+
+// Motion vector for a block that uses the PrevFrame predictor
+struct DepthMotion
+{
+    uint8_t Reference = 0; // 0 = Previous frame
+    int8_t X = 0, Y = 0; // Offset in pixels
+};
+
+// Previous frames that a P-frame tile can reference
+struct DepthReferences
+{
+    // Number of frames available.  0 for keyframes
+    int Count = 0;
+
+    // Quantized depth for the previous frames, most recent first.
+    // Each points at the first pixel of the tile in that frame
+    const uint16_t* Frames[kMaxReferenceFrames] = {};
+
+    // Number of image rows above and below the tile that motion vectors reach
+    int RowsAbove = 0, RowsBelow = 0;
+
+    // Motion stream is present
+    bool Motion = false;
+
+    // Encoder only: Largest motion vector component in pixels,
+    // and the number of candidates to evaluate for each block
+    int SearchRange = 0;
+    int SearchBudget = 0;
+};
+
+// Near-lossless error bounds for a frame
+struct DepthErrorBounds
+{
+    // Residuals are quantized.  Otherwise the frame is lossless
+    bool Enabled = false;
+
+    // Largest error for each range band in quantized depth units
+    uint8_t Bands[kDepthRangeBands] = {};
+};
+
+// Rectangle of the depth image that is compressed
+struct DepthCrop
+{
+    int X = 0, Y = 0;
+    int Width = 0, Height = 0;
+
+    bool operator==(const DepthCrop& other) const
+    {
+        return X == other.X && Y == other.Y && Width == other.Width && Height == other.Height;
+    }
+    bool operator!=(const DepthCrop& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+
+// Time spent in each encoder stage for one frame.
+// Tile stages are summed over the tiles, so with SetParallelFor() they are
+// CPU time rather than wall time.
+struct DepthEncoderTimes
+{
+    uint64_t QuantizeUsec = 0;  // Quantization of the input
+    uint64_t PredictUsec = 0;   // Zeroes, block predictors and motion search
+    uint64_t PackUsec = 0;      // 12-bit packing of the residuals
+    uint64_t ZstdUsec = 0;      // Zstd compression of the streams
+    uint64_t TotalUsec = 0;     // Whole CompressInto() call
+};
+
+
+//------------------------------------------------------------------------------
+// DepthTile
+
+// Compression state for one horizontal tile of the image.
+// Untiled frames are handled as a single tile covering the whole image.
+struct DepthTile
+{
+    // Accumulated through the end of the filtering then compressed separately
+    std::vector<uint16_t> Edges, Surfaces;
+
+    // Block descriptors
+    std::vector<uint8_t> Zeroes, Blocks, Motion;
+
+    // Motion vector chosen for each block, used to seed the neighbor searches
+    std::vector<DepthMotion> BlockMotion;
+
+    // Motion stream is present
+    bool HasMotion = false;
+
+    int Zeroes_UncompressedBytes = 0;
+    int Surfaces_UncompressedBytes = 0;
+    int Blocks_UncompressedBytes = 0;
+    int Edges_UncompressedBytes = 0;
+    int Motion_UncompressedBytes = 0;
+
+    unsigned Zeroes_CompressedBytes = 0;
+    unsigned Surfaces_CompressedBytes = 0;
+    unsigned Blocks_CompressedBytes = 0;
+    unsigned Edges_CompressedBytes = 0;
+    unsigned Motion_CompressedBytes = 0;
+
+    // Packs the 16-bit overruns into 12-bit values and apply Zstd
+    std::vector<uint8_t> PackedEdges, PackedSurfaces;
+
+    // Compressed data when the tile cannot be written directly to the output
+    std::vector<uint8_t> Compressed;
+
+    // Zstd contexts for this tile
+    ZstdContext Zstd;
+
+    // Encoder stage times for the last frame
+    uint64_t PredictUsec = 0, PackUsec = 0, ZstdUsec = 0;
+
+
+    // Prepare the streams for the quantized depth tile.
+    // For near-lossless frames the depth is overwritten with the values that
+    // the decoder will reconstruct, so it can be used as a reference frame
+    void Compress(
+        int width,
+        int height,
+        uint16_t* depth,
+        const DepthReferences& references,
+        const DepthErrorBounds& bounds);
+
+    // Bound on WriteCompressed() output after Compress()
+    size_t MaxCompressedBytes() const;
+
+    // Zstd compress the streams into dest.  Dictionary is optional.
+    // Returns the number of bytes written, or 0 if capacity is too small
+    size_t WriteCompressed(
+        uint8_t* dest,
+        size_t capacity,
+        const DepthDictionary* dictionary);
+
+    // Write the section sizes (32 bytes, or 40 bytes with motion)
+    void WriteSizes(uint8_t* dest) const;
+
+    // Decompress tile from src (following the header) into quantized depth.
+    // sizes: Pointer to the section sizes (32 bytes, or 40 bytes with motion)
+    bool Decompress(
+        int width,
+        int height,
+        const uint8_t* sizes,
+        const uint8_t* src,
+        uint16_t* depth,
+        const DepthReferences& references,
+        const DepthErrorBounds& bounds,
+        const DepthDictionary* dictionary);
+
+protected:
+    size_t WriteStreams(
+        uint8_t* dest,
+        size_t capacity,
+        const DepthDictionary* dictionary);
+
+    void CompressImage(
+        int width,
+        int height,
+        uint16_t* depth,
+        const DepthReferences& references,
+        const DepthErrorBounds& bounds);
+    bool DecompressImage(
+        int width,
+        int height,
+        uint16_t* depth,
+        const DepthReferences& references,
+        const DepthErrorBounds& bounds);
+
+    void EncodeZeroes(
+        int width,
+        int height,
+        const uint16_t* depth);
+
+    // This writes the whole QuantizedDepth image with 0 or 1
+    // before the block decoding starts.
+    void DecodeZeroes(
+        int width,
+        int height,
+        uint16_t* depth);
+};
+
+
 //------------------------------------------------------------------------------
 // DepthCompressor
 
 class DepthCompressor
 {
+    friend class DepthDictionaryTrainer;
+
 public:
+    // Split the image into this many horizontal tiles that are compressed
+    // independently.  This allows encoding and decoding to run in parallel
+    // for a small cost in compression ratio.  Default is 1: No tiling.
+    // The tile count is reduced for small images.
+    void SetTileCount(int tile_count);
+
+    // Provide a thread pool for encoding/decoding tiles in parallel.
+    // By default tiles are processed one at a time on the calling thread.
+    void SetParallelFor(ParallelForCallback parallel_for);
+
+    // Compress the following I-frames using this dictionary.
+    // P-frames are compressed without it because their streams come out
+    // larger with a dictionary than without.
+    // Pass nullptr to stop using a dictionary.
+    void SetDictionary(std::shared_ptr<const DepthDictionary> dictionary);
+
+    // Allow decompressing frames that reference this dictionary by ID
+    void AddDictionary(std::shared_ptr<const DepthDictionary> dictionary);
+
+    // Enable motion-compensated P-frames.
+    // reference_count: Number of previous frames that blocks can reference,
+    // from 1 to kMaxReferenceFrames.
+    // search_range: Largest motion vector component in pixels, up to
+    // kMaxMotionSearchRange.  0 only searches the reference frames.
+    // search_budget: Largest number of candidates evaluated for each 8x8
+    // block, which bounds the extra encoder time.
+    // Default is 1 reference with no search, which does not add a Motion
+    // stream.  The decoder does not need any setup.
+    void SetMotionSearch(int reference_count, int search_range, int search_budget);
+
+    // Enable near-lossless compression.
+    // max_error_mm: Largest error in millimetres for each range band of the
+    // quantization table, on top of the quantization itself.  The bounds are
+    // rounded down to whole quantized units for each band.
+    // Pass nullptr or all zeroes for lossless compression (default).
+    // The decoder does not need any setup.
+    void SetMaxError(const int max_error_mm[kDepthRangeBands]);
+
+    // Adjust the near-lossless error bound from frame to frame between
+    // lossless and the SetMaxError() bound to hit a target bitrate.
+    // Pass 0 to always use the SetMaxError() bound (default).
+    void SetTargetBitrate(int bits_per_second, int framerate);
+
+    // Only compress the pixels inside this rectangle, for example the part of
+    // the image that can contain a clipped mesh, so the encoding time and
+    // size scale with the rectangle instead of the sensor resolution.
+    // The rectangle is expanded to 8x8 block boundaries and clamped to the
+    // image.  Pixels outside of it are zero after decoding.  Changing the
+    // rectangle makes the next frame a keyframe.
+    // Pass nullptr to compress the whole image (default).
+    // The decoder does not need any setup.
+    void SetCrop(const DepthCrop* crop);
+
+    // Current step from 0 (lossless) to kNearLosslessLevels (SetMaxError bound)
+    int GetNearLosslessLevel() const
+    {
+        return NearLosslessLevel;
+    }
+
+    // Encoder stage times for the last compressed frame
+    const DepthEncoderTimes& GetEncoderTimes() const
+    {
+        return EncoderTimes;
+    }
+
     // Compress depth array to buffer
     // Set keyframe to indicate this frame should not reference the previous one
     void Compress(
@@ -272,6 +826,21 @@ public:
         std::vector<uint8_t>& compressed,
         bool keyframe);
 
+    // Largest output from CompressInto() for this image size with the
+    // current tile count
+    size_t MaxCompressedBytes(int width, int height) const;
+
+    // Compress depth array directly into a caller-provided buffer.
+    // Returns the number of bytes written, or 0 if the buffer is too small.
+    // After a failure the next frame is a keyframe.
+    size_t CompressInto(
+        int width,
+        int height,
+        const uint16_t* unquantized_depth,
+        uint8_t* compressed,
+        size_t compressed_capacity,
+        bool keyframe);
+
     // Decompress buffer to depth array.
     // Resulting depth buffer is row-first, stride=width*2 (no surprises).
     // Returns false if input is invalid
@@ -281,58 +850,140 @@ public:
         int& height,
         std::vector<uint16_t>& depth_out);
 
+    // Decompress directly into a caller-provided depth buffer.
+    // stride: Number of depth values between rows, at least width.
+    // depth_out_rows: Number of rows available in depth_out.
+    // Use GetDepthDimensions() to read the size of the image beforehand.
+    DepthResult DecompressInto(
+        const uint8_t* compressed,
+        size_t compressed_bytes,
+        int& width,
+        int& height,
+        uint16_t* depth_out,
+        int stride,
+        int depth_out_rows);
+
 protected:
-    // Depth values quantized for current and last frame
-    std::vector<uint16_t> QuantizedDepth[2];
+    // Depth values quantized for the current frame and the reference frames
+    // before it, used as a ring buffer
+    std::vector<uint16_t> QuantizedDepth[kMaxReferenceFrames + 1];
     unsigned CurrentFrameIndex = 0;
+
+    // Crop rectangle for each frame in QuantizedDepth
+    DepthCrop FrameCrops[kMaxReferenceFrames + 1];
     unsigned CompressedFrameNumber = 0;
 
-    // Accumulated through the end of the filtering then compressed separately
-    std::vector<uint16_t> Edges, Surfaces;
+    // Number of frames before the current one that can be referenced
+    int ReferenceCount = 0;
 
-    // Block descriptors
-    std::vector<uint8_t> Zeroes, Blocks;
+    // Motion search settings
+    int ReferenceFrames = 1;
+    int MotionSearchRange = 0;
+    int MotionSearchBudget = 0;
 
-    int Zeroes_UncompressedBytes = 0;
-    int Surfaces_UncompressedBytes = 0;
-    int Blocks_UncompressedBytes = 0;
-    int Edges_UncompressedBytes = 0;
+    // Near-lossless settings
+    int MaxErrorMM[kDepthRangeBands] = {};
+    int TargetFrameBytes = 0;
 
-    // Results of zstd compression
-    std::vector<uint8_t> ZeroesOut, SurfacesOut, BlocksOut, EdgesOut;
+    // Rate controller state: Error bound step and bytes sent over target
+    int NearLosslessLevel = kNearLosslessLevels;
+    int64_t RateBucketBytes = 0;
 
-    // Packs the 16-bit overruns into 12-bit values and apply Zstd
-    std::vector<uint8_t> Packed;
+    // Crop settings
+    bool CropEnabled = false;
+    DepthCrop Crop;
 
+    // Encoder stage times for the last frame
+    DepthEncoderTimes EncoderTimes;
 
-    void CompressImage(
-        int width,
-        int height,
-        const uint16_t* depth,
-        const uint16_t* prev_depth);
-    bool DecompressImage(
+    int TileCount = 1;
+    ParallelForCallback ParallelFor;
+
+    // State for each tile
+    std::vector<DepthTile> Tiles;
+
+    // Dictionary used by the encoder
+    std::shared_ptr<const DepthDictionary> Dictionary;
+
+    // Dictionaries available to the decoder
+    std::vector<std::shared_ptr<const DepthDictionary>> Dictionaries;
+
+
+    // Run task for each tile using ParallelFor if provided
+    void ForEachTile(int count, const std::function<void(int)>& task);
+
+    // Get the block-aligned crop rectangle to encode for an image size.
+    // Returns false if the whole image should be encoded
+    bool GetEncoderCrop(int width, int height, DepthCrop& crop) const;
+
+    // Get up to max_count previous frames with the same crop, most recent
+    // first.  Returns the number of frames
+    int GetReferenceFrames(
+        const DepthCrop& crop,
+        int max_count,
+        const uint16_t* frames[kMaxReferenceFrames]) const;
+
+    // Get references for the tile that starts at first_row
+    void GetTileReferences(
+        const uint16_t* const frames[kMaxReferenceFrames],
+        int frame_count,
         int width,
         int height,
-        uint16_t* depth,
-        const uint16_t* prev_depth);
+        int first_row,
+        int row_count,
+        bool motion,
+        DepthReferences& references) const;
+
+    // Get the error bounds for the current rate controller level
+    void GetErrorBounds(DepthErrorBounds& bounds) const;
 
-    void WriteCompressedFile(
+    // Update the rate controller after compressing a frame
+    void UpdateRateControl(size_t frame_bytes);
+
+    // Write header, tile table, dictionary ID, error bounds and crop
+    void WriteHeader(
         int width,
         int height,
         bool keyframe,
-        std::vector<uint8_t>& compressed);
+        bool tiled,
+        bool motion,
+        const DepthErrorBounds& bounds,
+        const DepthCrop* crop,
+        uint8_t* dest);
+};
 
-    void EncodeZeroes(
-        int width,
-        int height,
-        const uint16_t* depth);
 
-    // This writes the whole QuantizedDepth image with 0 or 1
-    // before the block decoding starts.
-    void DecodeZeroes(
+//------------------------------------------------------------------------------
+// DepthDictionaryTrainer
+
+// Collects the stream data produced while compressing example depth images,
+// and then selects the most common content for each stream dictionary.
+class DepthDictionaryTrainer
+{
+public:
+    // Add a depth image to the training set.
+    // source: Identifies the camera the image came from.
+    // P-frames are ignored since dictionaries are only used for I-frames.
+    void AddFrame(
+        unsigned source,
         int width,
         int height,
-        uint16_t* depth);
+        const uint16_t* depth,
+        bool keyframe);
+
+    // Build a dictionary with up to dictionary_bytes for each stream.
+    // Returns false if no training data was added
+    bool Train(
+        uint32_t id,
+        int dictionary_bytes,
+        DepthDictionary& dictionary);
+
+protected:
+    // Encoder for each source
+    std::map<unsigned, std::unique_ptr<DepthCompressor>> Compressors;
+
+    // Uncompressed stream data collected so far
+    std::vector<uint8_t> Samples[DepthStream_Count];
 };
 
 
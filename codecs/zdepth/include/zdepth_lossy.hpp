@@ -14,8 +14,13 @@
     Requirements:
 
         + Windows or Linux computer.
-        + Encoder requires an Intel CPU and the iGPU must be enabled in BIOS.
-        + Decoder requires either the iGPU or an Nvidia graphics card.
+        + Encoder uses the Intel iGPU if it is enabled in BIOS.
+        + Decoder uses either the iGPU or an Nvidia graphics card.
+        + Otherwise both fall back to ffmpeg (libx264/libx265) on the CPU,
+          when built with ZDEPTH_FFMPEG.
+
+    All of the video backends produce and accept standard Annex-B NALUs,
+    so for example a headless software encoder can feed a hardware decoder.
 */
 
 /*
@@ -113,6 +118,7 @@
 
 #include <stdint.h>
 #include <vector>
+#include <memory>
 
 // Compiler-specific force inline keyword
 #if defined(_MSC_VER)
@@ -127,14 +133,12 @@
     #define DEPTH_ALIGNED_ACCESSES
 #endif // ANDROID
 
-#include <MfxVideoDecoder.hpp> // mfx_codecs
-#include <MfxVideoEncoder.hpp> // mfx_codecs
-#ifdef ZDEPTH_NVCUVID
-#include <NvVideoCodec.hpp> // nvcuvid_codecs
-#endif
-
 #include <core_video.hpp> // Video parser
 
+// Zstd types, declared here to avoid exposing zstd.h to applications
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
 namespace lossy {
 
 
@@ -148,11 +152,18 @@ enum DepthFlags
 {
     DepthFlags_Keyframe = 1,    // Frame is an IDR
     DepthFlags_HEVC = 2,        // Use HEVC instead of H.264
+    DepthFlags_Cropped = 4,     // Only a rectangle of the image is coded
 };
 
 // Number of bytes in header
 static const int kDepthHeaderBytes = 26;
 
+// Number of bytes for the crop rectangle when DepthFlags_Cropped is set
+static const int kDepthCropBytes = 8;
+
+// Crop rectangles are aligned to video codec macroblocks
+static const int kDepthCropAlign = 16;
+
 /*
     File format:
 
@@ -163,6 +174,11 @@ static const int kDepthHeaderBytes = 26;
     The P-frames are able to use predictors that reference the previous frame.
     The decoder keeps track of the previously decoded Frame Number and rejects
     frames that cannot be decoded due to a missing previous frame.
+
+    When DepthFlags_Cropped is set, an 8 byte crop rectangle follows the
+    header: X, Y, Width, Height as 16-bit words.  The high and low bits then
+    cover only the Width x Height pixels inside the rectangle, and the
+    decoder produces a full-size image that is zero outside of it.
 */
 
 #pragma pack(push)
@@ -185,6 +201,15 @@ struct DepthHeader
     // Compressed data follows: High bits (Zstd), then low bits (NALUs).
 };
 
+// Follows DepthHeader when DepthFlags_Cropped is set
+struct DepthCropHeader
+{
+    /* 0 */ uint16_t X;
+    /* 2 */ uint16_t Y;
+    /* 4 */ uint16_t Width;
+    /* 6 */ uint16_t Height;
+};
+
 #pragma pack(pop)
 
 // No error codes are unrecoverable.  To recover, simply keep passing frames
@@ -295,6 +320,24 @@ void UndoRescaleImage_11Bits(
     uint16_t max_value,
     std::vector<uint16_t>& quantized);
 
+// Same result as QuantizeDepthImage() followed by RescaleImage_11Bits(),
+// fused into one vectorized pass plus one table lookup pass.
+// Returns the minimum and maximum values in the data, needed for the decoder.
+void QuantizeAndRescaleImage_11Bits(
+    int n,
+    const uint16_t* depth,
+    std::vector<uint16_t>& rescaled,
+    uint16_t& min_value,
+    uint16_t& max_value);
+
+// Same result as UndoRescaleImage_11Bits() followed by DequantizeDepthImage(),
+// done with a single table lookup.
+// This modifies the data in-place.
+void UndoRescaleAndDequantizeImage(
+    uint16_t min_value,
+    uint16_t max_value,
+    std::vector<uint16_t>& depth_inout);
+
 
 //------------------------------------------------------------------------------
 // Zstd
@@ -309,13 +352,144 @@ bool ZstdDecompress(
     int uncompressed_bytes,
     std::vector<uint8_t>& uncompressed);
 
+// Zstd contexts that are kept between frames to avoid reallocating them
+class ZstdContext
+{
+public:
+    ZstdContext() = default;
+    ~ZstdContext();
+
+    ZstdContext(const ZstdContext&) = delete;
+    ZstdContext& operator=(const ZstdContext&) = delete;
+
+    void Compress(
+        const std::vector<uint8_t>& uncompressed,
+        std::vector<uint8_t>& compressed);
+
+    bool Decompress(
+        const uint8_t* compressed_data,
+        int compressed_bytes,
+        int uncompressed_bytes,
+        std::vector<uint8_t>& uncompressed);
+
+protected:
+    ZSTD_CCtx_s* CCtx = nullptr;
+    ZSTD_DCtx_s* DCtx = nullptr;
+};
+
+
+//------------------------------------------------------------------------------
+// Low Plane Video Codec
+
+/*
+    The low 8 bits of depth are compressed as the luma plane of a 4:2:0 video
+    frame with constant chroma.  Each backend implements the interfaces below
+    so the hardware codecs are an acceleration rather than a requirement.
+*/
+
+enum class VideoBackend
+{
+    Auto,       // Use the first backend that works, in the order below
+    Mfx,        // Intel QuickSync (ZDEPTH_MFX)
+    Nvcuvid,    // Nvidia NVDEC, decoder only (ZDEPTH_NVCUVID)
+    Ffmpeg,     // Software libavcodec (ZDEPTH_FFMPEG)
+};
+
+const char* VideoBackendString(VideoBackend backend);
+
+struct LowPlaneParams
+{
+    int Width = 0;
+    int Height = 0;
+    bool Hevc = false;
+
+    // Encoder only
+    unsigned Framerate = 30;
+    unsigned Bitrate = 3000000;
+    int Quality = 20; // 1-51 (1=best)
+};
+
+class LowPlaneEncoder
+{
+public:
+    virtual ~LowPlaneEncoder() = default;
+
+    virtual VideoBackend GetBackend() const = 0;
+
+    // Returns false if the backend is not available
+    virtual bool Initialize(const LowPlaneParams& params) = 0;
+
+    // Encode a Width x Height plane of bytes.
+    // On success the Annex-B NALUs for the picture are returned in data/bytes,
+    // which remain valid until the next call.  Returns false on failure
+    virtual bool Encode(
+        const uint8_t* plane,
+        bool keyframe,
+        uint8_t*& data,
+        int& bytes) = 0;
+};
+
+class LowPlaneDecoder
+{
+public:
+    virtual ~LowPlaneDecoder() = default;
+
+    virtual VideoBackend GetBackend() const = 0;
+
+    // Provided with the keyframe that starts the stream, including the
+    // parameter sets.  Returns false if the backend cannot decode it
+    virtual bool Initialize(
+        const LowPlaneParams& params,
+        const uint8_t* keyframe,
+        int keyframe_bytes) = 0;
+
+    // Decode the Annex-B NALUs for one picture.
+    // Returns a Width x Height plane of bytes that remains valid until the
+    // next call, or nullptr on failure
+    virtual const uint8_t* Decode(const uint8_t* data, int bytes) = 0;
+};
+
+// Create and initialize an encoder for the backend.
+// Returns nullptr if no matching backend is compiled in and working
+std::unique_ptr<LowPlaneEncoder> CreateLowPlaneEncoder(
+    VideoBackend backend,
+    const LowPlaneParams& params);
+
+// Create and initialize a decoder for the backend from a keyframe.
+// Returns nullptr if no matching backend is compiled in and working
+std::unique_ptr<LowPlaneDecoder> CreateLowPlaneDecoder(
+    VideoBackend backend,
+    const LowPlaneParams& params,
+    const uint8_t* keyframe,
+    int keyframe_bytes);
+
 
 //------------------------------------------------------------------------------
 // DepthCompressor
 
+// Rectangle of the depth image in pixels
+struct DepthCrop
+{
+    int X = 0, Y = 0;
+    int Width = 0, Height = 0;
+};
+
 class DepthCompressor
 {
 public:
+    // Select the video codec backend for the low bits.
+    // Default is Auto: Hardware if available, otherwise software.
+    // Takes effect when the encoder or decoder is next created
+    void SetVideoBackend(VideoBackend backend);
+
+    // Only compress the pixels inside this rectangle.
+    // The rectangle is expanded to 16x16 macroblock boundaries and clamped
+    // to the image.  Pixels outside of it are zero after decoding.  When the
+    // size of the rectangle changes the video encoder is restarted, so the
+    // next frame is a keyframe.
+    // Pass nullptr to compress the whole image (default).
+    void SetCrop(const DepthCrop* crop);
+
     // Compress depth array to buffer
     // Set keyframe to indicate this frame should not reference the previous one
     void Compress(
@@ -339,6 +513,13 @@ public:
 protected:
     // Depth values quantized
     std::vector<uint16_t> QuantizedDepth;
+
+    // Crop rectangle selected by SetCrop()
+    bool CropEnabled = false;
+    DepthCrop Crop;
+
+    // Depth inside the crop rectangle
+    std::vector<uint16_t> CropDepth;
     uint64_t FrameCount = 0;
 
     std::vector<uint8_t> High;
@@ -347,26 +528,24 @@ protected:
     // Results of compression
     std::vector<uint8_t> HighOut, LowOut;
 
-    // Video encoder used for low bits
-    std::unique_ptr<mfx::VideoEncoder> Encoder;
+    // Zstd contexts for the high bits
+    ZstdContext Zstd;
 
-    // Intel and Nvidia hwaccel video decoders
-    std::unique_ptr<mfx::VideoDecoder> IntelDecoder;
-#ifdef ZDEPTH_NVCUVID
-    std::unique_ptr<nvcuvid::VideoCodec> NvidiaDecoder;
-#endif
+    // Video codecs used for low bits
+    VideoBackend Backend = VideoBackend::Auto;
+    std::unique_ptr<LowPlaneEncoder> Encoder;
+    std::unique_ptr<LowPlaneDecoder> Decoder;
 
     unsigned LastWidth = 0, LastHeight = 0;
-
-    // We need a buffer allocator for the encoder because the
-    // encoder holds onto frames after encode completes.
-    std::shared_ptr<mfx::SystemAllocator> Allocator;
-    std::shared_ptr<mfx::MfxContext> Context;
+    bool LastHevc = false;
 
     std::unique_ptr<core::VideoParser> Parser;
     std::vector<uint8_t> VideoParameters;
 
 
+    // Returns false if the whole image should be compressed
+    bool GetEncoderCrop(int width, int height, DepthCrop& crop) const;
+
     // Transform the data for compression by Zstd/H.264
     void Filter(
         const std::vector<uint16_t>& depth_in);
@@ -1,8 +1,12 @@
 // Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
 
 #include "zdepth_lossless.hpp"
+#include "zdepth_simd.hpp"
+#include "zdepth_quantize.hpp"
 #include <zstd.h> // Zstd
 #include <string.h> // memcpy
+#include <algorithm> // std::sort
+#include <chrono> // Encoder stage timing
 
 namespace lossless {
 
@@ -13,9 +17,21 @@ namespace lossless {
 // Size of a block for predictor selection purposes
 static const int kBlockSize = 8;
 
+// Smallest crop rectangle width and height
+static const int kMinCropSize = kBlockSize * 2;
+
 // Zstd compression level
 static const int kZstdLevel = 1;
 
+// Most data to collect for each stream while training a dictionary
+static const size_t kMaxTrainingBytes = 64 * 1024 * 1024;
+
+// Dictionary training: Size of the byte strings that are counted
+static const int kTrainingDmerBytes = 8;
+
+// Dictionary training: Size of segments copied into the dictionary
+static const int kTrainingSegmentBytes = 256;
+
 const char* DepthResultString(DepthResult result)
 {
     switch (result)
@@ -24,6 +40,8 @@ const char* DepthResultString(DepthResult result)
     case DepthResult::WrongFormat: return "WrongFormat";
     case DepthResult::Corrupted: return "Corrupted";
     case DepthResult::MissingPFrame: return "MissingPFrame";
+    case DepthResult::MissingDictionary: return "MissingDictionary";
+    case DepthResult::BufferTooSmall: return "BufferTooSmall";
     case DepthResult::Success: return "Success";
     default: break;
     }
@@ -45,6 +63,20 @@ bool IsDepthFrame(const uint8_t* file_data, unsigned file_bytes)
     return true;
 }
 
+bool GetDepthDimensions(
+    const uint8_t* file_data,
+    unsigned file_bytes,
+    int& width,
+    int& height)
+{
+    if (!IsDepthFrame(file_data, file_bytes)) {
+        return false;
+    }
+    width = ReadU16_LE(file_data + 4);
+    height = ReadU16_LE(file_data + 6);
+    return true;
+}
+
 bool IsKeyFrame(const uint8_t* file_data, unsigned file_bytes)
 {
     if (!IsDepthFrame(file_data, file_bytes)) {
@@ -53,6 +85,13 @@ bool IsKeyFrame(const uint8_t* file_data, unsigned file_bytes)
     return (file_data[1] & 1) != 0;
 }
 
+static bool SimdEnabled = true;
+
+void SetSimdEnabled(bool enabled)
+{
+    SimdEnabled = enabled;
+}
+
 
 //------------------------------------------------------------------------------
 // Depth Quantization
@@ -111,11 +150,9 @@ void QuantizeDepthImage(
 {
     const int n = width * height;
     quantized.resize(n);
-    uint16_t* dest = quantized.data();
 
-    for (int i = 0; i < n; ++i) {
-        dest[i] = AzureKinectQuantizeDepth(depth[i]);
-    }
+    zdepth::QuantizedStats stats;
+    zdepth::QuantizeDepthImage(SimdEnabled, n, depth, quantized.data(), stats);
 }
 
 void DequantizeDepthImage(
@@ -126,10 +163,51 @@ void DequantizeDepthImage(
 {
     const int n = width * height;
     depth.resize(n);
-    uint16_t* dest = depth.data();
 
-    for (int i = 0; i < n; ++i) {
-        dest[i] = AzureKinectDequantizeDepth(quantized[i]);
+    zdepth::DequantizeDepthImage(n, quantized, depth.data());
+}
+
+// Monotonic clock for the encoder stage times
+static uint64_t GetTimeUsec()
+{
+    return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() );
+}
+
+// Quantize the crop rectangle of a depth image into a packed image
+static void QuantizeDepthCrop(
+    int width,
+    const uint16_t* depth,
+    const DepthCrop& crop,
+    std::vector<uint16_t>& quantized)
+{
+    quantized.resize(crop.Width * crop.Height);
+    uint16_t* dest = quantized.data();
+    const uint16_t* src = depth + crop.Y * width + crop.X;
+
+    zdepth::QuantizedStats stats;
+    for (int y = 0; y < crop.Height; ++y, src += width, dest += crop.Width) {
+        zdepth::QuantizeDepthImage(SimdEnabled, crop.Width, src, dest, stats);
+    }
+}
+
+// Zero the output pixels outside of the crop rectangle
+static void ClearOutsideCrop(
+    int width,
+    int height,
+    const DepthCrop& crop,
+    uint16_t* depth,
+    int stride)
+{
+    const int right = crop.X + crop.Width;
+    for (int y = 0; y < height; ++y, depth += stride)
+    {
+        if (y < crop.Y || y >= crop.Y + crop.Height) {
+            memset(depth, 0, width * sizeof(uint16_t));
+            continue;
+        }
+        memset(depth, 0, crop.X * sizeof(uint16_t));
+        memset(depth + right, 0, (width - right) * sizeof(uint16_t));
     }
 }
 
@@ -219,371 +297,2780 @@ static inline int Predict_PrevFrame(int prev0, int left0, int up0)
     return Predict_Larger(left0, up0);
 }
 
-
-//------------------------------------------------------------------------------
-// Zstd
-
-void ZstdCompress(
-    const std::vector<uint8_t>& uncompressed,
-    std::vector<uint8_t>& compressed)
+// Evaluate one predictor for row[x], which must not be on the image border
+static inline int Predict(
+    int predictor,
+    const uint16_t* row,
+    int x,
+    int width,
+    const uint16_t* prev_row)
 {
-    compressed.resize(ZSTD_compressBound(uncompressed.size()));
-    const size_t size = ZSTD_compress(
-        compressed.data(),
-        compressed.size(),
-        uncompressed.data(),
-        uncompressed.size(),
-        kZstdLevel);
-    if (ZSTD_isError(size)) {
-        compressed.clear();
-        return;
+    const unsigned left0 = row[x - 1];
+    const unsigned up0 = row[x - width];
+
+    switch (predictor)
+    {
+    default:
+    case PredictorType_Larger:
+        return Predict_Larger(left0, up0);
+    case PredictorType_Up:
+        return Predict_Up(left0, up0);
+    case PredictorType_Left:
+        return Predict_Left(left0, up0);
+    case PredictorType_UpTrend:
+        return Predict_UpTrend(left0, up0, row[x - width * 2]);
+    case PredictorType_LeftTrend:
+        return Predict_LeftTrend(left0, row[x - 2], up0);
+    case PredictorType_Average:
+        return Predict_Average(left0, up0);
+    case PredictorType_PrevFrame:
+        return Predict_PrevFrame(prev_row[x], left0, up0);
     }
-    compressed.resize(size);
 }
 
-bool ZstdDecompress(
-    const uint8_t* compressed_data,
-    int compressed_bytes,
-    int uncompressed_bytes,
-    std::vector<uint8_t>& uncompressed)
+// Pick the predictor with the smallest sum of residuals.
+// Ties go to the predictor with the lower index.
+static inline int ChooseBestPredictor(const unsigned* pred_sum, bool pframe)
 {
-    uncompressed.resize(uncompressed_bytes);
-    const size_t size = ZSTD_decompress(
-        uncompressed.data(),
-        uncompressed.size(),
-        compressed_data,
-        compressed_bytes);
-    if (ZSTD_isError(size)) {
-        return false;
+    unsigned smallest_i = pred_sum[0];
+    int best_predictor = 0;
+    int pred_count = PredictorType_Count;
+    if (!pframe) {
+        pred_count = PredictorType_PrevFrame; // Skip P-frame ones
     }
-    if (size != static_cast<size_t>( uncompressed_bytes )) {
-        return false;
+    for (int i = 1; i < pred_count; ++i)
+    {
+        if (pred_sum[i] < smallest_i) {
+            best_predictor = i;
+            smallest_i = pred_sum[i];
+        }
     }
-    return true;
+    return best_predictor;
 }
 
 
 //------------------------------------------------------------------------------
-// Pack12
+// Block Kernels: Scalar
 
-void Pad12(std::vector<uint16_t>& data)
-{
-    if (data.size() % 2 != 0) {
-        data.push_back(0);
-    }
-}
+/*
+    These operate on one 8x8 block that is not in the first row or column of
+    blocks, so the x-2 and y-2 neighbors are always available.
 
-void Pack12(
-    const std::vector<uint16_t>& unpacked,
-    std::vector<uint8_t>& packed)
+    prev_row points at the same pixel in the previous frame, or is nullptr
+    for keyframes.
+
+    Residuals for pixels with a missing left/up neighbor are written to the
+    Edges stream and the rest to the Surfaces stream, in raster order.
+*/
+
+static int SelectBlockPredictor(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
 {
-    unsigned data_count = static_cast<unsigned>( unpacked.size() );
-    packed.resize(data_count + (data_count / 2));
-    uint8_t* packed0 = packed.data();
-    uint8_t* packed1 = packed0 + data_count;
-    const uint16_t* data = unpacked.data();
-    const uint16_t* data_end = data + data_count;
-    while (data < data_end)
+    // Identify the prediction with the best accuracy for this block:
+    unsigned pred_sum[PredictorType_Count] = {0};
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
     {
-        const uint16_t x = data[0];
-        const uint16_t y = data[1];
-        data += 2;
+        for (int x = 0; x < kBlockSize; ++x)
+        {
+            const unsigned d = row[x];
+            if (d != 0)
+            {
+                const unsigned left0 = row[x - 1];
+                const unsigned left1 = row[x - 2];
+                const unsigned up0 = row[x - width];
+                const unsigned up1 = row[x - width * 2];
+
+                pred_sum[PredictorType_Larger] += ApplyPrediction(d, Predict_Larger(left0, up0));
+                pred_sum[PredictorType_Up] += ApplyPrediction(d, Predict_Up(left0, up0));
+                pred_sum[PredictorType_Left] += ApplyPrediction(d, Predict_Left(left0, up0));
+                pred_sum[PredictorType_UpTrend] += ApplyPrediction(d, Predict_UpTrend(left0, up0, up1));
+                pred_sum[PredictorType_LeftTrend] += ApplyPrediction(d, Predict_LeftTrend(left0, left1, up0));
+                pred_sum[PredictorType_Average] += ApplyPrediction(d, Predict_Average(left0, up0));
+
+                if (prev_row) {
+                    pred_sum[PredictorType_PrevFrame] += ApplyPrediction(d, Predict_PrevFrame(prev_row[x], left0, up0));
+                }
+            }
+        }
 
-        packed0[0] = static_cast<uint8_t>( x >> 4 );
-        packed0[1] = static_cast<uint8_t>( y >> 4 );
-        packed0 += 2;
+        if (prev_row) {
+            prev_row += width;
+        }
+    } // end x,y loop
 
-        packed1[0] = static_cast<uint8_t>( (x & 15) | ((y & 15) << 4) );
-        packed1++;
-    }
+    return ChooseBestPredictor(pred_sum, prev_row != nullptr);
 }
 
-void Unpack12(
-    const std::vector<uint8_t>& packed,
-    std::vector<uint16_t>& unpacked)
+// Sum of PrevFrame residuals for the Surfaces pixels of a block,
+// used to compare motion vectors
+static unsigned PrevFrameBlockCost(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
 {
-    unsigned data_count = static_cast<unsigned>(packed.size()) * 2 / 3;
-    unpacked.resize(data_count);
-    const uint8_t* packed0 = packed.data();
-    const uint8_t* packed1 = packed0 + data_count;
-    uint16_t* data = unpacked.data();
-    const uint16_t* data_end = data + data_count;
-    while (data < data_end)
-    {
-        uint16_t x = static_cast<uint16_t>( packed0[0] ) << 4;
-        uint16_t y = static_cast<uint16_t>( packed0[1] ) << 4;
-        packed0 += 2;
+    unsigned sum = 0;
 
-        const uint8_t p1 = packed1[0];
-        x |= p1 & 15;
-        y |= p1 >> 4;
-        packed1++;
-
-        data[0] = x;
-        data[1] = y;
-        data += 2;
+    for (int y = 0; y < kBlockSize; ++y, row += width, prev_row += width)
+    {
+        for (int x = 0; x < kBlockSize; ++x)
+        {
+            const unsigned d = row[x];
+            const unsigned left0 = row[x - 1];
+            const unsigned up0 = row[x - width];
+            if (d != 0 && left0 != 0 && up0 != 0) {
+                sum += ApplyPrediction(d, Predict_PrevFrame(prev_row[x], left0, up0));
+            }
+        }
     }
-}
-
 
-//------------------------------------------------------------------------------
-// DepthCompressor
+    return sum;
+}
 
-void DepthCompressor::Compress(
+static void EmitBlockResiduals(
+    const uint16_t* row,
     int width,
-    int height,
-    const uint16_t* unquantized_depth,
-    std::vector<uint8_t>& compressed,
-    bool keyframe)
+    const uint16_t* prev_row,
+    int predictor,
+    uint16_t*& edges,
+    uint16_t*& surfaces)
 {
-    // Enforce keyframe if we have not compressed anything yet
-    if (CompressedFrameNumber == 0) {
-        keyframe = true;
-    }
-    ++CompressedFrameNumber;
-
-    // Quantize the depth image
-    QuantizeDepthImage(width, height, unquantized_depth, QuantizedDepth[CurrentFrameIndex]);
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        for (int x = 0; x < kBlockSize; ++x)
+        {
+            const unsigned d = row[x];
+            if (d == 0) {
+                continue;
+            }
 
-    // Get depth for previous frame
-    const uint16_t* depth = QuantizedDepth[CurrentFrameIndex].data();
+            const unsigned zigzag = ApplyPrediction(d, Predict(predictor, row, x, width, prev_row));
+            if (!row[x - 1] || !row[x - width]) {
+                *edges++ = static_cast<uint16_t>( zigzag );
+            } else {
+                *surfaces++ = static_cast<uint16_t>( zigzag );
+            }
+        }
 
-    CurrentFrameIndex = (CurrentFrameIndex + 1) % 2;
-    const uint16_t* prev_depth = nullptr;
-    if (!keyframe) {
-        prev_depth = QuantizedDepth[CurrentFrameIndex].data();
-    }
+        if (prev_row) {
+            prev_row += width;
+        }
+    } // next depth pixel
+}
 
-    EncodeZeroes(width, height, depth);
+static bool DecodeBlock(
+    uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    const uint16_t*& edges,
+    const uint16_t* edges_end,
+    const uint16_t*& surfaces,
+    const uint16_t* surfaces_end)
+{
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        for (int x = 0; x < kBlockSize; ++x)
+        {
+            if (row[x] == 0) {
+                continue;
+            }
 
-    CompressImage(width, height, depth, prev_depth);
+            unsigned zigzag;
+            if (!row[x - 1] || !row[x - width]) {
+                if (edges >= edges_end) {
+                    return false;
+                }
+                zigzag = *edges++;
+            } else {
+                if (surfaces >= surfaces_end) {
+                    return false;
+                }
+                zigzag = *surfaces++;
+            }
 
-    // Do Zstd compressions all together to keep the code cache hot:
+            const int d = UndoPrediction(zigzag, Predict(predictor, row, x, width, prev_row));
+            row[x] = static_cast<uint16_t>( d );
+        }
 
-    Pad12(Surfaces);
-    Pack12(Surfaces, Packed);
-    Surfaces_UncompressedBytes = static_cast<unsigned>( Packed.size() );
-    ZstdCompress(Packed, SurfacesOut);
+        if (prev_row) {
+            prev_row += width;
+        }
+    } // next depth pixel
 
-    Pad12(Edges);
-    Pack12(Edges, Packed);
-    Edges_UncompressedBytes = static_cast<unsigned>( Packed.size() );
-    ZstdCompress(Packed, EdgesOut);
+    return true;
+}
 
-    Zeroes_UncompressedBytes = static_cast<unsigned>( Zeroes.size() );
-    ZstdCompress(Zeroes, ZeroesOut);
 
-    Blocks_UncompressedBytes = static_cast<unsigned>( Blocks.size() );
-    ZstdCompress(Blocks, BlocksOut);
+//------------------------------------------------------------------------------
+// Block Kernels: Lookup Tables
 
-    WriteCompressedFile(width, height, keyframe, compressed);
-}
+/*
+    Emitting residuals is a stream compaction: Only the lanes of an 8-pixel
+    row that are non-zero (and on an edge/surface) are written out.
+    We use byte shuffles (pshufb/tbl) indexed by an 8-bit lane mask to pack
+    the selected 16-bit lanes together, and the inverse shuffle to spread
+    them back out when decoding.
+*/
 
-void DepthCompressor::CompressImage(
-    int width,
-    int height,
-    const uint16_t* depth,
-    const uint16_t* prev_depth)
+struct BlockTables
 {
-    // Accumulated through the end of the filtering then compressed separately
-    Surfaces.clear();
-    Blocks.clear();
-    Edges.clear();
+    // Shuffle that packs the selected 16-bit lanes to the front
+    alignas(16) uint8_t Compact[256][16];
 
-    const int cy = height / kBlockSize;
-    const int cx = width / kBlockSize;
-    Blocks.resize((cx-1) * (cy-1));
+    // Shuffle that spreads packed 16-bit values out to the selected lanes
+    alignas(16) uint8_t Expand[256][16];
 
-    const uint16_t* outer_row = depth;
-    for (int iy = 0; iy < cy; ++iy, outer_row += width * kBlockSize)
-    {
-        const uint16_t* inner_row = outer_row;
+    // Number of lanes selected by each mask
+    uint8_t Count[256];
 
-        for (int ix = 0; ix < cx; ++ix, inner_row += kBlockSize)
+    // Depth value 0/1 for each bit of a byte after prefix-XOR (DecodeZeroes)
+    alignas(16) uint16_t Bits[256][8];
+};
+
+static const BlockTables& GetBlockTables()
+{
+    static const BlockTables* tables = []() {
+        static BlockTables t;
+        for (unsigned mask = 0; mask < 256; ++mask)
         {
-            if (ix == 0 || iy == 0)
+            unsigned count = 0;
+            for (unsigned lane = 0; lane < 8; ++lane)
             {
-                const uint16_t* row = inner_row;
-                for (int y = 0; y < kBlockSize; ++y, row += width)
-                {
-                    for (int x = 0; x < kBlockSize; ++x)
-                    {
-                        // Get quantized depth value for this element
-                        const unsigned d = row[x];
-                        if (d == 0) {
-                            continue;
-                        }
+                // 0x80 selects zero for pshufb and is out of range for tbl
+                t.Expand[mask][lane * 2] = 0x80;
+                t.Expand[mask][lane * 2 + 1] = 0x80;
+                t.Compact[mask][lane * 2] = 0x80;
+                t.Compact[mask][lane * 2 + 1] = 0x80;
 
-                        const unsigned left0 = x > 0 ? row[x - 1] : 0;
-                        const unsigned up0 = y > 0 ? row[x - width] : 0;
-                        const unsigned zigzag = ApplyPrediction(d, Predict_Larger(left0, up0));
-                        if (!left0 || !up0) {
-                            Edges.push_back(static_cast<uint16_t>( zigzag ));
-                        } else {
-                            Surfaces.push_back(static_cast<uint16_t>( zigzag ));
-                        }
-                    }
+                t.Bits[mask][lane] = static_cast<uint16_t>( (mask >> lane) & 1 );
+            }
+            for (unsigned lane = 0; lane < 8; ++lane)
+            {
+                if (mask & (1 << lane)) {
+                    t.Compact[mask][count * 2] = static_cast<uint8_t>( lane * 2 );
+                    t.Compact[mask][count * 2 + 1] = static_cast<uint8_t>( lane * 2 + 1 );
+                    t.Expand[mask][lane * 2] = static_cast<uint8_t>( count * 2 );
+                    t.Expand[mask][lane * 2 + 1] = static_cast<uint8_t>( count * 2 + 1 );
+                    ++count;
                 }
-
-                continue;
             }
+            t.Count[mask] = static_cast<uint8_t>( count );
+        }
+        return &t;
+    }();
+    return *tables;
+}
 
-            // Identify the prediction with the best accuracy for this block:
-            unsigned pred_sum[PredictorType_Count] = {0};
 
-            const uint16_t* row = inner_row;
-            for (int y = 0; y < kBlockSize; ++y, row += width)
-            {
-                for (int x = 0; x < kBlockSize; ++x)
-                {
-                    const unsigned d = row[x];
-                    if (d != 0)
-                    {
-                        const unsigned left0 = row[x - 1];
-                        const unsigned left1 = row[x - 2];
-                        const unsigned up0 = row[x - width];
-                        const unsigned up1 = row[x - width * 2];
-
-                        pred_sum[PredictorType_Larger] += ApplyPrediction(d, Predict_Larger(left0, up0));
-                        pred_sum[PredictorType_Up] += ApplyPrediction(d, Predict_Up(left0, up0));
-                        pred_sum[PredictorType_Left] += ApplyPrediction(d, Predict_Left(left0, up0));
-                        pred_sum[PredictorType_UpTrend] += ApplyPrediction(d, Predict_UpTrend(left0, up0, up1));
-                        pred_sum[PredictorType_LeftTrend] += ApplyPrediction(d, Predict_LeftTrend(left0, left1, up0));
-                        pred_sum[PredictorType_Average] += ApplyPrediction(d, Predict_Average(left0, up0));
-
-                        if (prev_depth) {
-                            pred_sum[PredictorType_PrevFrame] += ApplyPrediction(d, Predict_PrevFrame(prev_depth[row + x - depth], left0, up0));
-                        }
-                    }
-                }
-            } // end x,y loop
+//------------------------------------------------------------------------------
+// Block Kernels: SSE4.1 / AVX2
 
-            // Find best one
-            unsigned smallest_i = pred_sum[0];
-            int best_predictor = 0;
-            int pred_count = PredictorType_Count;
-            if (!prev_depth) {
-                pred_count = PredictorType_PrevFrame; // Skip P-frame ones
-            }
-            for (int i = 1; i < pred_count; ++i)
-            {
-                if (pred_sum[i] < smallest_i) {
-                    best_predictor = i;
-                    smallest_i = pred_sum[i];
-                }
-            }
-            Blocks[(iy-1) * (cx-1) + (ix-1)] = static_cast<uint8_t>( best_predictor );
+/*
+    All of the math is done in 16-bit lanes.  This is exact because the
+    encoder input is quantized to 0..2040, so predictions fit in -2040..4080
+    and zig-zag residuals fit in 0..8161.
 
-            row = inner_row;
-            for (int y = 0; y < kBlockSize; ++y, row += width)
-            {
-                for (int x = 0; x < kBlockSize; ++x)
-                {
-                    const unsigned d = row[x];
-                    if (d == 0) {
-                        continue;
-                    }
+    The decoder receives 12-bit residuals so 16-bit math is also exact
+    (wrapping the same way as the scalar cast to uint16_t).
+*/
 
-                    const unsigned left0 = row[x - 1];
-                    const unsigned up0 = row[x - width];
+#if defined(ZDEPTH_TRY_SSE41)
 
-                    unsigned zigzag;
-                    switch (best_predictor)
-                    {
-                    default:
-                    case PredictorType_Larger:
-                        zigzag = ApplyPrediction(d, Predict_Larger(left0, up0));
-                        break;
-                    case PredictorType_Up:
-                        zigzag = ApplyPrediction(d, Predict_Up(left0, up0));
-                        break;
-                    case PredictorType_Left:
-                        zigzag = ApplyPrediction(d, Predict_Left(left0, up0));
-                        break;
-                    case PredictorType_UpTrend:
-                        zigzag = ApplyPrediction(d, Predict_UpTrend(left0, up0, row[x - width * 2]));
-                        break;
-                    case PredictorType_LeftTrend:
-                        zigzag = ApplyPrediction(d, Predict_LeftTrend(left0, row[x - 2], up0));
-                        break;
-                    case PredictorType_Average:
-                        zigzag = ApplyPrediction(d, Predict_Average(left0, up0));
-                        break;
-                    case PredictorType_PrevFrame:
-                        zigzag = ApplyPrediction(d, Predict_PrevFrame(prev_depth[row + x - depth], left0, up0));
-                        break;
-                    }
-                    if (!left0 || !up0) {
-                        Edges.push_back(static_cast<uint16_t>( zigzag ));
-                    } else {
-                        Surfaces.push_back(static_cast<uint16_t>( zigzag ));
-                    }
-                }
-            } // next depth pixel
-        } 
-    } // next block
+namespace sse41 {
+
+static DEPTH_INLINE __m128i Load(const uint16_t* p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>( p ));
 }
 
-void DepthCompressor::WriteCompressedFile(
-    int width,
-    int height,
-    bool keyframe,
-    std::vector<uint8_t>& compressed)
+static DEPTH_INLINE void Store(uint16_t* p, __m128i v)
 {
-    compressed.resize(
-        kDepthHeaderBytes +
-        ZeroesOut.size() +
-        SurfacesOut.size() +
-        BlocksOut.size() +
-        EdgesOut.size());
-    uint8_t* copy_dest = compressed.data();
+    _mm_storeu_si128(reinterpret_cast<__m128i*>( p ), v);
+}
 
-    // Write header
-    copy_dest[0] = kDepthFormatMagic;
+static DEPTH_INLINE __m128i IsZero(__m128i v)
+{
+    return _mm_cmpeq_epi16(v, _mm_setzero_si128());
+}
 
-    uint8_t flags = 0;
-    if (keyframe) {
-        flags |= 1;
-    }
-    copy_dest[1] = flags;
-
-    WriteU16_LE(copy_dest + 2, static_cast<uint16_t>( CompressedFrameNumber ));
-    WriteU16_LE(copy_dest + 4, static_cast<uint16_t>( width ));
-    WriteU16_LE(copy_dest + 6, static_cast<uint16_t>( height ));
-    WriteU32_LE(copy_dest + 8, Zeroes_UncompressedBytes);
-    WriteU32_LE(copy_dest + 12, static_cast<uint32_t>( ZeroesOut.size() ));
-    WriteU32_LE(copy_dest + 16, Blocks_UncompressedBytes);
-    WriteU32_LE(copy_dest + 20, static_cast<uint32_t>( BlocksOut.size() ));
-    WriteU32_LE(copy_dest + 24, Edges_UncompressedBytes);
-    WriteU32_LE(copy_dest + 28, static_cast<uint32_t>( EdgesOut.size() ));
-    WriteU32_LE(copy_dest + 32, Surfaces_UncompressedBytes);
-    WriteU32_LE(copy_dest + 36, static_cast<uint32_t>( SurfacesOut.size() ));
-    copy_dest += kDepthHeaderBytes;
-
-    // Concatenate the compressed data
-    memcpy(copy_dest, ZeroesOut.data(), ZeroesOut.size());
-    copy_dest += ZeroesOut.size();
-    memcpy(copy_dest, BlocksOut.data(), BlocksOut.size());
-    copy_dest += BlocksOut.size();
-    memcpy(copy_dest, EdgesOut.data(), EdgesOut.size());
-    copy_dest += EdgesOut.size();
-    memcpy(copy_dest, SurfacesOut.data(), SurfacesOut.size());
+// Returns an 8-bit mask with one bit for each 16-bit lane
+static DEPTH_INLINE unsigned LaneMask(__m128i m)
+{
+    return static_cast<unsigned>( _mm_movemask_epi8(_mm_packs_epi16(m, _mm_setzero_si128())) );
 }
 
-DepthResult DepthCompressor::Decompress(
+static DEPTH_INLINE __m128i ZigZag(__m128i delta)
+{
+    return _mm_xor_si128(_mm_slli_epi16(delta, 1), _mm_srai_epi16(delta, 15));
+}
+
+static DEPTH_INLINE __m128i UndoZigZag(__m128i zigzag)
+{
+    const __m128i sign = _mm_sub_epi16(_mm_setzero_si128(), _mm_and_si128(zigzag, _mm_set1_epi16(1)));
+    return _mm_xor_si128(_mm_srli_epi16(zigzag, 1), sign);
+}
+
+static DEPTH_INLINE unsigned HorizontalSum(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<unsigned>( _mm_cvtsi128_si32(v) );
+}
+
+// Evaluate one predictor for 8 pixels in a row
+static DEPTH_INLINE __m128i Predict(
+    int predictor,
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    __m128i left0,
+    __m128i up0)
+{
+    const __m128i larger = _mm_max_epi16(left0, up0);
+
+    switch (predictor)
+    {
+    default:
+    case PredictorType_Larger:
+        return larger;
+    case PredictorType_Up:
+        return _mm_blendv_epi8(up0, left0, IsZero(up0));
+    case PredictorType_Left:
+        return _mm_blendv_epi8(left0, up0, IsZero(left0));
+    case PredictorType_UpTrend: {
+        const __m128i up1 = Load(row - width * 2);
+        const __m128i trend = _mm_sub_epi16(_mm_slli_epi16(up0, 1), up1);
+        return _mm_blendv_epi8(trend, larger, _mm_or_si128(IsZero(up0), IsZero(up1)));
+    }
+    case PredictorType_LeftTrend: {
+        const __m128i left1 = Load(row - 2);
+        const __m128i trend = _mm_sub_epi16(_mm_slli_epi16(left0, 1), left1);
+        return _mm_blendv_epi8(trend, larger, _mm_or_si128(IsZero(left0), IsZero(left1)));
+    }
+    case PredictorType_Average: {
+        const __m128i avg = _mm_srli_epi16(_mm_add_epi16(left0, up0), 1);
+        return _mm_blendv_epi8(avg, larger, _mm_or_si128(IsZero(left0), IsZero(up0)));
+    }
+    case PredictorType_PrevFrame: {
+        const __m128i prev0 = Load(prev_row);
+        return _mm_blendv_epi8(prev0, larger, IsZero(prev0));
+    }
+    }
+}
+
+static int SelectBlockPredictor(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+
+    __m128i sum[PredictorType_Count];
+    for (int i = 0; i < PredictorType_Count; ++i) {
+        sum[i] = _mm_setzero_si128();
+    }
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        const __m128i d = Load(row);
+        const __m128i left0 = Load(row - 1);
+        const __m128i left1 = Load(row - 2);
+        const __m128i up0 = Load(row - width);
+        const __m128i up1 = Load(row - width * 2);
+
+        const __m128i zd = IsZero(d);
+        const __m128i zl0 = IsZero(left0);
+        const __m128i zu0 = IsZero(up0);
+        const __m128i larger = _mm_max_epi16(left0, up0);
+
+        // Sum zig-zag residuals of non-zero pixels into 32-bit lanes
+#define ZDEPTH_SSE41_COST(type, pred) \
+        sum[type] = _mm_add_epi32(sum[type], _mm_madd_epi16( \
+            _mm_andnot_si128(zd, ZigZag(_mm_sub_epi16(d, (pred)))), ones));
+
+        ZDEPTH_SSE41_COST(PredictorType_Larger, larger);
+        ZDEPTH_SSE41_COST(PredictorType_Up, _mm_blendv_epi8(up0, left0, zu0));
+        ZDEPTH_SSE41_COST(PredictorType_Left, _mm_blendv_epi8(left0, up0, zl0));
+        ZDEPTH_SSE41_COST(PredictorType_UpTrend, _mm_blendv_epi8(
+            _mm_sub_epi16(_mm_slli_epi16(up0, 1), up1),
+            larger,
+            _mm_or_si128(zu0, IsZero(up1))));
+        ZDEPTH_SSE41_COST(PredictorType_LeftTrend, _mm_blendv_epi8(
+            _mm_sub_epi16(_mm_slli_epi16(left0, 1), left1),
+            larger,
+            _mm_or_si128(zl0, IsZero(left1))));
+        ZDEPTH_SSE41_COST(PredictorType_Average, _mm_blendv_epi8(
+            _mm_srli_epi16(_mm_add_epi16(left0, up0), 1),
+            larger,
+            _mm_or_si128(zl0, zu0)));
+
+        if (prev_row) {
+            const __m128i prev0 = Load(prev_row);
+            ZDEPTH_SSE41_COST(PredictorType_PrevFrame, _mm_blendv_epi8(prev0, larger, IsZero(prev0)));
+            prev_row += width;
+        }
+
+#undef ZDEPTH_SSE41_COST
+    }
+
+    unsigned pred_sum[PredictorType_Count];
+    for (int i = 0; i < PredictorType_Count; ++i) {
+        pred_sum[i] = HorizontalSum(sum[i]);
+    }
+    return ChooseBestPredictor(pred_sum, prev_row != nullptr);
+}
+
+static unsigned PrevFrameBlockCost(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i sum = _mm_setzero_si128();
+
+    for (int y = 0; y < kBlockSize; ++y, row += width, prev_row += width)
+    {
+        const __m128i d = Load(row);
+        const __m128i left0 = Load(row - 1);
+        const __m128i up0 = Load(row - width);
+        const __m128i prev0 = Load(prev_row);
+        const __m128i pred = _mm_blendv_epi8(prev0, _mm_max_epi16(left0, up0), IsZero(prev0));
+        const __m128i skip = _mm_or_si128(IsZero(d), _mm_or_si128(IsZero(left0), IsZero(up0)));
+
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(
+            _mm_andnot_si128(skip, ZigZag(_mm_sub_epi16(d, pred))), ones));
+    }
+
+    return HorizontalSum(sum);
+}
+
+static void EmitBlockResiduals(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    uint16_t*& edges,
+    uint16_t*& surfaces)
+{
+    const BlockTables& tables = GetBlockTables();
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        const __m128i d = Load(row);
+        const __m128i left0 = Load(row - 1);
+        const __m128i up0 = Load(row - width);
+
+        const __m128i pred = Predict(predictor, row, width, prev_row, left0, up0);
+        const __m128i zigzag = ZigZag(_mm_sub_epi16(d, pred));
+
+        const unsigned zero_mask = LaneMask(IsZero(d));
+        const unsigned edge_mask = LaneMask(_mm_or_si128(IsZero(left0), IsZero(up0)));
+        const unsigned edges_sel = edge_mask & ~zero_mask & 0xff;
+        const unsigned surfaces_sel = ~(edge_mask | zero_mask) & 0xff;
+
+        // Buffers have room for a full vector past the end
+        const __m128i edges_shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>( tables.Compact[edges_sel] ));
+        Store(edges, _mm_shuffle_epi8(zigzag, edges_shuffle));
+        edges += tables.Count[edges_sel];
+
+        const __m128i surfaces_shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>( tables.Compact[surfaces_sel] ));
+        Store(surfaces, _mm_shuffle_epi8(zigzag, surfaces_shuffle));
+        surfaces += tables.Count[surfaces_sel];
+
+        if (prev_row) {
+            prev_row += width;
+        }
+    }
+}
+
+static bool DecodeBlock(
+    uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    const uint16_t*& edges,
+    const uint16_t* edges_end,
+    const uint16_t*& surfaces,
+    const uint16_t* surfaces_end)
+{
+    const BlockTables& tables = GetBlockTables();
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        // Row contains 0/1 from DecodeZeroes and left0 lanes 1..7 are also
+        // 0/1, which classifies edges the same as the decoded values would.
+        const __m128i mask = Load(row);
+        const __m128i left0 = Load(row - 1);
+        const __m128i up0 = Load(row - width);
+
+        const unsigned zero_mask = LaneMask(IsZero(mask));
+        const unsigned nonzero_mask = ~zero_mask & 0xff;
+        const unsigned edge_mask = LaneMask(_mm_or_si128(IsZero(left0), IsZero(up0)));
+        const unsigned edges_sel = edge_mask & nonzero_mask;
+        const unsigned surfaces_sel = ~edge_mask & nonzero_mask;
+
+        const unsigned edges_count = tables.Count[edges_sel];
+        const unsigned surfaces_count = tables.Count[surfaces_sel];
+        if (static_cast<uintptr_t>( edges_end - edges ) < edges_count ||
+            static_cast<uintptr_t>( surfaces_end - surfaces ) < surfaces_count)
+        {
+            return false;
+        }
+
+        // Buffers have room for a full vector past the end
+        const __m128i edges_shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>( tables.Expand[edges_sel] ));
+        const __m128i surfaces_shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>( tables.Expand[surfaces_sel] ));
+        const __m128i zigzag = _mm_or_si128(
+            _mm_shuffle_epi8(Load(edges), edges_shuffle),
+            _mm_shuffle_epi8(Load(surfaces), surfaces_shuffle));
+        edges += edges_count;
+        surfaces += surfaces_count;
+
+        // Predictors that do not reference the left neighbor can be undone
+        // for the whole row at once.  Otherwise fall back to a serial loop.
+        bool row_parallel = false;
+        __m128i pred = _mm_setzero_si128();
+        switch (predictor)
+        {
+        case PredictorType_Up:
+            if ((LaneMask(IsZero(up0)) & nonzero_mask) == 0) {
+                pred = up0;
+                row_parallel = true;
+            }
+            break;
+        case PredictorType_UpTrend: {
+            const __m128i up1 = Load(row - width * 2);
+            if ((LaneMask(_mm_or_si128(IsZero(up0), IsZero(up1))) & nonzero_mask) == 0) {
+                pred = _mm_sub_epi16(_mm_slli_epi16(up0, 1), up1);
+                row_parallel = true;
+            }
+            break;
+        }
+        case PredictorType_PrevFrame: {
+            const __m128i prev0 = Load(prev_row);
+            if ((LaneMask(IsZero(prev0)) & nonzero_mask) == 0) {
+                pred = prev0;
+                row_parallel = true;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (row_parallel)
+        {
+            const __m128i d = _mm_andnot_si128(IsZero(mask), _mm_add_epi16(UndoZigZag(zigzag), pred));
+
+            // A valid stream never decodes a non-zero pixel to zero
+            if ((LaneMask(IsZero(d)) & nonzero_mask) != 0) {
+                return false;
+            }
+            Store(row, d);
+        }
+        else
+        {
+            alignas(16) uint16_t residuals[8];
+            _mm_store_si128(reinterpret_cast<__m128i*>( residuals ), zigzag);
+
+            for (int x = 0; x < kBlockSize; ++x)
+            {
+                if (row[x] == 0) {
+                    continue;
+                }
+
+                const int d = UndoPrediction(residuals[x], lossless::Predict(predictor, row, x, width, prev_row));
+                if (static_cast<uint16_t>( d ) == 0) {
+                    return false;
+                }
+                row[x] = static_cast<uint16_t>( d );
+            }
+        }
+
+        if (prev_row) {
+            prev_row += width;
+        }
+    }
+
+    return true;
+}
+
+} // namespace sse41
+
+#endif // ZDEPTH_TRY_SSE41
+
+#if defined(ZDEPTH_TRY_AVX2)
+
+namespace avx2 {
+
+static DEPTH_INLINE __m256i Load(const uint16_t* p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>( p ));
+}
+
+static DEPTH_INLINE __m256i IsZero(__m256i v)
+{
+    return _mm256_cmpeq_epi16(v, _mm256_setzero_si256());
+}
+
+static DEPTH_INLINE __m256i ZigZag(__m256i delta)
+{
+    return _mm256_xor_si256(_mm256_slli_epi16(delta, 1), _mm256_srai_epi16(delta, 15));
+}
+
+// Select predictors for two horizontally adjacent blocks at once.
+// The low 128 bits of each accumulator belong to the first block.
+static void SelectBlockPredictors(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int& best0,
+    int& best1)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    __m256i sum[PredictorType_Count];
+    for (int i = 0; i < PredictorType_Count; ++i) {
+        sum[i] = _mm256_setzero_si256();
+    }
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        const __m256i d = Load(row);
+        const __m256i left0 = Load(row - 1);
+        const __m256i left1 = Load(row - 2);
+        const __m256i up0 = Load(row - width);
+        const __m256i up1 = Load(row - width * 2);
+
+        const __m256i zd = IsZero(d);
+        const __m256i zl0 = IsZero(left0);
+        const __m256i zu0 = IsZero(up0);
+        const __m256i larger = _mm256_max_epi16(left0, up0);
+
+#define ZDEPTH_AVX2_COST(type, pred) \
+        sum[type] = _mm256_add_epi32(sum[type], _mm256_madd_epi16( \
+            _mm256_andnot_si256(zd, ZigZag(_mm256_sub_epi16(d, (pred)))), ones));
+
+        ZDEPTH_AVX2_COST(PredictorType_Larger, larger);
+        ZDEPTH_AVX2_COST(PredictorType_Up, _mm256_blendv_epi8(up0, left0, zu0));
+        ZDEPTH_AVX2_COST(PredictorType_Left, _mm256_blendv_epi8(left0, up0, zl0));
+        ZDEPTH_AVX2_COST(PredictorType_UpTrend, _mm256_blendv_epi8(
+            _mm256_sub_epi16(_mm256_slli_epi16(up0, 1), up1),
+            larger,
+            _mm256_or_si256(zu0, IsZero(up1))));
+        ZDEPTH_AVX2_COST(PredictorType_LeftTrend, _mm256_blendv_epi8(
+            _mm256_sub_epi16(_mm256_slli_epi16(left0, 1), left1),
+            larger,
+            _mm256_or_si256(zl0, IsZero(left1))));
+        ZDEPTH_AVX2_COST(PredictorType_Average, _mm256_blendv_epi8(
+            _mm256_srli_epi16(_mm256_add_epi16(left0, up0), 1),
+            larger,
+            _mm256_or_si256(zl0, zu0)));
+
+        if (prev_row) {
+            const __m256i prev0 = Load(prev_row);
+            ZDEPTH_AVX2_COST(PredictorType_PrevFrame, _mm256_blendv_epi8(prev0, larger, IsZero(prev0)));
+            prev_row += width;
+        }
+
+#undef ZDEPTH_AVX2_COST
+    }
+
+    unsigned pred_sum0[PredictorType_Count], pred_sum1[PredictorType_Count];
+    for (int i = 0; i < PredictorType_Count; ++i) {
+        pred_sum0[i] = sse41::HorizontalSum(_mm256_castsi256_si128(sum[i]));
+        pred_sum1[i] = sse41::HorizontalSum(_mm256_extracti128_si256(sum[i], 1));
+    }
+    best0 = ChooseBestPredictor(pred_sum0, prev_row != nullptr);
+    best1 = ChooseBestPredictor(pred_sum1, prev_row != nullptr);
+}
+
+} // namespace avx2
+
+#endif // ZDEPTH_TRY_AVX2
+
+
+//------------------------------------------------------------------------------
+// Block Kernels: NEON
+
+#if defined(ZDEPTH_TRY_NEON)
+
+namespace neon {
+
+static DEPTH_INLINE uint16x8_t Load(const uint16_t* p)
+{
+    return vld1q_u16(p);
+}
+
+static DEPTH_INLINE uint16x8_t IsZero(uint16x8_t v)
+{
+    return vceqq_u16(v, vdupq_n_u16(0));
+}
+
+// Returns an 8-bit mask with one bit for each 16-bit lane
+static DEPTH_INLINE unsigned LaneMask(uint16x8_t m)
+{
+    static const uint16_t kLaneBits[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    return vaddvq_u16(vandq_u16(m, vld1q_u16(kLaneBits)));
+}
+
+static DEPTH_INLINE uint16x8_t ZigZag(uint16x8_t delta)
+{
+    const int16x8_t s = vreinterpretq_s16_u16(delta);
+    return vreinterpretq_u16_s16(veorq_s16(vshlq_n_s16(s, 1), vshrq_n_s16(s, 15)));
+}
+
+static DEPTH_INLINE uint16x8_t UndoZigZag(uint16x8_t zigzag)
+{
+    const uint16x8_t sign = vsubq_u16(vdupq_n_u16(0), vandq_u16(zigzag, vdupq_n_u16(1)));
+    return veorq_u16(vshrq_n_u16(zigzag, 1), sign);
+}
+
+static DEPTH_INLINE uint16x8_t Shuffle(uint16x8_t v, const uint8_t* table)
+{
+    return vreinterpretq_u16_u8(vqtbl1q_u8(vreinterpretq_u8_u16(v), vld1q_u8(table)));
+}
+
+// Evaluate one predictor for 8 pixels in a row
+static DEPTH_INLINE uint16x8_t Predict(
+    int predictor,
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    uint16x8_t left0,
+    uint16x8_t up0)
+{
+    const uint16x8_t larger = vmaxq_u16(left0, up0);
+
+    switch (predictor)
+    {
+    default:
+    case PredictorType_Larger:
+        return larger;
+    case PredictorType_Up:
+        return vbslq_u16(IsZero(up0), left0, up0);
+    case PredictorType_Left:
+        return vbslq_u16(IsZero(left0), up0, left0);
+    case PredictorType_UpTrend: {
+        const uint16x8_t up1 = Load(row - width * 2);
+        const uint16x8_t trend = vsubq_u16(vshlq_n_u16(up0, 1), up1);
+        return vbslq_u16(vorrq_u16(IsZero(up0), IsZero(up1)), larger, trend);
+    }
+    case PredictorType_LeftTrend: {
+        const uint16x8_t left1 = Load(row - 2);
+        const uint16x8_t trend = vsubq_u16(vshlq_n_u16(left0, 1), left1);
+        return vbslq_u16(vorrq_u16(IsZero(left0), IsZero(left1)), larger, trend);
+    }
+    case PredictorType_Average: {
+        const uint16x8_t avg = vshrq_n_u16(vaddq_u16(left0, up0), 1);
+        return vbslq_u16(vorrq_u16(IsZero(left0), IsZero(up0)), larger, avg);
+    }
+    case PredictorType_PrevFrame: {
+        const uint16x8_t prev0 = Load(prev_row);
+        return vbslq_u16(IsZero(prev0), larger, prev0);
+    }
+    }
+}
+
+static int SelectBlockPredictor(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
+{
+    uint32x4_t sum[PredictorType_Count];
+    for (int i = 0; i < PredictorType_Count; ++i) {
+        sum[i] = vdupq_n_u32(0);
+    }
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        const uint16x8_t d = Load(row);
+        const uint16x8_t left0 = Load(row - 1);
+        const uint16x8_t left1 = Load(row - 2);
+        const uint16x8_t up0 = Load(row - width);
+        const uint16x8_t up1 = Load(row - width * 2);
+
+        const uint16x8_t zd = IsZero(d);
+        const uint16x8_t zl0 = IsZero(left0);
+        const uint16x8_t zu0 = IsZero(up0);
+        const uint16x8_t larger = vmaxq_u16(left0, up0);
+
+#define ZDEPTH_NEON_COST(type, pred) \
+        sum[type] = vpadalq_u16(sum[type], vbicq_u16(ZigZag(vsubq_u16(d, (pred))), zd));
+
+        ZDEPTH_NEON_COST(PredictorType_Larger, larger);
+        ZDEPTH_NEON_COST(PredictorType_Up, vbslq_u16(zu0, left0, up0));
+        ZDEPTH_NEON_COST(PredictorType_Left, vbslq_u16(zl0, up0, left0));
+        ZDEPTH_NEON_COST(PredictorType_UpTrend, vbslq_u16(
+            vorrq_u16(zu0, IsZero(up1)),
+            larger,
+            vsubq_u16(vshlq_n_u16(up0, 1), up1)));
+        ZDEPTH_NEON_COST(PredictorType_LeftTrend, vbslq_u16(
+            vorrq_u16(zl0, IsZero(left1)),
+            larger,
+            vsubq_u16(vshlq_n_u16(left0, 1), left1)));
+        ZDEPTH_NEON_COST(PredictorType_Average, vbslq_u16(
+            vorrq_u16(zl0, zu0),
+            larger,
+            vshrq_n_u16(vaddq_u16(left0, up0), 1)));
+
+        if (prev_row) {
+            const uint16x8_t prev0 = Load(prev_row);
+            ZDEPTH_NEON_COST(PredictorType_PrevFrame, vbslq_u16(IsZero(prev0), larger, prev0));
+            prev_row += width;
+        }
+
+#undef ZDEPTH_NEON_COST
+    }
+
+    unsigned pred_sum[PredictorType_Count];
+    for (int i = 0; i < PredictorType_Count; ++i) {
+        pred_sum[i] = vaddvq_u32(sum[i]);
+    }
+    return ChooseBestPredictor(pred_sum, prev_row != nullptr);
+}
+
+static unsigned PrevFrameBlockCost(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
+{
+    uint32x4_t sum = vdupq_n_u32(0);
+
+    for (int y = 0; y < kBlockSize; ++y, row += width, prev_row += width)
+    {
+        const uint16x8_t d = Load(row);
+        const uint16x8_t left0 = Load(row - 1);
+        const uint16x8_t up0 = Load(row - width);
+        const uint16x8_t prev0 = Load(prev_row);
+        const uint16x8_t pred = vbslq_u16(IsZero(prev0), vmaxq_u16(left0, up0), prev0);
+        const uint16x8_t skip = vorrq_u16(IsZero(d), vorrq_u16(IsZero(left0), IsZero(up0)));
+
+        sum = vpadalq_u16(sum, vbicq_u16(ZigZag(vsubq_u16(d, pred)), skip));
+    }
+
+    return vaddvq_u32(sum);
+}
+
+static void EmitBlockResiduals(
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    uint16_t*& edges,
+    uint16_t*& surfaces)
+{
+    const BlockTables& tables = GetBlockTables();
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        const uint16x8_t d = Load(row);
+        const uint16x8_t left0 = Load(row - 1);
+        const uint16x8_t up0 = Load(row - width);
+
+        const uint16x8_t pred = Predict(predictor, row, width, prev_row, left0, up0);
+        const uint16x8_t zigzag = ZigZag(vsubq_u16(d, pred));
+
+        const unsigned zero_mask = LaneMask(IsZero(d));
+        const unsigned edge_mask = LaneMask(vorrq_u16(IsZero(left0), IsZero(up0)));
+        const unsigned edges_sel = edge_mask & ~zero_mask & 0xff;
+        const unsigned surfaces_sel = ~(edge_mask | zero_mask) & 0xff;
+
+        // Buffers have room for a full vector past the end
+        vst1q_u16(edges, Shuffle(zigzag, tables.Compact[edges_sel]));
+        edges += tables.Count[edges_sel];
+        vst1q_u16(surfaces, Shuffle(zigzag, tables.Compact[surfaces_sel]));
+        surfaces += tables.Count[surfaces_sel];
+
+        if (prev_row) {
+            prev_row += width;
+        }
+    }
+}
+
+static bool DecodeBlock(
+    uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    const uint16_t*& edges,
+    const uint16_t* edges_end,
+    const uint16_t*& surfaces,
+    const uint16_t* surfaces_end)
+{
+    const BlockTables& tables = GetBlockTables();
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        // See sse41::DecodeBlock
+        const uint16x8_t mask = Load(row);
+        const uint16x8_t left0 = Load(row - 1);
+        const uint16x8_t up0 = Load(row - width);
+
+        const unsigned zero_mask = LaneMask(IsZero(mask));
+        const unsigned nonzero_mask = ~zero_mask & 0xff;
+        const unsigned edge_mask = LaneMask(vorrq_u16(IsZero(left0), IsZero(up0)));
+        const unsigned edges_sel = edge_mask & nonzero_mask;
+        const unsigned surfaces_sel = ~edge_mask & nonzero_mask;
+
+        const unsigned edges_count = tables.Count[edges_sel];
+        const unsigned surfaces_count = tables.Count[surfaces_sel];
+        if (static_cast<uintptr_t>( edges_end - edges ) < edges_count ||
+            static_cast<uintptr_t>( surfaces_end - surfaces ) < surfaces_count)
+        {
+            return false;
+        }
+
+        const uint16x8_t zigzag = vorrq_u16(
+            Shuffle(Load(edges), tables.Expand[edges_sel]),
+            Shuffle(Load(surfaces), tables.Expand[surfaces_sel]));
+        edges += edges_count;
+        surfaces += surfaces_count;
+
+        bool row_parallel = false;
+        uint16x8_t pred = vdupq_n_u16(0);
+        switch (predictor)
+        {
+        case PredictorType_Up:
+            if ((LaneMask(IsZero(up0)) & nonzero_mask) == 0) {
+                pred = up0;
+                row_parallel = true;
+            }
+            break;
+        case PredictorType_UpTrend: {
+            const uint16x8_t up1 = Load(row - width * 2);
+            if ((LaneMask(vorrq_u16(IsZero(up0), IsZero(up1))) & nonzero_mask) == 0) {
+                pred = vsubq_u16(vshlq_n_u16(up0, 1), up1);
+                row_parallel = true;
+            }
+            break;
+        }
+        case PredictorType_PrevFrame: {
+            const uint16x8_t prev0 = Load(prev_row);
+            if ((LaneMask(IsZero(prev0)) & nonzero_mask) == 0) {
+                pred = prev0;
+                row_parallel = true;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (row_parallel)
+        {
+            const uint16x8_t d = vbicq_u16(vaddq_u16(UndoZigZag(zigzag), pred), IsZero(mask));
+            if ((LaneMask(IsZero(d)) & nonzero_mask) != 0) {
+                return false;
+            }
+            vst1q_u16(row, d);
+        }
+        else
+        {
+            uint16_t residuals[8];
+            vst1q_u16(residuals, zigzag);
+
+            for (int x = 0; x < kBlockSize; ++x)
+            {
+                if (row[x] == 0) {
+                    continue;
+                }
+
+                const int d = UndoPrediction(residuals[x], lossless::Predict(predictor, row, x, width, prev_row));
+                if (static_cast<uint16_t>( d ) == 0) {
+                    return false;
+                }
+                row[x] = static_cast<uint16_t>( d );
+            }
+        }
+
+        if (prev_row) {
+            prev_row += width;
+        }
+    }
+
+    return true;
+}
+
+} // namespace neon
+
+#endif // ZDEPTH_TRY_NEON
+
+
+//------------------------------------------------------------------------------
+// Block Kernels: Dispatch
+
+enum class BlockKernel
+{
+    Scalar,
+    SSE41,
+    AVX2,
+    Neon
+};
+
+static BlockKernel ChooseBlockKernel()
+{
+    if (!SimdEnabled) {
+        return BlockKernel::Scalar;
+    }
+    const zdepth::CpuFeatures& cpu = zdepth::GetCpuFeatures();
+#if defined(ZDEPTH_TRY_AVX2)
+    if (cpu.AVX2) {
+        return BlockKernel::AVX2;
+    }
+#endif
+#if defined(ZDEPTH_TRY_SSE41)
+    if (cpu.SSE41) {
+        return BlockKernel::SSE41;
+    }
+#endif
+#if defined(ZDEPTH_TRY_NEON)
+    if (cpu.Neon) {
+        return BlockKernel::Neon;
+    }
+#endif
+    (void)cpu;
+    return BlockKernel::Scalar;
+}
+
+// Select predictors for blocks 1..cx-1 in a row of blocks
+static void SelectRowPredictors(
+    BlockKernel kernel,
+    const uint16_t* outer_row,
+    int width,
+    int cx,
+    const uint16_t* prev_outer_row,
+    uint8_t* blocks)
+{
+    for (int ix = 1; ix < cx; ++ix)
+    {
+        const uint16_t* row = outer_row + ix * kBlockSize;
+        const uint16_t* prev_row = prev_outer_row ? prev_outer_row + ix * kBlockSize : nullptr;
+
+        int best_predictor;
+        switch (kernel)
+        {
+#if defined(ZDEPTH_TRY_AVX2)
+        case BlockKernel::AVX2:
+            if (ix + 1 < cx) {
+                int best_next;
+                avx2::SelectBlockPredictors(row, width, prev_row, best_predictor, best_next);
+                blocks[ix] = static_cast<uint8_t>( best_next );
+                blocks[ix - 1] = static_cast<uint8_t>( best_predictor );
+                ++ix;
+                continue;
+            }
+            best_predictor = sse41::SelectBlockPredictor(row, width, prev_row);
+            break;
+#endif
+#if defined(ZDEPTH_TRY_SSE41)
+        case BlockKernel::SSE41:
+            best_predictor = sse41::SelectBlockPredictor(row, width, prev_row);
+            break;
+#endif
+#if defined(ZDEPTH_TRY_NEON)
+        case BlockKernel::Neon:
+            best_predictor = neon::SelectBlockPredictor(row, width, prev_row);
+            break;
+#endif
+        default:
+            best_predictor = SelectBlockPredictor(row, width, prev_row);
+            break;
+        }
+        blocks[ix - 1] = static_cast<uint8_t>( best_predictor );
+    }
+}
+
+// Select the predictor for one block
+static int SelectBlockPredictor(
+    BlockKernel kernel,
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
+{
+    switch (kernel)
+    {
+#if defined(ZDEPTH_TRY_SSE41)
+    case BlockKernel::AVX2:
+    case BlockKernel::SSE41:
+        return sse41::SelectBlockPredictor(row, width, prev_row);
+#endif
+#if defined(ZDEPTH_TRY_NEON)
+    case BlockKernel::Neon:
+        return neon::SelectBlockPredictor(row, width, prev_row);
+#endif
+    default:
+        break;
+    }
+    return SelectBlockPredictor(row, width, prev_row);
+}
+
+static unsigned PrevFrameBlockCost(
+    BlockKernel kernel,
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row)
+{
+    switch (kernel)
+    {
+#if defined(ZDEPTH_TRY_SSE41)
+    case BlockKernel::AVX2:
+    case BlockKernel::SSE41:
+        return sse41::PrevFrameBlockCost(row, width, prev_row);
+#endif
+#if defined(ZDEPTH_TRY_NEON)
+    case BlockKernel::Neon:
+        return neon::PrevFrameBlockCost(row, width, prev_row);
+#endif
+    default:
+        break;
+    }
+    return PrevFrameBlockCost(row, width, prev_row);
+}
+
+static void EmitBlockResiduals(
+    BlockKernel kernel,
+    const uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    uint16_t*& edges,
+    uint16_t*& surfaces)
+{
+    switch (kernel)
+    {
+#if defined(ZDEPTH_TRY_SSE41)
+    case BlockKernel::AVX2:
+    case BlockKernel::SSE41:
+        sse41::EmitBlockResiduals(row, width, prev_row, predictor, edges, surfaces);
+        break;
+#endif
+#if defined(ZDEPTH_TRY_NEON)
+    case BlockKernel::Neon:
+        neon::EmitBlockResiduals(row, width, prev_row, predictor, edges, surfaces);
+        break;
+#endif
+    default:
+        EmitBlockResiduals(row, width, prev_row, predictor, edges, surfaces);
+        break;
+    }
+}
+
+static bool DecodeBlock(
+    BlockKernel kernel,
+    uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    const uint16_t*& edges,
+    const uint16_t* edges_end,
+    const uint16_t*& surfaces,
+    const uint16_t* surfaces_end)
+{
+    switch (kernel)
+    {
+#if defined(ZDEPTH_TRY_SSE41)
+    case BlockKernel::AVX2:
+    case BlockKernel::SSE41:
+        return sse41::DecodeBlock(row, width, prev_row, predictor, edges, edges_end, surfaces, surfaces_end);
+#endif
+#if defined(ZDEPTH_TRY_NEON)
+    case BlockKernel::Neon:
+        return neon::DecodeBlock(row, width, prev_row, predictor, edges, edges_end, surfaces, surfaces_end);
+#endif
+    default:
+        break;
+    }
+    return DecodeBlock(row, width, prev_row, predictor, edges, edges_end, surfaces, surfaces_end);
+}
+
+
+//------------------------------------------------------------------------------
+// Near-Lossless
+
+/*
+    Near-lossless blocks are coded one pixel at a time because each
+    reconstructed pixel is the left neighbor of the next one.  Predictor
+    selection still uses the vectorized kernels.
+
+    The encoder runs the same reconstruction as the decoder, including the
+    12-bit packing of the residual, and writes the result back over the
+    depth image.  If any pixel ends up outside the error bound for the band
+    of its original value, the block is restored and coded losslessly.
+*/
+
+// Quantize a residual so the reconstruction is within delta of the depth
+static inline int QuantizeResidual(int residual, int delta)
+{
+    const int step = 2 * delta + 1;
+    if (residual >= 0) {
+        return (residual + delta) / step;
+    }
+    return -((delta - residual) / step);
+}
+
+static inline int ReconstructDepth(int prediction, int quantized, int delta)
+{
+    int d = prediction + quantized * (2 * delta + 1);
+    if (d < 1) {
+        d = 1;
+    }
+    if (d > kMaxQuantizedDepth) {
+        d = kMaxQuantizedDepth;
+    }
+    return d;
+}
+
+static inline bool IsWithinErrorBound(
+    int depth,
+    int reconstructed,
+    const DepthErrorBounds& bounds)
+{
+    const int band = GetDepthRangeBand(depth);
+    int error = AzureKinectDequantizeDepth(static_cast<uint16_t>( depth )) -
+        AzureKinectDequantizeDepth(static_cast<uint16_t>( reconstructed ));
+    if (error < 0) {
+        error = -error;
+    }
+    return error <= bounds.Bands[band] * kDepthBandUnitMM[band];
+}
+
+// Returns false if the block must be coded losslessly instead,
+// in which case the block and output pointers are left unchanged
+static bool EmitNearLosslessBlock(
+    uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    const DepthErrorBounds& bounds,
+    uint16_t*& edges,
+    uint16_t*& surfaces)
+{
+    uint16_t original[kBlockSize * kBlockSize];
+    for (int y = 0; y < kBlockSize; ++y) {
+        memcpy(original + y * kBlockSize, row + y * width, kBlockSize * sizeof(uint16_t));
+    }
+    uint16_t* block = row;
+    uint16_t* edges_out = edges;
+    uint16_t* surfaces_out = surfaces;
+
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        for (int x = 0; x < kBlockSize; ++x)
+        {
+            const int d = row[x];
+            if (d == 0) {
+                continue;
+            }
+
+            const int prediction = Predict(predictor, row, x, width, prev_row);
+            const int delta = bounds.Bands[GetDepthRangeBand(prediction)];
+
+            // Keep only the bits that survive Pack12
+            const unsigned zigzag = ApplyPrediction(QuantizeResidual(d - prediction, delta), 0) & 0xfff;
+            const int reconstructed = ReconstructDepth(prediction, UndoPrediction(zigzag, 0), delta);
+
+            if (reconstructed != d && !IsWithinErrorBound(d, reconstructed, bounds)) {
+                for (int i = 0; i < kBlockSize; ++i) {
+                    memcpy(block + i * width, original + i * kBlockSize, kBlockSize * sizeof(uint16_t));
+                }
+                return false;
+            }
+            row[x] = static_cast<uint16_t>( reconstructed );
+
+            if (!row[x - 1] || !row[x - width]) {
+                *edges_out++ = static_cast<uint16_t>( zigzag );
+            } else {
+                *surfaces_out++ = static_cast<uint16_t>( zigzag );
+            }
+        }
+
+        if (prev_row) {
+            prev_row += width;
+        }
+    } // next depth pixel
+
+    edges = edges_out;
+    surfaces = surfaces_out;
+    return true;
+}
+
+static bool DecodeNearLosslessBlock(
+    uint16_t* row,
+    int width,
+    const uint16_t* prev_row,
+    int predictor,
+    const DepthErrorBounds& bounds,
+    const uint16_t*& edges,
+    const uint16_t* edges_end,
+    const uint16_t*& surfaces,
+    const uint16_t* surfaces_end)
+{
+    for (int y = 0; y < kBlockSize; ++y, row += width)
+    {
+        for (int x = 0; x < kBlockSize; ++x)
+        {
+            if (row[x] == 0) {
+                continue;
+            }
+
+            unsigned zigzag;
+            if (!row[x - 1] || !row[x - width]) {
+                if (edges >= edges_end) {
+                    return false;
+                }
+                zigzag = *edges++;
+            } else {
+                if (surfaces >= surfaces_end) {
+                    return false;
+                }
+                zigzag = *surfaces++;
+            }
+
+            const int prediction = Predict(predictor, row, x, width, prev_row);
+            const int delta = bounds.Bands[GetDepthRangeBand(prediction)];
+            const int d = ReconstructDepth(prediction, UndoPrediction(zigzag, 0), delta);
+            row[x] = static_cast<uint16_t>( d );
+        }
+
+        if (prev_row) {
+            prev_row += width;
+        }
+    } // next depth pixel
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Motion Search
+
+/*
+    With DepthFlags_Motion, blocks that use the PrevFrame predictor can
+    sample any of the reference frames at an offset.  The motion vectors are
+    chosen on the same 8x8 grid as the predictors, by the sum of the
+    PrevFrame residuals for the block.
+
+    The search evaluates at most SearchBudget candidates for each block:
+    The zero vector for each reference frame, the vectors chosen for the left
+    and up neighbors, and then a small diamond search around the best one
+    until it stops improving.  Depth images are mostly smooth surfaces with
+    small motions between frames, so a local search finds most of the gain.
+
+    Only the Surfaces pixels are counted.  The Edges residuals are large and
+    compress poorly either way, and vectors that trade smaller Edges for
+    larger Surfaces residuals make the frame bigger.
+
+    For a static camera the search mostly fits sensor noise, which lowers
+    the residual sum a little but makes the residuals and the Motion stream
+    harder to compress.  So the vectors are only kept for a tile if they
+    reduce its residual sum by at least 1/kMotionTileGainDivisor.
+*/
+
+// Motion vectors must remove this fraction of the tile residuals
+static const unsigned kMotionTileGainDivisor = 2;
+
+
+// Returns true if the motion vector for the block at (x, y) in the tile
+// points at a block inside the reference image
+static bool IsMotionInBounds(
+    const DepthReferences& references,
+    int width,
+    int height,
+    int x,
+    int y,
+    const DepthMotion& motion)
+{
+    if (motion.Reference >= references.Count) {
+        return false;
+    }
+    const int ref_x = x + motion.X;
+    const int ref_y = y + motion.Y;
+    return ref_x >= 0 && ref_x + kBlockSize <= width &&
+        ref_y >= -references.RowsAbove && ref_y + kBlockSize <= height + references.RowsBelow;
+}
+
+// Get the referenced block.  Motion vector must be in bounds
+static const uint16_t* GetMotionBlock(
+    const DepthReferences& references,
+    int width,
+    int x,
+    int y,
+    const DepthMotion& motion)
+{
+    return references.Frames[motion.Reference] + (y + motion.Y) * width + x + motion.X;
+}
+
+static bool IsZeroMotion(const DepthMotion& motion)
+{
+    return motion.Reference == 0 && motion.X == 0 && motion.Y == 0;
+}
+
+// Find the motion vector with the smallest PrevFrame residuals for the block
+// at (x, y) in the tile.  neighbors: Vectors chosen for nearby blocks.
+// zero_cost: Set to the residual sum for zero motion
+// best_cost: Set to the residual sum for the returned motion vector
+static DepthMotion SearchBlockMotion(
+    BlockKernel kernel,
+    const uint16_t* row,
+    int width,
+    int height,
+    int x,
+    int y,
+    const DepthReferences& references,
+    const DepthMotion* neighbors,
+    int neighbor_count,
+    unsigned& zero_cost,
+    unsigned& best_cost)
+{
+    DepthMotion best;
+    best_cost = PrevFrameBlockCost(kernel, row, width, GetMotionBlock(references, width, x, y, best));
+    zero_cost = best_cost;
+    int budget = references.SearchBudget - 1;
+    const int range = references.SearchRange;
+
+    // Returns true if the candidate is the new best
+    auto evaluate = [&](int reference, int dx, int dy) -> bool {
+        if (budget <= 0 || best_cost == 0) {
+            return false;
+        }
+        if (dx < -range || dx > range || dy < -range || dy > range) {
+            return false;
+        }
+        DepthMotion candidate;
+        candidate.Reference = static_cast<uint8_t>( reference );
+        candidate.X = static_cast<int8_t>( dx );
+        candidate.Y = static_cast<int8_t>( dy );
+        if (!IsMotionInBounds(references, width, height, x, y, candidate)) {
+            return false;
+        }
+        --budget;
+
+        const unsigned cost = PrevFrameBlockCost(kernel, row, width, GetMotionBlock(references, width, x, y, candidate));
+        if (cost >= best_cost) {
+            return false;
+        }
+        best = candidate;
+        best_cost = cost;
+        return true;
+    };
+
+    for (int i = 1; i < references.Count; ++i) {
+        evaluate(i, 0, 0);
+    }
+    for (int i = 0; i < neighbor_count; ++i) {
+        const DepthMotion& neighbor = neighbors[i];
+        if (neighbor.X != 0 || neighbor.Y != 0) {
+            evaluate(neighbor.Reference, neighbor.X, neighbor.Y);
+        }
+    }
+
+    if (range <= 0) {
+        return best;
+    }
+
+    static const int kDiamond[4][2] = {
+        { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 }
+    };
+
+    // Skip the center we just came from, which was already evaluated
+    DepthMotion prev_center = best;
+    bool improved = true;
+    while (improved && budget > 0 && best_cost > 0)
+    {
+        improved = false;
+        const DepthMotion center = best;
+        for (int i = 0; i < 4; ++i)
+        {
+            const int dx = center.X + kDiamond[i][0];
+            const int dy = center.Y + kDiamond[i][1];
+            if (dx == prev_center.X && dy == prev_center.Y) {
+                continue;
+            }
+            if (evaluate(center.Reference, dx, dy)) {
+                improved = true;
+            }
+        }
+        prev_center = center;
+    }
+
+    return best;
+}
+
+
+// Select predictors and motion vectors for all the blocks in a tile
+static void SelectMotionPredictors(
+    BlockKernel kernel,
+    int width,
+    int height,
+    const uint16_t* depth,
+    const DepthReferences& references,
+    uint8_t* blocks,
+    DepthMotion* block_motion)
+{
+    const int cy = height / kBlockSize;
+    const int cx = width / kBlockSize;
+    const uint16_t* prev_depth = references.Frames[0];
+
+    uint64_t zero_sum = 0, best_sum = 0;
+
+    for (int iy = 1; iy < cy; ++iy)
+    {
+        const uint16_t* outer_row = depth + iy * kBlockSize * width;
+        uint8_t* blocks_row = blocks + (iy-1) * (cx-1);
+        DepthMotion* motion_row = block_motion + (iy-1) * (cx-1);
+
+        SelectRowPredictors(kernel, outer_row, width, cx, prev_depth + (outer_row - depth), blocks_row);
+
+        for (int ix = 1; ix < cx; ++ix)
+        {
+            DepthMotion neighbors[2];
+            int neighbor_count = 0;
+            if (ix > 1) {
+                neighbors[neighbor_count++] = motion_row[ix - 2];
+            }
+            if (iy > 1) {
+                neighbors[neighbor_count++] = motion_row[ix - 1 - (cx-1)];
+            }
+
+            unsigned zero_cost, best_cost;
+            motion_row[ix - 1] = SearchBlockMotion(
+                kernel,
+                outer_row + ix * kBlockSize,
+                width,
+                height,
+                ix * kBlockSize,
+                iy * kBlockSize,
+                references,
+                neighbors,
+                neighbor_count,
+                zero_cost,
+                best_cost);
+
+            zero_sum += zero_cost;
+            best_sum += best_cost;
+        }
+    }
+
+    const int block_count = (cx-1) * (cy-1);
+
+    // If motion does not help enough, keep the zero motion predictors
+    if ((zero_sum - best_sum) * kMotionTileGainDivisor < zero_sum) {
+        for (int i = 0; i < block_count; ++i) {
+            block_motion[i] = DepthMotion();
+        }
+        return;
+    }
+
+    // Zero motion was already considered by SelectRowPredictors()
+    for (int i = 0; i < block_count; ++i)
+    {
+        const DepthMotion& motion = block_motion[i];
+        if (IsZeroMotion(motion)) {
+            continue;
+        }
+
+        const int x = (i % (cx-1) + 1) * kBlockSize;
+        const int y = (i / (cx-1) + 1) * kBlockSize;
+        const uint16_t* row = depth + y * width + x;
+        const uint16_t* prev_row = GetMotionBlock(references, width, x, y, motion);
+        blocks[i] = static_cast<uint8_t>( SelectBlockPredictor(kernel, row, width, prev_row) );
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Zstd
+
+void ZstdCompress(
+    const std::vector<uint8_t>& uncompressed,
+    std::vector<uint8_t>& compressed)
+{
+    compressed.resize(ZSTD_compressBound(uncompressed.size()));
+    const size_t size = ZSTD_compress(
+        compressed.data(),
+        compressed.size(),
+        uncompressed.data(),
+        uncompressed.size(),
+        kZstdLevel);
+    if (ZSTD_isError(size)) {
+        compressed.clear();
+        return;
+    }
+    compressed.resize(size);
+}
+
+bool ZstdDecompress(
+    const uint8_t* compressed_data,
+    int compressed_bytes,
+    int uncompressed_bytes,
+    std::vector<uint8_t>& uncompressed)
+{
+    uncompressed.resize(uncompressed_bytes);
+    const size_t size = ZSTD_decompress(
+        uncompressed.data(),
+        uncompressed.size(),
+        compressed_data,
+        compressed_bytes);
+    if (ZSTD_isError(size)) {
+        return false;
+    }
+    if (size != static_cast<size_t>( uncompressed_bytes )) {
+        return false;
+    }
+    return true;
+}
+
+ZstdContext::~ZstdContext()
+{
+    ZSTD_freeCCtx(CCtx);
+    ZSTD_freeDCtx(DCtx);
+}
+
+ZstdContext::ZstdContext(ZstdContext&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+ZstdContext& ZstdContext::operator=(ZstdContext&& other) noexcept
+{
+    std::swap(CCtx, other.CCtx);
+    std::swap(DCtx, other.DCtx);
+    return *this;
+}
+
+size_t ZstdContext::Compress(
+    const uint8_t* uncompressed_data,
+    size_t uncompressed_bytes,
+    uint8_t* compressed_data,
+    size_t compressed_capacity,
+    const ZSTD_CDict_s* dictionary)
+{
+    if (!CCtx) {
+        CCtx = ZSTD_createCCtx();
+        if (!CCtx) {
+            return 0;
+        }
+    }
+
+    size_t size;
+    if (dictionary) {
+        size = ZSTD_compress_usingCDict(
+            CCtx,
+            compressed_data,
+            compressed_capacity,
+            uncompressed_data,
+            uncompressed_bytes,
+            dictionary);
+    } else {
+        size = ZSTD_compressCCtx(
+            CCtx,
+            compressed_data,
+            compressed_capacity,
+            uncompressed_data,
+            uncompressed_bytes,
+            kZstdLevel);
+    }
+    if (ZSTD_isError(size)) {
+        return 0;
+    }
+    return size;
+}
+
+bool ZstdContext::Decompress(
+    const uint8_t* compressed_data,
+    int compressed_bytes,
+    int uncompressed_bytes,
+    std::vector<uint8_t>& uncompressed,
+    const ZSTD_DDict_s* dictionary)
+{
+    if (!DCtx) {
+        DCtx = ZSTD_createDCtx();
+        if (!DCtx) {
+            return false;
+        }
+    }
+
+    uncompressed.resize(uncompressed_bytes);
+    size_t size;
+    if (dictionary) {
+        size = ZSTD_decompress_usingDDict(
+            DCtx,
+            uncompressed.data(),
+            uncompressed.size(),
+            compressed_data,
+            compressed_bytes,
+            dictionary);
+    } else {
+        size = ZSTD_decompressDCtx(
+            DCtx,
+            uncompressed.data(),
+            uncompressed.size(),
+            compressed_data,
+            compressed_bytes);
+    }
+    if (ZSTD_isError(size)) {
+        return false;
+    }
+    if (size != static_cast<size_t>( uncompressed_bytes )) {
+        return false;
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// DepthDictionary
+
+DepthDictionary::~DepthDictionary()
+{
+    Clear();
+}
+
+void DepthDictionary::Clear()
+{
+    for (int i = 0; i < DepthStream_Count; ++i) {
+        ZSTD_freeCDict(CDicts[i]);
+        CDicts[i] = nullptr;
+        ZSTD_freeDDict(DDicts[i]);
+        DDicts[i] = nullptr;
+        Content[i].clear();
+    }
+    Id = 0;
+}
+
+bool DepthDictionary::Initialize(
+    uint32_t id,
+    const std::vector<uint8_t> content[DepthStream_Count])
+{
+    Clear();
+
+    if (id == 0) {
+        return false;
+    }
+
+    for (int i = 0; i < DepthStream_Count; ++i)
+    {
+        Content[i] = content[i];
+        if (Content[i].empty()) {
+            continue;
+        }
+
+        // Content without the Zstd dictionary magic is used as raw content
+        CDicts[i] = ZSTD_createCDict(Content[i].data(), Content[i].size(), kZstdLevel);
+        DDicts[i] = ZSTD_createDDict(Content[i].data(), Content[i].size());
+        if (!CDicts[i] || !DDicts[i]) {
+            Clear();
+            return false;
+        }
+    }
+
+    Id = id;
+    return true;
+}
+
+bool DepthDictionary::Load(const uint8_t* data, size_t bytes)
+{
+    if (bytes < kDepthDictionaryHeaderBytes) {
+        return false;
+    }
+    if (ReadU32_LE(data) != kDepthDictionaryMagic) {
+        return false;
+    }
+    const uint32_t id = ReadU32_LE(data + 4);
+
+    std::vector<uint8_t> content[DepthStream_Count];
+    size_t offset = kDepthDictionaryHeaderBytes;
+    for (int i = 0; i < DepthStream_Count; ++i)
+    {
+        const uint32_t content_bytes = ReadU32_LE(data + 8 + i * 4);
+        if (content_bytes > bytes - offset) {
+            return false;
+        }
+        content[i].assign(data + offset, data + offset + content_bytes);
+        offset += content_bytes;
+    }
+    if (offset != bytes) {
+        return false;
+    }
+
+    return Initialize(id, content);
+}
+
+void DepthDictionary::Save(std::vector<uint8_t>& data) const
+{
+    size_t bytes = kDepthDictionaryHeaderBytes;
+    for (int i = 0; i < DepthStream_Count; ++i) {
+        bytes += Content[i].size();
+    }
+    data.resize(bytes);
+
+    uint8_t* dest = data.data();
+    WriteU32_LE(dest, kDepthDictionaryMagic);
+    WriteU32_LE(dest + 4, Id);
+    for (int i = 0; i < DepthStream_Count; ++i) {
+        WriteU32_LE(dest + 8 + i * 4, static_cast<uint32_t>( Content[i].size() ));
+    }
+    dest += kDepthDictionaryHeaderBytes;
+
+    for (int i = 0; i < DepthStream_Count; ++i) {
+        if (!Content[i].empty()) {
+            memcpy(dest, Content[i].data(), Content[i].size());
+            dest += Content[i].size();
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Pack12
+
+void Pad12(std::vector<uint16_t>& data)
+{
+    if (data.size() % 2 != 0) {
+        data.push_back(0);
+    }
+}
+
+void Pack12(
+    const std::vector<uint16_t>& unpacked,
+    std::vector<uint8_t>& packed)
+{
+    unsigned data_count = static_cast<unsigned>( unpacked.size() );
+    packed.resize(data_count + (data_count / 2));
+    uint8_t* packed0 = packed.data();
+    uint8_t* packed1 = packed0 + data_count;
+    const uint16_t* data = unpacked.data();
+    const uint16_t* data_end = data + data_count;
+    while (data < data_end)
+    {
+        const uint16_t x = data[0];
+        const uint16_t y = data[1];
+        data += 2;
+
+        packed0[0] = static_cast<uint8_t>( x >> 4 );
+        packed0[1] = static_cast<uint8_t>( y >> 4 );
+        packed0 += 2;
+
+        packed1[0] = static_cast<uint8_t>( (x & 15) | ((y & 15) << 4) );
+        packed1++;
+    }
+}
+
+void Unpack12(
+    const std::vector<uint8_t>& packed,
+    std::vector<uint16_t>& unpacked)
+{
+    unsigned data_count = static_cast<unsigned>(packed.size()) * 2 / 3;
+    unpacked.resize(data_count);
+    const uint8_t* packed0 = packed.data();
+    const uint8_t* packed1 = packed0 + data_count;
+    uint16_t* data = unpacked.data();
+    const uint16_t* data_end = data + data_count;
+    while (data < data_end)
+    {
+        uint16_t x = static_cast<uint16_t>( packed0[0] ) << 4;
+        uint16_t y = static_cast<uint16_t>( packed0[1] ) << 4;
+        packed0 += 2;
+
+        const uint8_t p1 = packed1[0];
+        x |= p1 & 15;
+        y |= p1 >> 4;
+        packed1++;
+
+        data[0] = x;
+        data[1] = y;
+        data += 2;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// DepthCompressor
+
+// Reduce the tile count so that each tile has at least two block rows
+static int ClampTileCount(int height, int tile_count)
+{
+    const int max_tiles = height / (kBlockSize * 2);
+    if (tile_count > max_tiles) {
+        tile_count = max_tiles;
+    }
+    if (tile_count > 0xffff) {
+        tile_count = 0xffff;
+    }
+    if (tile_count < 1) {
+        tile_count = 1;
+    }
+    return tile_count;
+}
+
+// Get the range of pixel rows covered by a tile
+static void GetTileRows(
+    int height,
+    int tile_count,
+    int tile_index,
+    int& first_row,
+    int& row_count)
+{
+    const int block_rows = height / kBlockSize;
+    first_row = block_rows * tile_index / tile_count * kBlockSize;
+    int end_row = block_rows * (tile_index + 1) / tile_count * kBlockSize;
+    if (tile_index == tile_count - 1) {
+        end_row = height; // Last tile takes any leftover rows
+    }
+    row_count = end_row - first_row;
+}
+
+// Number of bytes of section sizes for each tile
+static int GetTileSizesBytes(bool motion)
+{
+    return motion ? kDepthTileBytes + kDepthMotionSizeBytes : kDepthTileBytes;
+}
+
+// Ring buffer size for the current frame and the reference frames
+static const unsigned kQuantizedDepthRingSize = kMaxReferenceFrames + 1;
+
+// Rate controller bucket size in frames of target bytes
+static const int kRateBucketFrames = 4;
+
+void DepthCompressor::SetTileCount(int tile_count)
+{
+    TileCount = tile_count;
+}
+
+void DepthCompressor::SetParallelFor(ParallelForCallback parallel_for)
+{
+    ParallelFor = parallel_for;
+}
+
+void DepthCompressor::SetDictionary(std::shared_ptr<const DepthDictionary> dictionary)
+{
+    Dictionary = dictionary;
+}
+
+void DepthCompressor::AddDictionary(std::shared_ptr<const DepthDictionary> dictionary)
+{
+    if (!dictionary) {
+        return;
+    }
+
+    // Replace any dictionary with the same ID
+    for (auto& existing : Dictionaries) {
+        if (existing->GetId() == dictionary->GetId()) {
+            existing = dictionary;
+            return;
+        }
+    }
+    Dictionaries.push_back(dictionary);
+}
+
+void DepthCompressor::SetMotionSearch(int reference_count, int search_range, int search_budget)
+{
+    if (reference_count < 1) {
+        reference_count = 1;
+    }
+    if (reference_count > kMaxReferenceFrames) {
+        reference_count = kMaxReferenceFrames;
+    }
+    if (search_range < 0) {
+        search_range = 0;
+    }
+    if (search_range > kMaxMotionSearchRange) {
+        search_range = kMaxMotionSearchRange;
+    }
+    if (search_budget < 1) {
+        search_budget = 1;
+    }
+
+    ReferenceFrames = reference_count;
+    MotionSearchRange = search_range;
+    MotionSearchBudget = search_budget;
+}
+
+void DepthCompressor::SetMaxError(const int max_error_mm[kDepthRangeBands])
+{
+    for (int i = 0; i < kDepthRangeBands; ++i) {
+        int error = max_error_mm ? max_error_mm[i] : 0;
+        if (error < 0) {
+            error = 0;
+        }
+        MaxErrorMM[i] = error;
+    }
+}
+
+void DepthCompressor::SetTargetBitrate(int bits_per_second, int framerate)
+{
+    if (bits_per_second <= 0 || framerate <= 0) {
+        TargetFrameBytes = 0;
+        NearLosslessLevel = kNearLosslessLevels;
+        RateBucketBytes = 0;
+        return;
+    }
+
+    TargetFrameBytes = bits_per_second / 8 / framerate;
+    if (TargetFrameBytes < 1) {
+        TargetFrameBytes = 1;
+    }
+}
+
+void DepthCompressor::SetCrop(const DepthCrop* crop)
+{
+    CropEnabled = crop != nullptr;
+    if (crop) {
+        Crop = *crop;
+    }
+}
+
+bool DepthCompressor::GetEncoderCrop(int width, int height, DepthCrop& crop) const
+{
+    crop = DepthCrop();
+    crop.Width = width;
+    crop.Height = height;
+    if (!CropEnabled) {
+        return false;
+    }
+
+    // Expand to block boundaries
+    int x0 = Crop.X < 0 ? 0 : Crop.X / kBlockSize * kBlockSize;
+    int y0 = Crop.Y < 0 ? 0 : Crop.Y / kBlockSize * kBlockSize;
+    int x1 = (Crop.X + Crop.Width + kBlockSize - 1) / kBlockSize * kBlockSize;
+    int y1 = (Crop.Y + Crop.Height + kBlockSize - 1) / kBlockSize * kBlockSize;
+
+    // Clamp to the image, keeping at least two blocks in each direction
+    if (x1 > width) {
+        x1 = width;
+    }
+    if (y1 > height) {
+        y1 = height;
+    }
+    if (x1 - x0 < kMinCropSize) {
+        x1 = std::min(width, x0 + kMinCropSize);
+        x0 = std::max(0, x1 - kMinCropSize);
+    }
+    if (y1 - y0 < kMinCropSize) {
+        y1 = std::min(height, y0 + kMinCropSize);
+        y0 = std::max(0, y1 - kMinCropSize);
+    }
+
+    if (x0 == 0 && y0 == 0 && x1 == width && y1 == height) {
+        return false;
+    }
+
+    crop.X = x0;
+    crop.Y = y0;
+    crop.Width = x1 - x0;
+    crop.Height = y1 - y0;
+    return true;
+}
+
+void DepthCompressor::GetErrorBounds(DepthErrorBounds& bounds) const
+{
+    bounds.Enabled = false;
+    for (int i = 0; i < kDepthRangeBands; ++i)
+    {
+        int units = MaxErrorMM[i] / kDepthBandUnitMM[i];
+        if (units > 255) {
+            units = 255;
+        }
+        units = units * NearLosslessLevel / kNearLosslessLevels;
+
+        bounds.Bands[i] = static_cast<uint8_t>( units );
+        if (units > 0) {
+            bounds.Enabled = true;
+        }
+    }
+}
+
+void DepthCompressor::UpdateRateControl(size_t frame_bytes)
+{
+    if (TargetFrameBytes <= 0) {
+        return;
+    }
+
+    // Leaky bucket of bytes sent over the target.  Unused bandwidth is not
+    // saved up, and the bucket is capped so a keyframe does not hold the
+    // error at the maximum for long
+    RateBucketBytes += static_cast<int64_t>( frame_bytes ) - TargetFrameBytes;
+    if (RateBucketBytes < 0) {
+        RateBucketBytes = 0;
+    }
+    if (RateBucketBytes > kRateBucketFrames * TargetFrameBytes) {
+        RateBucketBytes = kRateBucketFrames * TargetFrameBytes;
+    }
+
+    if (RateBucketBytes > TargetFrameBytes) {
+        if (NearLosslessLevel < kNearLosslessLevels) {
+            ++NearLosslessLevel;
+        }
+    } else if (RateBucketBytes == 0 && frame_bytes < static_cast<size_t>( TargetFrameBytes ) * 3 / 4) {
+        if (NearLosslessLevel > 0) {
+            --NearLosslessLevel;
+        }
+    }
+}
+
+int DepthCompressor::GetReferenceFrames(
+    const DepthCrop& crop,
+    int max_count,
+    const uint16_t* frames[kMaxReferenceFrames]) const
+{
+    const size_t n = static_cast<size_t>( crop.Width ) * crop.Height;
+    int count = 0;
+    while (count < ReferenceCount && count < max_count)
+    {
+        const unsigned index = (CurrentFrameIndex + kQuantizedDepthRingSize - 1 - count) % kQuantizedDepthRingSize;
+        const std::vector<uint16_t>& frame = QuantizedDepth[index];
+
+        // Stop at a frame with a different image size or crop
+        if (frame.size() != n || FrameCrops[index] != crop) {
+            break;
+        }
+        frames[count++] = frame.data();
+    }
+    return count;
+}
+
+void DepthCompressor::GetTileReferences(
+    const uint16_t* const frames[kMaxReferenceFrames],
+    int frame_count,
+    int width,
+    int height,
+    int first_row,
+    int row_count,
+    bool motion,
+    DepthReferences& references) const
+{
+    references.Count = frame_count;
+    for (int i = 0; i < frame_count; ++i) {
+        references.Frames[i] = frames[i] + first_row * width;
+    }
+    references.RowsAbove = first_row;
+    references.RowsBelow = height - first_row - row_count;
+    references.Motion = motion;
+    references.SearchRange = MotionSearchRange;
+    references.SearchBudget = MotionSearchBudget;
+}
+
+void DepthCompressor::ForEachTile(int count, const std::function<void(int)>& task)
+{
+    if (count > 1 && ParallelFor) {
+        ParallelFor(count, task);
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        task(i);
+    }
+}
+
+static const ZSTD_CDict* GetCompressDictionary(const DepthDictionary* dictionary, int stream)
+{
+    return dictionary ? dictionary->GetCompressDictionary(stream) : nullptr;
+}
+
+static const ZSTD_DDict* GetDecompressDictionary(const DepthDictionary* dictionary, int stream)
+{
+    return dictionary ? dictionary->GetDecompressDictionary(stream) : nullptr;
+}
+
+size_t DepthCompressor::MaxCompressedBytes(int width, int height) const
+{
+    const int tile_count = ClampTileCount(height, TileCount);
+    const bool motion = ReferenceFrames > 1 || MotionSearchRange > 0;
+    const int tile_sizes_bytes = GetTileSizesBytes(motion);
+
+    // A crop rectangle has fewer tiles and pixels than the whole image
+    size_t bytes = 8 + tile_sizes_bytes;
+    if (tile_count > 1) {
+        bytes = kDepthTiledHeaderBytes + tile_sizes_bytes * tile_count;
+    }
+    bytes += kDepthDictionaryIdBytes + kDepthErrorBoundBytes + kDepthCropBytes;
+
+    for (int i = 0; i < tile_count; ++i)
+    {
+        int first_row, row_count;
+        GetTileRows(height, tile_count, i, first_row, row_count);
+
+        const int n = width * row_count;
+        const int cx = width / kBlockSize;
+        const int cy = row_count / kBlockSize;
+        const size_t zeroes_bytes = n / 8;
+        const size_t blocks_bytes = (cx - 1) * (cy - 1);
+
+        // Each pixel goes to either Edges or Surfaces, and each is padded to
+        // an even count before packing.  The Zstd bound is convex so the two
+        // streams together are bounded by one stream of the combined size
+        // plus the bound for an empty stream.
+        const size_t packed_bytes = (n + 2) * 3 / 2;
+
+        bytes += ZSTD_compressBound(zeroes_bytes);
+        bytes += ZSTD_compressBound(blocks_bytes);
+        bytes += ZSTD_compressBound(packed_bytes);
+        bytes += ZSTD_compressBound(0);
+        if (motion) {
+            bytes += ZSTD_compressBound(blocks_bytes * kDepthMotionBytes);
+        }
+    }
+
+    return bytes;
+}
+
+void DepthCompressor::Compress(
+    int width,
+    int height,
+    const uint16_t* unquantized_depth,
+    std::vector<uint8_t>& compressed,
+    bool keyframe)
+{
+    compressed.resize(MaxCompressedBytes(width, height));
+    const size_t bytes = CompressInto(
+        width,
+        height,
+        unquantized_depth,
+        compressed.data(),
+        compressed.size(),
+        keyframe);
+    compressed.resize(bytes);
+}
+
+size_t DepthCompressor::CompressInto(
+    int width,
+    int height,
+    const uint16_t* unquantized_depth,
+    uint8_t* compressed,
+    size_t compressed_capacity,
+    bool keyframe)
+{
+    const uint64_t t0 = GetTimeUsec();
+
+    // Enforce keyframe if we have not compressed anything yet
+    if (CompressedFrameNumber == 0) {
+        keyframe = true;
+    }
+    ++CompressedFrameNumber;
+
+    // Quantize the part of the depth image that is encoded
+    DepthCrop crop;
+    const bool cropped = GetEncoderCrop(width, height, crop);
+    if (cropped) {
+        QuantizeDepthCrop(width, unquantized_depth, crop, QuantizedDepth[CurrentFrameIndex]);
+    } else {
+        QuantizeDepthImage(width, height, unquantized_depth, QuantizedDepth[CurrentFrameIndex]);
+    }
+    FrameCrops[CurrentFrameIndex] = crop;
+    uint16_t* depth = QuantizedDepth[CurrentFrameIndex].data();
+
+    EncoderTimes = DepthEncoderTimes();
+    EncoderTimes.QuantizeUsec = GetTimeUsec() - t0;
+
+    // Everything below works on the cropped image
+    const int coded_width = crop.Width;
+    const int coded_height = crop.Height;
+
+    DepthErrorBounds bounds;
+    GetErrorBounds(bounds);
+
+    // Get depth for previous frames
+    const uint16_t* reference_frames[kMaxReferenceFrames];
+    int reference_count = 0;
+    if (!keyframe) {
+        reference_count = GetReferenceFrames(crop, ReferenceFrames, reference_frames);
+        if (reference_count == 0) {
+            keyframe = true; // Image size or crop changed
+        }
+    }
+
+    CurrentFrameIndex = (CurrentFrameIndex + 1) % kQuantizedDepthRingSize;
+    if (keyframe) {
+        ReferenceCount = 0;
+    }
+    if (ReferenceCount < kMaxReferenceFrames) {
+        ++ReferenceCount;
+    }
+
+    const int tile_count = ClampTileCount(coded_height, TileCount);
+    const bool tiled = tile_count > 1;
+    const bool motion = !keyframe && (ReferenceFrames > 1 || MotionSearchRange > 0);
+    Tiles.resize(tile_count);
+
+    size_t header_bytes = 8 + GetTileSizesBytes(motion);
+    if (tiled) {
+        header_bytes = kDepthTiledHeaderBytes + GetTileSizesBytes(motion) * tile_count;
+    }
+    // Dictionaries only help I-frames: P-frame streams come out larger
+    const DepthDictionary* dictionary = keyframe ? Dictionary.get() : nullptr;
+    if (dictionary) {
+        header_bytes += kDepthDictionaryIdBytes;
+    }
+    if (bounds.Enabled) {
+        header_bytes += kDepthErrorBoundBytes;
+    }
+    if (cropped) {
+        header_bytes += kDepthCropBytes;
+    }
+
+    size_t total_bytes = 0;
+    if (compressed_capacity >= header_bytes)
+    {
+
+        if (!tiled)
+        {
+            // Compress straight into the output after the header
+            DepthReferences references;
+            GetTileReferences(reference_frames, reference_count, coded_width, coded_height, 0, coded_height, motion, references);
+
+            DepthTile& tile = Tiles[0];
+            tile.Compress(coded_width, coded_height, depth, references, bounds);
+            const size_t data_bytes = tile.WriteCompressed(
+                compressed + header_bytes,
+                compressed_capacity - header_bytes,
+                dictionary);
+            if (data_bytes > 0) {
+                total_bytes = header_bytes + data_bytes;
+            }
+        }
+        else
+        {
+            // Tiles finish out of order so they compress into their own
+            // buffers and are then concatenated
+            ForEachTile(tile_count, [&](int tile_index) {
+                int first_row, row_count;
+                GetTileRows(coded_height, tile_count, tile_index, first_row, row_count);
+
+                DepthReferences references;
+                GetTileReferences(reference_frames, reference_count, coded_width, coded_height, first_row, row_count, motion, references);
+
+                DepthTile& tile = Tiles[tile_index];
+                tile.Compress(
+                    coded_width,
+                    row_count,
+                    depth + first_row * coded_width,
+                    references,
+                    bounds);
+
+                tile.Compressed.resize(tile.MaxCompressedBytes());
+                const size_t data_bytes = tile.WriteCompressed(
+                    tile.Compressed.data(),
+                    tile.Compressed.size(),
+                    dictionary);
+                tile.Compressed.resize(data_bytes);
+            });
+
+            total_bytes = header_bytes;
+            for (const DepthTile& tile : Tiles) {
+                if (tile.Compressed.empty()) {
+                    total_bytes = 0;
+                    break;
+                }
+                total_bytes += tile.Compressed.size();
+            }
+            if (total_bytes > compressed_capacity) {
+                total_bytes = 0;
+            }
+
+            if (total_bytes > 0) {
+                uint8_t* copy_dest = compressed + header_bytes;
+                for (const DepthTile& tile : Tiles) {
+                    memcpy(copy_dest, tile.Compressed.data(), tile.Compressed.size());
+                    copy_dest += tile.Compressed.size();
+                }
+            }
+        }
+
+        for (const DepthTile& tile : Tiles) {
+            EncoderTimes.PredictUsec += tile.PredictUsec;
+            EncoderTimes.PackUsec += tile.PackUsec;
+            EncoderTimes.ZstdUsec += tile.ZstdUsec;
+        }
+    }
+
+    if (total_bytes == 0) {
+        // Next frame must be a keyframe since this one was not delivered
+        CompressedFrameNumber = 0;
+        return 0;
+    }
+
+    WriteHeader(width, height, keyframe, tiled, motion, bounds, cropped ? &crop : nullptr, compressed);
+    UpdateRateControl(total_bytes);
+
+    EncoderTimes.TotalUsec = GetTimeUsec() - t0;
+    return total_bytes;
+}
+
+void DepthTile::Compress(
+    int width,
+    int height,
+    uint16_t* depth,
+    const DepthReferences& references,
+    const DepthErrorBounds& bounds)
+{
+    HasMotion = references.Motion;
+
+    const uint64_t t0 = GetTimeUsec();
+
+    EncodeZeroes(width, height, depth);
+
+    CompressImage(width, height, depth, references, bounds);
+
+    const uint64_t t1 = GetTimeUsec();
+
+    Pad12(Surfaces);
+    Pack12(Surfaces, PackedSurfaces);
+    Pad12(Edges);
+    Pack12(Edges, PackedEdges);
+
+    const uint64_t t2 = GetTimeUsec();
+    PredictUsec = t1 - t0;
+    PackUsec = t2 - t1;
+    ZstdUsec = 0;
+
+    Zeroes_UncompressedBytes = static_cast<unsigned>( Zeroes.size() );
+    Blocks_UncompressedBytes = static_cast<unsigned>( Blocks.size() );
+    Edges_UncompressedBytes = static_cast<unsigned>( PackedEdges.size() );
+    Surfaces_UncompressedBytes = static_cast<unsigned>( PackedSurfaces.size() );
+    Motion_UncompressedBytes = static_cast<unsigned>( Motion.size() );
+}
+
+size_t DepthTile::MaxCompressedBytes() const
+{
+    size_t bytes = ZSTD_compressBound(Zeroes.size()) +
+        ZSTD_compressBound(Blocks.size()) +
+        ZSTD_compressBound(PackedEdges.size()) +
+        ZSTD_compressBound(PackedSurfaces.size());
+    if (HasMotion) {
+        bytes += ZSTD_compressBound(Motion.size());
+    }
+    return bytes;
+}
+
+size_t DepthTile::WriteCompressed(
+    uint8_t* dest,
+    size_t capacity,
+    const DepthDictionary* dictionary)
+{
+    // Do Zstd compressions all together to keep the code cache hot:
+
+    const uint64_t t0 = GetTimeUsec();
+    const size_t bytes = WriteStreams(dest, capacity, dictionary);
+    ZstdUsec = GetTimeUsec() - t0;
+    return bytes;
+}
+
+size_t DepthTile::WriteStreams(
+    uint8_t* dest,
+    size_t capacity,
+    const DepthDictionary* dictionary)
+{
+    uint8_t* dest_start = dest;
+    const uint8_t* dest_end = dest + capacity;
+
+    Zeroes_CompressedBytes = static_cast<unsigned>( Zstd.Compress(
+        Zeroes.data(),
+        Zeroes.size(),
+        dest,
+        dest_end - dest,
+        GetCompressDictionary(dictionary, DepthStream_Zeroes)) );
+    if (Zeroes_CompressedBytes == 0) {
+        return 0;
+    }
+    dest += Zeroes_CompressedBytes;
+
+    Blocks_CompressedBytes = static_cast<unsigned>( Zstd.Compress(
+        Blocks.data(),
+        Blocks.size(),
+        dest,
+        dest_end - dest,
+        GetCompressDictionary(dictionary, DepthStream_Blocks)) );
+    if (Blocks_CompressedBytes == 0) {
+        return 0;
+    }
+    dest += Blocks_CompressedBytes;
+
+    Edges_CompressedBytes = static_cast<unsigned>( Zstd.Compress(
+        PackedEdges.data(),
+        PackedEdges.size(),
+        dest,
+        dest_end - dest,
+        GetCompressDictionary(dictionary, DepthStream_Edges)) );
+    if (Edges_CompressedBytes == 0) {
+        return 0;
+    }
+    dest += Edges_CompressedBytes;
+
+    Surfaces_CompressedBytes = static_cast<unsigned>( Zstd.Compress(
+        PackedSurfaces.data(),
+        PackedSurfaces.size(),
+        dest,
+        dest_end - dest,
+        GetCompressDictionary(dictionary, DepthStream_Surfaces)) );
+    if (Surfaces_CompressedBytes == 0) {
+        return 0;
+    }
+    dest += Surfaces_CompressedBytes;
+
+    if (HasMotion)
+    {
+        // Motion vectors are not covered by the dictionary
+        Motion_CompressedBytes = static_cast<unsigned>( Zstd.Compress(
+            Motion.data(),
+            Motion.size(),
+            dest,
+            dest_end - dest) );
+        if (Motion_CompressedBytes == 0) {
+            return 0;
+        }
+        dest += Motion_CompressedBytes;
+    }
+
+    return dest - dest_start;
+}
+
+void DepthTile::CompressImage(
+    int width,
+    int height,
+    uint16_t* depth,
+    const DepthReferences& references,
+    const DepthErrorBounds& bounds)
+{
+    const BlockKernel kernel = ChooseBlockKernel();
+
+    const int cy = height / kBlockSize;
+    const int cx = width / kBlockSize;
+    Blocks.resize((cx-1) * (cy-1));
+
+    const uint16_t* prev_depth = references.Count > 0 ? references.Frames[0] : nullptr;
+    const bool motion_search = references.Motion && prev_depth;
+    Motion.clear();
+    if (motion_search) {
+        BlockMotion.resize(Blocks.size());
+        SelectMotionPredictors(kernel, width, height, depth, references, Blocks.data(), BlockMotion.data());
+    }
+
+    // Accumulated through the end of the filtering then compressed separately.
+    // Every pixel goes to at most one of these, and the SIMD kernels write a
+    // full vector past the end of the output.
+    const int n = width * height;
+    Edges.resize(n + kBlockSize);
+    Surfaces.resize(n + kBlockSize);
+    uint16_t* edges = Edges.data();
+    uint16_t* surfaces = Surfaces.data();
+
+    uint16_t* outer_row = depth;
+    for (int iy = 0; iy < cy; ++iy, outer_row += width * kBlockSize)
+    {
+        const uint16_t* prev_outer_row = prev_depth ? prev_depth + (outer_row - depth) : nullptr;
+        uint8_t* blocks_row = nullptr;
+        if (iy > 0) {
+            blocks_row = Blocks.data() + (iy-1) * (cx-1);
+            if (!motion_search) {
+                SelectRowPredictors(kernel, outer_row, width, cx, prev_outer_row, blocks_row);
+            }
+        }
+
+        uint16_t* inner_row = outer_row;
+
+        for (int ix = 0; ix < cx; ++ix, inner_row += kBlockSize)
+        {
+            if (ix == 0 || iy == 0)
+            {
+                const uint16_t* row = inner_row;
+                for (int y = 0; y < kBlockSize; ++y, row += width)
+                {
+                    for (int x = 0; x < kBlockSize; ++x)
+                    {
+                        // Get quantized depth value for this element
+                        const unsigned d = row[x];
+                        if (d == 0) {
+                            continue;
+                        }
+
+                        const unsigned left0 = x > 0 ? row[x - 1] : 0;
+                        const unsigned up0 = y > 0 ? row[x - width] : 0;
+                        const unsigned zigzag = ApplyPrediction(d, Predict_Larger(left0, up0));
+                        if (!left0 || !up0) {
+                            *edges++ = static_cast<uint16_t>( zigzag );
+                        } else {
+                            *surfaces++ = static_cast<uint16_t>( zigzag );
+                        }
+                    }
+                }
+
+                continue;
+            }
+
+            const int predictor = blocks_row[ix - 1];
+            const uint16_t* prev_row = prev_outer_row ? prev_outer_row + ix * kBlockSize : nullptr;
+            if (references.Motion && predictor == PredictorType_PrevFrame)
+            {
+                const DepthMotion& motion = BlockMotion[(iy-1) * (cx-1) + (ix-1)];
+                prev_row = GetMotionBlock(references, width, ix * kBlockSize, iy * kBlockSize, motion);
+
+                Motion.push_back(motion.Reference);
+                Motion.push_back(static_cast<uint8_t>( motion.X ));
+                Motion.push_back(static_cast<uint8_t>( motion.Y ));
+            }
+
+            if (bounds.Enabled &&
+                EmitNearLosslessBlock(inner_row, width, prev_row, predictor, bounds, edges, surfaces))
+            {
+                continue;
+            }
+            if (bounds.Enabled) {
+                blocks_row[ix - 1] |= kDepthBlockExactFlag;
+            }
+
+            EmitBlockResiduals(kernel, inner_row, width, prev_row, predictor, edges, surfaces);
+        } 
+    } // next block
+
+    Edges.resize(edges - Edges.data());
+    Surfaces.resize(surfaces - Surfaces.data());
+}
+
+void DepthTile::WriteSizes(uint8_t* dest) const
+{
+    WriteU32_LE(dest, Zeroes_UncompressedBytes);
+    WriteU32_LE(dest + 4, Zeroes_CompressedBytes);
+    WriteU32_LE(dest + 8, Blocks_UncompressedBytes);
+    WriteU32_LE(dest + 12, Blocks_CompressedBytes);
+    WriteU32_LE(dest + 16, Edges_UncompressedBytes);
+    WriteU32_LE(dest + 20, Edges_CompressedBytes);
+    WriteU32_LE(dest + 24, Surfaces_UncompressedBytes);
+    WriteU32_LE(dest + 28, Surfaces_CompressedBytes);
+    if (HasMotion) {
+        WriteU32_LE(dest + 32, Motion_UncompressedBytes);
+        WriteU32_LE(dest + 36, Motion_CompressedBytes);
+    }
+}
+
+void DepthCompressor::WriteHeader(
+    int width,
+    int height,
+    bool keyframe,
+    bool tiled,
+    bool motion,
+    const DepthErrorBounds& bounds,
+    const DepthCrop* crop,
+    uint8_t* dest)
+{
+    const int tile_count = static_cast<int>( Tiles.size() );
+    const int tile_sizes_bytes = GetTileSizesBytes(motion);
+
+    dest[0] = kDepthFormatMagic;
+
+    uint8_t flags = 0;
+    if (keyframe) {
+        flags |= DepthFlags_Keyframe;
+    }
+    if (tiled) {
+        flags |= DepthFlags_Tiled;
+    }
+    if (keyframe && Dictionary) {
+        flags |= DepthFlags_Dictionary;
+    }
+    if (motion) {
+        flags |= DepthFlags_Motion;
+    }
+    if (bounds.Enabled) {
+        flags |= DepthFlags_NearLossless;
+    }
+    if (crop) {
+        flags |= DepthFlags_Cropped;
+    }
+    dest[1] = flags;
+
+    WriteU16_LE(dest + 2, static_cast<uint16_t>( CompressedFrameNumber ));
+    WriteU16_LE(dest + 4, static_cast<uint16_t>( width ));
+    WriteU16_LE(dest + 6, static_cast<uint16_t>( height ));
+
+    size_t header_bytes = 8 + tile_sizes_bytes;
+    if (tiled) {
+        WriteU16_LE(dest + 8, static_cast<uint16_t>( tile_count ));
+        for (int i = 0; i < tile_count; ++i) {
+            Tiles[i].WriteSizes(dest + kDepthTiledHeaderBytes + tile_sizes_bytes * i);
+        }
+        header_bytes = kDepthTiledHeaderBytes + tile_sizes_bytes * tile_count;
+    } else {
+        Tiles[0].WriteSizes(dest + 8);
+    }
+
+    if (keyframe && Dictionary) {
+        WriteU32_LE(dest + header_bytes, Dictionary->GetId());
+        header_bytes += kDepthDictionaryIdBytes;
+    }
+
+    if (bounds.Enabled) {
+        memcpy(dest + header_bytes, bounds.Bands, kDepthErrorBoundBytes);
+        header_bytes += kDepthErrorBoundBytes;
+    }
+
+    if (crop) {
+        WriteU16_LE(dest + header_bytes, static_cast<uint16_t>( crop->X ));
+        WriteU16_LE(dest + header_bytes + 2, static_cast<uint16_t>( crop->Y ));
+        WriteU16_LE(dest + header_bytes + 4, static_cast<uint16_t>( crop->Width ));
+        WriteU16_LE(dest + header_bytes + 6, static_cast<uint16_t>( crop->Height ));
+    }
+}
+
+// Sum of compressed section sizes for a tile
+static uint64_t TileCompressedBytes(const uint8_t* sizes, bool motion)
+{
+    uint64_t bytes = static_cast<uint64_t>( ReadU32_LE(sizes + 4) ) +
+        ReadU32_LE(sizes + 12) +
+        ReadU32_LE(sizes + 20) +
+        ReadU32_LE(sizes + 28);
+    if (motion) {
+        bytes += ReadU32_LE(sizes + 36);
+    }
+    return bytes;
+}
+
+DepthResult DepthCompressor::Decompress(
     const std::vector<uint8_t>& compressed,
     int& width,
     int& height,
     std::vector<uint16_t>& depth_out)
 {
-    if (compressed.size() < kDepthHeaderBytes) {
+    const unsigned compressed_bytes = static_cast<unsigned>( compressed.size() );
+    if (GetDepthDimensions(compressed.data(), compressed_bytes, width, height)) {
+        depth_out.resize(width * height);
+    }
+
+    return DecompressInto(
+        compressed.data(),
+        compressed.size(),
+        width,
+        height,
+        depth_out.data(),
+        width,
+        height);
+}
+
+DepthResult DepthCompressor::DecompressInto(
+    const uint8_t* compressed,
+    size_t compressed_bytes,
+    int& width,
+    int& height,
+    uint16_t* depth_out,
+    int stride,
+    int depth_out_rows)
+{
+    if (compressed_bytes < kDepthHeaderBytes) {
         return DepthResult::FileTruncated;
     }
-    const uint8_t* src = compressed.data();
+    const uint8_t* src = compressed;
     if (src[0] != kDepthFormatMagic) {
         return DepthResult::WrongFormat;
     }
-    bool keyframe = (src[1] & 1) != 0;
+    const bool keyframe = (src[1] & DepthFlags_Keyframe) != 0;
+    const bool tiled = (src[1] & DepthFlags_Tiled) != 0;
+    const bool has_dictionary = (src[1] & DepthFlags_Dictionary) != 0;
+    const bool motion = (src[1] & DepthFlags_Motion) != 0;
+    const bool near_lossless = (src[1] & DepthFlags_NearLossless) != 0;
+    const bool cropped = (src[1] & DepthFlags_Cropped) != 0;
+    const int tile_sizes_bytes = GetTileSizesBytes(motion);
     const unsigned frame_number = ReadU16_LE(src + 2);
 
     if (!keyframe && frame_number != CompressedFrameNumber + 1) {
@@ -596,113 +3083,297 @@ DepthResult DepthCompressor::Decompress(
     if (width < 1 || width > 4096 || height < 1 || height > 4096) {
         return DepthResult::Corrupted;
     }
+    if (!depth_out || stride < width || depth_out_rows < height) {
+        return DepthResult::BufferTooSmall;
+    }
+
+    int tile_count = 1;
+    size_t header_bytes = 8 + tile_sizes_bytes;
+    const uint8_t* tile_sizes = src + 8;
+    if (tiled) {
+        tile_count = ReadU16_LE(src + 8);
+        if (tile_count < 1) {
+            return DepthResult::Corrupted;
+        }
+        header_bytes = kDepthTiledHeaderBytes + tile_sizes_bytes * tile_count;
+        tile_sizes = src + kDepthTiledHeaderBytes;
+    }
+    if (compressed_bytes < header_bytes) {
+        return DepthResult::FileTruncated;
+    }
+
+    const DepthDictionary* dictionary = nullptr;
+    if (has_dictionary) {
+        header_bytes += kDepthDictionaryIdBytes;
+        if (compressed_bytes < header_bytes) {
+            return DepthResult::FileTruncated;
+        }
+        const uint32_t dictionary_id = ReadU32_LE(src + header_bytes - kDepthDictionaryIdBytes);
+        for (const auto& candidate : Dictionaries) {
+            if (candidate->GetId() == dictionary_id) {
+                dictionary = candidate.get();
+                break;
+            }
+        }
+        if (!dictionary) {
+            return DepthResult::MissingDictionary;
+        }
+    }
+
+    DepthErrorBounds bounds;
+    if (near_lossless) {
+        header_bytes += kDepthErrorBoundBytes;
+        if (compressed_bytes < header_bytes) {
+            return DepthResult::FileTruncated;
+        }
+        bounds.Enabled = true;
+        memcpy(bounds.Bands, src + header_bytes - kDepthErrorBoundBytes, kDepthErrorBoundBytes);
+    }
+
+    DepthCrop crop;
+    crop.Width = width;
+    crop.Height = height;
+    if (cropped) {
+        header_bytes += kDepthCropBytes;
+        if (compressed_bytes < header_bytes) {
+            return DepthResult::FileTruncated;
+        }
+        const uint8_t* crop_data = src + header_bytes - kDepthCropBytes;
+        crop.X = ReadU16_LE(crop_data);
+        crop.Y = ReadU16_LE(crop_data + 2);
+        crop.Width = ReadU16_LE(crop_data + 4);
+        crop.Height = ReadU16_LE(crop_data + 6);
+        if (crop.Width < 1 || crop.X + crop.Width > width ||
+            crop.Height < 1 || crop.Y + crop.Height > height)
+        {
+            return DepthResult::Corrupted;
+        }
+    }
+
+    // Everything below works on the cropped image
+    const int coded_width = crop.Width;
+    const int coded_height = crop.Height;
+    if (tile_count != ClampTileCount(coded_height, tile_count)) {
+        return DepthResult::Corrupted;
+    }
+
+    // Locate the data for each tile
+    std::vector<const uint8_t*> tile_data(tile_count);
+    uint64_t total_bytes = header_bytes;
+    for (int i = 0; i < tile_count; ++i) {
+        tile_data[i] = src + total_bytes;
+        total_bytes += TileCompressedBytes(tile_sizes + tile_sizes_bytes * i, motion);
+    }
+    if (compressed_bytes != total_bytes) {
+        return DepthResult::FileTruncated;
+    }
+
+    // Get depth for previous frames
+    const int n = coded_width * coded_height;
+    if (keyframe) {
+        ReferenceCount = 0;
+    }
+    const uint16_t* reference_frames[kMaxReferenceFrames];
+    const int reference_count = GetReferenceFrames(crop, kMaxReferenceFrames, reference_frames);
+    if (!keyframe && reference_count == 0) {
+        return DepthResult::MissingPFrame;
+    }
 
-    // Get depth for previous frame
-    const int n = width * height;
     QuantizedDepth[CurrentFrameIndex].resize(n);
+    FrameCrops[CurrentFrameIndex] = crop;
     uint16_t* depth = QuantizedDepth[CurrentFrameIndex].data();
-    CurrentFrameIndex = (CurrentFrameIndex + 1) % 2;
-    uint16_t* prev_depth = nullptr;
-    if (!keyframe) {
-        if (QuantizedDepth[CurrentFrameIndex].size() != static_cast<size_t>( n )) {
-            return DepthResult::MissingPFrame;
+    CurrentFrameIndex = (CurrentFrameIndex + 1) % kQuantizedDepthRingSize;
+
+    if (cropped) {
+        ClearOutsideCrop(width, height, crop, depth_out, stride);
+    }
+    uint16_t* crop_out = depth_out + crop.Y * stride + crop.X;
+
+    Tiles.resize(tile_count);
+    std::vector<uint8_t> tile_success(tile_count);
+
+    ForEachTile(tile_count, [&](int tile_index) {
+        int first_row, row_count;
+        GetTileRows(coded_height, tile_count, tile_index, first_row, row_count);
+
+        DepthReferences references;
+        GetTileReferences(reference_frames, reference_count, coded_width, coded_height, first_row, row_count, motion, references);
+
+        const int offset = first_row * coded_width;
+        const bool success = Tiles[tile_index].Decompress(
+            coded_width,
+            row_count,
+            tile_sizes + tile_sizes_bytes * tile_index,
+            tile_data[tile_index],
+            depth + offset,
+            references,
+            bounds,
+            dictionary);
+
+        if (success) {
+            const uint16_t* quantized = depth + offset;
+            uint16_t* dest = crop_out + first_row * stride;
+            for (int y = 0; y < row_count; ++y, quantized += coded_width, dest += stride) {
+                zdepth::DequantizeDepthImage(coded_width, quantized, dest);
+            }
+        }
+
+        tile_success[tile_index] = success ? 1 : 0;
+    });
+
+    for (int i = 0; i < tile_count; ++i) {
+        if (!tile_success[i]) {
+            // Following P-frames cannot reference this frame
+            ReferenceCount = 0;
+            return DepthResult::Corrupted;
         }
-        prev_depth = QuantizedDepth[CurrentFrameIndex].data();
     }
 
-    Zeroes_UncompressedBytes = ReadU32_LE(src + 8);
-    const unsigned ZeroesCompressedBytes = ReadU32_LE(src + 12);
-    Blocks_UncompressedBytes = ReadU32_LE(src + 16);
-    const unsigned BlocksCompressedBytes = ReadU32_LE(src + 20);
-    Edges_UncompressedBytes = ReadU32_LE(src + 24);
-    const unsigned EdgesCompressedBytes = ReadU32_LE(src + 28);
-    Surfaces_UncompressedBytes = ReadU32_LE(src + 32);
-    const unsigned SurfacesCompressedBytes = ReadU32_LE(src + 36);
+    if (ReferenceCount < kMaxReferenceFrames) {
+        ++ReferenceCount;
+    }
+    return DepthResult::Success;
+}
+
+bool DepthTile::Decompress(
+    int width,
+    int height,
+    const uint8_t* sizes,
+    const uint8_t* src,
+    uint16_t* depth,
+    const DepthReferences& references,
+    const DepthErrorBounds& bounds,
+    const DepthDictionary* dictionary)
+{
+    HasMotion = references.Motion;
+
+    Zeroes_UncompressedBytes = ReadU32_LE(sizes);
+    const unsigned ZeroesCompressedBytes = ReadU32_LE(sizes + 4);
+    Blocks_UncompressedBytes = ReadU32_LE(sizes + 8);
+    const unsigned BlocksCompressedBytes = ReadU32_LE(sizes + 12);
+    Edges_UncompressedBytes = ReadU32_LE(sizes + 16);
+    const unsigned EdgesCompressedBytes = ReadU32_LE(sizes + 20);
+    Surfaces_UncompressedBytes = ReadU32_LE(sizes + 24);
+    const unsigned SurfacesCompressedBytes = ReadU32_LE(sizes + 28);
+    Motion_UncompressedBytes = 0;
+    unsigned MotionCompressedBytes = 0;
+    if (HasMotion) {
+        Motion_UncompressedBytes = ReadU32_LE(sizes + 32);
+        MotionCompressedBytes = ReadU32_LE(sizes + 36);
+    }
 
     if (Blocks_UncompressedBytes < 2) {
-        return DepthResult::Corrupted;
+        return false;
     }
 
-    if (compressed.size() !=
-        kDepthHeaderBytes +
-        ZeroesCompressedBytes +
-        BlocksCompressedBytes +
-        EdgesCompressedBytes +
-        SurfacesCompressedBytes)
+    // Reject sizes that cannot be valid before allocating buffers for them
+    const unsigned n = width * height;
+    const unsigned max_packed_bytes = (n + 2) * 3 / 2;
+    if (static_cast<unsigned>( Zeroes_UncompressedBytes ) != n / 8 ||
+        static_cast<unsigned>( Blocks_UncompressedBytes ) > n / (kBlockSize * kBlockSize) ||
+        static_cast<unsigned>( Edges_UncompressedBytes ) > max_packed_bytes ||
+        static_cast<unsigned>( Surfaces_UncompressedBytes ) > max_packed_bytes ||
+        static_cast<unsigned>( Motion_UncompressedBytes ) > static_cast<unsigned>( Blocks_UncompressedBytes ) * kDepthMotionBytes)
     {
-        return DepthResult::FileTruncated;
+        return false;
     }
 
-    const uint8_t* ZeroesData = src + kDepthHeaderBytes;
+    const uint8_t* ZeroesData = src;
     const uint8_t* BlocksData = ZeroesData + ZeroesCompressedBytes;
     const uint8_t* EdgesData = BlocksData + BlocksCompressedBytes;
     const uint8_t* SurfacesData = EdgesData + EdgesCompressedBytes;
+    const uint8_t* MotionData = SurfacesData + SurfacesCompressedBytes;
 
-    bool success = ZstdDecompress(
+    bool success = Zstd.Decompress(
         ZeroesData,
         ZeroesCompressedBytes,
         Zeroes_UncompressedBytes,
-        Zeroes);
+        Zeroes,
+        GetDecompressDictionary(dictionary, DepthStream_Zeroes));
     if (!success) {
-        return DepthResult::Corrupted;
+        return false;
     }
 
-    success = ZstdDecompress(
+    success = Zstd.Decompress(
         EdgesData,
         EdgesCompressedBytes,
         Edges_UncompressedBytes,
-        Packed);
+        PackedEdges,
+        GetDecompressDictionary(dictionary, DepthStream_Edges));
     if (!success) {
-        return DepthResult::Corrupted;
+        return false;
     }
-    Unpack12(Packed, Edges);
+    Unpack12(PackedEdges, Edges);
 
-    success = ZstdDecompress(
+    success = Zstd.Decompress(
         SurfacesData,
         SurfacesCompressedBytes,
         Surfaces_UncompressedBytes,
-        Packed);
+        PackedSurfaces,
+        GetDecompressDictionary(dictionary, DepthStream_Surfaces));
     if (!success) {
-        return DepthResult::Corrupted;
+        return false;
     }
-    Unpack12(Packed, Surfaces);
+    Unpack12(PackedSurfaces, Surfaces);
 
-    success = ZstdDecompress(
+    success = Zstd.Decompress(
         BlocksData,
         BlocksCompressedBytes,
         Blocks_UncompressedBytes,
-        Blocks);
+        Blocks,
+        GetDecompressDictionary(dictionary, DepthStream_Blocks));
     if (!success) {
-        return DepthResult::Corrupted;
+        return false;
     }
 
-    if (Zeroes.size() != static_cast<size_t>( n ) / 8) {
-        return DepthResult::Corrupted;
+    Motion.clear();
+    if (HasMotion) {
+        success = Zstd.Decompress(
+            MotionData,
+            MotionCompressedBytes,
+            Motion_UncompressedBytes,
+            Motion);
+        if (!success) {
+            return false;
+        }
     }
-    DecodeZeroes(width, height, depth);
 
-    success = DecompressImage(width, height, depth, prev_depth);
-    if (!success) {
-        return DepthResult::Corrupted;
+    if (Zeroes.size() != static_cast<size_t>( width * height / 8 )) {
+        return false;
     }
+    DecodeZeroes(width, height, depth);
 
-    DequantizeDepthImage(width, height, depth, depth_out);
-    return DepthResult::Success;
+    return DecompressImage(width, height, depth, references, bounds);
 }
 
-bool DepthCompressor::DecompressImage(
+bool DepthTile::DecompressImage(
     int width,
     int height,
     uint16_t* depth,
-    const uint16_t* prev_depth)
+    const DepthReferences& references,
+    const DepthErrorBounds& bounds)
 {
+    const BlockKernel kernel = ChooseBlockKernel();
+
     const int cy = height / kBlockSize;
     const int cx = width / kBlockSize;
     if (Blocks.size() != static_cast<size_t>( (cx - 1) * (cy - 1) )) {
         return false;
     }
 
-    unsigned EdgesIndex = 0, SurfacesIndex = 0;
+    // The SIMD kernels read a full vector past the end of the input
+    const size_t edges_count = Edges.size();
+    const size_t surfaces_count = Surfaces.size();
+    Edges.resize(edges_count + kBlockSize);
+    Surfaces.resize(surfaces_count + kBlockSize);
+    const uint16_t* edges = Edges.data();
+    const uint16_t* edges_end = edges + edges_count;
+    const uint16_t* surfaces = Surfaces.data();
+    const uint16_t* surfaces_end = surfaces + surfaces_count;
+
+    const uint16_t* prev_depth = references.Count > 0 ? references.Frames[0] : nullptr;
+    const uint8_t* motion = Motion.data();
+    const uint8_t* motion_end = motion + Motion.size();
 
     uint16_t* outer_row = depth;
     for (int iy = 0; iy < cy; ++iy, outer_row += kBlockSize * width)
@@ -728,15 +3399,15 @@ bool DepthCompressor::DecompressImage(
 
                         unsigned zigzag;
                         if (!left0 || !up0) {
-                            if (EdgesIndex >= Edges.size()) {
+                            if (edges >= edges_end) {
                                 return false;
                             }
-                            zigzag = Edges[EdgesIndex++];
+                            zigzag = *edges++;
                         } else {
-                            if (SurfacesIndex >= Surfaces.size()) {
+                            if (surfaces >= surfaces_end) {
                                 return false;
                             }
-                            zigzag = Surfaces[SurfacesIndex++];
+                            zigzag = *surfaces++;
                         }
 
                         d = UndoPrediction(zigzag, Predict_Larger(left0, up0));
@@ -747,70 +3418,73 @@ bool DepthCompressor::DecompressImage(
                 continue;
             }
 
-            const uint8_t predictor = Blocks[(iy-1) * (cx-1) + (ix-1)];
-
-            uint16_t* row = inner_row;
-            for (int y = 0; y < kBlockSize; ++y, row += width)
-            {
-                for (int x = 0; x < kBlockSize; ++x)
-                {
-                    unsigned d = row[x];
-                    if (d == 0) {
-                        continue;
-                    }
-
-                    const unsigned left0 = row[x - 1];
-                    const unsigned up0 = row[x - width];
-
-                    unsigned zigzag;
-                    if (!left0 || !up0) {
-                        if (EdgesIndex >= Edges.size()) {
-                            return false;
-                        }
-                        zigzag = Edges[EdgesIndex++];
-                    } else {
-                        if (SurfacesIndex >= Surfaces.size()) {
-                            return false;
-                        }
-                        zigzag = Surfaces[SurfacesIndex++];
-                    }
+            uint8_t predictor = Blocks[(iy-1) * (cx-1) + (ix-1)];
+            bool near_lossless = false;
+            if (bounds.Enabled) {
+                near_lossless = (predictor & kDepthBlockExactFlag) == 0;
+                predictor = static_cast<uint8_t>( predictor & ~kDepthBlockExactFlag );
+            }
 
-                    switch (predictor)
-                    {
-                    default:
-                    case PredictorType_Larger:
-                        d = UndoPrediction(zigzag, Predict_Larger(left0, up0));
-                        break;
-                    case PredictorType_Up:
-                        d = UndoPrediction(zigzag, Predict_Up(left0, up0));
-                        break;
-                    case PredictorType_Left:
-                        d = UndoPrediction(zigzag, Predict_Left(left0, up0));
-                        break;
-                    case PredictorType_UpTrend:
-                        d = UndoPrediction(zigzag, Predict_UpTrend(left0, up0, row[x - width * 2]));
-                        break;
-                    case PredictorType_LeftTrend:
-                        d = UndoPrediction(zigzag, Predict_LeftTrend(left0, row[x - 2], up0));
-                        break;
-                    case PredictorType_Average:
-                        d = UndoPrediction(zigzag, Predict_Average(left0, up0));
-                        break;
-                    case PredictorType_PrevFrame:
-                        d = UndoPrediction(zigzag, Predict_PrevFrame(prev_depth[row + x - depth], left0, up0));
-                        break;
-                    }
+            const uint16_t* prev_row = nullptr;
+            if (prev_depth) {
+                prev_row = prev_depth + (inner_row - depth);
+            } else if (predictor == PredictorType_PrevFrame) {
+                return false; // Keyframes cannot reference the previous frame
+            }
 
-                    row[x] = static_cast<uint16_t>( d );
+            if (references.Motion && predictor == PredictorType_PrevFrame)
+            {
+                if (motion_end - motion < kDepthMotionBytes) {
+                    return false;
                 }
-            } // next depth pixel
+                DepthMotion block_motion;
+                block_motion.Reference = motion[0];
+                block_motion.X = static_cast<int8_t>( motion[1] );
+                block_motion.Y = static_cast<int8_t>( motion[2] );
+                motion += kDepthMotionBytes;
+
+                const int x = ix * kBlockSize, y = iy * kBlockSize;
+                if (!IsMotionInBounds(references, width, height, x, y, block_motion)) {
+                    return false;
+                }
+                prev_row = GetMotionBlock(references, width, x, y, block_motion);
+            }
+
+            bool success;
+            if (near_lossless) {
+                success = DecodeNearLosslessBlock(
+                    inner_row,
+                    width,
+                    prev_row,
+                    predictor,
+                    bounds,
+                    edges,
+                    edges_end,
+                    surfaces,
+                    surfaces_end);
+            } else {
+                success = DecodeBlock(
+                    kernel,
+                    inner_row,
+                    width,
+                    prev_row,
+                    predictor,
+                    edges,
+                    edges_end,
+                    surfaces,
+                    surfaces_end);
+            }
+            if (!success) {
+                return false;
+            }
         } 
     } // next block
 
-    return true;
+    // Every motion vector must be used
+    return motion == motion_end;
 }
 
-void DepthCompressor::EncodeZeroes(
+void DepthTile::EncodeZeroes(
     int width,
     int height,
     const uint16_t* depth)
@@ -832,25 +3506,195 @@ void DepthCompressor::EncodeZeroes(
     }
 }
 
-void DepthCompressor::DecodeZeroes(
+void DepthTile::DecodeZeroes(
     int width,
     int height,
     uint16_t* depth)
 {
+    const BlockTables& tables = GetBlockTables();
     const int bytes = width * height / 8;
 
     unsigned prev = 0;
     for (int i = 0; i < bytes; ++i, depth += 8)
     {
-        const unsigned bits = Zeroes[i];
+        // Prefix-XOR the bits to undo the transition coding
+        unsigned bits = Zeroes[i];
+        bits ^= bits << 1;
+        bits ^= bits << 2;
+        bits ^= bits << 4;
+        bits = (bits ^ (0u - prev)) & 0xff;
+        prev = bits >> 7;
+
+        memcpy(depth, tables.Bits[bits], sizeof(tables.Bits[bits]));
+    }
+}
+
+
+
+//------------------------------------------------------------------------------
+// DepthDictionaryTrainer
+
+/*
+    Dictionary training follows the idea of the Zstd FASTCOVER trainer,
+    which is not part of the Zstd library build here:
+
+    Count how often each short byte string (d-mer) appears in the samples.
+    Split the samples into one epoch per dictionary segment, and from each
+    epoch pick the segment whose d-mers are most common.  D-mers that were
+    selected do not count again so the segments cover different content.
+    The best segments go at the end of the dictionary where matches are
+    cheapest to reference.
+*/
+
+// Number of bits in the d-mer frequency table
+static const int kTrainingHashBits = 20;
+
+static DEPTH_INLINE uint32_t HashDmer(const uint8_t* data)
+{
+    uint64_t dmer;
+    memcpy(&dmer, data, sizeof(dmer));
+    return static_cast<uint32_t>( (dmer * 0x9E3779B97F4A7C15ULL) >> (64 - kTrainingHashBits) );
+}
+
+static void TrainStreamDictionary(
+    const std::vector<uint8_t>& samples,
+    size_t dictionary_bytes,
+    std::vector<uint8_t>& dictionary)
+{
+    static_assert(kTrainingDmerBytes == 8, "HashDmer reads 8 bytes");
+
+    if (samples.size() <= dictionary_bytes) {
+        dictionary = samples;
+        return;
+    }
+    dictionary.clear();
+
+    const size_t dmer_count = samples.size() - kTrainingDmerBytes + 1;
+    const size_t segment_dmers = kTrainingSegmentBytes - kTrainingDmerBytes + 1;
+
+    std::vector<uint32_t> hashes(dmer_count);
+    std::vector<uint32_t> counts(size_t(1) << kTrainingHashBits);
+    for (size_t i = 0; i < dmer_count; ++i) {
+        const uint32_t hash = HashDmer(samples.data() + i);
+        hashes[i] = hash;
+        ++counts[hash];
+    }
+
+    struct Segment
+    {
+        size_t Offset;
+        uint64_t Score;
+    };
+    std::vector<Segment> segments;
+
+    size_t segment_count = dictionary_bytes / kTrainingSegmentBytes;
+    if (segment_count < 1) {
+        segment_count = 1;
+    }
+    const size_t epoch_dmers = dmer_count / segment_count;
+    if (epoch_dmers < segment_dmers) {
+        dictionary.assign(samples.end() - dictionary_bytes, samples.end());
+        return;
+    }
 
-        for (int j = 0; j < 8; ++j) {
-            unsigned x_xor_prev = (bits >> j) & 1;
-            prev ^= x_xor_prev;
-            depth[j] = static_cast<uint16_t>( prev );
+    for (size_t epoch = 0; epoch < segment_count; ++epoch)
+    {
+        const size_t begin = epoch * epoch_dmers;
+        const size_t end = begin + epoch_dmers;
+
+        // Slide a segment-sized window over the epoch
+        uint64_t score = 0;
+        for (size_t i = begin; i < begin + segment_dmers; ++i) {
+            score += counts[hashes[i]];
+        }
+        Segment best{ begin, score };
+        for (size_t i = begin + segment_dmers; i < end; ++i) {
+            score += counts[hashes[i]];
+            score -= counts[hashes[i - segment_dmers]];
+            if (score > best.Score) {
+                best.Offset = i - segment_dmers + 1;
+                best.Score = score;
+            }
         }
+        if (best.Score == 0) {
+            continue;
+        }
+
+        for (size_t i = best.Offset; i < best.Offset + segment_dmers; ++i) {
+            counts[hashes[i]] = 0;
+        }
+        segments.push_back(best);
+    }
+
+    std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) {
+        return a.Score < b.Score;
+    });
+
+    for (const Segment& segment : segments) {
+        const uint8_t* data = samples.data() + segment.Offset;
+        dictionary.insert(dictionary.end(), data, data + kTrainingSegmentBytes);
+    }
+}
+
+static void AppendSample(std::vector<uint8_t>& samples, const std::vector<uint8_t>& data)
+{
+    if (samples.size() + data.size() <= kMaxTrainingBytes) {
+        samples.insert(samples.end(), data.begin(), data.end());
+    }
+}
+
+void DepthDictionaryTrainer::AddFrame(
+    unsigned source,
+    int width,
+    int height,
+    const uint16_t* depth,
+    bool keyframe)
+{
+    // The encoder only applies dictionaries to I-frames
+    if (!keyframe) {
+        return;
+    }
+
+    std::unique_ptr<DepthCompressor>& compressor = Compressors[source];
+    if (!compressor) {
+        compressor = std::make_unique<DepthCompressor>();
+    }
+
+    std::vector<uint8_t> compressed;
+    compressor->Compress(width, height, depth, compressed, keyframe);
+
+    // Collect the data that was fed to Zstd
+    for (const DepthTile& tile : compressor->Tiles)
+    {
+        AppendSample(Samples[DepthStream_Zeroes], tile.Zeroes);
+        AppendSample(Samples[DepthStream_Blocks], tile.Blocks);
+        AppendSample(Samples[DepthStream_Edges], tile.PackedEdges);
+        AppendSample(Samples[DepthStream_Surfaces], tile.PackedSurfaces);
     }
 }
 
+bool DepthDictionaryTrainer::Train(
+    uint32_t id,
+    int dictionary_bytes,
+    DepthDictionary& dictionary)
+{
+    if (dictionary_bytes < kTrainingSegmentBytes) {
+        return false;
+    }
+
+    bool has_samples = false;
+    std::vector<uint8_t> content[DepthStream_Count];
+    for (int i = 0; i < DepthStream_Count; ++i) {
+        TrainStreamDictionary(Samples[i], dictionary_bytes, content[i]);
+        if (!Samples[i].empty()) {
+            has_samples = true;
+        }
+    }
+    if (!has_samples) {
+        return false;
+    }
+
+    return dictionary.Initialize(id, content);
+}
 
 } // namespace lossless
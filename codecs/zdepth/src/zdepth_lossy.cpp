@@ -3,12 +3,28 @@
 #include "zdepth_lossy.hpp"
 
 #include "libdivide.h"
+#include "zdepth_quantize.hpp"
 
 #include <zstd.h> // Zstd
 #include <string.h> // memcpy
+#include <algorithm> // std::min
 
 #include <core_logging.hpp>
 
+#ifdef ZDEPTH_MFX
+#include <MfxVideoDecoder.hpp> // mfx_codecs
+#include <MfxVideoEncoder.hpp> // mfx_codecs
+#endif
+#ifdef ZDEPTH_NVCUVID
+#include <NvVideoCodec.hpp> // nvcuvid_codecs
+#endif
+#ifdef ZDEPTH_FFMPEG
+extern "C" {
+#include <libavcodec/avcodec.h> // ffmpeg
+#include <libavutil/opt.h>
+}
+#endif
+
 namespace lossy {
 
 
@@ -30,6 +46,7 @@ const char* DepthResultString(DepthResult result)
     case DepthResult::WrongFormat: return "WrongFormat";
     case DepthResult::Corrupted: return "Corrupted";
     case DepthResult::MissingFrame: return "MissingFrame";
+    case DepthResult::Error: return "Error";
     default: break;
     }
     return "Unknown";
@@ -114,11 +131,9 @@ void QuantizeDepthImage(
     std::vector<uint16_t>& quantized)
 {
     quantized.resize(n);
-    uint16_t* dest = quantized.data();
 
-    for (int i = 0; i < n; ++i) {
-        dest[i] = AzureKinectQuantizeDepth(depth[i]);
-    }
+    zdepth::QuantizedStats stats;
+    zdepth::QuantizeDepthImage(true, n, depth, quantized.data(), stats);
 }
 
 void DequantizeDepthImage(std::vector<uint16_t>& depth_inout)
@@ -126,9 +141,7 @@ void DequantizeDepthImage(std::vector<uint16_t>& depth_inout)
     const int n = static_cast<int>( depth_inout.size() );
     uint16_t* depth = depth_inout.data();
 
-    for (int i = 0; i < n; ++i) {
-        depth[i] = AzureKinectDequantizeDepth(depth[i]);
-    }
+    zdepth::DequantizeDepthImage(n, depth, depth);
 }
 
 
@@ -242,6 +255,104 @@ void UndoRescaleImage_11Bits(
     }
 }
 
+void QuantizeAndRescaleImage_11Bits(
+    int n,
+    const uint16_t* depth,
+    std::vector<uint16_t>& rescaled,
+    uint16_t& min_value,
+    uint16_t& max_value)
+{
+    rescaled.resize(n);
+    uint16_t* data = rescaled.data();
+
+    zdepth::QuantizedStats stats;
+    zdepth::QuantizeDepthImage(true, n, depth, data, stats);
+
+    min_value = static_cast<uint16_t>( stats.Minimum );
+    max_value = static_cast<uint16_t>( stats.Maximum );
+    if (stats.NonZeroCount == 0) {
+        return;
+    }
+
+    const unsigned smallest = stats.Minimum;
+    const unsigned largest = stats.Maximum;
+    const unsigned range = largest - smallest + 1;
+    if (range >= 2048) {
+        return;
+    }
+
+    // Quantized depth is at most 2040, so the rescale for each value that
+    // appears in the image fits in a small table
+    uint16_t table[zdepth::kDequantizeTableSize];
+    table[0] = 0;
+
+    if (range <= 1) {
+        table[smallest] = 1;
+    } else {
+        // Same as RescaleImage_11Bits() without a division per value:
+        // y = (x * 2047 + range / 2) / range
+        unsigned y = 0, remainder = range / 2;
+        for (unsigned x = smallest; x <= largest; ++x) {
+            table[x] = static_cast<uint16_t>(y + 1);
+            remainder += 2047;
+            while (remainder >= range) {
+                remainder -= range;
+                ++y;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        data[i] = table[data[i]];
+    }
+}
+
+void UndoRescaleAndDequantizeImage(
+    uint16_t min_value,
+    uint16_t max_value,
+    std::vector<uint16_t>& depth_inout)
+{
+    uint16_t* data = depth_inout.data();
+    const int size = static_cast<int>( depth_inout.size() );
+
+    const unsigned smallest = min_value;
+    const unsigned range = max_value - smallest + 1;
+
+    // Unfilter() produces up to 12 bits, so compose both steps into a table
+    // for every possible input
+    static const unsigned kTableSize = 4096;
+    uint16_t table[kTableSize];
+    table[0] = 0;
+
+    if (range >= 2048) {
+        for (unsigned x = 1; x < kTableSize; ++x) {
+            table[x] = static_cast<uint16_t>( zdepth::DequantizeDepth(x) );
+        }
+    } else if (range <= 1) {
+        for (unsigned x = 1; x < kTableSize; ++x) {
+            const uint16_t y = static_cast<uint16_t>( x - 1 + smallest );
+            table[x] = static_cast<uint16_t>( zdepth::DequantizeDepth(y) );
+        }
+    } else {
+        // Same as UndoRescaleImage_11Bits() without a division per value:
+        // y = ((x - 1) * range + 1023) / 2047
+        unsigned y = 0, remainder = 1023;
+        for (unsigned x = 1; x < kTableSize; ++x) {
+            table[x] = static_cast<uint16_t>( zdepth::DequantizeDepth(static_cast<uint16_t>(y + smallest)) );
+            remainder += range;
+            if (remainder >= 2047) {
+                remainder -= 2047;
+                ++y;
+            }
+        }
+    }
+
+    for (int i = 0; i < size; ++i) {
+        const unsigned x = data[i];
+        data[i] = x < kTableSize ? table[x] : 0;
+    }
+}
+
 
 //------------------------------------------------------------------------------
 // Zstd
@@ -285,10 +396,623 @@ bool ZstdDecompress(
     return true;
 }
 
+ZstdContext::~ZstdContext()
+{
+    ZSTD_freeCCtx(CCtx);
+    ZSTD_freeDCtx(DCtx);
+}
+
+void ZstdContext::Compress(
+    const std::vector<uint8_t>& uncompressed,
+    std::vector<uint8_t>& compressed)
+{
+    if (!CCtx) {
+        CCtx = ZSTD_createCCtx();
+        if (!CCtx) {
+            compressed.clear();
+            return;
+        }
+    }
+
+    compressed.resize(ZSTD_compressBound(uncompressed.size()));
+    const size_t size = ZSTD_compressCCtx(
+        CCtx,
+        compressed.data(),
+        compressed.size(),
+        uncompressed.data(),
+        uncompressed.size(),
+        kZstdLevel);
+    if (ZSTD_isError(size)) {
+        compressed.clear();
+        return;
+    }
+    compressed.resize(size);
+}
+
+bool ZstdContext::Decompress(
+    const uint8_t* compressed_data,
+    int compressed_bytes,
+    int uncompressed_bytes,
+    std::vector<uint8_t>& uncompressed)
+{
+    if (!DCtx) {
+        DCtx = ZSTD_createDCtx();
+        if (!DCtx) {
+            return false;
+        }
+    }
+
+    uncompressed.resize(uncompressed_bytes);
+    const size_t size = ZSTD_decompressDCtx(
+        DCtx,
+        uncompressed.data(),
+        uncompressed.size(),
+        compressed_data,
+        compressed_bytes);
+    if (ZSTD_isError(size)) {
+        return false;
+    }
+    if (size != static_cast<size_t>( uncompressed_bytes )) {
+        return false;
+    }
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Low Plane Video Codec
+
+const char* VideoBackendString(VideoBackend backend)
+{
+    switch (backend)
+    {
+    case VideoBackend::Auto: return "Auto";
+    case VideoBackend::Mfx: return "Mfx";
+    case VideoBackend::Nvcuvid: return "Nvcuvid";
+    case VideoBackend::Ffmpeg: return "Ffmpeg";
+    default: break;
+    }
+    return "Unknown";
+}
+
+#ifdef ZDEPTH_MFX
+
+class MfxLowPlaneEncoder : public LowPlaneEncoder
+{
+public:
+    VideoBackend GetBackend() const override
+    {
+        return VideoBackend::Mfx;
+    }
+
+    bool Initialize(const LowPlaneParams& params) override
+    {
+        Width = params.Width;
+        Height = params.Height;
+
+        mfx::EncoderParams encoder_params;
+        encoder_params.Bitrate = params.Bitrate;
+        encoder_params.Quality = params.Quality;
+        encoder_params.ProcAmp.Enabled = false; // No denoising etc
+        encoder_params.FourCC = params.Hevc ? MFX_CODEC_HEVC : MFX_CODEC_AVC;
+        encoder_params.Framerate = params.Framerate;
+        encoder_params.Height = params.Height;
+        encoder_params.Width = params.Width;
+        encoder_params.IntraRefreshCycleSize = params.Framerate;
+        encoder_params.IntraRefreshQPDelta = -5;
+
+        Context = std::make_shared<mfx::MfxContext>();
+        if (!Context->Initialize()) {
+            return false;
+        }
+
+        Allocator = std::make_shared<mfx::SystemAllocator>();
+        if (!Allocator->InitializeNV12SystemOnly(Width, Height, params.Framerate)) {
+            return false;
+        }
+
+        Encoder = std::make_unique<mfx::VideoEncoder>();
+        return Encoder->Initialize(Allocator, encoder_params);
+    }
+
+    bool Encode(
+        const uint8_t* plane,
+        bool keyframe,
+        uint8_t*& data,
+        int& bytes) override
+    {
+        const int n = Width * Height;
+
+        // Copy frame data to buffer allocator
+        mfx::frameref_t frame = Allocator->Allocate();
+        auto& surface_data = frame->Raw->Surface.Data;
+        memcpy(surface_data.Y, plane, n);
+        memset(surface_data.U, 0, n / 2);
+
+        mfx::VideoEncoderOutput video = Encoder->Encode(frame, keyframe);
+        if (video.Bytes <= 0) {
+            return false;
+        }
+
+        data = video.Data;
+        bytes = static_cast<int>( video.Bytes );
+        return true;
+    }
+
+protected:
+    int Width = 0, Height = 0;
+
+    std::unique_ptr<mfx::VideoEncoder> Encoder;
+
+    // We need a buffer allocator for the encoder because the
+    // encoder holds onto frames after encode completes.
+    std::shared_ptr<mfx::SystemAllocator> Allocator;
+    std::shared_ptr<mfx::MfxContext> Context;
+};
+
+class MfxLowPlaneDecoder : public LowPlaneDecoder
+{
+public:
+    VideoBackend GetBackend() const override
+    {
+        return VideoBackend::Mfx;
+    }
+
+    bool Initialize(
+        const LowPlaneParams& params,
+        const uint8_t* keyframe,
+        int keyframe_bytes) override
+    {
+        Decoder = std::make_unique<mfx::VideoDecoder>();
+        return Decoder->Initialize(
+            false, // prefer on CPU
+            params.Hevc ? MFX_CODEC_HEVC : MFX_CODEC_AVC,
+            keyframe,
+            keyframe_bytes);
+    }
+
+    const uint8_t* Decode(const uint8_t* data, int bytes) override
+    {
+        Frame = Decoder->Decode(data, bytes);
+        if (!Frame) {
+            return nullptr;
+        }
+        return Frame->Raw->Data.data();
+    }
+
+protected:
+    std::unique_ptr<mfx::VideoDecoder> Decoder;
+
+    // Holds the decoded frame until the next call
+    mfx::frameref_t Frame;
+};
+
+#endif // ZDEPTH_MFX
+
+#ifdef ZDEPTH_NVCUVID
+
+class NvcuvidLowPlaneDecoder : public LowPlaneDecoder
+{
+public:
+    VideoBackend GetBackend() const override
+    {
+        return VideoBackend::Nvcuvid;
+    }
+
+    bool Initialize(
+        const LowPlaneParams& params,
+        const uint8_t* keyframe,
+        int keyframe_bytes) override
+    {
+        Params = params;
+        Codec = std::make_unique<nvcuvid::VideoCodec>();
+
+        // The decoder is created lazily so check that it works on the keyframe
+        if (!Decode(keyframe, keyframe_bytes)) {
+            return false;
+        }
+        PrimedData = keyframe;
+        return true;
+    }
+
+    const uint8_t* Decode(const uint8_t* data, int bytes) override
+    {
+        // Skip decoding the keyframe a second time
+        if (PrimedData) {
+            const bool primed = (data == PrimedData);
+            PrimedData = nullptr;
+            if (primed) {
+                return Plane.data();
+            }
+        }
+
+        nvcuvid::VideoDecodeInput vinput{};
+        vinput.Mode = nvcuvid::DecodeMode::MonochromeOnly;
+        vinput.Type = Params.Hevc ? nvcuvid::VideoType::H265 : nvcuvid::VideoType::H264;
+        vinput.Bytes = bytes;
+        vinput.Data = data;
+        vinput.Width = Params.Width;
+        vinput.Height = Params.Height;
+
+        if (!Codec->Decode(vinput, Plane)) {
+            return nullptr;
+        }
+        return Plane.data();
+    }
+
+protected:
+    LowPlaneParams Params;
+    std::unique_ptr<nvcuvid::VideoCodec> Codec;
+    std::vector<uint8_t> Plane;
+
+    // Keyframe already decoded by Initialize()
+    const uint8_t* PrimedData = nullptr;
+};
+
+#endif // ZDEPTH_NVCUVID
+
+#ifdef ZDEPTH_FFMPEG
+
+/*
+    Software codecs from libavcodec.
+
+    The encoder requires libx264/libx265 with the zerolatency tuning so that
+    each input frame produces exactly one picture without B-frames, matching
+    the hardware encoder settings.  Without a global header the parameter
+    sets are repeated in-band on each keyframe as Annex-B NALUs.
+
+    The decoder uses slice threading only, since frame threading would delay
+    the output by one frame per thread.
+*/
+
+// Largest number of threads for the software codecs
+static const int kFfmpegMaxThreads = 4;
+
+class FfmpegLowPlaneEncoder : public LowPlaneEncoder
+{
+public:
+    ~FfmpegLowPlaneEncoder()
+    {
+        av_packet_free(&Packet);
+        av_frame_free(&Frame);
+        avcodec_free_context(&Context);
+    }
+
+    VideoBackend GetBackend() const override
+    {
+        return VideoBackend::Ffmpeg;
+    }
+
+    bool Initialize(const LowPlaneParams& params) override
+    {
+        // Other encoders may delay output or ignore the options below, which
+        // would break the one picture per frame stream layout
+        const char* codec_name = params.Hevc ? "libx265" : "libx264";
+        const AVCodec* codec = avcodec_find_encoder_by_name(codec_name);
+        if (!codec) {
+            spdlog::warn("Zdepth: Ffmpeg was built without {}", codec_name);
+            return false;
+        }
+
+        Context = avcodec_alloc_context3(codec);
+        Frame = av_frame_alloc();
+        Packet = av_packet_alloc();
+        if (!Context || !Frame || !Packet) {
+            return false;
+        }
+
+        const int framerate = params.Framerate > 0 ? static_cast<int>( params.Framerate ) : 30;
+        Context->width = params.Width;
+        Context->height = params.Height;
+        Context->pix_fmt = AV_PIX_FMT_YUV420P;
+        Context->time_base = AVRational{ 1, framerate };
+        Context->framerate = AVRational{ framerate, 1 };
+        Context->gop_size = framerate;
+        Context->max_b_frames = 0; // I and P frames only
+        Context->thread_count = kFfmpegMaxThreads;
+
+        // Quality-targeted with the bitrate as a ceiling, like QVBR
+        Context->rc_max_rate = params.Bitrate;
+        Context->rc_buffer_size = params.Bitrate;
+
+        AVDictionary* options = nullptr;
+        av_dict_set(&options, "preset", "veryfast", 0);
+        av_dict_set(&options, "tune", "zerolatency", 0);
+        av_dict_set_int(&options, "crf", params.Quality, 0);
+        av_dict_set(&options, "forced-idr", "1", 0);
+        if (!params.Hevc) {
+            av_dict_set(&options, "intra-refresh", "1", 0);
+        }
+
+        const int result = avcodec_open2(Context, codec, &options);
+        av_dict_free(&options);
+        if (result < 0) {
+            return false;
+        }
+
+        Frame->format = Context->pix_fmt;
+        Frame->width = Context->width;
+        Frame->height = Context->height;
+        if (av_frame_get_buffer(Frame, 0) < 0) {
+            return false;
+        }
+        return true;
+    }
+
+    bool Encode(
+        const uint8_t* plane,
+        bool keyframe,
+        uint8_t*& data,
+        int& bytes) override
+    {
+        // The encoder may still reference the previous frame buffer
+        if (av_frame_make_writable(Frame) < 0) {
+            return false;
+        }
+
+        const int width = Context->width;
+        const int height = Context->height;
+        for (int y = 0; y < height; ++y) {
+            memcpy(Frame->data[0] + y * Frame->linesize[0], plane + y * width, width);
+        }
+
+        // Constant mid-grey chroma
+        for (int y = 0; y < height / 2; ++y) {
+            memset(Frame->data[1] + y * Frame->linesize[1], 128, width / 2);
+            memset(Frame->data[2] + y * Frame->linesize[2], 128, width / 2);
+        }
+
+        Frame->pts = NextPts++;
+        Frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+        av_packet_unref(Packet);
+        if (avcodec_send_frame(Context, Frame) < 0) {
+            return false;
+        }
+        if (avcodec_receive_packet(Context, Packet) < 0) {
+            return false; // Encoder is buffering frames
+        }
+
+        data = Packet->data;
+        bytes = Packet->size;
+        return bytes > 0;
+    }
+
+protected:
+    AVCodecContext* Context = nullptr;
+    AVFrame* Frame = nullptr;
+    AVPacket* Packet = nullptr;
+    int64_t NextPts = 0;
+};
+
+class FfmpegLowPlaneDecoder : public LowPlaneDecoder
+{
+public:
+    ~FfmpegLowPlaneDecoder()
+    {
+        av_packet_free(&Packet);
+        av_frame_free(&Frame);
+        avcodec_free_context(&Context);
+    }
+
+    VideoBackend GetBackend() const override
+    {
+        return VideoBackend::Ffmpeg;
+    }
+
+    bool Initialize(
+        const LowPlaneParams& params,
+        const uint8_t* /*keyframe*/,
+        int /*keyframe_bytes*/) override
+    {
+        Width = params.Width;
+        Height = params.Height;
+
+        const AVCodec* codec = avcodec_find_decoder(params.Hevc ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
+        if (!codec) {
+            return false;
+        }
+
+        Context = avcodec_alloc_context3(codec);
+        Frame = av_frame_alloc();
+        Packet = av_packet_alloc();
+        if (!Context || !Frame || !Packet) {
+            return false;
+        }
+
+        Context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        Context->thread_type = FF_THREAD_SLICE;
+        Context->thread_count = kFfmpegMaxThreads;
+
+        return avcodec_open2(Context, codec, nullptr) >= 0;
+    }
+
+    const uint8_t* Decode(const uint8_t* data, int bytes) override
+    {
+        Packet->data = const_cast<uint8_t*>( data );
+        Packet->size = bytes;
+
+        const int send_result = avcodec_send_packet(Context, Packet);
+        Packet->data = nullptr;
+        Packet->size = 0;
+        if (send_result < 0) {
+            return nullptr;
+        }
+
+        if (avcodec_receive_frame(Context, Frame) < 0) {
+            return nullptr;
+        }
+        if (Frame->width != Width || Frame->height != Height) {
+            return nullptr;
+        }
+
+        // Remove the row padding
+        Plane.resize(Width * Height);
+        for (int y = 0; y < Height; ++y) {
+            memcpy(Plane.data() + y * Width, Frame->data[0] + y * Frame->linesize[0], Width);
+        }
+        return Plane.data();
+    }
+
+protected:
+    int Width = 0, Height = 0;
+
+    AVCodecContext* Context = nullptr;
+    AVFrame* Frame = nullptr;
+    AVPacket* Packet = nullptr;
+
+    std::vector<uint8_t> Plane;
+};
+
+#endif // ZDEPTH_FFMPEG
+
+// Get the backends to try in order
+static std::vector<VideoBackend> GetBackendCandidates(VideoBackend backend)
+{
+    if (backend != VideoBackend::Auto) {
+        return { backend };
+    }
+    return { VideoBackend::Mfx, VideoBackend::Nvcuvid, VideoBackend::Ffmpeg };
+}
+
+static std::unique_ptr<LowPlaneEncoder> MakeLowPlaneEncoder(VideoBackend backend)
+{
+    switch (backend)
+    {
+#ifdef ZDEPTH_MFX
+    case VideoBackend::Mfx: return std::make_unique<MfxLowPlaneEncoder>();
+#endif
+#ifdef ZDEPTH_FFMPEG
+    case VideoBackend::Ffmpeg: return std::make_unique<FfmpegLowPlaneEncoder>();
+#endif
+    default: break;
+    }
+    return nullptr;
+}
+
+static std::unique_ptr<LowPlaneDecoder> MakeLowPlaneDecoder(VideoBackend backend)
+{
+    switch (backend)
+    {
+#ifdef ZDEPTH_MFX
+    case VideoBackend::Mfx: return std::make_unique<MfxLowPlaneDecoder>();
+#endif
+#ifdef ZDEPTH_NVCUVID
+    case VideoBackend::Nvcuvid: return std::make_unique<NvcuvidLowPlaneDecoder>();
+#endif
+#ifdef ZDEPTH_FFMPEG
+    case VideoBackend::Ffmpeg: return std::make_unique<FfmpegLowPlaneDecoder>();
+#endif
+    default: break;
+    }
+    return nullptr;
+}
+
+std::unique_ptr<LowPlaneEncoder> CreateLowPlaneEncoder(
+    VideoBackend backend,
+    const LowPlaneParams& params)
+{
+    for (VideoBackend candidate : GetBackendCandidates(backend))
+    {
+        std::unique_ptr<LowPlaneEncoder> encoder = MakeLowPlaneEncoder(candidate);
+        if (!encoder) {
+            continue;
+        }
+        if (encoder->Initialize(params)) {
+            return encoder;
+        }
+        spdlog::warn("Zdepth: {} video encoder initialization failed", VideoBackendString(candidate));
+    }
+    return nullptr;
+}
+
+std::unique_ptr<LowPlaneDecoder> CreateLowPlaneDecoder(
+    VideoBackend backend,
+    const LowPlaneParams& params,
+    const uint8_t* keyframe,
+    int keyframe_bytes)
+{
+    for (VideoBackend candidate : GetBackendCandidates(backend))
+    {
+        std::unique_ptr<LowPlaneDecoder> decoder = MakeLowPlaneDecoder(candidate);
+        if (!decoder) {
+            continue;
+        }
+        if (decoder->Initialize(params, keyframe, keyframe_bytes)) {
+            return decoder;
+        }
+        spdlog::warn("Zdepth: {} video decoder initialization failed", VideoBackendString(candidate));
+    }
+    return nullptr;
+}
+
 
 //------------------------------------------------------------------------------
 // DepthCompressor
 
+void DepthCompressor::SetVideoBackend(VideoBackend backend)
+{
+    if (Backend == backend) {
+        return;
+    }
+    Backend = backend;
+
+    // Recreate the codecs on the next keyframe
+    Encoder.reset();
+    Decoder.reset();
+}
+
+void DepthCompressor::SetCrop(const DepthCrop* crop)
+{
+    CropEnabled = crop != nullptr;
+    if (crop) {
+        Crop = *crop;
+    }
+}
+
+bool DepthCompressor::GetEncoderCrop(int width, int height, DepthCrop& crop) const
+{
+    crop = DepthCrop();
+    crop.Width = width;
+    crop.Height = height;
+    if (!CropEnabled) {
+        return false;
+    }
+
+    // Expand to macroblock boundaries
+    int x0 = Crop.X < 0 ? 0 : Crop.X / kDepthCropAlign * kDepthCropAlign;
+    int y0 = Crop.Y < 0 ? 0 : Crop.Y / kDepthCropAlign * kDepthCropAlign;
+    int x1 = (Crop.X + Crop.Width + kDepthCropAlign - 1) / kDepthCropAlign * kDepthCropAlign;
+    int y1 = (Crop.Y + Crop.Height + kDepthCropAlign - 1) / kDepthCropAlign * kDepthCropAlign;
+
+    // Clamp to the image, keeping a few macroblocks for the video encoders
+    const int min_size = kDepthCropAlign * 4;
+    if (x1 > width) {
+        x1 = width;
+    }
+    if (y1 > height) {
+        y1 = height;
+    }
+    if (x1 - x0 < min_size) {
+        x1 = std::min(width, x0 + min_size);
+        x0 = std::max(0, x1 - min_size);
+    }
+    if (y1 - y0 < min_size) {
+        y1 = std::min(height, y0 + min_size);
+        y0 = std::max(0, y1 - min_size);
+    }
+
+    if (x0 == 0 && y0 == 0 && x1 == width && y1 == height) {
+        return false;
+    }
+
+    crop.X = x0;
+    crop.Y = y0;
+    crop.Width = x1 - x0;
+    crop.Height = y1 - y0;
+    return true;
+}
+
 void DepthCompressor::Compress(
     int width,
     int height,
@@ -309,7 +1033,27 @@ void DepthCompressor::Compress(
     }
     header.Width = static_cast<uint16_t>( width );
     header.Height = static_cast<uint16_t>( height );
-    const int n = width * height;
+
+    // Copy out the part of the image that is compressed
+    DepthCrop crop;
+    const bool cropped = GetEncoderCrop(width, height, crop);
+    const uint16_t* depth = unquantized_depth;
+    if (cropped) {
+        header.Flags |= DepthFlags_Cropped;
+
+        CropDepth.resize(crop.Width * crop.Height);
+        uint16_t* dest = CropDepth.data();
+        const uint16_t* src = unquantized_depth + crop.Y * width + crop.X;
+        for (int y = 0; y < crop.Height; ++y, src += width, dest += crop.Width) {
+            memcpy(dest, src, crop.Width * sizeof(uint16_t));
+        }
+        depth = CropDepth.data();
+    }
+
+    // Everything below works on the cropped image
+    const int coded_width = crop.Width;
+    const int coded_height = crop.Height;
+    const int n = coded_width * coded_height;
 
     // Enforce keyframe if we have not compressed anything yet
     if (FrameCount == 0) {
@@ -318,66 +1062,52 @@ void DepthCompressor::Compress(
     header.FrameNumber = static_cast<uint16_t>( FrameCount );
     ++FrameCount;
 
-    QuantizeDepthImage(n, unquantized_depth, QuantizedDepth);
-    RescaleImage_11Bits(QuantizedDepth, header.MinimumDepth, header.MaximumDepth);
+    QuantizeAndRescaleImage_11Bits(n, depth, QuantizedDepth, header.MinimumDepth, header.MaximumDepth);
     Filter(QuantizedDepth);
 
-    if (!Encoder || LastWidth != (unsigned)width || LastHeight != (unsigned)height)
+    if (!Encoder || LastWidth != (unsigned)coded_width || LastHeight != (unsigned)coded_height || LastHevc != hevc)
     {
-        spdlog::debug("Zdepth lossy encoder resolution changed: {}x{}", width, height);
+        spdlog::debug("Zdepth lossy encoder resolution changed: {}x{}", coded_width, coded_height);
 
-        LastWidth = (unsigned)width;
-        LastHeight = (unsigned)height;
-        Encoder = std::make_unique<mfx::VideoEncoder>();
+        LastWidth = (unsigned)coded_width;
+        LastHeight = (unsigned)coded_height;
+        LastHevc = hevc;
 
-        const float bitrate_scale = width * height / static_cast<float>(320 * 288);
-        const unsigned bitrate = static_cast<unsigned>( 3000000 * bitrate_scale );
-
-        mfx::EncoderParams encoder_params;
-        encoder_params.Bitrate = bitrate;
-        encoder_params.Quality = 20;
-        encoder_params.ProcAmp.Enabled = false; // No denoising etc
-        encoder_params.FourCC = hevc ? MFX_CODEC_HEVC : MFX_CODEC_AVC;
-        encoder_params.Framerate = framerate;
-        encoder_params.Height = height;
-        encoder_params.Width = width;
-        encoder_params.IntraRefreshCycleSize = framerate;
-        encoder_params.IntraRefreshQPDelta = -5;
+        // The new video stream starts with a keyframe
+        keyframe = true;
+        header.Flags |= DepthFlags_Keyframe;
 
-        Context = std::make_shared<mfx::MfxContext>();
-        if (!Context->Initialize()) {
-            spdlog::error("Zdepth: Video encoder initialization failed");
-            Encoder.reset();
-            return;
-        }
+        const float bitrate_scale = coded_width * coded_height / static_cast<float>(320 * 288);
 
-        Allocator = std::make_shared<mfx::SystemAllocator>();
+        LowPlaneParams params;
+        params.Width = coded_width;
+        params.Height = coded_height;
+        params.Hevc = hevc;
+        params.Framerate = framerate;
+        params.Bitrate = static_cast<unsigned>( 3000000 * bitrate_scale );
+        params.Quality = 20;
 
-        const bool success = Allocator->InitializeNV12SystemOnly(width, height, framerate);
-        if (!success || !Encoder->Initialize(Allocator, encoder_params)) {
-            Encoder.reset();
+        Encoder = CreateLowPlaneEncoder(Backend, params);
+        if (!Encoder) {
+            spdlog::error("Zdepth: Video encoder initialization failed");
             return;
         }
+        spdlog::info("Zdepth lossy encoder initialized: resolution={}x{} backend={}",
+            coded_width, coded_height, VideoBackendString(Encoder->GetBackend()));
 
         Parser.reset();
     }
 
-    // Copy frame data to buffer allocator
-    mfx::frameref_t frame = Allocator->Allocate();
-    auto& surface_data = frame->Raw->Surface.Data;
-    memcpy(surface_data.Y, Low.data(), n);
-    memset(surface_data.U, 0, n / 2);
-
     // Interleave Zstd compression with video encoder work.
     // Only saves about 400 microseconds from a 5000 microsecond encode.
-    ZstdCompress(High, HighOut);
+    Zstd.Compress(High, HighOut);
     header.HighUncompressedBytes = static_cast<uint32_t>( High.size() );
     header.HighCompressedBytes = static_cast<uint32_t>( HighOut.size() );
 
     // Start encoder
-    mfx::VideoEncoderOutput video = Encoder->Encode(frame, keyframe);
-
-    if (video.Bytes <= 0) {
+    uint8_t* video_data = nullptr;
+    int video_bytes = 0;
+    if (!Encoder->Encode(Low.data(), keyframe, video_data, video_bytes)) {
         spdlog::error("Zdepth lossy encoder failed: Reseting encoder!");
         Encoder.reset();
         return;
@@ -392,8 +1122,8 @@ void DepthCompressor::Compress(
     Parser->Reset();
     Parser->ParseVideo(
         hevc,
-        video.Data,
-        video.Bytes);
+        video_data,
+        video_bytes);
 
     if (Parser->Pictures.size() != 1) {
         spdlog::error("Zdepth: Found {} frames in encoder output", Parser->Pictures.size());
@@ -439,6 +1169,9 @@ void DepthCompressor::Compress(
 
     // Calculate output size
     size_t total_size = kDepthHeaderBytes + HighOut.size() + LowOut.size();
+    if (cropped) {
+        total_size += kDepthCropBytes;
+    }
     compressed.resize(total_size);
     uint8_t* copy_dest = compressed.data();
 
@@ -446,6 +1179,16 @@ void DepthCompressor::Compress(
     memcpy(copy_dest, &header, kDepthHeaderBytes);
     copy_dest += kDepthHeaderBytes;
 
+    if (cropped) {
+        DepthCropHeader crop_header;
+        crop_header.X = static_cast<uint16_t>( crop.X );
+        crop_header.Y = static_cast<uint16_t>( crop.Y );
+        crop_header.Width = static_cast<uint16_t>( crop.Width );
+        crop_header.Height = static_cast<uint16_t>( crop.Height );
+        memcpy(copy_dest, &crop_header, kDepthCropBytes);
+        copy_dest += kDepthCropBytes;
+    }
+
     // Concatenate the compressed data
     memcpy(copy_dest, HighOut.data(), HighOut.size());
     copy_dest += HighOut.size();
@@ -483,7 +1226,11 @@ DepthResult DepthCompressor::Decompress(
     }
 
     // Read header
+    const bool cropped = (header->Flags & DepthFlags_Cropped) != 0;
     unsigned total_bytes = kDepthHeaderBytes + header->HighCompressedBytes + header->LowCompressedBytes;
+    if (cropped) {
+        total_bytes += kDepthCropBytes;
+    }
     if (header->HighUncompressedBytes < 2) {
         return DepthResult::Corrupted;
     }
@@ -492,69 +1239,65 @@ DepthResult DepthCompressor::Decompress(
     }
 
     src += kDepthHeaderBytes;
+
+    DepthCrop crop;
+    crop.Width = width;
+    crop.Height = height;
+    if (cropped) {
+        DepthCropHeader crop_header;
+        memcpy(&crop_header, src, kDepthCropBytes);
+        crop.X = crop_header.X;
+        crop.Y = crop_header.Y;
+        crop.Width = crop_header.Width;
+        crop.Height = crop_header.Height;
+        if (crop.Width < 1 || crop.X + crop.Width > width ||
+            crop.Height < 1 || crop.Y + crop.Height > height)
+        {
+            return DepthResult::Corrupted;
+        }
+        src += kDepthCropBytes;
+    }
+
+    // Everything below works on the cropped image
+    const int coded_width = crop.Width;
+    const int coded_height = crop.Height;
+    const int n = coded_width * coded_height;
+    if (n % 2 != 0 || header->HighUncompressedBytes != static_cast<unsigned>( n / 2 )) {
+        return DepthResult::Corrupted;
+    }
     const uint8_t* zstd_src = src;
     src += header->HighCompressedBytes;
     const uint8_t* video_src = src;
     //src += header->LowCompressedBytes;
 
-    if (!IntelDecoder || LastWidth != static_cast<unsigned>(width) || LastHeight != static_cast<unsigned>(height))
+    const bool hevc = (header->Flags & DepthFlags_HEVC) != 0;
+    if (!Decoder || LastWidth != static_cast<unsigned>(coded_width) || LastHeight != static_cast<unsigned>(coded_height) || LastHevc != hevc)
     {
+        Decoder.reset();
         if (!keyframe) {
             return DepthResult::MissingFrame;
         }
 
-        LastWidth = width;
-        LastHeight = height;
-        IntelDecoder.reset();
-#ifdef ZDEPTH_NVCUVID
-        NvidiaDecoder.reset();
-#endif
+        LastWidth = coded_width;
+        LastHeight = coded_height;
+        LastHevc = hevc;
 
-        IntelDecoder = std::make_unique<mfx::VideoDecoder>();
-        if (!IntelDecoder->Initialize(
-            false, // prefer on CPU
-            (header->Flags & DepthFlags_HEVC) != 0 ? MFX_CODEC_HEVC : MFX_CODEC_AVC,
-            video_src,
-            header->LowCompressedBytes
-        ))
-        {
-            spdlog::error("Intel decoder failed to initialize");
-            IntelDecoder.reset();
-        } else {
-            spdlog::info("Zdepth lossy encoder initialized: resolution={}x{}", width, height);
-        }
-    }
-
-    const uint8_t* decoded_low_data = nullptr;
-
-    if (!IntelDecoder) {
-#ifdef ZDEPTH_NVCUVID
-        if (!NvidiaDecoder) {
-            NvidiaDecoder = std::make_unique<nvcuvid::VideoCodec>();
-        }
+        LowPlaneParams params;
+        params.Width = coded_width;
+        params.Height = coded_height;
+        params.Hevc = hevc;
 
-        nvcuvid::VideoDecodeInput vinput{};
-        vinput.Mode = nvcuvid::DecodeMode::MonochromeOnly;
-        vinput.Type = (header->Flags & DepthFlags_HEVC) != 0 ? nvcuvid::VideoType::H265 : nvcuvid::VideoType::H264;
-        vinput.Bytes = header->LowCompressedBytes;
-        vinput.Data = video_src;
-        vinput.Width = header->Width;
-        vinput.Height = header->Height;
-
-        if (!NvidiaDecoder->Decode(vinput, Low)) {
-            spdlog::error("Nvidia decoder failed");
-            NvidiaDecoder.reset();
+        Decoder = CreateLowPlaneDecoder(Backend, params, video_src, header->LowCompressedBytes);
+        if (!Decoder) {
+            spdlog::error("Zdepth: No video decoder available: Please enable the Intel GPU in your BIOS settings, or build with ZDEPTH_FFMPEG.");
             return DepthResult::Error;
         }
-        decoded_low_data = Low.data();
-#else
-        spdlog::error("Intel GPU decoder is not available: Please enable it in your BIOS settings.");
-        return DepthResult::Error;
-#endif
+        spdlog::info("Zdepth lossy decoder initialized: resolution={}x{} backend={}",
+            coded_width, coded_height, VideoBackendString(Decoder->GetBackend()));
     }
 
     // Decompress high bits
-    bool success = ZstdDecompress(
+    bool success = Zstd.Decompress(
         zstd_src,
         header->HighCompressedBytes,
         header->HighUncompressedBytes,
@@ -563,22 +1306,32 @@ DepthResult DepthCompressor::Decompress(
         return DepthResult::Corrupted;
     }
 
-    // Finish decoding low bits
-    if (IntelDecoder) {
-        mfx::frameref_t frame = IntelDecoder->Decode(
-            video_src,
-            header->LowCompressedBytes);
-        if (!frame) {
-            spdlog::error("Failed to decode video frame");
-            IntelDecoder.reset();
-            return DepthResult::Error;
-        }
-        decoded_low_data = frame->Raw->Data.data();
+    // Decode low bits
+    const uint8_t* decoded_low_data = Decoder->Decode(
+        video_src,
+        header->LowCompressedBytes);
+    if (!decoded_low_data) {
+        spdlog::error("Failed to decode video frame");
+        Decoder.reset();
+        return DepthResult::Error;
+    }
+
+    if (!cropped) {
+        Unfilter(width, height, decoded_low_data, depth_out);
+        UndoRescaleAndDequantizeImage(header->MinimumDepth, header->MaximumDepth, depth_out);
+        return DepthResult::Success;
     }
 
-    Unfilter(width, height, decoded_low_data, depth_out);
-    UndoRescaleImage_11Bits(header->MinimumDepth, header->MaximumDepth, depth_out);
-    DequantizeDepthImage(depth_out);
+    Unfilter(coded_width, coded_height, decoded_low_data, CropDepth);
+    UndoRescaleAndDequantizeImage(header->MinimumDepth, header->MaximumDepth, CropDepth);
+
+    // Place the crop rectangle in an otherwise empty image
+    depth_out.assign(width * height, 0);
+    const uint16_t* crop_src = CropDepth.data();
+    uint16_t* dest = depth_out.data() + crop.Y * width + crop.X;
+    for (int y = 0; y < coded_height; ++y, crop_src += coded_width, dest += width) {
+        memcpy(dest, crop_src, coded_width * sizeof(uint16_t));
+    }
 
     return DepthResult::Success;
 }
@@ -0,0 +1,382 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Zdepth full-frame depth quantization
+
+    Internal header shared by the zdepth codecs with whole-image versions of
+    AzureKinectQuantizeDepth() and AzureKinectDequantizeDepth().
+
+    The quantizer is a continuous piecewise-linear function of depth, and each
+    band boundary is a multiple of the step size of the band above it, so it
+    can be written as a sum of one clamped term per band:
+
+        q = (min(d, 750)   -sat  200)
+          + (min(d, 1500)  -sat  750) >> 1
+          + (min(d, 3000)  -sat 1500) >> 2
+          + (min(d, 6000)  -sat 3000) >> 3
+          + (min(d, 11840) -sat 6000) >> 4
+
+    with d >= 11840 forced to zero.  There are no data-dependent branches so
+    this maps directly to 16-bit unsigned min and saturating subtract, and the
+    same pass collects the extrema and non-zero count for the lossy rescaler.
+
+    Dequantization has only 2041 valid inputs so it is a table lookup.
+*/
+
+#pragma once
+
+#include "zdepth_simd.hpp"
+
+#include <stdint.h>
+#include <algorithm> // std::min
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Number of entries in the dequantization table (valid inputs are 0..2040)
+static const int kDequantizeTableSize = 2048;
+
+// Depth at and beyond this is out of range and quantizes to zero
+static const unsigned kFarDepthMM = 11840;
+
+
+//------------------------------------------------------------------------------
+// Scalar
+
+// Matches AzureKinectQuantizeDepth()
+static inline unsigned QuantizeDepth(unsigned d)
+{
+    if (d >= kFarDepthMM) {
+        return 0;
+    }
+    unsigned q = 0;
+    if (d > 200) {
+        q += std::min(d, 750u) - 200;
+    }
+    if (d > 750) {
+        q += (std::min(d, 1500u) - 750) >> 1;
+    }
+    if (d > 1500) {
+        q += (std::min(d, 3000u) - 1500) >> 2;
+    }
+    if (d > 3000) {
+        q += (std::min(d, 6000u) - 3000) >> 3;
+    }
+    if (d > 6000) {
+        q += (d - 6000) >> 4;
+    }
+    return q;
+}
+
+// Matches AzureKinectDequantizeDepth()
+static inline unsigned DequantizeDepth(unsigned q)
+{
+    if (q == 0 || q >= 2040) {
+        return 0;
+    }
+    if (q < 550) {
+        return q + 200;
+    }
+    if (q < 925) {
+        return 750 + (q - 550) * 2;
+    }
+    if (q < 1300) {
+        return 1500 + (q - 925) * 4;
+    }
+    if (q < 1675) {
+        return 3000 + (q - 1300) * 8;
+    }
+    return 6000 + (q - 1675) * 16;
+}
+
+// Built once on first use
+static inline const uint16_t* GetDequantizeTable()
+{
+    static const struct Table {
+        uint16_t Depth[kDequantizeTableSize];
+        Table()
+        {
+            for (int i = 0; i < kDequantizeTableSize; ++i) {
+                Depth[i] = static_cast<uint16_t>( DequantizeDepth(i) );
+            }
+        }
+    } table;
+    return table.Depth;
+}
+
+
+//------------------------------------------------------------------------------
+// Quantization Kernels
+
+// Statistics of the non-zero quantized values in an image
+struct QuantizedStats
+{
+    unsigned Minimum = 0;
+    unsigned Maximum = 0;
+    int NonZeroCount = 0;
+};
+
+#if defined(ZDEPTH_TRY_SSE41)
+
+namespace sse41 {
+
+static inline __m128i QuantizeDepth(__m128i d)
+{
+    const __m128i t0 = _mm_subs_epu16(_mm_min_epu16(d, _mm_set1_epi16(750)), _mm_set1_epi16(200));
+    const __m128i t1 = _mm_subs_epu16(_mm_min_epu16(d, _mm_set1_epi16(1500)), _mm_set1_epi16(750));
+    const __m128i t2 = _mm_subs_epu16(_mm_min_epu16(d, _mm_set1_epi16(3000)), _mm_set1_epi16(1500));
+    const __m128i t3 = _mm_subs_epu16(_mm_min_epu16(d, _mm_set1_epi16(6000)), _mm_set1_epi16(3000));
+    const __m128i t4 = _mm_subs_epu16(d, _mm_set1_epi16(6000));
+
+    __m128i q = _mm_add_epi16(t0, _mm_srli_epi16(t1, 1));
+    q = _mm_add_epi16(q, _mm_srli_epi16(t2, 2));
+    q = _mm_add_epi16(q, _mm_srli_epi16(t3, 3));
+    q = _mm_add_epi16(q, _mm_srli_epi16(t4, 4));
+
+    // Zero if d >= 11840
+    const __m128i in_range = _mm_cmpeq_epi16(
+        _mm_subs_epu16(d, _mm_set1_epi16(static_cast<int16_t>( kFarDepthMM - 1 ))),
+        _mm_setzero_si128());
+    return _mm_and_si128(q, in_range);
+}
+
+// Returns the number of pixels processed, a multiple of 8
+static int QuantizeDepthImage(int n, const uint16_t* depth, uint16_t* quantized, QuantizedStats& stats)
+{
+    const int count = n & ~7;
+
+    __m128i smallest = _mm_set1_epi16(-1);
+    __m128i largest = _mm_setzero_si128();
+    int64_t zero_count = 0;
+
+    // Zero lanes are counted in 16 bits so flush before they can overflow
+    static const int kFlushInterval = 32767 * 8;
+
+    for (int start = 0; start < count; start += kFlushInterval)
+    {
+        const int end = std::min(count, start + kFlushInterval);
+        __m128i zeroes = _mm_setzero_si128();
+
+        for (int i = start; i < end; i += 8)
+        {
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>( depth + i ));
+            const __m128i q = QuantizeDepth(d);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>( quantized + i ), q);
+
+            const __m128i z = _mm_cmpeq_epi16(q, _mm_setzero_si128());
+            smallest = _mm_min_epu16(smallest, _mm_or_si128(q, z));
+            largest = _mm_max_epu16(largest, q);
+            zeroes = _mm_sub_epi16(zeroes, z);
+        }
+
+        const __m128i sum = _mm_madd_epi16(zeroes, _mm_set1_epi16(1));
+        zero_count += _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 1) +
+            _mm_extract_epi32(sum, 2) + _mm_extract_epi32(sum, 3);
+    }
+
+    // _mm_minpos_epu16 finds the smallest lane
+    stats.Minimum = static_cast<unsigned>( _mm_cvtsi128_si32(_mm_minpos_epu16(smallest)) & 0xffff );
+    const __m128i inverted = _mm_xor_si128(largest, _mm_set1_epi16(-1));
+    stats.Maximum = 0xffff - static_cast<unsigned>( _mm_cvtsi128_si32(_mm_minpos_epu16(inverted)) & 0xffff );
+    stats.NonZeroCount = count - static_cast<int>( zero_count );
+    return count;
+}
+
+} // namespace sse41
+
+#endif // ZDEPTH_TRY_SSE41
+
+#if defined(ZDEPTH_TRY_AVX2)
+
+namespace avx2 {
+
+static inline __m256i QuantizeDepth(__m256i d)
+{
+    const __m256i t0 = _mm256_subs_epu16(_mm256_min_epu16(d, _mm256_set1_epi16(750)), _mm256_set1_epi16(200));
+    const __m256i t1 = _mm256_subs_epu16(_mm256_min_epu16(d, _mm256_set1_epi16(1500)), _mm256_set1_epi16(750));
+    const __m256i t2 = _mm256_subs_epu16(_mm256_min_epu16(d, _mm256_set1_epi16(3000)), _mm256_set1_epi16(1500));
+    const __m256i t3 = _mm256_subs_epu16(_mm256_min_epu16(d, _mm256_set1_epi16(6000)), _mm256_set1_epi16(3000));
+    const __m256i t4 = _mm256_subs_epu16(d, _mm256_set1_epi16(6000));
+
+    __m256i q = _mm256_add_epi16(t0, _mm256_srli_epi16(t1, 1));
+    q = _mm256_add_epi16(q, _mm256_srli_epi16(t2, 2));
+    q = _mm256_add_epi16(q, _mm256_srli_epi16(t3, 3));
+    q = _mm256_add_epi16(q, _mm256_srli_epi16(t4, 4));
+
+    // Zero if d >= 11840
+    const __m256i in_range = _mm256_cmpeq_epi16(
+        _mm256_subs_epu16(d, _mm256_set1_epi16(static_cast<int16_t>( kFarDepthMM - 1 ))),
+        _mm256_setzero_si256());
+    return _mm256_and_si256(q, in_range);
+}
+
+// Returns the number of pixels processed, a multiple of 16
+static int QuantizeDepthImage(int n, const uint16_t* depth, uint16_t* quantized, QuantizedStats& stats)
+{
+    const int count = n & ~15;
+
+    __m256i smallest = _mm256_set1_epi16(-1);
+    __m256i largest = _mm256_setzero_si256();
+    int64_t zero_count = 0;
+
+    // Zero lanes are counted in 16 bits so flush before they can overflow
+    static const int kFlushInterval = 32767 * 16;
+
+    for (int start = 0; start < count; start += kFlushInterval)
+    {
+        const int end = std::min(count, start + kFlushInterval);
+        __m256i zeroes = _mm256_setzero_si256();
+
+        for (int i = start; i < end; i += 16)
+        {
+            const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>( depth + i ));
+            const __m256i q = QuantizeDepth(d);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>( quantized + i ), q);
+
+            const __m256i z = _mm256_cmpeq_epi16(q, _mm256_setzero_si256());
+            smallest = _mm256_min_epu16(smallest, _mm256_or_si256(q, z));
+            largest = _mm256_max_epu16(largest, q);
+            zeroes = _mm256_sub_epi16(zeroes, z);
+        }
+
+        __m256i sum = _mm256_madd_epi16(zeroes, _mm256_set1_epi16(1));
+        const __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        zero_count += _mm_cvtsi128_si32(sum128) + _mm_extract_epi32(sum128, 1) +
+            _mm_extract_epi32(sum128, 2) + _mm_extract_epi32(sum128, 3);
+    }
+
+    const __m128i smallest128 = _mm_min_epu16(_mm256_castsi256_si128(smallest), _mm256_extracti128_si256(smallest, 1));
+    const __m128i largest128 = _mm_max_epu16(_mm256_castsi256_si128(largest), _mm256_extracti128_si256(largest, 1));
+    stats.Minimum = static_cast<unsigned>( _mm_cvtsi128_si32(_mm_minpos_epu16(smallest128)) & 0xffff );
+    const __m128i inverted = _mm_xor_si128(largest128, _mm_set1_epi16(-1));
+    stats.Maximum = 0xffff - static_cast<unsigned>( _mm_cvtsi128_si32(_mm_minpos_epu16(inverted)) & 0xffff );
+    stats.NonZeroCount = count - static_cast<int>( zero_count );
+    return count;
+}
+
+} // namespace avx2
+
+#endif // ZDEPTH_TRY_AVX2
+
+#if defined(ZDEPTH_TRY_NEON)
+
+namespace neon {
+
+static inline uint16x8_t QuantizeDepth(uint16x8_t d)
+{
+    const uint16x8_t t0 = vqsubq_u16(vminq_u16(d, vdupq_n_u16(750)), vdupq_n_u16(200));
+    const uint16x8_t t1 = vqsubq_u16(vminq_u16(d, vdupq_n_u16(1500)), vdupq_n_u16(750));
+    const uint16x8_t t2 = vqsubq_u16(vminq_u16(d, vdupq_n_u16(3000)), vdupq_n_u16(1500));
+    const uint16x8_t t3 = vqsubq_u16(vminq_u16(d, vdupq_n_u16(6000)), vdupq_n_u16(3000));
+    const uint16x8_t t4 = vqsubq_u16(d, vdupq_n_u16(6000));
+
+    uint16x8_t q = vsraq_n_u16(t0, t1, 1);
+    q = vsraq_n_u16(q, t2, 2);
+    q = vsraq_n_u16(q, t3, 3);
+    q = vsraq_n_u16(q, t4, 4);
+
+    // Zero if d >= 11840
+    return vandq_u16(q, vcltq_u16(d, vdupq_n_u16(kFarDepthMM)));
+}
+
+// Returns the number of pixels processed, a multiple of 8
+static int QuantizeDepthImage(int n, const uint16_t* depth, uint16_t* quantized, QuantizedStats& stats)
+{
+    const int count = n & ~7;
+
+    uint16x8_t smallest = vdupq_n_u16(0xffff);
+    uint16x8_t largest = vdupq_n_u16(0);
+    uint32x4_t nonzero = vdupq_n_u32(0);
+
+    for (int i = 0; i < count; i += 8)
+    {
+        const uint16x8_t q = QuantizeDepth(vld1q_u16(depth + i));
+        vst1q_u16(quantized + i, q);
+
+        const uint16x8_t z = vceqq_u16(q, vdupq_n_u16(0));
+        smallest = vminq_u16(smallest, vorrq_u16(q, z));
+        largest = vmaxq_u16(largest, q);
+        nonzero = vpadalq_u16(nonzero, vshrq_n_u16(vmvnq_u16(z), 15));
+    }
+
+    stats.Minimum = vminvq_u16(smallest);
+    stats.Maximum = vmaxvq_u16(largest);
+    stats.NonZeroCount = static_cast<int>( vaddvq_u32(nonzero) );
+    return count;
+}
+
+} // namespace neon
+
+#endif // ZDEPTH_TRY_NEON
+
+// Quantize a whole image and collect statistics of the result.
+// Set simd to false to use the scalar version
+static inline void QuantizeDepthImage(
+    bool simd,
+    int n,
+    const uint16_t* depth,
+    uint16_t* quantized,
+    QuantizedStats& stats)
+{
+    stats = QuantizedStats();
+    int i = 0;
+
+    if (simd) {
+        const CpuFeatures& cpu = GetCpuFeatures();
+        (void)cpu;
+#if defined(ZDEPTH_TRY_AVX2)
+        if (i == 0 && cpu.AVX2) {
+            i = avx2::QuantizeDepthImage(n, depth, quantized, stats);
+        }
+#endif
+#if defined(ZDEPTH_TRY_SSE41)
+        if (i == 0 && cpu.SSE41) {
+            i = sse41::QuantizeDepthImage(n, depth, quantized, stats);
+        }
+#endif
+#if defined(ZDEPTH_TRY_NEON)
+        if (i == 0 && cpu.Neon) {
+            i = neon::QuantizeDepthImage(n, depth, quantized, stats);
+        }
+#endif
+        // The SIMD minimum is 0xffff when every pixel was zero
+        if (stats.NonZeroCount == 0) {
+            stats.Minimum = 0;
+        }
+    }
+
+    for (; i < n; ++i)
+    {
+        const unsigned q = QuantizeDepth(depth[i]);
+        quantized[i] = static_cast<uint16_t>( q );
+        if (q == 0) {
+            continue;
+        }
+        if (stats.NonZeroCount == 0 || stats.Minimum > q) {
+            stats.Minimum = q;
+        }
+        if (stats.Maximum < q) {
+            stats.Maximum = q;
+        }
+        ++stats.NonZeroCount;
+    }
+}
+
+// Dequantize a whole image.  Quantized and depth may be the same buffer
+static inline void DequantizeDepthImage(
+    int n,
+    const uint16_t* quantized,
+    uint16_t* depth)
+{
+    const uint16_t* table = GetDequantizeTable();
+    for (int i = 0; i < n; ++i) {
+        const unsigned q = quantized[i];
+        depth[i] = q < kDequantizeTableSize ? table[q] : 0;
+    }
+}
+
+
+} // namespace zdepth
@@ -0,0 +1,105 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Zdepth SIMD support
+
+    Internal header shared by the zdepth codecs that selects which vector
+    instruction sets are compiled in and checks at runtime which ones the
+    CPU actually supports.
+
+    Feature checks follow gf256.cpp in the tonk library, which in turn
+    borrows from libsodium runtime.c.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+    #include <intrin.h> // __cpuid
+#endif
+
+#if defined(__AVX2__) || (defined(_MSC_VER) && _MSC_VER >= 1900 && (defined(_M_X64) || defined(_M_IX86)))
+    #define ZDEPTH_TRY_AVX2 /* 256-bit */
+    #include <immintrin.h>
+#endif
+
+#if defined(__SSE4_1__) || defined(ZDEPTH_TRY_AVX2) || (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)))
+    #define ZDEPTH_TRY_SSE41 /* 128-bit */
+    #include <smmintrin.h> // SSE4.1: _mm_blendv_epi8
+    #include <tmmintrin.h> // SSSE3: _mm_shuffle_epi8
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+    #define ZDEPTH_TRY_NEON /* 128-bit */
+    #include <arm_neon.h>
+#endif
+
+namespace zdepth {
+
+
+//------------------------------------------------------------------------------
+// Runtime CPU Architecture Check
+
+struct CpuFeatures
+{
+    bool SSE41 = false;
+    bool AVX2 = false;
+    bool Neon = false;
+};
+
+#if defined(ZDEPTH_TRY_SSE41)
+
+static inline void ZdepthCpuId(unsigned cpu_info[4], unsigned cpu_info_type)
+{
+#if defined(_MSC_VER)
+    __cpuidex((int*)cpu_info, cpu_info_type, 0);
+#elif defined(__x86_64__)
+    __asm__ __volatile__ ("xchgq %%rbx, %q1; cpuid; xchgq %%rbx, %q1" :
+                          "=a" (cpu_info[0]), "=&r" (cpu_info[1]),
+                          "=c" (cpu_info[2]), "=d" (cpu_info[3]) :
+                          "0" (cpu_info_type), "2" (0U));
+#else
+    __asm__ __volatile__ ("xchgl %%ebx, %k1; cpuid; xchgl %%ebx, %k1" :
+                          "=a" (cpu_info[0]), "=&r" (cpu_info[1]),
+                          "=c" (cpu_info[2]), "=d" (cpu_info[3]) :
+                          "0" (cpu_info_type), "2" (0U));
+#endif
+}
+
+#endif // ZDEPTH_TRY_SSE41
+
+// Checked once on first use
+static inline const CpuFeatures& GetCpuFeatures()
+{
+    static const CpuFeatures features = []() {
+        CpuFeatures f;
+#if defined(ZDEPTH_TRY_SSE41)
+        unsigned cpu_info[4] = { 0, 0, 0, 0 };
+        ZdepthCpuId(cpu_info, 0);
+        const unsigned max_leaf = cpu_info[0];
+
+        ZdepthCpuId(cpu_info, 1);
+        f.SSE41 = (cpu_info[2] & (1u << 19)) != 0;
+
+    #if defined(ZDEPTH_TRY_AVX2)
+        // AVX2 also requires the OS to save the YMM registers (OSXSAVE + AVX)
+        const bool os_avx = (cpu_info[2] & (1u << 27)) != 0 && (cpu_info[2] & (1u << 28)) != 0;
+        if (os_avx && max_leaf >= 7) {
+            ZdepthCpuId(cpu_info, 7);
+            f.AVX2 = f.SSE41 && (cpu_info[1] & (1u << 5)) != 0;
+        }
+    #else
+        (void)max_leaf;
+    #endif
+#endif // ZDEPTH_TRY_SSE41
+#if defined(ZDEPTH_TRY_NEON)
+        f.Neon = true; // Always available on AArch64
+#endif
+        return f;
+    }();
+    return features;
+}
+
+
+} // namespace zdepth
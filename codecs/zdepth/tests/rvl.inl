@@ -0,0 +1,117 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    RVL reference codec shared by the zdepth tests and benchmarks.
+    Included directly into each application like test_vectors.inl.
+*/
+
+// RVL library for performance baseline
+
+// Paper: https://www.microsoft.com/en-us/research/publication/fast-lossless-depth-image-compression/
+// Video presentation: https://www.youtube.com/watch?v=WYU2upBs2hA
+
+// RVL author suggests that H.264 is a bad idea to use.
+// But it seems like some masking can be used to avoid messing up the edges...
+
+// Effective Compression of Range Data Streams for Remote Robot Operations using H.264
+// http://www2.informatik.uni-freiburg.de/~stachnis/pdf/nenci14iros.pdf
+
+// Adapting Standard Video Codecs for Depth Streaming
+// http://reality.cs.ucl.ac.uk/projects/depth-streaming/depth-streaming.pdf
+
+inline void EncodeVLE(int* &pBuffer, int& word, int& nibblesWritten, int value)
+{
+    do
+    {
+        int nibble = value & 0x7; // lower 3 bits
+        if (value >>= 3) {
+            nibble |= 0x8; // more to come
+        }
+        word <<= 4;
+        word |= nibble;
+        if (++nibblesWritten == 8) // output word
+        {
+            *pBuffer++ = word;
+            nibblesWritten = 0;
+            word = 0;
+        }
+    } while (value);
+}
+
+inline int DecodeVLE(int* &pBuffer, int& word, int& nibblesWritten)
+{
+    unsigned int nibble;
+    int value = 0, bits = 29;
+    do
+    {
+        if (!nibblesWritten)
+        {
+            word = *pBuffer++; // load word
+            nibblesWritten = 8;
+        }
+        nibble = word & 0xf0000000;
+        value |= (nibble << 1) >> bits;
+        word <<= 4;
+        nibblesWritten--;
+        bits -= 3;
+    } while (nibble & 0x80000000);
+    return value;
+}
+
+int CompressRVL(short* input, char* output, int numPixels)
+{
+    int word, nibblesWritten;
+    int *pBuffer;
+    int *buffer = pBuffer = (int*)output;
+    nibblesWritten = 0;
+    short *end = input + numPixels;
+    short previous = 0;
+    while (input != end)
+    {
+        int zeros = 0, nonzeros = 0;
+        for (; (input != end) && !*input; input++, zeros++);
+        EncodeVLE(pBuffer, word, nibblesWritten, zeros); // number of zeros
+        for (short* p = input; (p != end) && *p++; nonzeros++);
+        EncodeVLE(pBuffer, word, nibblesWritten, nonzeros); // number of nonzeros
+        for (int i = 0; i < nonzeros; i++)
+        {
+            short current = *input++;
+            int delta = current - previous;
+            int positive = (delta << 1) ^ (delta >> 31);
+            EncodeVLE(pBuffer, word, nibblesWritten, positive); // nonzero value
+            previous = current;
+        }
+    }
+    if (nibblesWritten) // last few values
+    {
+        *pBuffer++ = word << 4 * (8 - nibblesWritten);
+    }
+    return int((char*)pBuffer - (char*)buffer); // num bytes
+}
+
+void DecompressRVL(char* input, short* output, int numPixels)
+{
+    int word, nibblesWritten;
+    int *pBuffer = pBuffer = (int*)input;
+    nibblesWritten = 0;
+    short current, previous = 0;
+    int numPixelsToDecode = numPixels;
+    while (numPixelsToDecode)
+    {
+        int zeros = DecodeVLE(pBuffer, word, nibblesWritten); // number of zeros
+        numPixelsToDecode -= zeros;
+        for (; zeros; zeros--) {
+            *output++ = 0;
+        }
+        int nonzeros = DecodeVLE(pBuffer, word, nibblesWritten); // number of nonzeros
+        numPixelsToDecode -= nonzeros;
+        for (; nonzeros; nonzeros--)
+        {
+            int positive = DecodeVLE(pBuffer, word, nibblesWritten); // nonzero value
+            int delta = (positive >> 1) ^ -(positive & 1);
+            current = (short)(previous + delta);
+            *output++ = current;
+            previous = current;
+        }
+    }
+}
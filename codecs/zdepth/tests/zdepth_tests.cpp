@@ -11,116 +11,7 @@ using namespace core;
 //------------------------------------------------------------------------------
 // RVL
 
-// RVL library for performance baseline
-
-// Paper: https://www.microsoft.com/en-us/research/publication/fast-lossless-depth-image-compression/
-// Video presentation: https://www.youtube.com/watch?v=WYU2upBs2hA
-
-// RVL author suggests that H.264 is a bad idea to use.
-// But it seems like some masking can be used to avoid messing up the edges...
-
-// Effective Compression of Range Data Streams for Remote Robot Operations using H.264
-// http://www2.informatik.uni-freiburg.de/~stachnis/pdf/nenci14iros.pdf
-
-// Adapting Standard Video Codecs for Depth Streaming
-// http://reality.cs.ucl.ac.uk/projects/depth-streaming/depth-streaming.pdf
-
-inline void EncodeVLE(int* &pBuffer, int& word, int& nibblesWritten, int value)
-{
-    do
-    {
-        int nibble = value & 0x7; // lower 3 bits
-        if (value >>= 3) {
-            nibble |= 0x8; // more to come
-        }
-        word <<= 4;
-        word |= nibble;
-        if (++nibblesWritten == 8) // output word
-        {
-            *pBuffer++ = word;
-            nibblesWritten = 0;
-            word = 0;
-        }
-    } while (value);
-}
-
-inline int DecodeVLE(int* &pBuffer, int& word, int& nibblesWritten)
-{
-    unsigned int nibble;
-    int value = 0, bits = 29;
-    do
-    {
-        if (!nibblesWritten)
-        {
-            word = *pBuffer++; // load word
-            nibblesWritten = 8;
-        }
-        nibble = word & 0xf0000000;
-        value |= (nibble << 1) >> bits;
-        word <<= 4;
-        nibblesWritten--;
-        bits -= 3;
-    } while (nibble & 0x80000000);
-    return value;
-}
-
-int CompressRVL(short* input, char* output, int numPixels)
-{
-    int word, nibblesWritten;
-    int *pBuffer;
-    int *buffer = pBuffer = (int*)output;
-    nibblesWritten = 0;
-    short *end = input + numPixels;
-    short previous = 0;
-    while (input != end)
-    {
-        int zeros = 0, nonzeros = 0;
-        for (; (input != end) && !*input; input++, zeros++);
-        EncodeVLE(pBuffer, word, nibblesWritten, zeros); // number of zeros
-        for (short* p = input; (p != end) && *p++; nonzeros++);
-        EncodeVLE(pBuffer, word, nibblesWritten, nonzeros); // number of nonzeros
-        for (int i = 0; i < nonzeros; i++)
-        {
-            short current = *input++;
-            int delta = current - previous;
-            int positive = (delta << 1) ^ (delta >> 31);
-            EncodeVLE(pBuffer, word, nibblesWritten, positive); // nonzero value
-            previous = current;
-        }
-    }
-    if (nibblesWritten) // last few values
-    {
-        *pBuffer++ = word << 4 * (8 - nibblesWritten);
-    }
-    return int((char*)pBuffer - (char*)buffer); // num bytes
-}
-
-void DecompressRVL(char* input, short* output, int numPixels)
-{
-    int word, nibblesWritten;
-    int *pBuffer = pBuffer = (int*)input;
-    nibblesWritten = 0;
-    short current, previous = 0;
-    int numPixelsToDecode = numPixels;
-    while (numPixelsToDecode)
-    {
-        int zeros = DecodeVLE(pBuffer, word, nibblesWritten); // number of zeros
-        numPixelsToDecode -= zeros;
-        for (; zeros; zeros--) {
-            *output++ = 0;
-        }
-        int nonzeros = DecodeVLE(pBuffer, word, nibblesWritten); // number of nonzeros
-        numPixelsToDecode -= nonzeros;
-        for (; nonzeros; nonzeros--)
-        {
-            int positive = DecodeVLE(pBuffer, word, nibblesWritten); // nonzero value
-            int delta = (positive >> 1) ^ -(positive & 1);
-            current = (short)(previous + delta);
-            *output++ = current;
-            previous = current;
-        }
-    }
-}
+#include "rvl.inl"
 
 
 //------------------------------------------------------------------------------
@@ -133,9 +24,14 @@ void DecompressRVL(char* input, short* output, int numPixels)
 // Test Application
 
 #include <iostream>
+#include <thread>
+#include <cmath>
+#include <string.h> // memcmp
 using namespace std;
 
 static lossless::DepthCompressor compressor0, decompressor0;
+static lossless::DepthCompressor scalar_compressor0, scalar_decompressor0;
+static lossless::DepthCompressor tiled_compressor0, tiled_decompressor0;
 static lossy::DepthCompressor compressor1, decompressor1;
 static lossy::DepthCompressor compressor2, decompressor2;
 
@@ -320,12 +216,70 @@ bool TestFrame(const uint16_t* frame, bool keyframe)
             return false;
         }
 
+        // The SIMD kernels must produce exactly the same output as scalar code
+        std::vector<uint16_t> scalar_depth;
+        std::vector<uint8_t> scalar_compressed;
+
+        lossless::SetSimdEnabled(false);
+        scalar_compressor0.Compress(Width, Height, frame, scalar_compressed, keyframe);
+        result = scalar_decompressor0.Decompress(compressed, width, height, scalar_depth);
+        lossless::SetSimdEnabled(true);
+
+        if (scalar_compressed != compressed) {
+            cout << "Lossless SIMD compression does not match scalar version" << endl;
+            return false;
+        }
+        if (result != lossless::DepthResult::Success || scalar_depth != depth) {
+            cout << "Lossless SIMD decompression does not match scalar version" << endl;
+            return false;
+        }
+
+        // Tiled images must decode to the same depth as untiled images.
+        // This also exercises the caller-provided buffer API.
+        std::vector<uint8_t> tiled_compressed(tiled_compressor0.MaxCompressedBytes(Width, Height));
+        tiled_compressed.resize(tiled_compressor0.CompressInto(
+            Width,
+            Height,
+            frame,
+            tiled_compressed.data(),
+            tiled_compressed.size(),
+            keyframe));
+
+        // Decode into a buffer with padding at the end of each row
+        const int tiled_stride = Width + 8;
+        std::vector<uint16_t> tiled_depth(tiled_stride * Height);
+
+        const uint64_t t4 = GetTimeUsec();
+
+        result = tiled_decompressor0.DecompressInto(
+            tiled_compressed.data(),
+            tiled_compressed.size(),
+            width,
+            height,
+            tiled_depth.data(),
+            tiled_stride,
+            Height);
+
+        const uint64_t t5 = GetTimeUsec();
+
+        if (result != lossless::DepthResult::Success) {
+            cout << "Failed: Lossless tiled DecompressInto returned " << lossless::DepthResultString(result) << endl;
+            return false;
+        }
+        for (int y = 0; y < Height; ++y) {
+            if (memcmp(tiled_depth.data() + y * tiled_stride, depth.data() + y * Width, Width * 2) != 0) {
+                cout << "Lossless tiled decompression does not match untiled version" << endl;
+                return false;
+            }
+        }
+
         const unsigned original_bytes = Width * Height * 2;
         cout << endl;
         cout << "Lossless Zdepth Compression: " << original_bytes << " bytes -> " << compressed.size() << 
             " bytes (ratio = " << original_bytes / (float)compressed.size() << ":1) ("
             << (compressed.size() * 30 * 8) / 1000000.f << " Mbps @ 30 FPS)" << endl;
         cout << "Lossless Zdepth Speed: Compressed in " << (t1 - t0) / 1000.f << " msec. Decompressed in " << (t2 - t1) / 1000.f << " msec" << endl;
+        cout << "Lossless Zdepth Tiled: " << tiled_compressed.size() << " bytes. Decompressed in " << (t5 - t4) / 1000.f << " msec" << endl;
     }
 
     // RVL
@@ -380,6 +334,522 @@ bool TestFrame(const uint16_t* frame, bool keyframe)
     return true;
 }
 
+bool TestDictionary(const uint16_t* frame0, const uint16_t* frame1)
+{
+    lossless::DepthDictionaryTrainer trainer;
+    trainer.AddFrame(0, Width, Height, frame0, true);
+
+    auto dictionary = std::make_shared<lossless::DepthDictionary>();
+    if (!trainer.Train(1, 32 * 1024, *dictionary)) {
+        cout << "Failed: Dictionary training" << endl;
+        return false;
+    }
+
+    // Decoder loads the dictionary from file data
+    std::vector<uint8_t> dictionary_file;
+    dictionary->Save(dictionary_file);
+    auto loaded = std::make_shared<lossless::DepthDictionary>();
+    if (!loaded->Load(dictionary_file.data(), dictionary_file.size())) {
+        cout << "Failed: Dictionary load" << endl;
+        return false;
+    }
+
+    lossless::DepthCompressor compressor, decompressor, plain_compressor;
+    compressor.SetDictionary(dictionary);
+    decompressor.AddDictionary(loaded);
+
+    const uint16_t* frames[2] = { frame0, frame1 };
+    for (int i = 0; i < 2; ++i)
+    {
+        std::vector<uint8_t> compressed, plain_compressed;
+        compressor.Compress(Width, Height, frames[i], compressed, i == 0);
+        plain_compressor.Compress(Width, Height, frames[i], plain_compressed, i == 0);
+
+        int width, height;
+        std::vector<uint16_t> depth;
+        lossless::DepthResult result = decompressor.Decompress(compressed, width, height, depth);
+        if (result != lossless::DepthResult::Success) {
+            cout << "Failed: Dictionary decompress returned " << lossless::DepthResultString(result) << endl;
+            return false;
+        }
+        if (!CompareFrames(depth.size(), depth.data(), frames[i])) {
+            cout << "Dictionary decompression result corrupted" << endl;
+            return false;
+        }
+
+        // Only the I-frame uses the dictionary
+        const bool has_dictionary = (compressed[1] & lossless::DepthFlags_Dictionary) != 0;
+        if (has_dictionary != (i == 0)) {
+            cout << "Failed: Dictionary flag set on the wrong frame" << endl;
+            return false;
+        }
+        if (i != 0 && compressed != plain_compressed) {
+            cout << "Failed: P-frame changed by the dictionary" << endl;
+            return false;
+        }
+
+        cout << "Lossless Zdepth Dictionary: Frame " << i << " " << plain_compressed.size() << " bytes -> " << compressed.size() << " bytes" << endl;
+    }
+
+    return true;
+}
+
+bool TestMotion(const uint16_t* frame0, const uint16_t* frame1)
+{
+    // Frame 0 again can reference the frame before last, and the shifted
+    // copy of frame 0 needs motion vectors
+    std::vector<uint16_t> shifted(Width * Height);
+    for (int y = 0; y < Height; ++y) {
+        for (int x = 0; x < Width; ++x) {
+            const int sx = x - 3, sy = y + 2;
+            const bool inside = sx >= 0 && sx < Width && sy >= 0 && sy < Height;
+            shifted[x + y * Width] = inside ? frame0[sx + sy * Width] : 0;
+        }
+    }
+
+    lossless::DepthCompressor compressor, decompressor, plain_compressor;
+    lossless::DepthCompressor scalar_compressor;
+    compressor.SetMotionSearch(2, 8, 16);
+    scalar_compressor.SetMotionSearch(2, 8, 16);
+
+    const uint16_t* frames[4] = { frame0, frame1, frame0, shifted.data() };
+    for (int i = 0; i < 4; ++i)
+    {
+        std::vector<uint8_t> compressed, plain_compressed, scalar_compressed;
+
+        const uint64_t t0 = GetTimeUsec();
+        compressor.Compress(Width, Height, frames[i], compressed, i == 0);
+        const uint64_t t1 = GetTimeUsec();
+
+        plain_compressor.Compress(Width, Height, frames[i], plain_compressed, i == 0);
+
+        lossless::SetSimdEnabled(false);
+        scalar_compressor.Compress(Width, Height, frames[i], scalar_compressed, i == 0);
+        lossless::SetSimdEnabled(true);
+
+        if (scalar_compressed != compressed) {
+            cout << "Lossless SIMD motion search does not match scalar version" << endl;
+            return false;
+        }
+
+        int width, height;
+        std::vector<uint16_t> depth;
+        lossless::DepthResult result = decompressor.Decompress(compressed, width, height, depth);
+        if (result != lossless::DepthResult::Success) {
+            cout << "Failed: Motion decompress returned " << lossless::DepthResultString(result) << endl;
+            return false;
+        }
+        for (int j = 0; j < Width * Height; ++j) {
+            if (lossless::AzureKinectQuantizeDepth(depth[j]) != lossless::AzureKinectQuantizeDepth(frames[i][j])) {
+                cout << "Motion decompression result corrupted" << endl;
+                return false;
+            }
+        }
+
+        cout << "Lossless Zdepth Motion: Frame " << i << " " << plain_compressed.size() << " bytes -> "
+            << compressed.size() << " bytes. Compressed in " << (t1 - t0) / 1000.f << " msec" << endl;
+    }
+
+    return true;
+}
+
+bool TestNearLossless(const uint16_t* frame0, const uint16_t* frame1)
+{
+    // Two quantized units of error in each range band
+    int max_error_mm[lossless::kDepthRangeBands];
+    for (int i = 0; i < lossless::kDepthRangeBands; ++i) {
+        max_error_mm[i] = 2 * lossless::kDepthBandUnitMM[i];
+    }
+
+    lossless::DepthCompressor compressor, decompressor, plain_compressor;
+    compressor.SetMaxError(max_error_mm);
+    compressor.SetMotionSearch(2, 4, 12);
+
+    const uint16_t* frames[4] = { frame0, frame1, frame0, frame1 };
+    for (int i = 0; i < 4; ++i)
+    {
+        std::vector<uint8_t> compressed, plain_compressed;
+
+        const uint64_t t0 = GetTimeUsec();
+        compressor.Compress(Width, Height, frames[i], compressed, i == 0);
+        const uint64_t t1 = GetTimeUsec();
+
+        plain_compressor.Compress(Width, Height, frames[i], plain_compressed, i == 0);
+
+        int width, height;
+        std::vector<uint16_t> depth;
+        lossless::DepthResult result = decompressor.Decompress(compressed, width, height, depth);
+        if (result != lossless::DepthResult::Success) {
+            cout << "Failed: Near-lossless decompress returned " << lossless::DepthResultString(result) << endl;
+            return false;
+        }
+
+        // Error is measured against the lossless quantized depth
+        for (int j = 0; j < Width * Height; ++j) {
+            const uint16_t quantized = lossless::AzureKinectQuantizeDepth(frames[i][j]);
+            if ((quantized == 0) != (depth[j] == 0)) {
+                cout << "Near-lossless decompression changed the zeroes" << endl;
+                return false;
+            }
+            if (quantized == 0) {
+                continue;
+            }
+            const int band = lossless::GetDepthRangeBand(quantized);
+            const int error = std::abs(static_cast<int>( lossless::AzureKinectDequantizeDepth(quantized) ) - depth[j]);
+            if (error > max_error_mm[band]) {
+                cout << "Near-lossless error " << error << " mm exceeds the bound for band " << band << endl;
+                return false;
+            }
+        }
+
+        cout << "Near-Lossless Zdepth: Frame " << i << " " << plain_compressed.size() << " bytes -> "
+            << compressed.size() << " bytes. Compressed in " << (t1 - t0) / 1000.f << " msec" << endl;
+    }
+
+    // Rate controller reduces the error when the target is easy to meet
+    lossless::DepthCompressor rate_compressor;
+    rate_compressor.SetMaxError(max_error_mm);
+    rate_compressor.SetTargetBitrate(100 * 1000 * 1000, 30);
+    for (int i = 0; i < 20; ++i) {
+        std::vector<uint8_t> compressed;
+        rate_compressor.Compress(Width, Height, frames[i % 2], compressed, i == 0);
+    }
+    if (rate_compressor.GetNearLosslessLevel() != 0) {
+        cout << "Near-lossless rate controller did not reduce the error for a high target bitrate" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool TestCrop(const uint16_t* frame0, const uint16_t* frame1)
+{
+    // Odd crop is expanded to 8x8 block boundaries by the encoder
+    lossless::DepthCrop crop;
+    crop.X = 101;
+    crop.Y = 67;
+    crop.Width = 250;
+    crop.Height = 190;
+
+    lossless::DepthCompressor compressor, decompressor, plain_compressor;
+    compressor.SetCrop(&crop);
+    compressor.SetMotionSearch(2, 4, 12);
+
+    const int x0 = crop.X / 8 * 8, x1 = (crop.X + crop.Width + 7) / 8 * 8;
+    const int y0 = crop.Y / 8 * 8, y1 = (crop.Y + crop.Height + 7) / 8 * 8;
+
+    const uint16_t* frames[4] = { frame0, frame1, frame0, frame1 };
+    for (int i = 0; i < 4; ++i)
+    {
+        // Moving the crop must force a keyframe
+        if (i == 3) {
+            crop.X += 16;
+            compressor.SetCrop(&crop);
+        }
+
+        std::vector<uint8_t> compressed, plain_compressed;
+
+        const uint64_t t0 = GetTimeUsec();
+        compressor.Compress(Width, Height, frames[i], compressed, i == 0);
+        const uint64_t t1 = GetTimeUsec();
+
+        plain_compressor.Compress(Width, Height, frames[i], plain_compressed, i == 0);
+
+        const bool keyframe = (compressed[1] & lossless::DepthFlags_Keyframe) != 0;
+        if (keyframe != (i == 0 || i == 3)) {
+            cout << "Crop keyframe flag is wrong for frame " << i << endl;
+            return false;
+        }
+        if (compressed.size() >= plain_compressed.size()) {
+            cout << "Cropped frame is not smaller than the full frame" << endl;
+            return false;
+        }
+
+        int width, height;
+        std::vector<uint16_t> depth;
+        lossless::DepthResult result = decompressor.Decompress(compressed, width, height, depth);
+        if (result != lossless::DepthResult::Success || width != Width || height != Height) {
+            cout << "Failed: Crop decompress returned " << lossless::DepthResultString(result) << endl;
+            return false;
+        }
+
+        const int shift = (i == 3) ? 16 : 0;
+        for (int y = 0; y < Height; ++y) {
+            for (int x = 0; x < Width; ++x) {
+                const int j = x + y * Width;
+                const bool inside = x >= x0 + shift && x < x1 + shift && y >= y0 && y < y1;
+                const uint16_t expected = inside ? lossless::AzureKinectQuantizeDepth(frames[i][j]) : 0;
+                if (lossless::AzureKinectQuantizeDepth(depth[j]) != expected) {
+                    cout << "Crop decompression result corrupted at " << x << ", " << y << endl;
+                    return false;
+                }
+            }
+        }
+
+        cout << "Cropped Zdepth: Frame " << i << " " << plain_compressed.size() << " bytes -> "
+            << compressed.size() << " bytes. Compressed in " << (t1 - t0) / 1000.f << " msec" << endl;
+    }
+
+    return true;
+}
+
+// Megapixels per second for a number of passes over an image
+static float MegapixelsPerSecond(int n, int passes, uint64_t usec)
+{
+    if (usec == 0) {
+        usec = 1;
+    }
+    return n * (float)passes / usec;
+}
+
+bool TestQuantization(const uint16_t* frame)
+{
+    const int n = Width * Height;
+
+    // Every possible input must match the scalar functions
+    std::vector<uint16_t> all_values(65536);
+    for (int i = 0; i < 65536; ++i) {
+        all_values[i] = static_cast<uint16_t>( i );
+    }
+    std::vector<uint16_t> quantized, depth;
+    lossless::QuantizeDepthImage(256, 256, all_values.data(), quantized);
+    lossless::DequantizeDepthImage(256, 256, all_values.data(), depth);
+    for (int i = 0; i < 65536; ++i) {
+        if (quantized[i] != lossless::AzureKinectQuantizeDepth(all_values[i]) ||
+            depth[i] != lossless::AzureKinectDequantizeDepth(all_values[i]))
+        {
+            cout << "Quantization mismatch for value " << i << endl;
+            return false;
+        }
+    }
+
+    // Fused lossy rescaling must match the separate steps
+    std::vector<uint16_t> expected(n), rescaled;
+    for (int i = 0; i < n; ++i) {
+        expected[i] = lossy::AzureKinectQuantizeDepth(frame[i]);
+    }
+    uint16_t expected_min, expected_max, min_value, max_value;
+    lossy::RescaleImage_11Bits(expected, expected_min, expected_max);
+    lossy::QuantizeAndRescaleImage_11Bits(n, frame, rescaled, min_value, max_value);
+    if (rescaled != expected || min_value != expected_min || max_value != expected_max) {
+        cout << "Lossy QuantizeAndRescaleImage_11Bits mismatch" << endl;
+        return false;
+    }
+
+    // Every value Unfilter() can produce must match for the inverse
+    std::vector<uint16_t> unfiltered(4096);
+    for (int i = 0; i < 4096; ++i) {
+        unfiltered[i] = static_cast<uint16_t>( i );
+    }
+    expected = unfiltered;
+    lossy::UndoRescaleImage_11Bits(min_value, max_value, expected);
+    for (auto& x : expected) {
+        x = lossy::AzureKinectDequantizeDepth(x);
+    }
+    lossy::UndoRescaleAndDequantizeImage(min_value, max_value, unfiltered);
+    if (unfiltered != expected) {
+        cout << "Lossy UndoRescaleAndDequantizeImage mismatch" << endl;
+        return false;
+    }
+
+    // Benchmark the original per-pixel code against the new kernels
+    const int kPasses = 200;
+    std::vector<uint16_t> temp(n);
+
+    uint64_t t0 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            temp[i] = lossless::AzureKinectQuantizeDepth(frame[i]);
+        }
+    }
+    uint64_t t1 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        lossless::QuantizeDepthImage(Width, Height, frame, quantized);
+    }
+    uint64_t t2 = GetTimeUsec();
+    cout << "Quantize: Old = " << MegapixelsPerSecond(n, kPasses, t1 - t0) << " MP/s, New = "
+        << MegapixelsPerSecond(n, kPasses, t2 - t1) << " MP/s" << endl;
+
+    t0 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            temp[i] = lossless::AzureKinectDequantizeDepth(quantized[i]);
+        }
+    }
+    t1 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        lossless::DequantizeDepthImage(Width, Height, quantized.data(), depth);
+    }
+    t2 = GetTimeUsec();
+    cout << "Dequantize: Old = " << MegapixelsPerSecond(n, kPasses, t1 - t0) << " MP/s, New = "
+        << MegapixelsPerSecond(n, kPasses, t2 - t1) << " MP/s" << endl;
+
+    t0 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        for (int i = 0; i < n; ++i) {
+            temp[i] = lossy::AzureKinectQuantizeDepth(frame[i]);
+        }
+        lossy::RescaleImage_11Bits(temp, min_value, max_value);
+    }
+    t1 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        lossy::QuantizeAndRescaleImage_11Bits(n, frame, rescaled, min_value, max_value);
+    }
+    t2 = GetTimeUsec();
+    cout << "Lossy Quantize+Rescale: Old = " << MegapixelsPerSecond(n, kPasses, t1 - t0) << " MP/s, New = "
+        << MegapixelsPerSecond(n, kPasses, t2 - t1) << " MP/s" << endl;
+
+    t0 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        temp = rescaled;
+        lossy::UndoRescaleImage_11Bits(min_value, max_value, temp);
+        for (int i = 0; i < n; ++i) {
+            temp[i] = lossy::AzureKinectDequantizeDepth(temp[i]);
+        }
+    }
+    t1 = GetTimeUsec();
+    for (int pass = 0; pass < kPasses; ++pass) {
+        temp = rescaled;
+        lossy::UndoRescaleAndDequantizeImage(min_value, max_value, temp);
+    }
+    t2 = GetTimeUsec();
+    cout << "Lossy Undo Rescale+Dequantize: Old = " << MegapixelsPerSecond(n, kPasses, t1 - t0) << " MP/s, New = "
+        << MegapixelsPerSecond(n, kPasses, t2 - t1) << " MP/s" << endl;
+
+    return true;
+}
+
+#ifdef ZDEPTH_FFMPEG
+
+// Encode and decode planes directly through the ffmpeg LowPlane backend,
+// without the rest of the lossy depth format around it
+bool TestLowPlaneFfmpeg(bool hevc)
+{
+    lossy::LowPlaneParams params;
+    params.Width = Width;
+    params.Height = Height;
+    params.Hevc = hevc;
+
+    std::unique_ptr<lossy::LowPlaneEncoder> encoder = lossy::CreateLowPlaneEncoder(lossy::VideoBackend::Ffmpeg, params);
+    if (!encoder) {
+        if (hevc) {
+            cout << "Skipped: Ffmpeg has no H.265 encoder" << endl;
+            return true;
+        }
+        cout << "Ffmpeg LowPlane encoder failed to initialize" << endl;
+        return false;
+    }
+    if (encoder->GetBackend() != lossy::VideoBackend::Ffmpeg) {
+        cout << "Ffmpeg LowPlane encoder has the wrong backend" << endl;
+        return false;
+    }
+
+    std::unique_ptr<lossy::LowPlaneDecoder> decoder;
+    std::vector<uint8_t> plane(Width * Height);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        // Smooth pattern that pans each frame, like the low bits of a surface
+        for (int y = 0; y < Height; ++y) {
+            for (int x = 0; x < Width; ++x) {
+                const float s = std::sin((x + i * 3) * 0.05f) * std::cos(y * 0.04f);
+                plane[x + y * Width] = static_cast<uint8_t>( 128.f + 100.f * s );
+            }
+        }
+
+        uint8_t* data = nullptr;
+        int bytes = 0;
+        if (!encoder->Encode(plane.data(), i == 0, data, bytes)) {
+            cout << "Ffmpeg LowPlane encode failed for frame " << i << endl;
+            return false;
+        }
+
+        if (i == 0) {
+            decoder = lossy::CreateLowPlaneDecoder(lossy::VideoBackend::Ffmpeg, params, data, bytes);
+            if (!decoder || decoder->GetBackend() != lossy::VideoBackend::Ffmpeg) {
+                cout << "Ffmpeg LowPlane decoder failed to initialize" << endl;
+                return false;
+            }
+        }
+
+        const uint8_t* decoded = decoder->Decode(data, bytes);
+        if (!decoded) {
+            cout << "Ffmpeg LowPlane decode failed for frame " << i << endl;
+            return false;
+        }
+
+        uint64_t error_sum = 0;
+        for (int j = 0; j < Width * Height; ++j) {
+            error_sum += std::abs(static_cast<int>( decoded[j] ) - static_cast<int>( plane[j] ));
+        }
+        const float mean_error = error_sum / static_cast<float>( Width * Height );
+        if (mean_error > 2.f) {
+            cout << "Ffmpeg LowPlane frame " << i << " error too high: " << mean_error << endl;
+            return false;
+        }
+
+        cout << "Ffmpeg LowPlane " << (hevc ? "H.265" : "H.264") << ": Frame " << i << " -> "
+            << bytes << " bytes, mean error = " << mean_error << endl;
+    }
+
+    return true;
+}
+
+bool TestSoftwareVideo(const uint16_t* frame0, const uint16_t* frame1)
+{
+    const uint16_t* frames[2] = { frame0, frame1 };
+
+    // Software encoder output must decode with the software decoder and with
+    // whichever decoder Auto picks on this machine
+    lossy::DepthCompressor encoder, software_decoder, auto_decoder;
+    encoder.SetVideoBackend(lossy::VideoBackend::Ffmpeg);
+    software_decoder.SetVideoBackend(lossy::VideoBackend::Ffmpeg);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        const uint16_t* frame = frames[i % 2];
+        std::vector<uint8_t> compressed;
+
+        const uint64_t t0 = GetTimeUsec();
+
+        encoder.Compress(Width, Height, false, 30, frame, compressed, i == 0);
+
+        const uint64_t t1 = GetTimeUsec();
+
+        if (compressed.empty()) {
+            cout << "Software video encoder failed" << endl;
+            return false;
+        }
+
+        lossy::DepthCompressor* decoders[2] = { &software_decoder, &auto_decoder };
+        for (lossy::DepthCompressor* decoder : decoders)
+        {
+            int width, height;
+            std::vector<uint16_t> depth;
+            lossy::DepthResult result = decoder->Decompress(compressed, width, height, depth);
+            if (result != lossy::DepthResult::Success) {
+                cout << "Failed: Software video Decompress returned " << lossy::DepthResultString(result) << endl;
+                return false;
+            }
+            if (width != Width || height != Height) {
+                cout << "Software video decompression failed: Resolution" << endl;
+                return false;
+            }
+            if (!LossyCompareFrames(depth.size(), depth.data(), frame)) {
+                cout << "Software video decompression result corrupted" << endl;
+                return false;
+            }
+        }
+
+        cout << "Software Video Zdepth: Frame " << i << " -> " << compressed.size()
+            << " bytes. Compressed in " << (t1 - t0) / 1000.f << " msec" << endl;
+    }
+
+    return true;
+}
+
+#endif // ZDEPTH_FFMPEG
+
 bool TestPattern(const uint16_t* frame0, const uint16_t* frame1)
 {
     cout << endl;
@@ -401,6 +871,78 @@ bool TestPattern(const uint16_t* frame0, const uint16_t* frame1)
         cout << "Failure: frame1 failed";
         return false;
     }
+
+    cout << endl;
+    cout << "===================================================================" << endl;
+    cout << "+ Test: Dictionary trained on frame 0 compression" << endl;
+    cout << "===================================================================" << endl;
+
+    if (!TestDictionary(frame0, frame1)) {
+        cout << "Failure: dictionary failed";
+        return false;
+    }
+
+    cout << endl;
+    cout << "===================================================================" << endl;
+    cout << "+ Test: Motion-compensated P-frames" << endl;
+    cout << "===================================================================" << endl;
+
+    if (!TestMotion(frame0, frame1)) {
+        cout << "Failure: motion failed";
+        return false;
+    }
+
+    cout << endl;
+    cout << "===================================================================" << endl;
+    cout << "+ Test: Near-lossless compression" << endl;
+    cout << "===================================================================" << endl;
+
+    if (!TestNearLossless(frame0, frame1)) {
+        cout << "Failure: near-lossless failed";
+        return false;
+    }
+
+    cout << endl;
+    cout << "===================================================================" << endl;
+    cout << "+ Test: Cropped lossless compression" << endl;
+    cout << "===================================================================" << endl;
+
+    if (!TestCrop(frame0, frame1)) {
+        cout << "Failure: crop failed";
+        return false;
+    }
+
+    cout << endl;
+    cout << "===================================================================" << endl;
+    cout << "+ Test: Quantization kernels" << endl;
+    cout << "===================================================================" << endl;
+
+    if (!TestQuantization(frame0)) {
+        cout << "Failure: quantization failed";
+        return false;
+    }
+
+#ifdef ZDEPTH_FFMPEG
+    cout << endl;
+    cout << "===================================================================" << endl;
+    cout << "+ Test: Software video backend" << endl;
+    cout << "===================================================================" << endl;
+
+    if (!TestSoftwareVideo(frame0, frame1)) {
+        cout << "Failure: software video failed";
+        return false;
+    }
+
+    cout << endl;
+    cout << "===================================================================" << endl;
+    cout << "+ Test: Ffmpeg LowPlane round trip" << endl;
+    cout << "===================================================================" << endl;
+
+    if (!TestLowPlaneFfmpeg(false) || !TestLowPlaneFfmpeg(true)) {
+        cout << "Failure: ffmpeg LowPlane failed";
+        return false;
+    }
+#endif // ZDEPTH_FFMPEG
     return true;
 }
 
@@ -412,6 +954,20 @@ int main(int argc, char* argv[])
 
     SetupAsyncDiskLog("zdepth_tests.txt");
 
+    // Run each tile on its own thread
+    auto parallel_for = [](int count, const std::function<void(int)>& task) {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < count; ++i) {
+            threads.emplace_back(task, i);
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    };
+    tiled_compressor0.SetTileCount(4);
+    tiled_compressor0.SetParallelFor(parallel_for);
+    tiled_decompressor0.SetParallelFor(parallel_for);
+
     cout << endl;
     cout << "-------------------------------------------------------------------" << endl;
     cout << "Test vector: Room" << endl;
@@ -14,17 +14,24 @@
 
     It then compresses the imagery and depth map for transport, passing the
     completed batch to the callback.
+
+    Color video is encoded with Intel QuickSync when built with CAPTURE_MFX.
+    Raw NV12 images (such as from replay cameras) fall back to the ffmpeg
+    software encoder when built with CAPTURE_FFMPEG.
 */
 
 #include "RgbdImage.hpp"
 #include "RuntimeConfiguration.hpp"
 #include <core_video.hpp>
 #include "TimeConverter.hpp"
+#include "SoftwareVideoEncoder.hpp"
 
 #include <DepthCalibration.hpp> // depth_mesh
 #include <DepthMesh.hpp> // depth_mesh
+#ifdef CAPTURE_MFX
 #include <MfxVideoDecoder.hpp> // mfx
 #include <MfxVideoEncoder.hpp> // mfx
+#endif
 #include <zdepth_lossless.hpp> // zdepth
 #include <zdepth_lossy.hpp> // zdepth
 
@@ -47,6 +54,23 @@ static const unsigned kWarningHoldMsec = 1000;
 // Depth of any of the pipeline queues
 static const int kPipelineQueueDepth = 8;
 
+// Number of bands to split lossless depth images into for parallel compression
+static const int kLosslessDepthTiles = 4;
+
+// Default lossless depth motion search: Number of previous frames to
+// reference, largest motion vector in pixels, and candidates per 8x8 block
+static const int kLosslessDepthReferenceFrames = 2;
+static const int kLosslessDepthMotionRange = 4;
+static const int kLosslessDepthMotionBudget = 12;
+
+// Near-lossless depth: Largest error in millimetres for each range band of the
+// depth quantization table, and the target bitrate for each camera.
+// The error bound is reduced from frame to frame while under the target
+static const int kNearLosslessDepthMaxErrorMM[lossless::kDepthRangeBands] = {
+    4, 8, 16, 32, 64
+};
+static const int kNearLosslessDepthBitrate = 3 * 1000 * 1000; // 3 Mbps
+
 enum class ProcessorState
 {
     Idle,
@@ -168,20 +192,39 @@ struct VideoEncoderElement : public BatchPipelineElement
         Shutdown();
     }
 
-    mfx::EncoderParams EncoderParams{};
-
-    std::unique_ptr<mfx::VideoEncoder> Encoder;
     std::unique_ptr<VideoParser> Parser;
     std::vector<uint8_t> VideoParameters;
 
     unsigned JpegWidth = 0, JpegHeight = 0;
+
+#ifdef CAPTURE_MFX
+    mfx::EncoderParams EncoderParams{};
+
+    std::unique_ptr<mfx::VideoEncoder> Encoder;
     std::unique_ptr<mfx::VideoDecoder> JpegDecoder;
 
     // Allocator used when input is in raw NV12 format
     // or when we need a copy-back buffer for JPEG
     std::shared_ptr<mfx::SystemAllocator> RawAllocator;
 
+    // Set when QuickSync failed on raw NV12 input,
+    // so the software encoder is used from then on
+    bool MfxUnavailable = false;
+#endif
+
+    // Encoder for raw NV12 input without QuickSync, e.g. replay cameras
+    std::unique_ptr<SoftwareVideoEncoder> SoftwareEncoder;
+
     bool Run(std::shared_ptr<PipelineData> data) override;
+
+protected:
+    // Each sets the Color pointers and, if video is needed, returns the
+    // encoder output that is valid until the next call
+#ifdef CAPTURE_MFX
+    bool RunMfx(PipelineData& data, uint8_t*& video_data, int& video_bytes);
+    void OnMfxUnavailable(const RgbdImage& image);
+#endif
+    bool RunSoftware(PipelineData& data, uint8_t*& video_data, int& video_bytes);
 };
 
 struct MeshCompressorElement : public BatchPipelineElement
@@ -197,12 +240,23 @@ struct MeshCompressorElement : public BatchPipelineElement
     std::unique_ptr<lossless::DepthCompressor> LosslessDepth;
     std::unique_ptr<lossy::DepthCompressor> LossyDepth;
 
+    // Lossless depth motion search settings for this camera
+    int DepthReferenceFrames = kLosslessDepthReferenceFrames;
+    int DepthMotionRange = kLosslessDepthMotionRange;
+    int DepthMotionBudget = kLosslessDepthMotionBudget;
+
+    // Near-lossless depth target bitrate for this camera
+    int DepthNearLosslessBitrate = kNearLosslessDepthBitrate;
+
     uint32_t ExtrinsicsEpoch = 0;
     uint32_t ClipEpoch = 0;
 
     bool EnableCrop = false;
     ImageCropRegion CropRegion;
 
+    // Part of the depth image that can contain the clipped mesh
+    ImageCropRegion DepthCropRegion;
+
     bool Run(std::shared_ptr<PipelineData> data) override;
 };
 
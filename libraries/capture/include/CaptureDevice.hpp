@@ -88,16 +88,26 @@ struct K4aDeviceInfo
 
 using ImageCallback = std::function<void(std::shared_ptr<RgbdImage>&)>;
 
-class K4aDevice
+
+//------------------------------------------------------------------------------
+// CaptureDevice
+
+/*
+    Camera source opened by CaptureManager.
+
+    K4aDevice talks to an Azure Kinect DK, and ReplayDevice plays back frames
+    from a file so the rest of the pipeline can run without the hardware.
+    Both keep a short capture history for multi-camera matching.
+*/
+class CaptureDevice
 {
 public:
-    K4aDevice(RuntimeConfiguration* config)
+    CaptureDevice(RuntimeConfiguration* config)
     {
         RuntimeConfig = config;
     }
-    virtual inline ~K4aDevice()
+    virtual inline ~CaptureDevice()
     {
-        Close();
     }
 
     CameraStatus GetStatus() const
@@ -109,27 +119,19 @@ public:
         return Info.Calibration;
     }
 
-    bool Open(
+    virtual bool Open(
         const uint32_t index,
         const K4aDeviceSettings& settings,
-        ImageCallback callback);
-    bool StartImageCapture(
+        ImageCallback callback) = 0;
+    virtual bool StartImageCapture(
         k4a_wired_sync_mode_t sync_mode,
-        int32_t depth_delay_off_color_usec);
+        int32_t depth_delay_off_color_usec) = 0;
 
     // Must be called after StartImageCapture()
-    bool StartImuCapture();
-
-    void Stop();
-    void Close();
-
-    // Get info about a control
-    bool GetControlInfo(k4a_color_control_command_t command, ControlInfo& info);
+    virtual bool StartImuCapture() = 0;
 
-    // Set color control
-    bool SetControlAuto(k4a_color_control_command_t command);
-    bool SetControlManual(k4a_color_control_command_t command, int32_t value);
-    bool SetControlDefault(k4a_color_control_command_t command);
+    virtual void Stop() = 0;
+    virtual void Close() = 0;
 
     const K4aDeviceInfo& GetInfo() const
     {
@@ -153,10 +155,66 @@ protected:
 
     std::atomic<bool> NeedsReset = ATOMIC_VAR_INIT(false);
 
-    k4a_device_t Device = 0;
     K4aDeviceInfo Info;
     int NextFrameNumber = 0;
 
+    // Capture history
+    mutable std::mutex CaptureHistoryLock;
+    std::shared_ptr<RgbdImage> CaptureHistory[kCaptureHistoryCount];
+    std::atomic<int> WriteCaptureIndex = ATOMIC_VAR_INIT(0);
+
+    // Mesher object for this device
+    std::shared_ptr<DepthMesher> Mesher;
+
+
+    // Store image to capture history to allow cross-camera matching,
+    // then deliver it to the callback
+    void StoreCapture(int write_capture_index, std::shared_ptr<RgbdImage>& image);
+
+    void ClearCaptureHistory();
+};
+
+
+//------------------------------------------------------------------------------
+// K4aDevice
+
+class K4aDevice : public CaptureDevice
+{
+public:
+    K4aDevice(RuntimeConfiguration* config)
+        : CaptureDevice(config)
+    {
+    }
+    virtual inline ~K4aDevice()
+    {
+        Close();
+    }
+
+    bool Open(
+        const uint32_t index,
+        const K4aDeviceSettings& settings,
+        ImageCallback callback) override;
+    bool StartImageCapture(
+        k4a_wired_sync_mode_t sync_mode,
+        int32_t depth_delay_off_color_usec) override;
+
+    // Must be called after StartImageCapture()
+    bool StartImuCapture() override;
+
+    void Stop() override;
+    void Close() override;
+
+    // Get info about a control
+    bool GetControlInfo(k4a_color_control_command_t command, ControlInfo& info);
+
+    // Set color control
+    bool SetControlAuto(k4a_color_control_command_t command);
+    bool SetControlManual(k4a_color_control_command_t command, int32_t value);
+    bool SetControlDefault(k4a_color_control_command_t command);
+
+protected:
+    k4a_device_t Device = 0;
+
     // WhiteBalance:
     // The unit is degrees Kelvin. The setting must be set to a value evenly divisible by 10 degrees.
     // AutoExposurePriority: DEPRECATED DO NOT USE
@@ -174,19 +232,11 @@ protected:
     mutable std::mutex ImuLock;
     k4a_imu_sample_t LastImuSample{};
 
-    // Capture history
-    mutable std::mutex CaptureHistoryLock;
-    std::shared_ptr<RgbdImage> CaptureHistory[kCaptureHistoryCount];
-    std::atomic<int> WriteCaptureIndex = ATOMIC_VAR_INIT(0);
-
     uint64_t LastDepthDeviceUsec = 0;
     int ExpectedFramerate = 0;
     unsigned ExpectedFrameIntervalUsec = 0;
     int DepthDelayOffColorUsec = 0;
 
-    // Mesher object for this device
-    std::shared_ptr<DepthMesher> Mesher;
-
     DeviceClockSync ClockSync;
 
     uint32_t ExposureEpoch = 0;
@@ -16,17 +16,20 @@
     If capture mode is enabled, then a clip region is applied and the depth
     data is culled of elements not needed for render.
     Otherwise the depth data is not culled because it is needed for calibration.
+
+    When replay is enabled, ReplayDevice cameras are opened in place of the
+    Azure Kinect cameras so the pipeline can run without hardware.  Frames from
+    the cameras can also be written to a replay recording for later playback.
 */
 
 #pragma once
 
 #include "RuntimeConfiguration.hpp"
 #include "CaptureDevice.hpp"
+#include "ReplayDevice.hpp"
 #include "CaptureProtocol.hpp"
 #include "BatchProcessor.hpp"
 
-#include <MfxVideoDecoder.hpp> // mfx
-
 #include <vector>
 #include <memory>
 #include <atomic>
@@ -80,6 +83,13 @@ public:
     void SetTdmaSlots(const std::vector<int>& tdma_slots = std::vector<int>());
     unsigned GetTdmaSlotCount();
 
+    // Takes effect the next time capture starts
+    void SetReplay(bool enabled, const ReplaySettings& settings = ReplaySettings());
+
+    // Record frames to the given file each time capture starts.
+    // Empty path disables recording
+    void SetReplayRecording(const std::string& file_path);
+
     CaptureStatus GetStatus() const
     {
         return Status;
@@ -106,7 +116,7 @@ protected:
 
     /// Connected devices
     std::atomic<uint32_t> DeviceCount = 0;
-    std::vector< std::shared_ptr<K4aDevice> > Devices;
+    std::vector< std::shared_ptr<CaptureDevice> > Devices;
 
     /// Latest image batch received from all connected cameras
     mutable std::mutex BatchLock;
@@ -125,9 +135,20 @@ protected:
     std::mutex TdmaLock;
     std::vector<int> TdmaSlots;
 
+    std::atomic<bool> ReplayEnabled = ATOMIC_VAR_INIT(false);
+    mutable std::mutex ReplayLock;
+    ReplaySettings Replay;
+    std::string ReplayRecordingPath;
+
+    /// Records frames when enabled
+    ReplayRecorder Recorder;
+
 
     void Loop();
 
+    // Number of cameras available to open, either attached or replayed
+    unsigned GetDetectedCameraCount() const;
+
     CaptureStatus BackgroundStart(CaptureMode mode);
     void BackgroundStop();
 
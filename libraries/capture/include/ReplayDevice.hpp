@@ -0,0 +1,172 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Replay camera source
+
+    ReplayDevice stands in for K4aDevice so that frame matching, the batch
+    processor and the capture server can be exercised and profiled without
+    any Azure Kinect hardware attached.
+
+    Frames are played back in a loop from a replay recording written by
+    ReplayRecorder.  If no recording is provided, a synthetic scene is
+    generated instead: a floor and back wall with a box moving across it.
+
+    The emulated cameras behave as if they shared a sync cable: every device
+    fires on the same grid of sync pulses, camera 0 reports itself as master,
+    and the depth exposure is offset by the TDMA slot.  Each device has its
+    own device clock and the frames arrive on the host with USB latency and
+    random jitter, so DeviceClockSync and the matching in CaptureManager see
+    realistic timestamps.
+*/
+
+#pragma once
+
+#include "CaptureDevice.hpp"
+
+#include <fstream>
+#include <random>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// ReplaySettings
+
+struct ReplaySettings
+{
+    // Replay recording to play back.
+    // Empty to generate a synthetic scene instead
+    std::string FilePath;
+
+    // Number of cameras to emulate.
+    // If the recording has fewer cameras then they are reused in order
+    int CameraCount = 3;
+
+    // Frames per second, or 0 to use the rate for the capture mode
+    int Framerate = 0;
+
+    // Random delay added to the time each frame arrives on the host
+    int JitterUsec = 2000;
+
+    // Fraction of frames dropped as if the USB bus stalled
+    float DropRate = 0.f;
+};
+
+
+//------------------------------------------------------------------------------
+// ReplayRecorder
+
+/*
+    Writes every frame received from the cameras to a replay recording.
+
+    The color image is stored as received (JPEG or NV12) along with the raw
+    depth image, so recordings grow by tens of megabytes per second for each
+    camera.  Intended for short clips.
+*/
+class ReplayRecorder
+{
+public:
+    ~ReplayRecorder()
+    {
+        Close();
+    }
+
+    bool Open(
+        const std::string& file_path,
+        const std::vector<CameraCalibration>& calibration,
+        const std::vector<protos::CameraExtrinsics>& extrinsics);
+    void Close();
+
+    bool IsOpen() const
+    {
+        return Recording;
+    }
+
+    // Thread-safe
+    void WriteFrame(const RgbdImage& image);
+
+protected:
+    std::atomic<bool> Recording = ATOMIC_VAR_INIT(false);
+
+    std::mutex FileLock;
+    std::ofstream File;
+    std::string FilePath;
+    unsigned CameraCount = 0;
+    unsigned FrameCount = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// ReplayDevice
+
+class ReplayDevice : public CaptureDevice
+{
+public:
+    ReplayDevice(RuntimeConfiguration* config, const ReplaySettings& replay)
+        : CaptureDevice(config)
+        , Replay(replay)
+    {
+    }
+    virtual inline ~ReplayDevice()
+    {
+        Close();
+    }
+
+    bool Open(
+        const uint32_t index,
+        const K4aDeviceSettings& settings,
+        ImageCallback callback) override;
+    bool StartImageCapture(
+        k4a_wired_sync_mode_t sync_mode,
+        int32_t depth_delay_off_color_usec) override;
+
+    // The accelerometer is filled in for every frame
+    bool StartImuCapture() override;
+
+    void Stop() override;
+    void Close() override;
+
+protected:
+    ReplaySettings Replay;
+
+    std::atomic<bool> Terminated = ATOMIC_VAR_INIT(true);
+    std::shared_ptr<std::thread> CameraThread;
+
+    int ExpectedFramerate = 0;
+    unsigned ExpectedFrameIntervalUsec = 0;
+    int DepthDelayOffColorUsec = 0;
+
+    // System time at which the emulated device clock read zero
+    uint64_t DeviceClockStartUsec = 0;
+
+    // Extra USB latency for this camera, as if it were behind a hub
+    unsigned HubDelayUsec = 0;
+
+    DeviceClockSync ClockSync;
+
+    std::mt19937 Prng;
+
+    // Recording being played back
+    std::ifstream File;
+    std::streampos FirstFrameOffset;
+    unsigned SourceCameraIndex = 0;
+
+    // Synthetic scene
+    int ColorWidth = 0, ColorHeight = 0;
+    int DepthWidth = 0, DepthHeight = 0;
+    std::vector<uint8_t> BackgroundColor;
+    std::vector<uint16_t> BackgroundDepth;
+
+
+    bool OpenRecording();
+    void OpenSynthetic();
+
+    void CameraLoop();
+
+    // Fill in the image contents for the next frame
+    bool ReadFrame(RgbdImage& image);
+    void GenerateFrame(uint64_t pulse_usec, RgbdImage& image);
+};
+
+
+} // namespace core
@@ -19,7 +19,9 @@
 #include <Eigen/Core> // Eigen
 #include <DepthCalibration.hpp> // depth_mesh
 #include <DepthMesh.hpp> // depth_mesh
+#ifdef CAPTURE_MFX
 #include <MfxTools.hpp> // mfx
+#endif
 #include <CaptureProtocol.hpp> // capture_protocol
 
 namespace core {
@@ -116,8 +118,10 @@ struct RgbdImage
     // Not transformed to scene space, so we can use this for registration.
     std::vector<float> MeshVertices;
 
+#ifdef CAPTURE_MFX
     // Color data copied back from GPU memory
     mfx::frameref_t CopyBack;
+#endif
 
     // Indices for each triangle
     std::vector<uint32_t> MeshTriangles;
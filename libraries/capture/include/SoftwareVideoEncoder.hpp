@@ -0,0 +1,97 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Software color video encoder
+
+    Encodes raw NV12 camera images with ffmpeg (libx264/libx265) on the CPU,
+    so the capture pipeline can stream video on machines without an Intel
+    iGPU, for example when replaying cameras on a build server.
+
+    Each input image produces exactly one picture without B-frames, and the
+    parameter sets are repeated in-band on each keyframe, matching the output
+    of the Intel QuickSync encoder.
+
+    JPEG input is not supported, and the ProcAmp adjustments (brightness,
+    saturation, denoise) are not applied.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// SoftwareVideoEncoder
+
+struct SoftwareEncoderParams
+{
+    bool Hevc = false;
+    int Width = 0, Height = 0;
+    int Framerate = 30;
+
+    // Bitrate ceiling in bits per second
+    int Bitrate = 4000000;
+
+    // Constant rate factor: Lower is higher quality
+    int Quality = 25;
+
+    bool operator==(const SoftwareEncoderParams& other) const
+    {
+        return Hevc == other.Hevc &&
+            Width == other.Width &&
+            Height == other.Height &&
+            Framerate == other.Framerate &&
+            Bitrate == other.Bitrate &&
+            Quality == other.Quality;
+    }
+    bool operator!=(const SoftwareEncoderParams& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+class SoftwareVideoEncoder
+{
+public:
+    ~SoftwareVideoEncoder()
+    {
+        Shutdown();
+    }
+
+    // Returns false if ffmpeg is unavailable or the codec failed to open
+    bool Initialize(const SoftwareEncoderParams& params);
+    void Shutdown();
+
+    const SoftwareEncoderParams& GetParams() const
+    {
+        return Params;
+    }
+
+    // Encode an NV12 image with the given row stride in bytes.
+    // Returns false on failure.
+    // The output is valid until the next call to Encode()
+    bool Encode(
+        const uint8_t* nv12,
+        unsigned stride,
+        bool keyframe,
+        uint8_t*& data,
+        int& bytes);
+
+protected:
+    SoftwareEncoderParams Params;
+
+    AVCodecContext* Context = nullptr;
+    AVFrame* Frame = nullptr;
+    AVPacket* Packet = nullptr;
+    int64_t NextPts = 0;
+};
+
+
+} // namespace core
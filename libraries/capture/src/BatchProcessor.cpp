@@ -5,6 +5,8 @@
 #include <core_logging.hpp>
 #include <core_serializer.hpp>
 
+#include <tbb/tbb.h>
+
 namespace core {
 
 
@@ -32,16 +34,112 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
         JpegWidth = batch->VideoInfo.Width;
         JpegHeight = batch->VideoInfo.Height;
 
+#ifdef CAPTURE_MFX
         if (JpegDecoder) {
             spdlog::info("Video format change: Resetting video pipeline.");
         }
         JpegDecoder.reset();
         Encoder.reset();
+#endif
+        SoftwareEncoder.reset();
     }
 
-    mfx::EncoderParams encoder_params;
+    image->IsNV12 = true;
+    image->ChromaWidth = image->ColorWidth / 2;
+    image->ChromaHeight = image->ColorHeight / 2;
+    image->ChromaStride = image->ChromaWidth * 2;
+    image->Color[0] = nullptr;
+    image->Color[1] = nullptr;
+    image->Color[2] = nullptr;
+
+    uint8_t* video_data = nullptr;
+    int video_bytes = 0;
+    bool success;
+
+#ifdef CAPTURE_MFX
+    // JPEG images can only be decoded by QuickSync.
+    // Raw images are passed through without it when video is not needed
+    if (image->IsJpegBuffer || (data->VideoNeeded && !MfxUnavailable)) {
+        success = RunMfx(*data, video_data, video_bytes);
+    } else
+#endif
+    {
+        success = RunSoftware(*data, video_data, video_bytes);
+    }
+
+    if (!success) {
+        return false;
+    }
+    if (!data->VideoNeeded) {
+        return true;
+    }
 
     const auto& compression = data->Compression;
+
+    if (!Parser) {
+        Parser = std::make_unique<VideoParser>();
+    }
+    Parser->Reset();
+    Parser->ParseVideo(
+        compression.ColorVideo == protos::VideoType_H265,
+        video_data,
+        video_bytes);
+
+    if (Parser->Pictures.size() != 1) {
+        spdlog::error("Found {} frames in encoder output", Parser->Pictures.size());
+        return false;
+    }
+
+    if (Parser->TotalParameterBytes > 0)
+    {
+        VideoParameters.resize(Parser->TotalParameterBytes);
+        uint8_t* dest = VideoParameters.data();
+        for (auto& nalu : Parser->Parameters) {
+            memcpy(dest, nalu.Ptr, nalu.Bytes);
+            dest += nalu.Bytes;
+        }
+    }
+
+    const bool keyframe = batch->Keyframe;
+    auto& picture = Parser->Pictures[0];
+    int compressed_bytes = picture.TotalBytes;
+    if (keyframe) {
+        compressed_bytes += static_cast<int>( VideoParameters.size() );
+    }
+
+    image->CompressedImage.resize(compressed_bytes);
+    uint8_t* dest = image->CompressedImage.data();
+
+    if (keyframe) {
+        if (VideoParameters.empty()) {
+            spdlog::error("Video parameters not available for keyframe");
+            return false;
+        }
+        memcpy(dest, VideoParameters.data(), VideoParameters.size());
+        dest += VideoParameters.size();
+    }
+
+    for (auto& nalu : picture.Ranges) {
+        memcpy(dest, nalu.Ptr, nalu.Bytes);
+        dest += nalu.Bytes;
+    }
+
+    return true;
+}
+
+#ifdef CAPTURE_MFX
+
+bool VideoEncoderElement::RunMfx(
+    PipelineData& data,
+    uint8_t*& video_data,
+    int& video_bytes)
+{
+    auto& batch = data.Batch;
+    auto& image = batch->Images[CameraIndex];
+
+    mfx::EncoderParams encoder_params;
+
+    const auto& compression = data.Compression;
     encoder_params.FourCC = compression.ColorVideo == protos::VideoType_H264 ? MFX_CODEC_AVC : MFX_CODEC_HEVC;
     encoder_params.Bitrate = compression.ColorBitrate;
     encoder_params.Quality = compression.ColorQuality;
@@ -60,7 +158,7 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
         Encoder.reset();
     }
 
-    const auto lighting = data->Config->GetLighting(CameraIndex);
+    const auto lighting = data.Config->GetLighting(CameraIndex);
     auto& procamp = encoder_params.ProcAmp;
     procamp.Enabled = true; // Always enabled
     procamp.DenoisePercentage = compression.DenoisePercent;
@@ -87,6 +185,7 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
         if (!success) {
             spdlog::error("MFX allocator failed to initialize");
             RawAllocator.reset();
+            OnMfxUnavailable(*image);
             return false;
         }
     }
@@ -116,14 +215,6 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
         }
     }
 
-    image->IsNV12 = true;
-    image->ChromaWidth = image->ColorWidth / 2;
-    image->ChromaHeight = image->ColorHeight / 2;
-    image->ChromaStride = image->ChromaWidth * 2;
-    image->Color[0] = nullptr;
-    image->Color[1] = nullptr;
-    image->Color[2] = nullptr;
-
     // TBD: As far as I can tell, D3D9 mode for Intel QSV only supports allocating one GPU texture at a time,
     // so we need to get rid of our frame reference as fast as we can.
     mfx::frameref_t frame;
@@ -140,7 +231,7 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
             return false;
         }
 
-        if (data->ImagesNeeded) {
+        if (data.ImagesNeeded) {
             image->CopyBack = JpegDecoder->Allocator->CopyToSystemMemory(frame);
             if (!image->CopyBack) {
                 spdlog::warn("Cannot copy frame to system memory from D3D memory");
@@ -157,19 +248,19 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
         uint8_t* src = image->ColorImage.data();
         const unsigned plane_bytes = image->ColorStride * image->ColorHeight;
 
-        if (data->ImagesNeeded) {
+        if (data.ImagesNeeded) {
             image->Color[0] = src;
             image->Color[1] = src + plane_bytes;
         }
 
-        if (data->VideoNeeded) {
+        if (data.VideoNeeded) {
             frame = RawAllocator->Allocate();
             uint8_t* dest = frame->Raw->Data.data();
             memcpy(dest, src, plane_bytes * 3 / 2);
         }
     }
 
-    if (!data->VideoNeeded) {
+    if (!data.VideoNeeded) {
         return true;
     }
 
@@ -191,6 +282,8 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
             EncoderParams);
         if (!success) {
             spdlog::error("MFX encoder initialization failed");
+            Encoder.reset();
+            OnMfxUnavailable(*image);
             return false;
         }
 
@@ -229,51 +322,98 @@ bool VideoEncoderElement::Run(std::shared_ptr<PipelineData> data)
         return false;
     }
 
-    if (!Parser) {
-        Parser = std::make_unique<VideoParser>();
-    }
-    Parser->Reset();
-    Parser->ParseVideo(
-        compression.ColorVideo == protos::VideoType_H265,
-        video.Data,
-        video.Bytes);
+    video_data = video.Data;
+    video_bytes = static_cast<int>( video.Bytes );
+    return true;
+}
 
-    if (Parser->Pictures.size() != 1) {
-        spdlog::error("Found {} frames in encoder output", Parser->Pictures.size());
+void VideoEncoderElement::OnMfxUnavailable(const RgbdImage& image)
+{
+#ifdef CAPTURE_FFMPEG
+    // Raw images can still be encoded on the CPU
+    if (!image.IsJpegBuffer) {
+        spdlog::warn("Intel QuickSync unavailable: Using the software video encoder for camera={}", CameraIndex);
+        MfxUnavailable = true;
+    }
+#else
+    CORE_UNUSED(image);
+#endif
+}
+
+#endif // CAPTURE_MFX
+
+bool VideoEncoderElement::RunSoftware(
+    PipelineData& data,
+    uint8_t*& video_data,
+    int& video_bytes)
+{
+    auto& batch = data.Batch;
+    auto& image = batch->Images[CameraIndex];
+
+    if (image->IsJpegBuffer) {
+        spdlog::error("JPEG color images need the Intel QuickSync decoder: Use the NV12 capture mode");
         return false;
     }
 
-    if (Parser->TotalParameterBytes > 0)
-    {
-        VideoParameters.resize(Parser->TotalParameterBytes);
-        uint8_t* dest = VideoParameters.data();
-        for (auto& nalu : Parser->Parameters) {
-            memcpy(dest, nalu.Ptr, nalu.Bytes);
-            dest += nalu.Bytes;
-        }
+    // ProcAmp is not applied in software
+    image->Brightness = 0.f;
+    image->Saturation = 0.f;
+
+    uint8_t* src = image->ColorImage.data();
+    const unsigned plane_bytes = image->ColorStride * image->ColorHeight;
+
+    if (data.ImagesNeeded) {
+        image->Color[0] = src;
+        image->Color[1] = src + plane_bytes;
     }
 
-    auto& picture = Parser->Pictures[0];
-    int compressed_bytes = picture.TotalBytes;
-    if (keyframe) {
-        compressed_bytes += static_cast<int>( VideoParameters.size() );
+    if (!data.VideoNeeded) {
+        return true;
     }
 
-    image->CompressedImage.resize(compressed_bytes);
-    uint8_t* dest = image->CompressedImage.data();
+    const auto& compression = data.Compression;
 
-    if (keyframe) {
-        if (VideoParameters.empty()) {
-            spdlog::error("Video parameters not available for keyframe");
+    SoftwareEncoderParams params;
+    params.Hevc = compression.ColorVideo == protos::VideoType_H265;
+    params.Width = image->ColorWidth;
+    params.Height = image->ColorHeight;
+    params.Framerate = image->Framerate;
+    params.Bitrate = compression.ColorBitrate;
+    params.Quality = compression.ColorQuality;
+
+    // The crop region is not applied here, so the whole image is encoded
+
+    if (SoftwareEncoder && SoftwareEncoder->GetParams() != params) {
+        spdlog::warn("Resetting software video encoder for new camera={} settings", CameraIndex);
+        SoftwareEncoder.reset();
+    }
+
+    if (!SoftwareEncoder)
+    {
+        const uint64_t t0 = GetTimeUsec();
+
+        SoftwareEncoder = std::make_unique<SoftwareVideoEncoder>();
+
+        if (!SoftwareEncoder->Initialize(params)) {
+            spdlog::error("Software video encoder initialization failed");
+            SoftwareEncoder.reset();
             return false;
         }
-        memcpy(dest, VideoParameters.data(), VideoParameters.size());
-        dest += VideoParameters.size();
+
+        const uint64_t t1 = GetTimeUsec();
+        spdlog::info("Software video encoder initialized in {} msec", (t1 - t0) / 1000.f);
     }
 
-    for (auto& nalu : picture.Ranges) {
-        memcpy(dest, nalu.Ptr, nalu.Bytes);
-        dest += nalu.Bytes;
+    const bool success = SoftwareEncoder->Encode(
+        src,
+        image->ColorStride,
+        batch->Keyframe,
+        video_data,
+        video_bytes);
+    if (!success) {
+        spdlog::error("Software encoder failed: Resetting video pipeline.");
+        SoftwareEncoder.reset();
+        return false;
     }
 
     return true;
@@ -301,9 +441,12 @@ bool MeshCompressorElement::Run(std::shared_ptr<PipelineData> data)
             ClipEpoch = data->Config->ClipEpoch;
 
             image->Mesher->CalculateCrop(clip_region, CropRegion);
+            image->Mesher->CalculateDepthCrop(clip_region, DepthCropRegion);
 
             spdlog::info("Updated camera {} crop: x={} y={} w={} h={}",
                 CameraIndex, CropRegion.CropX, CropRegion.CropY, CropRegion.CropW, CropRegion.CropH);
+            spdlog::info("Updated camera {} depth crop: x={} y={} w={} h={}",
+                CameraIndex, DepthCropRegion.CropX, DepthCropRegion.CropY, DepthCropRegion.CropW, DepthCropRegion.CropH);
         }
     }
     image->EnableCrop = EnableCrop = clip_needed;
@@ -344,13 +487,27 @@ bool MeshCompressorElement::Run(std::shared_ptr<PipelineData> data)
         return true;
     }
 
-    bool lossy_depth = data->Compression.DepthVideo != protos::VideoType_Lossless;
+    // Depth outside of the clip region was culled above, so only the
+    // part of the depth image that can contain the mesh is compressed.
+    // Calibration keeps the whole image.
+    const bool crop_depth = clip_needed && !is_calibration;
+    lossless::DepthCrop lossless_crop;
+    lossy::DepthCrop lossy_crop;
+    lossless_crop.X = lossy_crop.X = static_cast<int>( DepthCropRegion.CropX );
+    lossless_crop.Y = lossy_crop.Y = static_cast<int>( DepthCropRegion.CropY );
+    lossless_crop.Width = lossy_crop.Width = static_cast<int>( DepthCropRegion.CropW );
+    lossless_crop.Height = lossy_crop.Height = static_cast<int>( DepthCropRegion.CropH );
+
+    const bool near_lossless_depth = data->Compression.DepthVideo == protos::VideoType_NearLossless;
+    bool lossy_depth = data->Compression.DepthVideo != protos::VideoType_Lossless && !near_lossless_depth;
     if (lossy_depth && !is_calibration)
     {
         if (!LossyDepth) {
             LossyDepth = std::make_unique<lossy::DepthCompressor>();
         }
 
+        LossyDepth->SetCrop(crop_depth ? &lossy_crop : nullptr);
+
         bool is_hevc = data->Compression.DepthVideo == protos::VideoType_H265;
         LossyDepth->Compress(
             image->DepthWidth,
@@ -365,8 +522,30 @@ bool MeshCompressorElement::Run(std::shared_ptr<PipelineData> data)
     {
         if (!LosslessDepth) {
             LosslessDepth = std::make_unique<lossless::DepthCompressor>();
+
+            // Split the image into bands that compress in parallel
+            LosslessDepth->SetTileCount(kLosslessDepthTiles);
+            LosslessDepth->SetParallelFor([](int count, const std::function<void(int)>& task) {
+                tbb::parallel_for(0, count, task);
+            });
+
+            // Reference older frames and search for motion in P-frames
+            LosslessDepth->SetMotionSearch(
+                DepthReferenceFrames,
+                DepthMotionRange,
+                DepthMotionBudget);
         }
 
+        // Calibration needs lossless depth
+        if (near_lossless_depth && !is_calibration) {
+            LosslessDepth->SetMaxError(kNearLosslessDepthMaxErrorMM);
+            LosslessDepth->SetTargetBitrate(DepthNearLosslessBitrate, image->Framerate);
+        } else {
+            LosslessDepth->SetMaxError(nullptr);
+        }
+
+        LosslessDepth->SetCrop(crop_depth ? &lossless_crop : nullptr);
+
         LosslessDepth->Compress(
             image->DepthWidth,
             image->DepthHeight,
@@ -38,6 +38,71 @@ bool CameraStatusFailed(CameraStatus status)
 }
 
 
+//------------------------------------------------------------------------------
+// CaptureDevice
+
+std::shared_ptr<RgbdImage> CaptureDevice::FindCapture(uint64_t SyncSystemUsec)
+{
+    std::lock_guard<std::mutex> locker(CaptureHistoryLock);
+
+    const int write_index = WriteCaptureIndex;
+
+    for (int i = 0; i < kCaptureHistoryCount; ++i)
+    {
+        if (i == write_index) {
+            continue;
+        }
+
+        auto& image = CaptureHistory[i];
+        if (!image || image->Matched) {
+            continue;
+        }
+
+        // In practice the match distance is very small, under a millisecond.
+        // If one of the cameras is on an external USB hub then the frames
+        // from one camera arrive 3 milliseconds later which means even through
+        // a chain of 6 hubs we can correctly match frames from different cameras.
+        int64_t delta_usec = SyncSystemUsec - image->SyncSystemUsec;
+        if (delta_usec < 0) {
+            delta_usec = -delta_usec;
+        }
+
+        // If there is a match:
+        if (delta_usec < kMatchDistUsec) {
+            return image;
+        }
+    }
+
+    return nullptr;
+}
+
+void CaptureDevice::StoreCapture(int write_capture_index, std::shared_ptr<RgbdImage>& image)
+{
+    {
+        std::lock_guard<std::mutex> locker(CaptureHistoryLock);
+
+        CaptureHistory[write_capture_index] = image;
+
+        ++write_capture_index;
+        if (write_capture_index >= kCaptureHistoryCount) {
+            write_capture_index = 0;
+        }
+        WriteCaptureIndex = write_capture_index;
+    }
+
+    Callback(image);
+}
+
+void CaptureDevice::ClearCaptureHistory()
+{
+    std::lock_guard<std::mutex> locker(CaptureHistoryLock);
+
+    for (int i = 0; i < kCaptureHistoryCount; ++i) {
+        CaptureHistory[i].reset();
+    }
+}
+
+
 //------------------------------------------------------------------------------
 // K4aDevice
 
@@ -308,9 +373,7 @@ void K4aDevice::Stop()
         std::this_thread::sleep_for(std::chrono::milliseconds(1000));
     }
 
-    for (int i = 0; i < kCaptureHistoryCount; ++i) {
-        CaptureHistory[i].reset();
-    }
+    ClearCaptureHistory();
 
     const uint64_t t1 = GetTimeUsec();
     spdlog::info("[{}] Stop took {} msec", DeviceIndex, (t1 - t0) / 1000.f);
@@ -486,41 +549,6 @@ void K4aDevice::WriteExtrinsics()
     SaveToFile(extrinsics, GetSettingsFilePath("xrcap", FileNameFromSerial(serial)));
 }
 
-std::shared_ptr<RgbdImage> K4aDevice::FindCapture(uint64_t SyncSystemUsec)
-{
-    std::lock_guard<std::mutex> locker(CaptureHistoryLock);
-
-    const int write_index = WriteCaptureIndex;
-
-    for (int i = 0; i < kCaptureHistoryCount; ++i)
-    {
-        if (i == write_index) {
-            continue;
-        }
-
-        auto& image = CaptureHistory[i];
-        if (!image || image->Matched) {
-            continue;
-        }
-
-        // In practice the match distance is very small, under a millisecond.
-        // If one of the cameras is on an external USB hub then the frames
-        // from one camera arrive 3 milliseconds later which means even through
-        // a chain of 6 hubs we can correctly match frames from different cameras.
-        int64_t delta_usec = SyncSystemUsec - image->SyncSystemUsec;
-        if (delta_usec < 0) {
-            delta_usec = -delta_usec;
-        }
-
-        // If there is a match:
-        if (delta_usec < kMatchDistUsec) {
-            return image;
-        }
-    }
-
-    return nullptr;
-}
-
 void K4aDevice::OnCapture(int write_capture_index, k4a_capture_t capture)
 {
     if (Terminated) {
@@ -623,20 +651,7 @@ void K4aDevice::OnCapture(int write_capture_index, k4a_capture_t capture)
     // Offset by half of exposure time to when we actually read it off USB
     image->SyncSystemUsec += image->ColorExposureUsec / 2;
 
-    // Store image to capture history to allow cross-camera matching
-    {
-        std::lock_guard<std::mutex> locker(CaptureHistoryLock);
-
-        CaptureHistory[write_capture_index] = image;
-
-        ++write_capture_index;
-        if (write_capture_index >= kCaptureHistoryCount) {
-            write_capture_index = 0;
-        }
-        WriteCaptureIndex = write_capture_index;
-    }
-
-    Callback(image);
+    StoreCapture(write_capture_index, image);
 }
 
 bool K4aDevice::GetControlInfo(k4a_color_control_command_t command, ControlInfo& info)
@@ -110,6 +110,28 @@ unsigned CaptureManager::GetTdmaSlotCount()
     return static_cast<unsigned>( TdmaSlots.size() );
 }
 
+void CaptureManager::SetReplay(bool enabled, const ReplaySettings& settings)
+{
+    std::unique_lock<std::mutex> locker(ReplayLock);
+    Replay = settings;
+    ReplayEnabled = enabled;
+}
+
+void CaptureManager::SetReplayRecording(const std::string& file_path)
+{
+    std::unique_lock<std::mutex> locker(ReplayLock);
+    ReplayRecordingPath = file_path;
+}
+
+unsigned CaptureManager::GetDetectedCameraCount() const
+{
+    if (ReplayEnabled) {
+        std::unique_lock<std::mutex> locker(ReplayLock);
+        return static_cast<unsigned>( std::max(Replay.CameraCount, 0) );
+    }
+    return GetAttachedK4CameraCount();
+}
+
 std::vector<CameraStatus> CaptureManager::GetCameraStatus() const
 {
     std::vector<CameraStatus> status;
@@ -156,7 +178,7 @@ void CaptureManager::Loop()
 
         if (DeviceCount > 0)
         {
-            const unsigned detected_camera_count = GetAttachedK4CameraCount();
+            const unsigned detected_camera_count = GetDetectedCameraCount();
 
             if (DeviceCount != detected_camera_count) {
                 spdlog::warn("Detected camera count changed from {} -> {}: Stopping capture...", DeviceCount, detected_camera_count);
@@ -241,7 +263,7 @@ void CaptureManager::Loop()
 // CaptureManager : Background
 
 struct {
-    bool operator()(std::shared_ptr<K4aDevice> a, std::shared_ptr<K4aDevice> b) const {
+    bool operator()(std::shared_ptr<CaptureDevice> a, std::shared_ptr<CaptureDevice> b) const {
         return core::StrCaseCompare(
             a->GetInfo().SerialNumber.c_str(),
             b->GetInfo().SerialNumber.c_str()) < 0;
@@ -276,6 +298,16 @@ CaptureStatus CaptureManager::BackgroundStart(CaptureMode mode)
 
     Devices.clear();
 
+    bool replay_enabled;
+    ReplaySettings replay;
+    std::string recording_path;
+    {
+        std::unique_lock<std::mutex> locker(ReplayLock);
+        replay_enabled = ReplayEnabled;
+        replay = Replay;
+        recording_path = ReplayRecordingPath;
+    }
+
     const k4a_log_level_t min_log_level = k4a_log_level_t::K4A_LOG_LEVEL_WARNING;
 
     // If this is called before a device is opened, then the stdout will be
@@ -306,11 +338,15 @@ CaptureStatus CaptureManager::BackgroundStart(CaptureMode mode)
         spdlog::warn("Failed to hook Kinect allocator");
     }
 
-    const uint32_t count = k4a_device_get_installed_count();
+    const uint32_t count = replay_enabled ?
+        static_cast<uint32_t>( std::max(replay.CameraCount, 0) ) : k4a_device_get_installed_count();
     if (count == 0) {
         spdlog::warn("No cameras detected");
         return CaptureStatus::NoCameras;
     }
+    if (replay_enabled) {
+        spdlog::info("Replaying cameras from: {}", replay.FilePath.empty() ? "Synthetic scene" : replay.FilePath);
+    }
 
     spdlog::info("Number of cameras = {}", count);
     Devices.reserve(count);
@@ -338,7 +374,12 @@ CaptureStatus CaptureManager::BackgroundStart(CaptureMode mode)
     // We cannot open the cameras in parallel because it is not thread safe
     for (uint32_t camera_index = 0; camera_index < count; ++camera_index)
     {
-        std::shared_ptr<K4aDevice> device = std::make_shared<K4aDevice>(RuntimeConfig);
+        std::shared_ptr<CaptureDevice> device;
+        if (replay_enabled) {
+            device = std::make_shared<ReplayDevice>(RuntimeConfig, replay);
+        } else {
+            device = std::make_shared<K4aDevice>(RuntimeConfig);
+        }
 
         const bool success = device->Open(
             camera_index,
@@ -478,6 +519,11 @@ CaptureStatus CaptureManager::BackgroundStart(CaptureMode mode)
     spdlog::info("Took {} msec to start cameras", (t2 - t1) / 1000.f);
 
     DeviceCount = count;
+
+    if (!recording_path.empty()) {
+        Recorder.Open(recording_path, GetCameraCalibration(), RuntimeConfig->GetExtrinsics());
+    }
+
     return CaptureStatus::Capturing;
 }
 
@@ -506,6 +552,8 @@ void CaptureManager::BackgroundStop()
         k4a_set_debug_message_handler(nullptr, nullptr, k4a_log_level_t::K4A_LOG_LEVEL_OFF);
     });
 
+    Recorder.Close();
+
     // Must be performed in this order to avoid crashes on shutdown:
     StopAll();
 
@@ -564,6 +612,10 @@ void CaptureManager::OnImage(std::shared_ptr<RgbdImage>& image)
         return;
     }
 
+    if (Recorder.IsOpen()) {
+        Recorder.WriteFrame(*image);
+    }
+
     // If already matched:
     if (image->Matched) {
         return; // Do not match twice
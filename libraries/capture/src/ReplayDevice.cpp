@@ -0,0 +1,698 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+#include "ReplayDevice.hpp"
+
+#include <cmath>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+static const uint32_t kReplayFileMagic = 0x58524331;
+static const uint32_t kReplayFrameMagic = 0x58524632;
+
+// Sanity limit for color images read from a recording
+static const uint32_t kReplayMaxColorBytes = 64 * 1024 * 1024;
+
+// Time from the depth exposure until the frame is read off USB
+static const unsigned kUsbLatencyUsec = 8000;
+
+// Extra latency for each camera further down the emulated hub chain
+static const unsigned kHubDelayUsec = 300;
+
+// Synthetic scene dimensions in millimeters
+static const float kSyntheticCameraHeightMm = 1000.f;
+static const float kSyntheticWallMm = 3000.f;
+static const float kSyntheticBoxDistanceMm = 1800.f;
+static const float kSyntheticBoxWidthMm = 500.f;
+static const float kSyntheticBoxHeightMm = 1700.f;
+static const float kSyntheticBoxSweepMm = 600.f;
+
+// Period for the box to sweep side to side and back
+static const uint64_t kSyntheticSweepUsec = 4000000;
+
+#pragma pack(push)
+#pragma pack(1)
+
+// Header on each frame in a replay recording, followed by color and depth
+struct ReplayFrameHeader
+{
+    uint32_t Magic;
+    uint32_t CameraIndex;
+    uint32_t IsJpegBuffer;
+
+    int32_t ColorWidth, ColorHeight, ColorStride;
+    uint32_t ColorBytes;
+
+    // Depth is stored as DepthWidth * DepthHeight 16-bit values
+    int32_t DepthWidth, DepthHeight, DepthStride;
+
+    uint32_t ColorExposureUsec;
+    uint32_t ColorWhiteBalanceUsec;
+    uint32_t ColorIsoSpeed;
+    float TemperatureC;
+    float Accelerometer[3];
+};
+
+#pragma pack(pop)
+
+
+//------------------------------------------------------------------------------
+// Synthetic Scene
+
+static void GetColorResolution(k4a_color_resolution_t resolution, int& width, int& height)
+{
+    switch (resolution)
+    {
+    case K4A_COLOR_RESOLUTION_1080P: width = 1920; height = 1080; return;
+    case K4A_COLOR_RESOLUTION_1440P: width = 2560; height = 1440; return;
+    case K4A_COLOR_RESOLUTION_1536P: width = 2048; height = 1536; return;
+    case K4A_COLOR_RESOLUTION_2160P: width = 3840; height = 2160; return;
+    case K4A_COLOR_RESOLUTION_3072P: width = 4096; height = 3072; return;
+    default: break;
+    }
+    width = 1280;
+    height = 720;
+}
+
+static void GetDepthResolution(k4a_depth_mode_t mode, int& width, int& height)
+{
+    switch (mode)
+    {
+    case K4A_DEPTH_MODE_NFOV_UNBINNED: width = 640; height = 576; return;
+    case K4A_DEPTH_MODE_WFOV_2X2BINNED: width = 512; height = 512; return;
+    case K4A_DEPTH_MODE_WFOV_UNBINNED: width = 1024; height = 1024; return;
+    default: break;
+    }
+    width = 320;
+    height = 288;
+}
+
+// Distortion-free intrinsics with roughly the Kinect field of view
+static void MakeSyntheticIntrinsics(int width, int height, float focal_scale, CameraIntrinsics& intrinsics)
+{
+    intrinsics.Width = width;
+    intrinsics.Height = height;
+    intrinsics.LensModel = LensModel_Rational_6KT;
+    intrinsics.cx = width * 0.5f;
+    intrinsics.cy = height * 0.5f;
+    intrinsics.fx = width * focal_scale;
+    intrinsics.fy = intrinsics.fx;
+    for (int i = 0; i < 6; ++i) {
+        intrinsics.k[i] = 0.f;
+    }
+    intrinsics.codx = 0.f;
+    intrinsics.cody = 0.f;
+    intrinsics.p1 = 0.f;
+    intrinsics.p2 = 0.f;
+}
+
+// Distance to the floor or back wall seen by row y
+static float SyntheticBackgroundMm(const CameraIntrinsics& intrinsics, int y)
+{
+    const float slope = (y - intrinsics.cy) / intrinsics.fy;
+    if (slope > 0.f) {
+        const float floor_mm = kSyntheticCameraHeightMm / slope;
+        if (floor_mm < kSyntheticWallMm) {
+            return floor_mm;
+        }
+    }
+    return kSyntheticWallMm;
+}
+
+struct SyntheticRect
+{
+    int X0 = 0, Y0 = 0, X1 = 0, Y1 = 0;
+};
+
+// Project the box standing on the floor into the image
+static SyntheticRect ProjectSyntheticBox(const CameraIntrinsics& intrinsics, float center_x_mm)
+{
+    const float z = kSyntheticBoxDistanceMm;
+    const float left = center_x_mm - kSyntheticBoxWidthMm * 0.5f;
+    const float right = center_x_mm + kSyntheticBoxWidthMm * 0.5f;
+    const float top = kSyntheticCameraHeightMm - kSyntheticBoxHeightMm;
+    const float bottom = kSyntheticCameraHeightMm;
+
+    SyntheticRect rect;
+    rect.X0 = static_cast<int>( intrinsics.cx + intrinsics.fx * left / z );
+    rect.X1 = static_cast<int>( intrinsics.cx + intrinsics.fx * right / z );
+    rect.Y0 = static_cast<int>( intrinsics.cy + intrinsics.fy * top / z );
+    rect.Y1 = static_cast<int>( intrinsics.cy + intrinsics.fy * bottom / z );
+
+    rect.X0 = std::min(std::max(rect.X0, 0), intrinsics.Width);
+    rect.X1 = std::min(std::max(rect.X1, 0), intrinsics.Width);
+    rect.Y0 = std::min(std::max(rect.Y0, 0), intrinsics.Height);
+    rect.Y1 = std::min(std::max(rect.Y1, 0), intrinsics.Height);
+    return rect;
+}
+
+
+//------------------------------------------------------------------------------
+// ReplayRecorder
+
+bool ReplayRecorder::Open(
+    const std::string& file_path,
+    const std::vector<CameraCalibration>& calibration,
+    const std::vector<protos::CameraExtrinsics>& extrinsics)
+{
+    Close();
+
+    std::lock_guard<std::mutex> locker(FileLock);
+
+    File.open(file_path.c_str(), std::ios::binary);
+    if (!File) {
+        spdlog::error("Failed to open replay recording {}", file_path);
+        return false;
+    }
+
+    CameraCount = static_cast<unsigned>( calibration.size() );
+
+    const uint32_t magic = kReplayFileMagic;
+    const uint32_t count = CameraCount;
+    File.write((const char*)&magic, sizeof(magic));
+    File.write((const char*)&count, sizeof(count));
+
+    for (unsigned i = 0; i < CameraCount; ++i)
+    {
+        protos::CameraExtrinsics camera_extrinsics{};
+        if (i < extrinsics.size()) {
+            camera_extrinsics = extrinsics[i];
+        }
+
+        File.write((const char*)&calibration[i], sizeof(CameraCalibration));
+        File.write((const char*)&camera_extrinsics, sizeof(camera_extrinsics));
+    }
+
+    if (!File) {
+        spdlog::error("Failed to write replay recording {}", file_path);
+        File.close();
+        return false;
+    }
+
+    FilePath = file_path;
+    FrameCount = 0;
+    Recording = true;
+
+    spdlog::info("Recording {} cameras to {}", CameraCount, file_path);
+    return true;
+}
+
+void ReplayRecorder::Close()
+{
+    std::lock_guard<std::mutex> locker(FileLock);
+
+    if (!Recording) {
+        return;
+    }
+    Recording = false;
+
+    File.close();
+
+    spdlog::info("Recorded {} frames to {}", FrameCount, FilePath);
+}
+
+void ReplayRecorder::WriteFrame(const RgbdImage& image)
+{
+    std::lock_guard<std::mutex> locker(FileLock);
+
+    if (!Recording) {
+        return;
+    }
+    if (image.DeviceIndex < 0 || static_cast<unsigned>( image.DeviceIndex ) >= CameraCount) {
+        return;
+    }
+
+    ReplayFrameHeader header{};
+    header.Magic = kReplayFrameMagic;
+    header.CameraIndex = image.DeviceIndex;
+    header.IsJpegBuffer = image.IsJpegBuffer ? 1 : 0;
+    header.ColorWidth = image.ColorWidth;
+    header.ColorHeight = image.ColorHeight;
+    header.ColorStride = image.ColorStride;
+    header.ColorBytes = static_cast<uint32_t>( image.ColorImage.size() );
+    header.DepthWidth = image.DepthWidth;
+    header.DepthHeight = image.DepthHeight;
+    header.DepthStride = image.DepthStride;
+    header.ColorExposureUsec = static_cast<uint32_t>( image.ColorExposureUsec );
+    header.ColorWhiteBalanceUsec = image.ColorWhiteBalanceUsec;
+    header.ColorIsoSpeed = image.ColorIsoSpeed;
+    header.TemperatureC = image.TemperatureC;
+    for (int i = 0; i < 3; ++i) {
+        header.Accelerometer[i] = image.AccelerationSample[i];
+    }
+
+    const size_t depth_count = static_cast<size_t>( image.DepthWidth ) * image.DepthHeight;
+    if (image.DepthImage.size() < depth_count) {
+        spdlog::warn("Skipping camera {} frame with short depth image", image.DeviceIndex);
+        return;
+    }
+
+    File.write((const char*)&header, sizeof(header));
+    File.write((const char*)image.ColorImage.data(), image.ColorImage.size());
+    File.write((const char*)image.DepthImage.data(), depth_count * sizeof(uint16_t));
+
+    if (!File) {
+        spdlog::error("Failed to write {}: Stopping recording", FilePath);
+        Recording = false;
+        File.close();
+        return;
+    }
+
+    ++FrameCount;
+}
+
+
+//------------------------------------------------------------------------------
+// ReplayDevice
+
+bool ReplayDevice::Open(
+    const uint32_t index,
+    const K4aDeviceSettings& settings,
+    ImageCallback callback)
+{
+    Status = CameraStatus::Initializing;
+    NeedsReset = false;
+
+    Settings = settings;
+    DeviceIndex = index;
+    Callback = callback;
+
+    Info = K4aDeviceInfo();
+    Info.DeviceIndex = index;
+    Info.SerialNumber = fmt::format("replay{}", index);
+
+    // Emulate a daisy chain with camera 0 as master
+    Info.sync_out_jack_connected = (index == 0);
+    Info.sync_in_jack_connected = (index != 0);
+
+    Prng.seed(static_cast<unsigned>( GetTimeUsec() ) + index);
+
+    if (!Replay.FilePath.empty()) {
+        if (!OpenRecording()) {
+            Status = CameraStatus::StartFailed;
+            return false;
+        }
+    } else {
+        OpenSynthetic();
+    }
+
+    Mesher = std::make_shared<DepthMesher>();
+    Mesher->Initialize(Info.Calibration);
+
+    spdlog::info("[{}] Replay device open: {}",
+        DeviceIndex, Replay.FilePath.empty() ? "Synthetic scene" : Replay.FilePath);
+
+    return true;
+}
+
+bool ReplayDevice::OpenRecording()
+{
+    File.close();
+    File.clear();
+
+    File.open(Replay.FilePath.c_str(), std::ios::binary);
+    if (!File) {
+        spdlog::error("[{}] Failed to open replay recording {}", DeviceIndex, Replay.FilePath);
+        return false;
+    }
+
+    uint32_t magic = 0, count = 0;
+    File.read((char*)&magic, sizeof(magic));
+    File.read((char*)&count, sizeof(count));
+    if (!File || magic != kReplayFileMagic || count == 0) {
+        spdlog::error("[{}] Invalid replay recording {}", DeviceIndex, Replay.FilePath);
+        return false;
+    }
+
+    // Reuse the recorded cameras if we are emulating more of them
+    SourceCameraIndex = DeviceIndex % count;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        CameraCalibration calibration{};
+        protos::CameraExtrinsics extrinsics{};
+        File.read((char*)&calibration, sizeof(calibration));
+        File.read((char*)&extrinsics, sizeof(extrinsics));
+
+        if (i == SourceCameraIndex) {
+            Info.Calibration = calibration;
+            if (File && !extrinsics.IsIdentity) {
+                RuntimeConfig->SetExtrinsics(DeviceIndex, extrinsics);
+                spdlog::info("[{}] Restored extrinsics from replay recording", DeviceIndex);
+            }
+        }
+    }
+
+    if (!File) {
+        spdlog::error("[{}] Truncated replay recording {}", DeviceIndex, Replay.FilePath);
+        return false;
+    }
+
+    FirstFrameOffset = File.tellg();
+    return true;
+}
+
+void ReplayDevice::OpenSynthetic()
+{
+    GetColorResolution(Settings.ColorResolution, ColorWidth, ColorHeight);
+    GetDepthResolution(Settings.DepthMode, DepthWidth, DepthHeight);
+
+    const bool wide_fov = (Settings.DepthMode == K4A_DEPTH_MODE_WFOV_2X2BINNED ||
+        Settings.DepthMode == K4A_DEPTH_MODE_WFOV_UNBINNED);
+
+    CameraCalibration& calibration = Info.Calibration;
+    MakeSyntheticIntrinsics(ColorWidth, ColorHeight, 0.47f, calibration.Color);
+    MakeSyntheticIntrinsics(DepthWidth, DepthHeight, wide_fov ? 0.49f : 0.79f, calibration.Depth);
+
+    for (int i = 0; i < 9; ++i) {
+        calibration.RotationFromDepth[i] = (i % 4 == 0) ? 1.f : 0.f;
+    }
+    calibration.TranslationFromDepth[0] = -32.f;
+    calibration.TranslationFromDepth[1] = 0.f;
+    calibration.TranslationFromDepth[2] = 0.f;
+
+    // Floor and back wall do not move, so they are drawn once here
+    BackgroundDepth.resize(DepthWidth * DepthHeight);
+    for (int y = 0; y < DepthHeight; ++y)
+    {
+        const uint16_t depth_mm = static_cast<uint16_t>( SyntheticBackgroundMm(calibration.Depth, y) );
+        uint16_t* row = BackgroundDepth.data() + y * DepthWidth;
+        for (int x = 0; x < DepthWidth; ++x) {
+            row[x] = depth_mm;
+        }
+    }
+
+    // NV12 with stride = width.  The wall is tiled to give the video encoder
+    // some texture to work with, and the floor gets darker with distance
+    const int chroma_width = ColorWidth / 2, chroma_height = ColorHeight / 2;
+    BackgroundColor.resize(ColorWidth * ColorHeight + chroma_width * chroma_height * 2);
+    uint8_t* y_plane = BackgroundColor.data();
+    uint8_t* uv_plane = y_plane + ColorWidth * ColorHeight;
+
+    for (int y = 0; y < ColorHeight; ++y)
+    {
+        const float depth_mm = SyntheticBackgroundMm(calibration.Color, y);
+        const bool is_floor = depth_mm < kSyntheticWallMm;
+        const uint8_t floor_luma = static_cast<uint8_t>( 40.f + 100.f * (1.f - depth_mm / kSyntheticWallMm) );
+
+        uint8_t* row = y_plane + y * ColorWidth;
+        for (int x = 0; x < ColorWidth; ++x)
+        {
+            if (is_floor) {
+                row[x] = floor_luma;
+            } else {
+                row[x] = (((x >> 5) ^ (y >> 5)) & 1) ? 150 : 110;
+            }
+        }
+    }
+    for (int y = 0; y < chroma_height; ++y)
+    {
+        const bool is_floor = SyntheticBackgroundMm(calibration.Color, y * 2) < kSyntheticWallMm;
+
+        uint8_t* row = uv_plane + y * chroma_width * 2;
+        for (int x = 0; x < chroma_width; ++x)
+        {
+            row[x * 2] = is_floor ? 110 : 128; // U
+            row[x * 2 + 1] = is_floor ? 140 : 128; // V
+        }
+    }
+}
+
+bool ReplayDevice::StartImageCapture(
+    k4a_wired_sync_mode_t sync_mode,
+    int32_t depth_delay_off_color_usec)
+{
+    DepthDelayOffColorUsec = depth_delay_off_color_usec;
+
+    spdlog::info("[{}] Starting replay as {} with depth-color delay offset {} usec",
+        DeviceIndex,
+        k4a_sync_mode_to_string(sync_mode),
+        depth_delay_off_color_usec);
+
+    ExpectedFramerate = Replay.Framerate > 0 ? Replay.Framerate : k4a_fps_to_int(Settings.CameraFPS);
+    ExpectedFrameIntervalUsec = 1000000 / ExpectedFramerate;
+    spdlog::debug("Configured Framerate={} -> Expected interval={} usec",
+        ExpectedFramerate, ExpectedFrameIntervalUsec);
+
+    // Each device clock started counting at a different time
+    std::uniform_int_distribution<unsigned> start_dist(0, 1000000);
+    DeviceClockStartUsec = GetTimeUsec() - start_dist(Prng);
+
+    HubDelayUsec = DeviceIndex * kHubDelayUsec;
+
+    ClockSync.Reset();
+
+    Terminated = false;
+    CameraThread = std::make_shared<std::thread>(&ReplayDevice::CameraLoop, this);
+
+    Status = CameraStatus::Capturing;
+
+    return true;
+}
+
+bool ReplayDevice::StartImuCapture()
+{
+    return true;
+}
+
+void ReplayDevice::Stop()
+{
+    Status = CameraStatus::Idle;
+
+    if (Terminated) {
+        return;
+    }
+
+    Terminated = true;
+
+    JoinThread(CameraThread);
+
+    ClearCaptureHistory();
+}
+
+void ReplayDevice::Close()
+{
+    Stop();
+
+    File.close();
+}
+
+void ReplayDevice::CameraLoop()
+{
+    SetCurrentThreadName("ReplayCamera");
+
+    std::uniform_int_distribution<int> jitter_dist(0, std::max(Replay.JitterUsec, 0));
+    std::uniform_real_distribution<float> drop_dist(0.f, 1.f);
+
+    const uint64_t interval_usec = ExpectedFrameIntervalUsec;
+
+    // All replay devices fire on the same grid of sync pulses, as if they
+    // were connected by a sync cable
+    uint64_t pulse_usec = (GetTimeUsec() / interval_usec + 1) * interval_usec;
+
+    uint64_t last_status_usec = 0;
+
+    while (!Terminated)
+    {
+        // Lockless read of index
+        const int write_capture_index = WriteCaptureIndex;
+
+        // Release historical capture
+        CaptureHistory[write_capture_index].reset();
+
+        // Depth exposure follows the sync pulse by the TDMA offset,
+        // and then the frame takes a while to arrive over USB
+        const uint64_t frame_pulse_usec = pulse_usec;
+        const uint64_t depth_usec = frame_pulse_usec + DepthDelayOffColorUsec;
+        const uint64_t arrival_usec = depth_usec + kUsbLatencyUsec + HubDelayUsec + jitter_dist(Prng);
+
+        const uint64_t t0 = GetTimeUsec();
+        if (arrival_usec > t0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(arrival_usec - t0));
+        }
+        if (Terminated) {
+            break;
+        }
+
+        pulse_usec += interval_usec;
+
+        // If we fell behind then skip frames like the camera would
+        const uint64_t t1 = GetTimeUsec();
+        if (t1 > pulse_usec + interval_usec) {
+            const uint64_t skipped = (t1 - pulse_usec) / interval_usec;
+            pulse_usec += skipped * interval_usec;
+            spdlog::warn("[{}] Replay fell behind by {} frames!  CPU load may be too high.",
+                DeviceIndex, skipped);
+            Status = CameraStatus::SlowWarning;
+        } else if (t1 - last_status_usec > 3000000) {
+            Status = CameraStatus::Capturing;
+            last_status_usec = t1;
+        }
+
+        if (Replay.DropRate > 0.f && drop_dist(Prng) < Replay.DropRate) {
+            continue;
+        }
+
+        std::shared_ptr<RgbdImage> image = std::make_shared<RgbdImage>();
+
+        if (!Replay.FilePath.empty()) {
+            if (!ReadFrame(*image)) {
+                Status = CameraStatus::ReadFailed;
+                break;
+            }
+        } else {
+            GenerateFrame(frame_pulse_usec, *image);
+        }
+
+        image->DeviceIndex = DeviceIndex;
+        image->Mesher = Mesher;
+        image->FrameNumber = NextFrameNumber++;
+        image->Framerate = ExpectedFramerate;
+
+        image->DepthDeviceUsec = depth_usec - DeviceClockStartUsec;
+        image->DepthSystemUsec = arrival_usec;
+        image->ColorDeviceUsec = frame_pulse_usec - DeviceClockStartUsec;
+        image->ColorSystemUsec = arrival_usec;
+
+        // Same as K4aDevice::OnCapture()
+        image->SyncDeviceUsec = image->DepthDeviceUsec - DepthDelayOffColorUsec;
+        image->SyncSystemUsec = ClockSync.CalculateSyncSystemUsec(image->DepthSystemUsec, image->SyncDeviceUsec);
+        image->SyncSystemUsec += image->ColorExposureUsec / 2;
+
+        StoreCapture(write_capture_index, image);
+    }
+}
+
+bool ReplayDevice::ReadFrame(RgbdImage& image)
+{
+    // Read to the end of the file, then loop back around once
+    int rewind_count = 0;
+
+    while (rewind_count < 2)
+    {
+        ReplayFrameHeader header{};
+        File.read((char*)&header, sizeof(header));
+
+        const size_t depth_count = static_cast<size_t>( header.DepthWidth ) * header.DepthHeight;
+
+        if (File && header.Magic != kReplayFrameMagic) {
+            spdlog::error("[{}] Corrupted frame in replay recording {}", DeviceIndex, Replay.FilePath);
+            return false;
+        }
+
+        if (File && header.CameraIndex != SourceCameraIndex) {
+            File.seekg(header.ColorBytes + depth_count * sizeof(uint16_t), std::ios::cur);
+            continue;
+        }
+
+        if (File)
+        {
+            if (header.DepthWidth != Info.Calibration.Depth.Width ||
+                header.DepthHeight != Info.Calibration.Depth.Height ||
+                header.ColorBytes > kReplayMaxColorBytes)
+            {
+                spdlog::error("[{}] Frame does not match calibration in replay recording {}",
+                    DeviceIndex, Replay.FilePath);
+                return false;
+            }
+
+            image.ColorImage.resize(header.ColorBytes);
+            image.DepthImage.resize(depth_count);
+            File.read((char*)image.ColorImage.data(), header.ColorBytes);
+            File.read((char*)image.DepthImage.data(), depth_count * sizeof(uint16_t));
+        }
+
+        // If we reached the end of the recording:
+        if (!File) {
+            File.clear();
+            File.seekg(FirstFrameOffset);
+            ++rewind_count;
+            continue;
+        }
+
+        image.IsJpegBuffer = header.IsJpegBuffer != 0;
+        image.ColorWidth = header.ColorWidth;
+        image.ColorHeight = header.ColorHeight;
+        image.ColorStride = header.ColorStride;
+        image.DepthWidth = header.DepthWidth;
+        image.DepthHeight = header.DepthHeight;
+        image.DepthStride = header.DepthStride;
+        image.ColorExposureUsec = header.ColorExposureUsec;
+        image.ColorWhiteBalanceUsec = header.ColorWhiteBalanceUsec;
+        image.ColorIsoSpeed = header.ColorIsoSpeed;
+        image.TemperatureC = header.TemperatureC;
+        image.AccelerationSample = Eigen::Vector3f(
+            header.Accelerometer[0],
+            header.Accelerometer[1],
+            header.Accelerometer[2]);
+        return true;
+    }
+
+    spdlog::error("[{}] No frames for camera {} in replay recording {}",
+        DeviceIndex, SourceCameraIndex, Replay.FilePath);
+    return false;
+}
+
+void ReplayDevice::GenerateFrame(uint64_t pulse_usec, RgbdImage& image)
+{
+    // The box sweeps side to side, and each camera sees it at a different point
+    const float phase = (pulse_usec % kSyntheticSweepUsec) / static_cast<float>( kSyntheticSweepUsec );
+    const float box_x_mm = kSyntheticBoxSweepMm * std::sin(phase * 6.2831853f + static_cast<float>( DeviceIndex ));
+
+    image.IsJpegBuffer = false;
+    image.ColorWidth = ColorWidth;
+    image.ColorHeight = ColorHeight;
+    image.ColorStride = ColorWidth;
+    image.ColorImage = BackgroundColor;
+
+    const SyntheticRect color_rect = ProjectSyntheticBox(Info.Calibration.Color, box_x_mm);
+    uint8_t* y_plane = image.ColorImage.data();
+    uint8_t* uv_plane = y_plane + ColorWidth * ColorHeight;
+    for (int y = color_rect.Y0; y < color_rect.Y1; ++y) {
+        uint8_t* row = y_plane + y * ColorWidth;
+        for (int x = color_rect.X0; x < color_rect.X1; ++x) {
+            row[x] = static_cast<uint8_t>( 160 + ((x + y) & 31) );
+        }
+    }
+    for (int y = color_rect.Y0 / 2; y < color_rect.Y1 / 2; ++y) {
+        uint8_t* row = uv_plane + y * ColorWidth;
+        for (int x = color_rect.X0 / 2; x < color_rect.X1 / 2; ++x) {
+            row[x * 2] = 90; // U
+            row[x * 2 + 1] = 170; // V
+        }
+    }
+
+    image.DepthWidth = DepthWidth;
+    image.DepthHeight = DepthHeight;
+    image.DepthStride = DepthWidth * 2;
+    image.DepthImage = BackgroundDepth;
+
+    const SyntheticRect depth_rect = ProjectSyntheticBox(Info.Calibration.Depth, box_x_mm);
+    const uint16_t box_mm = static_cast<uint16_t>( kSyntheticBoxDistanceMm );
+    for (int y = depth_rect.Y0; y < depth_rect.Y1; ++y) {
+        uint16_t* row = image.DepthImage.data() + y * DepthWidth;
+        for (int x = depth_rect.X0; x < depth_rect.X1; ++x) {
+            row[x] = box_mm;
+        }
+    }
+
+    // A few millimeters of sensor noise so the depth does not compress for free
+    uint32_t seed = Prng();
+    for (auto& depth : image.DepthImage) {
+        seed = seed * 1103515245 + 12345;
+        depth = static_cast<uint16_t>( depth + (seed >> 29) - 3 );
+    }
+
+    // Level camera at room temperature with typical indoor exposure
+    image.AccelerationSample = Eigen::Vector3f(0.f, 0.f, -9.81f);
+    image.TemperatureC = 35.f;
+    image.ColorExposureUsec = 10000;
+    image.ColorWhiteBalanceUsec = 4500;
+    image.ColorIsoSpeed = 100;
+}
+
+
+} // namespace core
@@ -0,0 +1,185 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+#include "SoftwareVideoEncoder.hpp"
+
+#include <core_logging.hpp>
+
+#include <string.h> // memcpy
+
+#ifdef CAPTURE_FFMPEG
+extern "C" {
+#include <libavcodec/avcodec.h> // ffmpeg
+#include <libavutil/opt.h>
+}
+#endif
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Largest number of threads for the software encoder
+static const int kSoftwareEncoderMaxThreads = 4;
+
+
+//------------------------------------------------------------------------------
+// SoftwareVideoEncoder
+
+#ifdef CAPTURE_FFMPEG
+
+bool SoftwareVideoEncoder::Initialize(const SoftwareEncoderParams& params)
+{
+    Shutdown();
+    Params = params;
+
+    // Other encoders may delay output or ignore the options below, which
+    // would break the one picture per frame stream layout
+    const char* codec_name = params.Hevc ? "libx265" : "libx264";
+    const AVCodec* codec = avcodec_find_encoder_by_name(codec_name);
+    if (!codec) {
+        spdlog::error("Ffmpeg was built without {}", codec_name);
+        return false;
+    }
+
+    Context = avcodec_alloc_context3(codec);
+    Frame = av_frame_alloc();
+    Packet = av_packet_alloc();
+    if (!Context || !Frame || !Packet) {
+        spdlog::error("Ffmpeg allocation failed");
+        Shutdown();
+        return false;
+    }
+
+    const int framerate = params.Framerate > 0 ? params.Framerate : 30;
+    Context->width = params.Width;
+    Context->height = params.Height;
+    Context->pix_fmt = AV_PIX_FMT_YUV420P;
+    Context->time_base = AVRational{ 1, framerate };
+    Context->framerate = AVRational{ framerate, 1 };
+    Context->gop_size = framerate;
+    Context->max_b_frames = 0; // I and P frames only
+    Context->thread_count = kSoftwareEncoderMaxThreads;
+
+    // Quality-targeted with the bitrate as a ceiling, like QVBR
+    Context->rc_max_rate = params.Bitrate;
+    Context->rc_buffer_size = params.Bitrate;
+
+    AVDictionary* options = nullptr;
+    av_dict_set(&options, "preset", "veryfast", 0);
+    av_dict_set(&options, "tune", "zerolatency", 0);
+    av_dict_set_int(&options, "crf", params.Quality, 0);
+    av_dict_set(&options, "forced-idr", "1", 0);
+    if (!params.Hevc) {
+        av_dict_set(&options, "intra-refresh", "1", 0);
+    }
+
+    const int result = avcodec_open2(Context, codec, &options);
+    av_dict_free(&options);
+    if (result < 0) {
+        spdlog::error("Ffmpeg {} failed to open: result={}", codec_name, result);
+        Shutdown();
+        return false;
+    }
+
+    Frame->format = Context->pix_fmt;
+    Frame->width = Context->width;
+    Frame->height = Context->height;
+    if (av_frame_get_buffer(Frame, 0) < 0) {
+        spdlog::error("Ffmpeg frame allocation failed");
+        Shutdown();
+        return false;
+    }
+
+    return true;
+}
+
+void SoftwareVideoEncoder::Shutdown()
+{
+    av_packet_free(&Packet);
+    av_frame_free(&Frame);
+    avcodec_free_context(&Context);
+    NextPts = 0;
+}
+
+bool SoftwareVideoEncoder::Encode(
+    const uint8_t* nv12,
+    unsigned stride,
+    bool keyframe,
+    uint8_t*& data,
+    int& bytes)
+{
+    if (!Context) {
+        return false;
+    }
+
+    // The encoder may still reference the previous frame buffer
+    if (av_frame_make_writable(Frame) < 0) {
+        return false;
+    }
+
+    const int width = Context->width;
+    const int height = Context->height;
+    for (int y = 0; y < height; ++y) {
+        memcpy(Frame->data[0] + y * Frame->linesize[0], nv12 + y * stride, width);
+    }
+
+    // De-interleave the UV plane
+    const uint8_t* uv_plane = nv12 + stride * height;
+    for (int y = 0; y < height / 2; ++y)
+    {
+        const uint8_t* uv = uv_plane + y * stride;
+        uint8_t* u = Frame->data[1] + y * Frame->linesize[1];
+        uint8_t* v = Frame->data[2] + y * Frame->linesize[2];
+        for (int x = 0; x < width / 2; ++x) {
+            u[x] = uv[x * 2];
+            v[x] = uv[x * 2 + 1];
+        }
+    }
+
+    Frame->pts = NextPts++;
+    Frame->pict_type = keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    av_packet_unref(Packet);
+    if (avcodec_send_frame(Context, Frame) < 0) {
+        return false;
+    }
+    if (avcodec_receive_packet(Context, Packet) < 0) {
+        return false; // Encoder is buffering frames
+    }
+
+    data = Packet->data;
+    bytes = Packet->size;
+    return bytes > 0;
+}
+
+#else // CAPTURE_FFMPEG
+
+bool SoftwareVideoEncoder::Initialize(const SoftwareEncoderParams& params)
+{
+    Params = params;
+    spdlog::error("Software video encoder unavailable: Built without XRCAP_SOFTWARE_CODECS");
+    return false;
+}
+
+void SoftwareVideoEncoder::Shutdown()
+{
+}
+
+bool SoftwareVideoEncoder::Encode(
+    const uint8_t* nv12,
+    unsigned stride,
+    bool keyframe,
+    uint8_t*& data,
+    int& bytes)
+{
+    CORE_UNUSED2(nv12, stride);
+    CORE_UNUSED2(keyframe, data);
+    CORE_UNUSED(bytes);
+    return false;
+}
+
+#endif // CAPTURE_FFMPEG
+
+
+} // namespace core
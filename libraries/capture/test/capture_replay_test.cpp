@@ -0,0 +1,160 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Headless capture pipeline test
+
+    Starts the CaptureManager on synthetic ReplayDevice cameras, so no Azure
+    Kinect or GPU is needed, and checks that matched batches come out of the
+    batch processor.
+*/
+
+#include <CaptureManager.hpp>
+
+#include <core_logging.hpp>
+using namespace core;
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Number of synthetic cameras to replay
+static const int kCameraCount = 2;
+
+// Batches that must be received for each test
+static const int kBatchTarget = 10;
+
+// Time allowed to receive the batches, including camera startup
+static const int kTimeoutMsec = 20000;
+
+
+//------------------------------------------------------------------------------
+// Replay Test
+
+static bool CheckBatch(const ImageBatch& batch, bool images_needed, bool video_needed)
+{
+    if (batch.Images.size() != static_cast<size_t>( kCameraCount )) {
+        spdlog::error("Batch {} has {} images", batch.BatchNumber, batch.Images.size());
+        return false;
+    }
+
+    for (int i = 0; i < kCameraCount; ++i)
+    {
+        const RgbdImage* image = batch.Images[i].get();
+        if (!image) {
+            spdlog::error("Batch {} is missing camera {}", batch.BatchNumber, i);
+            return false;
+        }
+        if (image->DeviceIndex != i) {
+            spdlog::error("Batch {} has camera {} in slot {}", batch.BatchNumber, image->DeviceIndex, i);
+            return false;
+        }
+        if (image->DepthImage.empty() || image->MeshVertices.empty()) {
+            spdlog::error("Batch {} camera {} has no depth", batch.BatchNumber, i);
+            return false;
+        }
+        if (images_needed && (!image->Color[0] || !image->Color[1] || !image->IsNV12)) {
+            spdlog::error("Batch {} camera {} has no color image", batch.BatchNumber, i);
+            return false;
+        }
+        if (video_needed && (image->CompressedImage.empty() || image->CompressedDepth.empty())) {
+            spdlog::error("Batch {} camera {} was not compressed", batch.BatchNumber, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool ReplayTest(bool images_needed, bool video_needed)
+{
+    RuntimeConfiguration config{};
+    config.Mode = CaptureMode::Disabled;
+    config.ImagesNeeded = images_needed;
+    config.VideoNeeded = video_needed;
+
+    std::atomic<int> batch_count = ATOMIC_VAR_INIT(0);
+    std::atomic<int> keyframe_count = ATOMIC_VAR_INIT(0);
+    std::atomic<int> last_batch_number = ATOMIC_VAR_INIT(-1);
+    std::atomic<bool> failed = ATOMIC_VAR_INIT(false);
+
+    CaptureManager manager;
+
+    ReplaySettings replay;
+    replay.CameraCount = kCameraCount;
+    manager.SetReplay(true, replay);
+
+    manager.Initialize(&config, [&](std::shared_ptr<ImageBatch>& batch) {
+        if (!CheckBatch(*batch, images_needed, video_needed)) {
+            failed = true;
+        }
+
+        // Completed batches are delivered in order
+        if (batch->BatchNumber <= last_batch_number) {
+            spdlog::error("Batch {} received after batch {}", batch->BatchNumber, last_batch_number.load());
+            failed = true;
+        }
+        last_batch_number = batch->BatchNumber;
+
+        if (batch->Keyframe) {
+            ++keyframe_count;
+        }
+        ++batch_count;
+    });
+
+    // Low quality capture mode uses NV12 color
+    manager.SetMode(CaptureMode::CaptureLowQual);
+
+    const uint64_t t0 = GetTimeMsec();
+    while (batch_count < kBatchTarget && !failed)
+    {
+        if (GetTimeMsec() - t0 > kTimeoutMsec) {
+            spdlog::error("Timed out: Received {} batches, status={}",
+                batch_count.load(), CaptureStatusToString(manager.GetStatus()));
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    manager.Shutdown();
+
+    if (failed || batch_count < kBatchTarget) {
+        return false;
+    }
+    if (video_needed && keyframe_count <= 0) {
+        spdlog::error("No keyframe received");
+        return false;
+    }
+
+    spdlog::info("Replay images={} video={}: {} batches in {} msec",
+        images_needed, video_needed, batch_count.load(), GetTimeMsec() - t0);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char* argv[])
+{
+    CORE_UNUSED2(argc, argv);
+
+    SetCurrentThreadName("Main");
+
+    if (!ReplayTest(false, false)) {
+        spdlog::error("Replay matching test failed");
+        return CORE_APP_FAILURE;
+    }
+    if (!ReplayTest(true, false)) {
+        spdlog::error("Replay pass-through test failed");
+        return CORE_APP_FAILURE;
+    }
+
+#ifdef CAPTURE_FFMPEG
+    if (!ReplayTest(true, true)) {
+        spdlog::error("Replay video test failed");
+        return CORE_APP_FAILURE;
+    }
+#endif
+
+    return CORE_APP_SUCCESS;
+}
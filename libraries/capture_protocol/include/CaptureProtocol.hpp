@@ -101,6 +101,7 @@ enum VideoTypes
     VideoType_Lossless, ///< Used for depth compression only
     VideoType_H264,
     VideoType_H265,
+    VideoType_NearLossless, ///< Used for depth compression only
 
     VideoType_Count
 };
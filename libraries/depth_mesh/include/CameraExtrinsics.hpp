@@ -3,6 +3,17 @@
 /*
     From a set of point clouds, find a transform that best fits them together,
     producing the extrinsics for the depth cameras that generated the clouds.
+
+    The point cloud for each camera is downsampled and gets normals once, and
+    the clouds are prepared in parallel.  Then each camera is registered
+    against camera 0 with Colored ICP, with all cameras running concurrently.
+
+    Cameras on the far side of a rig may share little with camera 0, so the
+    registration to camera 0 is only a starting point.  Every other pair of
+    cameras is registered in parallel too, and pairs that overlap become edges
+    of a pose graph.  The edges that connect each camera to camera 0 through
+    the best overlaps are kept, and the rest may be pruned as outliers while
+    the pose graph optimization solves all of the camera poses together.
 */
 
 #pragma once
@@ -11,6 +22,8 @@
 #include <Eigen/Eigen>
 
 #include <cstdint>
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace core {
@@ -70,17 +83,49 @@ struct AlignmentTransform
 };
 
 // Returns result in `extrinsics`.
+// Each stage is timed in the log.
+// If `residuals` is provided, it receives the RMS distance in meters between
+// each camera's points and the cameras it overlaps.
 // Returns false if registration was not possible.  Try adding more features to the scene.
 bool CalculateExtrinsics(
     const std::vector<VerticesInfo>& vertices,
-    std::vector<AlignmentTransform>& extrinsics);
+    std::vector<AlignmentTransform>& extrinsics,
+    std::vector<float>* residuals = nullptr);
 
 // Requires previous extrinsics otherwise it will fail.
 // If successful it will update the extrinsics with the new results.
 // Returns false if registration was not possible.  Try adding more features to the scene.
 bool RefineExtrinsics(
     const std::vector<VerticesInfo>& vertices,
-    std::vector<AlignmentTransform>& extrinsics);
+    std::vector<AlignmentTransform>& extrinsics,
+    std::vector<float>* residuals = nullptr);
+
+
+//------------------------------------------------------------------------------
+// Vertices Dump
+
+// VerticesInfo loaded from a file, which owns the buffers it points to
+struct VerticesDump
+{
+    VerticesInfo Info;
+
+    std::vector<float> Floats;
+    std::vector<uint8_t> Y, UV;
+    CameraCalibration Calibration;
+};
+
+// Save the inputs for calibration so that it can be run offline.
+// Returns false if the file could not be written
+bool SaveVerticesDump(
+    const std::string& file_path,
+    const std::vector<VerticesInfo>& vertices);
+
+// Load cameras saved by SaveVerticesDump().  Files from older versions have
+// no calibration, and Info.Calibration is left null.
+// Returns false if the file could not be read
+bool LoadVerticesDump(
+    const std::string& file_path,
+    std::vector<std::shared_ptr<VerticesDump>>& dumps);
 
 
 } // namespace core
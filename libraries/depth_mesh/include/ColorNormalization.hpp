@@ -121,6 +121,95 @@ struct KdtreePointCloud
 };
 
 
+//------------------------------------------------------------------------------
+// Lighting Maps
+
+/*
+    ExtractCloudLighting() takes the median lightness and log saturation of a
+    12x12 pixel window around each mesh vertex.  Windows of nearby vertices
+    overlap almost entirely, so rather than converting each window from NV12
+    again, the image is converted once into planes of lightness and log
+    saturation, and each window is read from the planes.
+
+    The medians are found with histograms that are updated as the window
+    slides from one vertex to the next.  Lightness has one bin per value.
+    Log saturation is binned in order, so the histogram finds the bin with the
+    median, and then the exact median is selected from the few pixels in it.
+*/
+
+struct LightingMaps
+{
+    // Log saturation for pixels with no saturation
+    static constexpr float kNoSaturation = -1000.f;
+
+    // Log saturation bins: Bin 0 is for no saturation
+    static const int kSaturationBins = 4096;
+    static constexpr float kSaturationBinMin = -7.f;
+    static constexpr float kSaturationBinScale = (kSaturationBins - 2) / 14.f;
+
+    int Width = 0, Height = 0;
+
+    // HSL lightness, truncated to 0..255
+    std::vector<uint8_t> Lightness;
+
+    // Log of HSL saturation, or kNoSaturation
+    std::vector<float> LogSaturation;
+
+    // Bin for each LogSaturation value, in the same order
+    std::vector<uint16_t> SaturationBin;
+
+
+    void Resize(int width, int height);
+
+    // Convert rows [first_row, end_row) of an NV12 image with the size of the maps
+    void ConvertRows(
+        const uint8_t* y_plane,
+        const uint8_t* uv_plane,
+        int first_row,
+        int end_row);
+};
+
+// Window medians over LightingMaps
+class LightingWindow
+{
+public:
+    static const int kRadius = 6;
+
+    // Start over on the given maps
+    void Reset(const LightingMaps* maps);
+
+    // Median lightness and log saturation of the window around texture
+    // coordinates (u, v).  Log saturation is 0 if no pixel had saturation.
+    // Returns false if the window is outside the image
+    bool Sample(float u, float v, float& median_l, float& median_s);
+
+protected:
+    const LightingMaps* Maps = nullptr;
+
+    // Upper-left pixel of the window, which may be outside the image
+    bool Valid = false;
+    int X0 = 0, Y0 = 0;
+
+    // Number of pixels in the window
+    unsigned Count = 0;
+
+    // Lightness histogram, and sums of 16 bins to find the median quickly
+    uint16_t Lightness[256];
+    uint16_t LightnessCoarse[256 / 16];
+
+    // Log saturation bin histogram, and sums of 64 bins
+    uint16_t Saturation[LightingMaps::kSaturationBins];
+    uint16_t SaturationCoarse[LightingMaps::kSaturationBins / 64];
+
+    std::vector<float> SaturationWork;
+
+    // Add (sign = 1) or remove (sign = -1) pixels [x0, x1) x [y0, y1)
+    void UpdateRect(int x0, int x1, int y0, int y1, int sign);
+
+    float MedianSaturation();
+};
+
+
 //------------------------------------------------------------------------------
 // Color Normalization
 
@@ -170,9 +259,11 @@ void ForegroundCreateClouds(
     const std::vector<LightCloudInputs>& inputs,
     std::vector<std::shared_ptr<KdtreePointCloud>>& clouds);
 
-// Extract lighting information in background thread
+// Extract lighting information in background thread.
+// parallel_for: Optional, used to convert images and sample points in parallel
 void ExtractCloudLighting(
-    std::vector<std::shared_ptr<KdtreePointCloud>>& clouds);
+    std::vector<std::shared_ptr<KdtreePointCloud>>& clouds,
+    const DepthMesher::ParallelForCallback& parallel_for = nullptr);
 
 // Solve for lighting offsets for each camera in background thread
 // Returns false if normalization was not possible.  Ensure that cameras
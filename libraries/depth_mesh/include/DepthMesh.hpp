@@ -14,6 +14,7 @@
 
 #include <Eigen/Eigen>
 
+#include <functional>
 #include <vector>
 
 namespace core {
@@ -27,7 +28,7 @@ struct ClipRegion
 {
     Eigen::Matrix4f Extrinsics;
 
-    // Clip limits
+    // Clip limits in meters
     float Radius = 0.f;
     float Floor = 0.f;
     float Ceiling = 0.f;
@@ -44,17 +45,79 @@ struct ImageCropRegion
 };
 
 
+// Run of pixels in one row of the depth image, for dense meshing
+struct DepthSpan
+{
+    int Y = 0;
+
+    // Pixels [X0, X1)
+    int X0 = 0, X1 = 0;
+
+    // Room for (X1 - X0) * 5 floats
+    float* Coordinates = nullptr;
+};
+
+
+//------------------------------------------------------------------------------
+// Compact Vertices
+
+/*
+    Compact mesh vertex format: 10 bytes per vertex instead of 20 bytes.
+
+    Each vertex is kCompactVertexShorts uint16_t values: x, y, z, u, v
+
+    x, y, z are int16_t fixed-point: Position = kCompactPositionScale * (x, y, z)
+    in meters, which covers +/- 8 meters in 0.25 mm steps.  The scale does not
+    depend on the mesh bounds, so DepthMesher can write compact vertices in the
+    same pass as the float vertices.
+    Texture coordinate = (u, v) / 65535, which OpenGL can unpack directly
+    with a normalized GL_UNSIGNED_SHORT attribute.
+*/
+static const int kCompactVertexShorts = 5;
+static const float kCompactPositionScale = 1.f / 4000.f;
+
+struct CompactVertices
+{
+    int VertexCount = 0;
+    std::vector<uint16_t> Vertices;
+};
+
+
 //------------------------------------------------------------------------------
 // DepthMesher
 
+// The vectorized GenerateCoordinates() output matches the scalar reference
+// path to within this relative error
+static const float kMeshSimdEpsilon = 1e-5f;
+
 // After initialization this is safe to use from multiple threads in parallel.
 // The idea would be to have one of these for each capture device.
 class DepthMesher
 {
 public:
+    // Runs task(0) .. task(count - 1), possibly in parallel, and returns when
+    // all of them have completed.  For example this can wrap tbb::parallel_for.
+    using ParallelForCallback = std::function<void(int count, const std::function<void(int)>& task)>;
+
     // Must be called before other functions
     void Initialize(const CameraCalibration& calibration);
 
+    // Split meshing into this many horizontal bands of rows that are meshed
+    // independently.  Output is identical to the default of 1 band.
+    // The band count is reduced for small images.
+    void SetBandCount(int band_count);
+
+    // Provide a thread pool for meshing bands in parallel.
+    // By default bands are processed one at a time on the calling thread.
+    void SetParallelFor(ParallelForCallback parallel_for);
+
+    // Enable the vectorized GenerateCoordinates() path (default: enabled).
+    // The scalar path is kept as the reference implementation
+    void SetSimdEnabled(bool enabled)
+    {
+        SimdEnabled = enabled;
+    }
+
     // OpenGL-compatible x, y, z, u, v coordinates without padding.
     // depth: Must match the dimensions from Initialize().
     // Zeroes out depth entries that are not useful.
@@ -70,6 +133,15 @@ public:
         bool face_painting_fix = true,
         bool cull_depth = true);
 
+    // Also writes the same vertices in the compact format in the same pass
+    void GenerateCoordinates(
+        uint16_t* depth,
+        const ClipRegion* clip,
+        std::vector<float>& coordinates,
+        CompactVertices& compact,
+        bool face_painting_fix = true,
+        bool cull_depth = true);
+
     // OpenGL-compatible 3 indices for each triangle.
     // Call after GenerateCoordinates().
     // Triangle vertices are wound such that the right-hand rule yields
@@ -78,17 +150,149 @@ public:
         const uint16_t* depth,
         std::vector<uint32_t>& indices);
 
-    // Get image crop from mesh clip region
+    // Dense interface, for example for DepthMeshDelta:
+
+    // Flags pixels in rows [first_row, end_row) that the face painting fix in
+    // GenerateCoordinates() would remove.  This only depends on the depth
+    // values in each row.
+    // mask: One byte per depth pixel, written for the rows processed
+    void GenerateFacePaintingMask(
+        const uint16_t* depth,
+        int first_row,
+        int end_row,
+        uint8_t* mask);
+
+    // Writes x, y, z, u, v for every pixel of each span, without packing,
+    // and culls depth the same way as GenerateCoordinates().
+    // Pixels with no depth, or culled while cull_depth is set, get zeroes.
+    // face_painting_mask: From GenerateFacePaintingMask(), or nullptr to
+    // disable the face painting fix.
+    // Runs on the calling thread using the scalar path
+    void GenerateCoordinatesSpans(
+        uint16_t* depth,
+        const ClipRegion* clip,
+        const uint8_t* face_painting_mask,
+        bool cull_depth,
+        const DepthSpan* spans,
+        int span_count);
+
+    // Depth image resolution from Initialize()
+    int GetDepthWidth() const
+    {
+        return Calibration.Depth.Width;
+    }
+    int GetDepthHeight() const
+    {
+        return Calibration.Depth.Height;
+    }
+
+    // Get color image crop from mesh clip region
     void CalculateCrop(
         const ClipRegion& clip,
         ImageCropRegion& crop);
 
+    // Get depth image crop from mesh clip region.
+    // Depth pixels outside of this crop never produce clipped mesh vertices,
+    // so the depth codecs only need to compress the inside of it
+    void CalculateDepthCrop(
+        const ClipRegion& clip,
+        ImageCropRegion& crop);
+
 protected:
     CameraCalibration Calibration;
 
+    bool SimdEnabled = true;
+
+    // Bands are at least this many rows
+    static constexpr int kMinBandRows = 16;
+
+    int BandCount = 1;
+    ParallelForCallback ParallelFor;
+
+    // Planar depth pixel -> x, y scale factors: All x scales then all y scales
     std::vector<float> DepthLookup;
+
+    // Get band count for the depth image height
+    int GetBandCount() const;
+
+    // Run task for each band using ParallelFor if provided
+    void ForEachBand(int count, const std::function<void(int)>& task);
+
+    // Scalar projection of one depth pixel, shared by the scalar paths
+    struct ScalarProjector;
+
+    // Shared by both GenerateCoordinates() versions.
+    // compact: Optional, or nullptr to skip compact vertices
+    void GenerateVertices(
+        uint16_t* depth,
+        const ClipRegion* clip,
+        std::vector<float>& coordinates,
+        CompactVertices* compact,
+        bool face_painting_fix,
+        bool cull_depth);
+
+    // Generate coordinates for rows [first_row, end_row).
+    // compact: Optional room for kCompactVertexShorts per vertex, or nullptr.
+    // Returns the number of vertices written
+    int GenerateCoordinatesRows(
+        uint16_t* depth,
+        const ClipRegion* clip,
+        int first_row,
+        int end_row,
+        float* coordinates,
+        uint16_t* compact,
+        bool face_painting_fix,
+        bool cull_depth);
+    int GenerateCoordinatesRowsSimd(
+        uint16_t* depth,
+        const ClipRegion* clip,
+        int first_row,
+        int end_row,
+        float* coordinates,
+        uint16_t* compact,
+        bool face_painting_fix,
+        bool cull_depth);
+
+    // Generate triangles for rows [first_row, end_row), where first_index is
+    // the lowest vertex index in the row above the band (or the first row).
+    // Returns the number of indices written
+    int GenerateTriangleRows(
+        const uint16_t* depth,
+        int first_row,
+        int end_row,
+        unsigned first_index,
+        uint32_t* indices);
+};
+
+
+//------------------------------------------------------------------------------
+// Cell Triangles
+
+/*
+    Each cell of the depth image, whose corners are:
+
+        A -- B
+        |  / |
+        | /  |
+        C -- D
+
+    produces up to two of three candidate triangles: CBA and CDB if B has
+    depth, or else CDA.  Cells are meshed by row from top to bottom, and
+    right to left within a row, like GenerateTriangleIndices().
+*/
+
+enum CellTriangleBits
+{
+    kCellTriangleCBA = 1,
+    kCellTriangleCDB = 2,
+    kCellTriangleCDA = 4,
 };
 
+// kCellTriangle* bits for the triangles GenerateTriangleIndices() emits for
+// the cell whose lower-left corner C is at c.  C must have non-zero depth and
+// must not be in the first row or the last column
+unsigned GetCellTriangles(const uint16_t* c, int width);
+
 
 //------------------------------------------------------------------------------
 // TemporalDepthFilter
@@ -105,16 +309,30 @@ protected:
         by using the Iterative Closest Points (ICP) method to align the meshes.
         Improving accuracy of depth meshes for static background scene objects.
         Expected to be applied on the capture server.
+
+    History is a planar ring of frames, so each pixel's history is read with
+    one vector load per frame: kLanes pixels are filtered at a time with
+    vertical min/max/sum across frames and a reciprocal-multiply average.
 */
 class TemporalDepthFilter
 {
 public:
+    static const int kMaxHistoryFrames = 8;
+    static const int kMinHistoryFrames = 2;
+
+    // Number of frames of history to keep, clamped to 2..8.  Default: 8.
+    // Shorter history uses less memory and time but smooths less.
+    // Resets the history if it changes
+    void SetHistoryFrames(int frames);
+
     void Filter(uint16_t* depth, int w, int h);
 
 protected:
-    static const int kStride = 8;
+    int HistoryFrames = kMaxHistoryFrames;
 
     int Width = 0, Height = 0, Count = 0, Index = 0;
+
+    // HistoryFrames planes of Width * Height depth values
     std::vector<uint16_t> History;
 };
 
@@ -125,30 +343,46 @@ protected:
 /*
     This filter cuts away edges of a mesh where there is the most uncertainty.
 
-    The first pass through the image will filter large changes in depth as edges
-    by setting the closer depth pixel to zero.  In this pass we also construct
-    an integral image (see below).
+    Large changes in depth are filtered as edges by setting the closer depth
+    pixel to zero.  Then we count the number of neighbors for each depth image
+    pixel, and cull any pixel with fewer than 6 neighbors, which is considered
+    an edge.
 
-    The second pass through the image we query the integral image to determine
-    the number of neighbors for each depth image pixel.  We cull any pixel with
-    fewer than 6 neighbors, which is considered an edge.
+    Both steps run in a single streaming pass over the image: Each row is
+    filtered for gradients (kLanes pixels at a time), then its horizontal
+    3-pixel neighbor counts are stored in a rolling window of three rows,
+    and the row above is culled from the sum of the window.
 */
 
 class DepthEdgeFilter
 {
 public:
+    static const unsigned kDefaultGradientThresholdMm = 200;
+    static const int kDefaultMinNeighbors = 6;
+
+    // Depth pixels more than this much closer than a neighbor are removed
+    void SetGradientThreshold(unsigned threshold_mm)
+    {
+        GradientThresholdMm = threshold_mm;
+    }
+
+    // Pixels with fewer than this many of their 8 neighbors are removed
+    void SetMinNeighbors(int min_neighbors)
+    {
+        MinNeighbors = min_neighbors;
+    }
+
     void Filter(uint16_t* depth, int w, int h);
 
 protected:
-    /*
-        Integral image counting the number of non-zero neighbors for each depth
-        image pixel.  It will overflow and wrap around but since we are only
-        querying the I.I. for small regions it is still unambiguous.
-
-        Good reference for this data structure:
-        https://www.mathworks.com/help/images/ref/integralimage.html
-    */
-    std::vector<uint16_t> IntegralImage;
+    unsigned GradientThresholdMm = kDefaultGradientThresholdMm;
+    int MinNeighbors = kDefaultMinNeighbors;
+
+    // Rolling window of horizontal neighbor counts for three rows, 3 * w
+    std::vector<uint8_t> RowCounts;
+
+    // Filter gradients in row y using the already filtered row above
+    void FilterRowGradients(uint16_t* depth, int w, int y);
 };
 
 
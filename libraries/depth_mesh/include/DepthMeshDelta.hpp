@@ -0,0 +1,234 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Incremental depth mesh
+
+    With the temporal filter enabled, large static parts of the depth image
+    are identical from frame to frame, so most of the mesh does not change.
+    DepthMeshDelta keeps the mesh from the previous frame and only re-meshes
+    the kBlockSize x kBlockSize blocks of depth pixels that changed.
+
+    Vertices are numbered by block rather than packed, so vertex numbers are
+    stable between frames: Block b = by * BlocksX + bx owns vertices
+    [b * kBlockVertices, (b + 1) * kBlockVertices), with pixel (x, y) at
+    local offset (y % kBlockSize) * kBlockSize + (x % kBlockSize).
+    Vertices without depth are zeroes.
+
+    Block b also owns indices [b * kBlockIndices, (b + 1) * kBlockIndices)
+    for the triangles of cells whose lower-left corner C is in the block
+    (see DepthMesher::GenerateTriangleIndices()).  The first
+    GetBlockIndexCounts()[b] indices are used, and the rest are padding with
+    degenerate triangles, so the whole index buffer can also be drawn as-is.
+
+    Each block records the version of the update in which its vertices or
+    indices last changed.  A renderer that holds the buffers from update
+    version V only needs to upload the blocks that changed after V, even if
+    it skipped some updates in between.  Versions are only comparable within
+    one stream: Each Reset() starts a new stream with a unique id.
+
+    GetSnapshot() hands out an immutable copy of the mesh that the
+    application can hold while later frames are meshed.  Snapshots that the
+    application released are recycled, and only the blocks that changed after
+    the version they hold are copied into them.
+
+    Dirty blocks are found by comparing the input depth and the face
+    painting fix mask with the previous frame: The vertex for a pixel only
+    depends on those two, given the same calibration and clip region.
+    Triangles for a cell also depend on the pixels to the right and above,
+    so a changed block also re-triangulates the blocks to its left and below.
+*/
+
+#pragma once
+
+#include "DepthMesh.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// DepthMeshDelta
+
+// Range of a mesh buffer, in elements (floats or indices)
+struct MeshDeltaRange
+{
+    int Offset = 0;
+    int Count = 0;
+};
+
+// Immutable copy of the mesh after one update, see DepthMeshDelta
+struct DepthMeshSnapshot
+{
+    uint32_t StreamId = 0;
+    uint32_t Version = 0;
+    int BlockCount = 0;
+
+    std::vector<float> Coordinates;
+    std::vector<uint32_t> Indices;
+    std::vector<uint32_t> BlockIndexCounts;
+    std::vector<uint32_t> VertexVersions;
+    std::vector<uint32_t> IndexVersions;
+};
+
+class DepthMeshDelta
+{
+public:
+    static const int kBlockSize = 8;
+    static const int kBlockVertices = kBlockSize * kBlockSize;
+    static const int kBlockFloats = kBlockVertices * 5;
+    static const int kBlockIndices = kBlockVertices * 2 * 3;
+
+    // Number of released snapshots kept for recycling
+    static const int kMaxSnapshots = 4;
+
+    DepthMeshDelta()
+    {
+        Reset();
+    }
+
+    // Start a new stream: The next update rewrites every block.
+    // Call this when the mesher calibration changes
+    void Reset();
+
+    // Like DepthMesher::GenerateCoordinates(), but only re-meshes blocks
+    // that changed since the last update.  Starts a new stream if the depth
+    // resolution, clip region or flags changed.
+    // depth: Must match the dimensions of the mesher.  Culled in place for
+    // the whole image, including unchanged blocks
+    void UpdateCoordinates(
+        DepthMesher& mesher,
+        uint16_t* depth,
+        const ClipRegion* clip,
+        bool face_painting_fix = true,
+        bool cull_depth = true);
+
+    // Like DepthMesher::GenerateTriangleIndices().
+    // Call after UpdateCoordinates() with the same depth image
+    void UpdateTriangles(const uint16_t* depth);
+
+    // Outputs:
+
+    uint32_t GetStreamId() const
+    {
+        return StreamId;
+    }
+
+    // Version of the last update, starting from 1 in each stream
+    uint32_t GetVersion() const
+    {
+        return Version;
+    }
+
+    int GetBlockCount() const
+    {
+        return BlocksX * BlocksY;
+    }
+
+    // kBlockFloats floats per block
+    const std::vector<float>& GetCoordinates() const
+    {
+        return Coordinates;
+    }
+
+    // kBlockIndices indices per block
+    const std::vector<uint32_t>& GetIndices() const
+    {
+        return Indices;
+    }
+
+    // Number of used indices in each block
+    const std::vector<uint32_t>& GetBlockIndexCounts() const
+    {
+        return BlockIndexCounts;
+    }
+
+    // Version of the update in which each block last changed
+    const std::vector<uint32_t>& GetVertexVersions() const
+    {
+        return VertexVersions;
+    }
+    const std::vector<uint32_t>& GetIndexVersions() const
+    {
+        return IndexVersions;
+    }
+
+    // Number of blocks re-meshed and re-triangulated by the last update
+    int GetChangedVertexBlocks() const
+    {
+        return ChangedVertexBlocks;
+    }
+    int GetChangedIndexBlocks() const
+    {
+        return ChangedIndexBlocks;
+    }
+
+    // Get ranges of the coordinates (in floats) and indices that changed
+    // after version since_version.  Adjacent blocks are merged
+    void GetChangedRanges(
+        uint32_t since_version,
+        std::vector<MeshDeltaRange>& coordinate_ranges,
+        std::vector<MeshDeltaRange>& index_ranges) const;
+
+    // Get a snapshot of the mesh after the last update.
+    // Repeated calls without an update return the same snapshot
+    std::shared_ptr<const DepthMeshSnapshot> GetSnapshot();
+
+protected:
+    uint32_t StreamId = 0;
+    uint32_t Version = 0;
+
+    int Width = 0, Height = 0;
+    int BlocksX = 0, BlocksY = 0;
+
+    // Parameters of the stream
+    bool HasClip = false;
+    ClipRegion Clip;
+    bool FacePaintingFix = false;
+    bool CullDepth = false;
+
+    // Input depth and face painting mask for the previous frame
+    std::vector<uint16_t> PrevDepth;
+    std::vector<uint8_t> PrevFaceMask;
+
+    // Culled depth for the previous frame
+    std::vector<uint16_t> CulledDepth;
+
+    std::vector<uint8_t> FaceMask;
+
+    // Blocks re-meshed by the last UpdateCoordinates(),
+    // and rows of blocks with any re-meshed blocks
+    std::vector<uint8_t> VertexDirty;
+    std::vector<uint8_t> RowDirty;
+    int ChangedVertexBlocks = 0;
+    int ChangedIndexBlocks = 0;
+
+    std::vector<DepthSpan> Spans;
+
+    std::vector<float> Coordinates;
+    std::vector<uint32_t> Indices;
+    std::vector<uint32_t> BlockIndexCounts;
+    std::vector<uint32_t> VertexVersions;
+    std::vector<uint32_t> IndexVersions;
+
+    // Snapshots handed out by GetSnapshot().
+    // Ones only referenced from here have been released by the application
+    std::vector<std::shared_ptr<DepthMeshSnapshot>> Snapshots;
+
+    // Returns true if the stream parameters changed
+    bool UpdateParameters(
+        DepthMesher& mesher,
+        const ClipRegion* clip,
+        bool face_painting_fix,
+        bool cull_depth);
+
+    // Returns true if block (bx, by) of the input changed
+    bool BlockChanged(const uint16_t* depth, int bx, int by) const;
+
+    // Write triangles for block (bx, by)
+    void TriangulateBlock(const uint16_t* depth, int bx, int by);
+};
+
+
+} // namespace core
@@ -0,0 +1,124 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Depth mesh level of detail
+
+    The full resolution mesh has two triangles per depth pixel, which is far
+    more geometry than needed for exports with a size cap or for viewers far
+    from the subject.  DepthMeshLod builds a simplified mesh from the same
+    depth grid by merging smooth regions into larger quadtree cells.
+
+    A square cell of s x s pixel quads is kept as one piece if all of its
+    (s + 1) x (s + 1) pixels have depth, and its triangles are within the
+    error bound of the depth of each pixel in the cell.  This is checked
+    against the bilinear surface through the four cell corners: The pixels
+    must be close to it, and the twist of the cell bounds how far the
+    triangles can be from it.  Otherwise the cell is split into four, down to
+    single pixel quads, which get the same triangles as
+    DepthMesher::GenerateTriangleIndices().
+
+    Cells are triangulated from the corners of the neighboring cells on their
+    edges, so there are no T-junctions between cells of different sizes:
+    A cell with no smaller neighbors is two triangles, and otherwise it is a
+    fan around its center pixel.
+
+    The output vertices are the used subset of the input vertices, so the
+    simplified mesh samples the same depth and texture coordinates.
+*/
+
+#pragma once
+
+#include "DepthMesh.hpp"
+
+#include <vector>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// DepthMeshLod
+
+// Order of the input vertices
+enum class DepthLodLayout
+{
+    // One vertex for each pixel with depth, packed in the order written by
+    // DepthMesher::GenerateCoordinates()
+    Packed,
+
+    // One vertex for each pixel, in blocks, see DepthMeshDelta
+    Blocks,
+};
+
+struct DepthLodParams
+{
+    // Maximum depth error in millimeters for merged cells
+    float MaxErrorMm = 4.f;
+
+    // If non-zero: The error bound is doubled until the mesh has at most
+    // this many triangles, as far as MaxCellSize allows
+    int MaxTriangles = 0;
+
+    // Largest cell in pixels, a power of two.  1 = Full resolution
+    int MaxCellSize = 32;
+};
+
+class DepthMeshLod
+{
+public:
+    // depth: Culled depth image from DepthMesher::GenerateCoordinates()
+    // coordinates: Vertices for the depth image in the given layout
+    // lod_coordinates, lod_indices: Simplified mesh in the same vertex format
+    void Generate(
+        const uint16_t* depth,
+        int width,
+        int height,
+        const float* coordinates,
+        DepthLodLayout layout,
+        const DepthLodParams& params,
+        std::vector<float>& lod_coordinates,
+        std::vector<uint32_t>& lod_indices);
+
+    // Error bound used by the last Generate(), after any budget adjustment
+    float GetErrorMm() const
+    {
+        return ErrorMm;
+    }
+
+protected:
+    int Width = 0, Height = 0;
+    float ErrorMm = 0.f;
+
+    struct LodCell
+    {
+        int X, Y; // Upper-left pixel
+        int Size;
+    };
+    std::vector<LodCell> Cells;
+
+    // 1 for each pixel that is a corner of a cell
+    std::vector<uint8_t> Corners;
+
+    // Triangles as pixel indices
+    std::vector<uint32_t> PixelTriangles;
+
+    // Scratch space for cell edges
+    std::vector<uint32_t> Boundary;
+
+    // Output vertex for each pixel, or -1
+    std::vector<int32_t> VertexMap;
+
+    // Input vertex for each pixel in the packed layout
+    std::vector<int32_t> PackedVertices;
+
+    // Split the image into cells within the error bound
+    void BuildCells(const uint16_t* depth, int max_cell_size, float max_error_mm);
+    void SplitCell(const uint16_t* depth, int x0, int y0, int size, float max_error_mm);
+    bool IsCellSmooth(const uint16_t* depth, int x0, int y0, int size, float max_error_mm) const;
+
+    // Fill PixelTriangles from Cells
+    void Triangulate(const uint16_t* depth);
+    void AddTriangle(uint32_t a, uint32_t b, uint32_t c);
+};
+
+
+} // namespace core
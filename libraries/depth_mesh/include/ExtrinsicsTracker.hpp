@@ -0,0 +1,107 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+/*
+    Incremental extrinsics tracking
+
+    Full calibration is too slow to run during capture, but the rig can still
+    drift by a few millimeters (thermal expansion, bumped tripods).
+    ExtrinsicsTracker follows the drift from live frames instead, starting
+    from the current extrinsics.
+
+    Each frame it samples a few thousand points from each camera and keeps the
+    ones that overlap camera 0, then runs a bounded number of point-to-plane
+    ICP iterations against a sparse copy of camera 0.  Cameras are processed
+    round-robin until the CPU budget for the frame runs out, and the rest pick
+    up on the next frame.  The ICP solution carries over between frames.
+
+    Results are only published when they fit the current frame significantly
+    better than the extrinsics in use, so noise does not make the mesh jitter.
+*/
+
+#pragma once
+
+#include "CameraExtrinsics.hpp"
+
+#include <memory>
+#include <vector>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// ExtrinsicsTracker
+
+struct ExtrinsicsTrackerSettings
+{
+    // Points sampled from each camera per frame
+    int SourcePoints = 2000;
+
+    // Points sampled from camera 0 to match against
+    int TargetPoints = 20000;
+
+    // Point-to-plane ICP iterations per camera per frame
+    int IterationsPerFrame = 2;
+
+    // CPU time allowed per frame.  At least one camera runs each frame
+    float BudgetMsec = 8.f;
+
+    // Points farther than this from camera 0 are outside the overlap
+    float MaxDistanceMeters = 0.02f;
+
+    // Publish when the RMS error drops by at least this fraction
+    float MinImprovement = 0.05f;
+
+    // ...and the transform moved at least this much
+    float MinTranslationMeters = 0.001f;
+    float MinRotationDegrees = 0.05f;
+};
+
+struct ExtrinsicsTrackerTarget;
+
+class ExtrinsicsTracker
+{
+public:
+    void SetSettings(const ExtrinsicsTrackerSettings& settings)
+    {
+        Settings = settings;
+    }
+
+    // Forget the tracking state.  The next Update() starts from its input
+    void Reset();
+
+    // Runs ICP on the new frame, starting from the previous solution.
+    // If `extrinsics` do not match the last published result (for example
+    // after a full calibration) then tracking restarts from them.
+    // Returns true if `extrinsics` were updated
+    bool Update(
+        const std::vector<VerticesInfo>& vertices,
+        std::vector<AlignmentTransform>& extrinsics);
+
+protected:
+    ExtrinsicsTrackerSettings Settings;
+
+    // Extrinsics as of the last Update()
+    std::vector<AlignmentTransform> Published;
+
+    // Transform from camera i to camera 0 that ICP is converging on
+    std::vector<Eigen::Matrix4f> Working;
+
+    // Next camera to track when the budget ran out last frame
+    int NextCamera = 1;
+
+    // Rotates the sampled points between frames
+    unsigned FrameCount = 0;
+
+    std::shared_ptr<ExtrinsicsTrackerTarget> Target;
+
+    // Workspace for the sampled points of one camera
+    std::vector<Eigen::Vector3f> SourcePoints;
+
+
+    bool IsPublished(const std::vector<AlignmentTransform>& extrinsics) const;
+    void Restart(const std::vector<AlignmentTransform>& extrinsics);
+    void SampleSource(const VerticesInfo& info);
+};
+
+
+} // namespace core
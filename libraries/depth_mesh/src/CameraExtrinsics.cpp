@@ -8,12 +8,20 @@
 #include <vector>
 #include <future>
 #include <cmath>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <algorithm>
 
 #include <Open3D/Geometry/PointCloud.h>
 #include <Open3D/Registration/FastGlobalRegistration.h>
 #include <Open3D/Registration/Feature.h>
 #include <Open3D/Registration/Registration.h>
 #include <Open3D/Registration/ColoredICP.h>
+#include <Open3D/Registration/GlobalOptimization.h>
+#include <Open3D/Registration/GlobalOptimizationConvergenceCriteria.h>
+#include <Open3D/Registration/GlobalOptimizationMethod.h>
+#include <Open3D/Registration/PoseGraph.h>
 #include <Open3D/Utility/Console.h>
 
 #include <apriltag.h>
@@ -26,10 +34,11 @@ namespace core {
 //------------------------------------------------------------------------------
 // Registration
 
+// Pass nullptr for `feature_out` to skip FPFH feature generation
 static bool GenerateCloudFromVertices(
-    VerticesInfo vertices,
+    const VerticesInfo& vertices,
     std::shared_ptr<open3d::geometry::PointCloud>& cloud,
-    std::shared_ptr<open3d::registration::Feature>& feature)
+    std::shared_ptr<open3d::registration::Feature>* feature_out)
 {
     if (!vertices.XyzuvVertices || vertices.FloatsCount <= 0) {
         return false;
@@ -86,35 +95,375 @@ static bool GenerateCloudFromVertices(
         return false;
     }
 
+    // Features are only needed for global registration
+    if (!feature_out) {
+        return true;
+    }
+
     // Generate cloud features
     const double feature_radius = voxel_size * 5.0;
     const open3d::geometry::KDTreeSearchParamHybrid features_params(feature_radius, 100);
+    auto& feature = *feature_out;
     feature = open3d::registration::ComputeFPFHFeature(*cloud, features_params);
     if (!feature) {
-        spdlog::error("ComputeFPFHFeature failed for i=0");
+        spdlog::error("ComputeFPFHFeature failed");
         return false;
     }
 
     return true;
 }
 
-bool CalculateExtrinsics(
+// Runs the tasks on a thread per CPU core
+static void RegistrationParallelFor(int count, const std::function<void(int)>& task)
+{
+    std::atomic<int> next_task(0);
+    auto worker = [&]() {
+        for (;;) {
+            const int i = next_task++;
+            if (i >= count) {
+                break;
+            }
+            task(i);
+        }
+    };
+
+    const int thread_count = std::min(count, std::max(1, static_cast<int>( std::thread::hardware_concurrency() )));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Downsampled cloud with normals for one camera, shared by all of its pairs
+struct RegistrationCloud
+{
+    std::shared_ptr<open3d::geometry::PointCloud> Cloud;
+
+    // Only generated if requested
+    std::shared_ptr<open3d::registration::Feature> Feature;
+};
+
+static bool GenerateClouds(
     const std::vector<VerticesInfo>& vertices,
-    std::vector<AlignmentTransform>& output)
+    bool generate_features,
+    std::vector<RegistrationCloud>& clouds)
 {
-    output.clear();
-    if (vertices.empty()) {
-        spdlog::warn("No images provided to registration");
+    const uint64_t t0 = GetTimeUsec();
+
+    const int camera_count = static_cast<int>( vertices.size() );
+    clouds.clear();
+    clouds.resize(camera_count);
+    std::vector<uint8_t> generated(camera_count, 0);
+
+    RegistrationParallelFor(camera_count, [&](int camera_index) {
+        auto& cloud = clouds[camera_index];
+        if (GenerateCloudFromVertices(
+            vertices[camera_index],
+            cloud.Cloud,
+            generate_features ? &cloud.Feature : nullptr))
+        {
+            generated[camera_index] = 1;
+        }
+    });
+
+    for (int camera_index = 0; camera_index < camera_count; ++camera_index) {
+        if (!generated[camera_index]) {
+            spdlog::error("GenerateCloudFromVertices failed for i={}", camera_index);
+            return false;
+        }
+    }
+
+    const uint64_t t1 = GetTimeUsec();
+    spdlog::info("===========================================================");
+    spdlog::info("Generated {} clouds in {} msec", camera_count, (t1 - t0) / 1000.f);
+
+    return true;
+}
+
+// Cameras are registered concurrently so each line is tagged with the camera
+static void LogTransform(const char* name, int camera_index, const Eigen::Matrix4f& transform)
+{
+    for (int j = 0; j < 4; ++j)
+    {
+        spdlog::info("Camera {}: {}{} {}, {}, {}, {}{}",
+            camera_index,
+            j == 0 ? name : "",
+            j == 0 ? " = [" : "",
+            transform(j, 0),
+            transform(j, 1),
+            transform(j, 2),
+            transform(j, 3),
+            j == 3 ? " ]" : ",");
+    }
+}
+
+// Register every camera i > 0 against camera 0 in parallel.
+// Reads initial guesses from `transforms` and replaces them with the results.
+// `fitness` receives the fraction of each camera's points that overlap camera 0
+static void RegisterToFirstCamera(
+    const std::vector<RegistrationCloud>& clouds,
+    double max_distance,
+    double lambda_geometric,
+    std::vector<Eigen::Matrix4f>& transforms,
+    std::vector<double>& fitness)
+{
+    const uint64_t t0 = GetTimeUsec();
+
+    const int camera_count = static_cast<int>( clouds.size() );
+    const auto& cloud_0 = *clouds[0].Cloud;
+    fitness.assign(camera_count, 1.0);
+
+    RegistrationParallelFor(camera_count - 1, [&](int task_index) {
+        const int camera_index = task_index + 1;
+        const uint64_t t1 = GetTimeUsec();
+
+        const Eigen::Matrix4d initial_transform = transforms[camera_index].cast<double>();
+
+        auto result = open3d::registration::RegistrationColoredICP(
+            *clouds[camera_index].Cloud,
+            cloud_0,
+            max_distance,
+            initial_transform,
+            lambda_geometric);
+
+        transforms[camera_index] = result.transformation_.cast<float>();
+        fitness[camera_index] = result.fitness_;
+
+        const uint64_t t2 = GetTimeUsec();
+        spdlog::info("Color ICP refinement for {} -> 0 in {} msec: fitness={} rmse={}",
+            camera_index, (t2 - t1) / 1000.f, result.fitness_, result.inlier_rmse_);
+
+        LogTransform("transform", camera_index, transforms[camera_index]);
+    });
+
+    const uint64_t t3 = GetTimeUsec();
+    spdlog::info("===========================================================");
+    spdlog::info("Registered {} cameras in {} msec", camera_count - 1, (t3 - t0) / 1000.f);
+}
+
+//------------------------------------------------------------------------------
+// Pose Graph
+
+// Pairs that share less than this fraction of points are not constrained
+static const double kMinPairFitness = 0.1;
+
+// Relative transform from the source camera to the target camera
+struct PairConstraint
+{
+    int Source = 0, Target = 0;
+    Eigen::Matrix4d Transform;
+    Eigen::Matrix6d Information;
+    double Fitness = 0.0;
+
+    // Part of the maximum spanning tree of fitness, so never pruned
+    bool Certain = false;
+};
+
+// Mark edges that connect every camera to camera 0 through the best overlaps.
+// Returns false if some camera does not overlap any other camera
+static bool SelectCertainEdges(int camera_count, std::vector<PairConstraint>& pairs)
+{
+    std::vector<uint8_t> connected(camera_count, 0);
+    connected[0] = 1;
+
+    // Prim's algorithm: Grow the tree by the best edge leaving it
+    for (int added = 1; added < camera_count; ++added)
+    {
+        int best_pair = -1;
+        for (int i = 0; i < (int)pairs.size(); ++i)
+        {
+            const auto& pair = pairs[i];
+            if (connected[pair.Source] == connected[pair.Target]) {
+                continue;
+            }
+            if (best_pair == -1 || pair.Fitness > pairs[best_pair].Fitness) {
+                best_pair = i;
+            }
+        }
+        if (best_pair == -1) {
+            return false;
+        }
+
+        pairs[best_pair].Certain = true;
+        connected[pairs[best_pair].Source] = 1;
+        connected[pairs[best_pair].Target] = 1;
+    }
+
+    return true;
+}
+
+// Jointly solve all camera poses from every overlapping pair.
+// The star registration to camera 0 provides `transforms` and `star_fitness`,
+// where transforms[0] is the identity.
+// `residuals` receives the RMS point distance in meters for each camera.
+// Returns false if the cameras do not form a connected graph
+static bool OptimizePoseGraph(
+    const std::vector<RegistrationCloud>& clouds,
+    double max_distance,
+    double lambda_geometric,
+    const std::vector<double>& star_fitness,
+    std::vector<Eigen::Matrix4f>& transforms,
+    std::vector<float>& residuals)
+{
+    const uint64_t t0 = GetTimeUsec();
+
+    const int camera_count = static_cast<int>( clouds.size() );
+    residuals.assign(camera_count, 0.f);
+
+    // Every pair of cameras, including the star edges already registered
+    std::vector<PairConstraint> pairs;
+    for (int source = 1; source < camera_count; ++source) {
+        for (int target = 0; target < source; ++target) {
+            PairConstraint pair;
+            pair.Source = source;
+            pair.Target = target;
+            pair.Transform = (transforms[target].inverse() * transforms[source]).cast<double>();
+            pairs.push_back(pair);
+        }
+    }
+
+    RegistrationParallelFor(static_cast<int>( pairs.size() ), [&](int pair_index) {
+        auto& pair = pairs[pair_index];
+        const auto& source = *clouds[pair.Source].Cloud;
+        const auto& target = *clouds[pair.Target].Cloud;
+
+        if (pair.Target == 0) {
+            pair.Fitness = star_fitness[pair.Source];
+        } else {
+            auto result = open3d::registration::RegistrationColoredICP(
+                source,
+                target,
+                max_distance,
+                pair.Transform,
+                lambda_geometric);
+
+            pair.Transform = result.transformation_;
+            pair.Fitness = result.fitness_;
+        }
+
+        if (pair.Fitness >= kMinPairFitness) {
+            pair.Information = open3d::registration::GetInformationMatrixFromPointClouds(
+                source,
+                target,
+                max_distance,
+                pair.Transform);
+        }
+    });
+
+    pairs.erase(std::remove_if(pairs.begin(), pairs.end(), [](const PairConstraint& pair) {
+        return pair.Fitness < kMinPairFitness;
+    }), pairs.end());
+
+    const uint64_t t1 = GetTimeUsec();
+    spdlog::info("===========================================================");
+    spdlog::info("Registered {} overlapping camera pairs in {} msec", pairs.size(), (t1 - t0) / 1000.f);
+
+    if (!SelectCertainEdges(camera_count, pairs)) {
+        spdlog::error("Some cameras do not overlap any other camera");
         return false;
     }
-    open3d::utility::SetVerbosityLevel(open3d::utility::VerbosityLevel::Debug);
 
+    open3d::registration::PoseGraph pose_graph;
+    for (int camera_index = 0; camera_index < camera_count; ++camera_index) {
+        const Eigen::Matrix4d pose = transforms[camera_index].cast<double>();
+        pose_graph.nodes_.push_back(open3d::registration::PoseGraphNode(pose));
+    }
+    for (const auto& pair : pairs)
+    {
+        spdlog::info("Pair {} -> {}: fitness={} certain={}", pair.Source, pair.Target, pair.Fitness, pair.Certain);
+
+        pose_graph.edges_.push_back(open3d::registration::PoseGraphEdge(
+            pair.Source,
+            pair.Target,
+            pair.Transform,
+            pair.Information,
+            !pair.Certain));
+    }
+
+    const open3d::registration::GlobalOptimizationOption option(
+        max_distance,
+        0.25, // edge_prune_threshold
+        1.0, // preference_loop_closure
+        0); // reference_node
+    open3d::registration::GlobalOptimization(
+        pose_graph,
+        open3d::registration::GlobalOptimizationLevenbergMarquardt(),
+        open3d::registration::GlobalOptimizationConvergenceCriteria(),
+        option);
+
+    const Eigen::Matrix4d inv_pose_0 = pose_graph.nodes_[0].pose_.inverse();
+    for (int camera_index = 1; camera_index < camera_count; ++camera_index) {
+        transforms[camera_index] = (inv_pose_0 * pose_graph.nodes_[camera_index].pose_).cast<float>();
+    }
+
+    const uint64_t t2 = GetTimeUsec();
+    spdlog::info("Optimized pose graph with {} of {} pairs in {} msec",
+        pose_graph.edges_.size(), pairs.size(), (t2 - t1) / 1000.f);
+
+    // Residual of each remaining pair with the optimized poses
+    const int edge_count = static_cast<int>( pose_graph.edges_.size() );
+    std::vector<open3d::registration::RegistrationResult> evaluations(edge_count);
+
+    RegistrationParallelFor(edge_count, [&](int edge_index) {
+        const auto& edge = pose_graph.edges_[edge_index];
+        const Eigen::Matrix4d transform = (transforms[edge.target_node_id_].inverse() * transforms[edge.source_node_id_]).cast<double>();
+
+        evaluations[edge_index] = open3d::registration::EvaluateRegistration(
+            *clouds[edge.source_node_id_].Cloud,
+            *clouds[edge.target_node_id_].Cloud,
+            max_distance,
+            transform);
+    });
+
+    std::vector<double> error_sums(camera_count, 0.0), inlier_counts(camera_count, 0.0);
+    for (int edge_index = 0; edge_index < edge_count; ++edge_index)
+    {
+        const auto& edge = pose_graph.edges_[edge_index];
+        const auto& evaluation = evaluations[edge_index];
+        const double inliers = static_cast<double>( evaluation.correspondence_set_.size() );
+        const double error_sum = evaluation.inlier_rmse_ * evaluation.inlier_rmse_ * inliers;
+
+        for (int node_id : { edge.source_node_id_, edge.target_node_id_ }) {
+            error_sums[node_id] += error_sum;
+            inlier_counts[node_id] += inliers;
+        }
+    }
+
+    for (int camera_index = 0; camera_index < camera_count; ++camera_index)
+    {
+        if (inlier_counts[camera_index] > 0.0) {
+            residuals[camera_index] = static_cast<float>( std::sqrt(error_sums[camera_index] / inlier_counts[camera_index]) );
+        }
+        spdlog::info("Camera {} residual = {} mm", camera_index, residuals[camera_index] * 1000.f);
+
+        if (camera_index > 0) {
+            LogTransform("transform", camera_index, transforms[camera_index]);
+        }
+    }
+
+    const uint64_t t3 = GetTimeUsec();
+    spdlog::info("Evaluated residuals in {} msec", (t3 - t2) / 1000.f);
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Extrinsics
+
+// Returns false if any camera did not see the marker
+static bool DetectTagPoses(
+    const std::vector<VerticesInfo>& vertices,
+    std::vector<Eigen::Matrix4f>& tag_poses)
+{
     const uint64_t t0 = GetTimeUsec();
 
     const int camera_count = static_cast<int>( vertices.size() );
-    output.resize(camera_count);
-
-    // Estimate camera poses from April tag:
+    tag_poses.resize(camera_count);
 
     apriltag_family_t *tf = tagStandard41h12_create();
     ScopedFunction tf_scope([tf]() {
@@ -126,15 +475,15 @@ bool CalculateExtrinsics(
         apriltag_detector_destroy(td);
     });
 
+    // The detector has its own worker pool, so run the cameras one at a time
+    // and let each detection use every core
     apriltag_detector_add_family_bits(td, tf, 1);
     td->quad_decimate = 1.f;
     td->quad_sigma = 0.8f;
-    td->nthreads = 1;
+    td->nthreads = std::max(1, static_cast<int>( std::thread::hardware_concurrency() ));
     td->refine_edges = 1;
     td->decode_sharpening = 0.25;
 
-    std::vector<Eigen::Matrix4f> tag_poses(camera_count);
-
     for (int camera_index = 0; camera_index < camera_count; ++camera_index)
     {
         image_u8_t orig {
@@ -144,6 +493,9 @@ bool CalculateExtrinsics(
             vertices[camera_index].Y
         };
         zarray_t* detections = apriltag_detector_detect(td, &orig);
+        ScopedFunction detections_scope([detections]() {
+            apriltag_detections_destroy(detections);
+        });
 
         spdlog::info("Detected {} fiducial markers", zarray_size(detections));
 
@@ -162,6 +514,11 @@ bool CalculateExtrinsics(
 
             spdlog::info("Camera {} detected marker: {}", camera_index, det->id);
 
+            if (!calibration) {
+                spdlog::error("Camera {} has no calibration for marker pose estimation", camera_index);
+                continue;
+            }
+
             spdlog::info("cx={} cy={} fx={} fy={}", calibration->Color.cx, calibration->Color.cy, calibration->Color.fx, calibration->Color.fy);
 
             apriltag_detection_info_t info;
@@ -199,6 +556,9 @@ bool CalculateExtrinsics(
             transform(3, 3) = 1.f;
             tag_poses[camera_index] = transform;
 
+            matd_destroy(pose.R);
+            matd_destroy(pose.t);
+
             found = true;
         }
 
@@ -208,7 +568,35 @@ bool CalculateExtrinsics(
         }
     }
 
-    spdlog::info("All cameras observed the fiducial marker");
+    const uint64_t t1 = GetTimeUsec();
+    spdlog::info("All cameras observed the fiducial marker in {} msec", (t1 - t0) / 1000.f);
+
+    return true;
+}
+
+bool CalculateExtrinsics(
+    const std::vector<VerticesInfo>& vertices,
+    std::vector<AlignmentTransform>& output,
+    std::vector<float>* residuals)
+{
+    output.clear();
+    if (vertices.empty()) {
+        spdlog::warn("No images provided to registration");
+        return false;
+    }
+    open3d::utility::SetVerbosityLevel(open3d::utility::VerbosityLevel::Debug);
+
+    const uint64_t t0 = GetTimeUsec();
+
+    const int camera_count = static_cast<int>( vertices.size() );
+    output.resize(camera_count);
+
+    // Estimate camera poses from April tag:
+
+    std::vector<Eigen::Matrix4f> tag_poses;
+    if (!DetectTagPoses(vertices, tag_poses)) {
+        return false;
+    }
 
     // Calculate scene yaw relative to marker:
 
@@ -262,115 +650,76 @@ bool CalculateExtrinsics(
 
     output[0] = center_transform;
 
-    std::shared_ptr<open3d::geometry::PointCloud> cloud_0;
-    std::shared_ptr<open3d::registration::Feature> feature_0;
-    if (!GenerateCloudFromVertices(vertices[0], cloud_0, feature_0)) {
-        spdlog::error("GenerateCloudFromVertices failed for i=0");
+    // Features are only consumed by global registration, which is disabled
+    const bool generate_features = false;
+
+    std::vector<RegistrationCloud> clouds;
+    if (!GenerateClouds(vertices, generate_features, clouds)) {
         return false;
     }
 
-    const uint64_t t1 = GetTimeUsec();
-    spdlog::info("===========================================================");
-    spdlog::info("Generated cloud 0 in {} msec", (t1 - t0) / 1000.f);
-
-    for (int camera_index = 1; camera_index < camera_count; ++camera_index)
-    {
-        const uint64_t t2 = GetTimeUsec();
-
-        std::shared_ptr<open3d::geometry::PointCloud> cloud_i;
-        std::shared_ptr<open3d::registration::Feature> feature_i;
-        if (!GenerateCloudFromVertices(vertices[camera_index], cloud_i, feature_i)) {
-            spdlog::error("GenerateCloudFromVertices failed for i={}", camera_index);
-            return false;
-        }
-
-        const uint64_t t3 = GetTimeUsec();
-        spdlog::info("===========================================================");
-        spdlog::info("Generated cloud {} in {} msec", camera_index, (t3 - t2) / 1000.f);
-
 #if 0
-        // Some notes are at the bottom of this README:
-        // https://github.com/mylxiaoyi/FastGlobalRegistration
-        open3d::registration::FastGlobalRegistrationOption fgr_option{};
-        fgr_option.use_absolute_scale_ = true;
-        fgr_option.decrease_mu_ = true;
-        fgr_option.division_factor_ = 1.4;
-        fgr_option.maximum_correspondence_distance_ = 0.05f; // meters
-        fgr_option.iteration_number_ = 128;
-        fgr_option.tuple_scale_ = 0.95;
-        fgr_option.maximum_tuple_count_ = 3000;
-
-        auto result = open3d::registration::FastGlobalRegistration(
-            *cloud_i,
-            *cloud_0,
-            *feature_i,
-            *feature_0,
-            fgr_option);
-
-        const uint64_t t4 = GetTimeUsec();
-        spdlog::info("===========================================================");
-        spdlog::info("Global registration for {} -> 0 in {} msec", i, (t4 - t3) / 1000.f);
+    // Some notes are at the bottom of this README:
+    // https://github.com/mylxiaoyi/FastGlobalRegistration
+    open3d::registration::FastGlobalRegistrationOption fgr_option{};
+    fgr_option.use_absolute_scale_ = true;
+    fgr_option.decrease_mu_ = true;
+    fgr_option.division_factor_ = 1.4;
+    fgr_option.maximum_correspondence_distance_ = 0.05f; // meters
+    fgr_option.iteration_number_ = 128;
+    fgr_option.tuple_scale_ = 0.95;
+    fgr_option.maximum_tuple_count_ = 3000;
+
+    auto result = open3d::registration::FastGlobalRegistration(
+        *clouds[i].Cloud,
+        *clouds[0].Cloud,
+        *clouds[i].Feature,
+        *clouds[0].Feature,
+        fgr_option);
 #endif
 
-        const Eigen::Matrix4f tag_pose = tag_poses[0] * tag_poses[camera_index].inverse();
-        const Eigen::Matrix4d initial_transform = tag_pose.cast<double>();
+    // Initial guess for each camera is from the marker pose
+    std::vector<Eigen::Matrix4f> transforms(camera_count, Eigen::Matrix4f::Identity());
+    for (int camera_index = 1; camera_index < camera_count; ++camera_index)
+    {
+        transforms[camera_index] = tag_poses[0] * tag_poses[camera_index].inverse();
 
-        for (int j = 0; j < 4; ++j)
-        {
-            spdlog::info("{} {}, {}, {}, {}{}",
-                j == 0 ? "initial_transform = [" : " ",
-                tag_pose(j, 0),
-                tag_pose(j, 1),
-                tag_pose(j, 2),
-                tag_pose(j, 3),
-                j == 3 ? " ]" : ",");
-        }
+        LogTransform("initial_transform", camera_index, transforms[camera_index]);
+    }
 
-        const double max_distance = 0.03; // meters
-        open3d::registration::ICPConvergenceCriteria criteria(1e-16, 1e-16, 500);
+    const double max_distance = 0.03; // meters
 
-        // How much it tends towards using the geometry instead of the color
-        const double lambda_geometric = 0.97;
+    // How much it tends towards using the geometry instead of the color
+    const double lambda_geometric = 0.97;
 
-        auto result = open3d::registration::RegistrationColoredICP(
-            *cloud_i,
-            *cloud_0,
-            max_distance,
-            initial_transform,
-            lambda_geometric);
-
-        const uint64_t t5 = GetTimeUsec();
-        spdlog::info("===========================================================");
-        spdlog::info("Color ICP refinement for {} -> 0 in {} msec", camera_index, (t5 - t3) / 1000.f);
+    std::vector<double> star_fitness;
+    RegisterToFirstCamera(clouds, max_distance, lambda_geometric, transforms, star_fitness);
 
-        auto transform4x4 = result.transformation_.cast<float>();
-
-        for (int j = 0; j < 4; ++j)
-        {
-            spdlog::info("{} {}, {}, {}, {}{}",
-                j == 0 ? "transform = [" : " ",
-                transform4x4(j, 0),
-                transform4x4(j, 1),
-                transform4x4(j, 2),
-                transform4x4(j, 3),
-                j == 3 ? " ]" : ",");
-        }
+    std::vector<float> camera_residuals;
+    if (!OptimizePoseGraph(clouds, max_distance, lambda_geometric, star_fitness, transforms, camera_residuals)) {
+        spdlog::warn("Pose graph optimization failed - Using registration to camera 0 only");
+    }
+    if (residuals) {
+        *residuals = camera_residuals;
+    }
 
-        output[camera_index] = center_transform * transform4x4;
-    } // next image
+    for (int camera_index = 1; camera_index < camera_count; ++camera_index) {
+        output[camera_index] = center_transform * transforms[camera_index];
+    }
 
-    const uint64_t t6 = GetTimeUsec();
+    const uint64_t t1 = GetTimeUsec();
     spdlog::info("===========================================================");
-    spdlog::info("Full registration in {} msec", (t6 - t0) / 1000.f);
+    spdlog::info("Full registration in {} msec", (t1 - t0) / 1000.f);
 
     return true;
 }
 
 bool RefineExtrinsics(
     const std::vector<VerticesInfo>& vertices,
-    std::vector<AlignmentTransform>& extrinsics)
+    std::vector<AlignmentTransform>& extrinsics,
+    std::vector<float>* residuals)
 {
-    if (extrinsics.size() != vertices.size()) {
+    if (vertices.empty() || extrinsics.size() != vertices.size()) {
         spdlog::error("Invalid input");
         return false;
     }
@@ -387,78 +736,174 @@ bool RefineExtrinsics(
 
     const uint64_t t0 = GetTimeUsec();
 
-    std::shared_ptr<open3d::geometry::PointCloud> cloud_0;
-    std::shared_ptr<open3d::registration::Feature> feature_0;
-    if (!GenerateCloudFromVertices(vertices[0], cloud_0, feature_0)) {
-        spdlog::error("GenerateCloudFromVertices failed for i=0");
+    std::vector<RegistrationCloud> clouds;
+    if (!GenerateClouds(vertices, false, clouds)) {
         return false;
     }
 
+    // Left multiply to undo the "center transform" from full registration,
+    // leaving just the prior transform from cloud_i to cloud_0
+    std::vector<Eigen::Matrix4f> transforms(camera_count, Eigen::Matrix4f::Identity());
+    for (int camera_index = 1; camera_index < camera_count; ++camera_index)
+    {
+        Eigen::Matrix4f transform_i;
+        extrinsics[camera_index].Set(transform_i);
+        transforms[camera_index] = inv_center_transform * transform_i;
+    }
+
+    const double max_distance = 0.02; // meters
+
+    // How much it tends towards using the geometry instead of the color
+    const double lambda_geometric = 1.0;
+
+    std::vector<double> star_fitness;
+    RegisterToFirstCamera(clouds, max_distance, lambda_geometric, transforms, star_fitness);
+
+    std::vector<float> camera_residuals;
+    if (!OptimizePoseGraph(clouds, max_distance, lambda_geometric, star_fitness, transforms, camera_residuals)) {
+        spdlog::warn("Pose graph optimization failed - Using registration to camera 0 only");
+    }
+    if (residuals) {
+        *residuals = camera_residuals;
+    }
+
+    for (int camera_index = 1; camera_index < camera_count; ++camera_index) {
+        extrinsics[camera_index] = center_transform * transforms[camera_index];
+    }
+
     const uint64_t t1 = GetTimeUsec();
     spdlog::info("===========================================================");
-    spdlog::info("Generated cloud 0 in {} msec", (t1 - t0) / 1000.f);
+    spdlog::info("Registration refinement in {} msec", (t1 - t0) / 1000.f);
 
-    for (int camera_index = 1; camera_index < camera_count; ++camera_index)
-    {
-        const uint64_t t2 = GetTimeUsec();
+    return true;
+}
 
-        std::shared_ptr<open3d::geometry::PointCloud> cloud_i;
-        std::shared_ptr<open3d::registration::Feature> feature_i;
-        if (!GenerateCloudFromVertices(vertices[camera_index], cloud_i, feature_i)) {
-            spdlog::error("GenerateCloudFromVertices failed for i={}", camera_index);
-            return false;
-        }
 
-        const uint64_t t3 = GetTimeUsec();
-        spdlog::info("===========================================================");
-        spdlog::info("Generated cloud {} in {} msec", camera_index, (t3 - t2) / 1000.f);
+//------------------------------------------------------------------------------
+// Vertices Dump
 
-        const double max_distance = 0.02; // meters
-        open3d::registration::ICPConvergenceCriteria criteria(1e-16, 1e-16, 500);
+// Original format written by the viewer, without calibration
+static const uint32_t kVerticesDumpMagic = 0x00112233;
 
-        // How much it tends towards using the geometry instead of the color
-        const double lambda_geometric = 1.0;
+// Followed by CameraCalibration after the accelerometer reading
+static const uint32_t kVerticesDumpCalibrationMagic = 0x00112234;
 
-        Eigen::Matrix4f transform_i;
-        extrinsics[camera_index].Set(transform_i);
+static const uint32_t kVerticesDumpStride = 5;
 
-        // Left multiply to undo the "center transform" from full registration,
-        // leaving just the prior transform from cloud_i to cloud_0
-        Eigen::Matrix4f initial_transform_f = inv_center_transform * transform_i;
-        Eigen::Matrix4d initial_transform_d = initial_transform_f.cast<double>();
+bool SaveVerticesDump(
+    const std::string& file_path,
+    const std::vector<VerticesInfo>& vertices)
+{
+    std::ofstream file(file_path.c_str(), std::ios::binary);
+    if (!file) {
+        spdlog::error("Failed to open {}", file_path);
+        return false;
+    }
 
-        auto result = open3d::registration::RegistrationColoredICP(
-            *cloud_i,
-            *cloud_0,
-            max_distance,
-            initial_transform_d,
-            lambda_geometric);
+    for (const auto& info : vertices)
+    {
+        const uint32_t magic = info.Calibration ? kVerticesDumpCalibrationMagic : kVerticesDumpMagic;
+        const uint32_t stride = kVerticesDumpStride;
+        const uint32_t count = info.FloatsCount;
+        const uint32_t width = info.Width;
+        const uint32_t height = info.Height;
+        const uint32_t cwidth = info.ChromaWidth;
+        const uint32_t cheight = info.ChromaHeight;
+
+        file.write((const char*)&magic, sizeof(magic));
+        file.write((const char*)&width, sizeof(width));
+        file.write((const char*)&height, sizeof(height));
+        file.write((const char*)&cwidth, sizeof(cwidth));
+        file.write((const char*)&cheight, sizeof(cheight));
+        file.write((const char*)&count, sizeof(count));
+        file.write((const char*)&stride, sizeof(stride));
+        file.write((const char*)info.Accelerometer, sizeof(info.Accelerometer));
+        if (info.Calibration) {
+            file.write((const char*)info.Calibration, sizeof(CameraCalibration));
+        }
+        file.write((const char*)info.XyzuvVertices, count * sizeof(float));
+        file.write((const char*)info.Y, width * height);
+        file.write((const char*)info.UV, cwidth * cheight * 2);
+    }
+
+    if (!file) {
+        spdlog::error("Failed to write {}", file_path);
+        return false;
+    }
 
-        const uint64_t t5 = GetTimeUsec();
-        spdlog::info("===========================================================");
-        spdlog::info("Color ICP refinement for {} -> 0 in {} msec", camera_index, (t5 - t3) / 1000.f);
+    spdlog::debug("Stored {} cameras to {}", vertices.size(), file_path);
+    return true;
+}
+
+bool LoadVerticesDump(
+    const std::string& file_path,
+    std::vector<std::shared_ptr<VerticesDump>>& dumps)
+{
+    dumps.clear();
 
-        auto transform4x4 = result.transformation_.cast<float>();
+    std::ifstream file(file_path.c_str(), std::ios::binary);
+    if (!file) {
+        spdlog::error("Failed to open {}", file_path);
+        return false;
+    }
 
-        for (int j = 0; j < 4; ++j)
+    for (;;)
+    {
+        uint32_t magic = 0;
+        file.read((char*)&magic, sizeof(magic));
+        if (!file) {
+            break; // End of file
+        }
+        if (magic != kVerticesDumpMagic && magic != kVerticesDumpCalibrationMagic) {
+            spdlog::error("Invalid magic in {}", file_path);
+            return false;
+        }
+
+        std::shared_ptr<VerticesDump> dump = std::make_shared<VerticesDump>();
+        auto& info = dump->Info;
+
+        uint32_t stride = 0;
+        file.read((char*)&info.Width, sizeof(info.Width));
+        file.read((char*)&info.Height, sizeof(info.Height));
+        file.read((char*)&info.ChromaWidth, sizeof(info.ChromaWidth));
+        file.read((char*)&info.ChromaHeight, sizeof(info.ChromaHeight));
+        file.read((char*)&info.FloatsCount, sizeof(info.FloatsCount));
+        file.read((char*)&stride, sizeof(stride));
+        file.read((char*)&info.Accelerometer[0], sizeof(info.Accelerometer));
+
+        if (!file || info.FloatsCount <= 0 || info.Width <= 0 || info.Height <= 0 ||
+            info.ChromaWidth <= 0 || info.ChromaHeight <= 0 || stride != kVerticesDumpStride)
         {
-            spdlog::info("{} {}, {}, {}, {}{}",
-                j == 0 ? "transform = [" : " ",
-                transform4x4(j, 0),
-                transform4x4(j, 1),
-                transform4x4(j, 2),
-                transform4x4(j, 3),
-                j == 3 ? " ]" : ",");
+            spdlog::error("Invalid header in {}", file_path);
+            return false;
         }
 
-        extrinsics[camera_index] = center_transform * transform4x4;
-    } // next image
+        if (magic == kVerticesDumpCalibrationMagic) {
+            file.read((char*)&dump->Calibration, sizeof(dump->Calibration));
+            info.Calibration = &dump->Calibration;
+        }
 
-    const uint64_t t6 = GetTimeUsec();
-    spdlog::info("===========================================================");
-    spdlog::info("Registration refinement in {} msec", (t6 - t0) / 1000.f);
+        dump->Floats.resize(info.FloatsCount);
+        file.read((char*)dump->Floats.data(), info.FloatsCount * sizeof(float));
 
-    return true;
+        dump->Y.resize(info.Width * info.Height);
+        dump->UV.resize(info.ChromaWidth * info.ChromaHeight * 2);
+        file.read((char*)dump->Y.data(), dump->Y.size());
+        file.read((char*)dump->UV.data(), dump->UV.size());
+
+        if (!file) {
+            spdlog::error("Truncated camera {} in {}", dumps.size(), file_path);
+            return false;
+        }
+
+        info.XyzuvVertices = dump->Floats.data();
+        info.Y = dump->Y.data();
+        info.UV = dump->UV.data();
+        dumps.push_back(dump);
+    }
+
+    spdlog::debug("Loaded {} cameras from {}", dumps.size(), file_path);
+    return !dumps.empty();
 }
 
 
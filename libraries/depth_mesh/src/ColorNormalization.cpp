@@ -6,9 +6,25 @@
 
 #include "nanoflann.hpp"
 
+#include <algorithm> // std::nth_element
+#include <cstring> // memcpy
+
+#include <enoki/array.h>
+
 namespace core {
 
 
+//------------------------------------------------------------------------------
+// SIMD
+
+using FloatP = enoki::Packet<float>;
+using MaskP = enoki::mask_t<FloatP>;
+using Int32P = enoki::Packet<int32_t, FloatP::Size>;
+using UInt16P = enoki::Packet<uint16_t, FloatP::Size>;
+using UInt8P = enoki::Packet<uint8_t, FloatP::Size>;
+static const int kLanes = static_cast<int>( FloatP::Size );
+
+
 //------------------------------------------------------------------------------
 // Percentile
 
@@ -214,138 +230,397 @@ void ForegroundCreateClouds(
     }
 }
 
-struct ColorHistogram
+// Bin for a log saturation value: Bins are in the same order as the values
+static inline uint16_t GetSaturationBin(float log_s)
+{
+    if (log_s == LightingMaps::kNoSaturation) {
+        return 0;
+    }
+    const int bin = static_cast<int>( (log_s - LightingMaps::kSaturationBinMin) * LightingMaps::kSaturationBinScale );
+    return static_cast<uint16_t>( 1 + std::min(std::max(bin, 0), LightingMaps::kSaturationBins - 2) );
+}
+
+// Convert one NV12 pixel to lightness and log saturation
+static inline void ConvertLightingPixel(
+    uint8_t Y, uint8_t Cb, uint8_t Cr,
+    uint8_t& lightness,
+    float& log_saturation)
+{
+    float R, G, B;
+    YCbCrToRGB(Y, Cb, Cr, R, G, B);
+
+    const float Cmax = std::max(R, std::max(G, B));
+    const float Cmin = std::min(R, std::min(G, B));
+
+    const float L = (Cmax + Cmin) * 0.5f;
+
+    log_saturation = LightingMaps::kNoSaturation;
+    if (L >= 1.f && L <= 254.0f) {
+        const float S = (Cmax - Cmin) / (255.f - std::abs(2.f * L - 255.f));
+
+        if (S > 0.001f) {
+            log_saturation = std::logf(S);
+        }
+    }
+
+    const int index = static_cast<int>( L );
+    lightness = static_cast<uint8_t>( std::min(std::max(index, 0), 255) );
+}
+
+void LightingMaps::Resize(int width, int height)
+{
+    Width = width;
+    Height = height;
+    Lightness.resize(width * height);
+    LogSaturation.resize(width * height);
+    SaturationBin.resize(width * height);
+}
+
+void LightingMaps::ConvertRows(
+    const uint8_t* y_plane,
+    const uint8_t* uv_plane,
+    int first_row,
+    int end_row)
 {
-    uint8_t Histogram[256] = { 0 };
-    unsigned Count = 0;
+    const int width = Width;
+    const int uv_stride = (width / 2) * 2;
+
+    // Chroma for each pixel of the row, centered on zero
+    std::vector<float> row_cb(width), row_cr(width);
 
-    // Expects input in the range 0..1
-    // This will convert the float to an integer between 0..255
-    void Insert(float value)
+    for (int y = first_row; y < end_row; ++y)
     {
-        int index = static_cast<int>( value );
-        if (index > 255) {
-            index = 255;
+        const uint8_t* y_row = y_plane + y * width;
+        const uint8_t* uv_row = uv_plane + (y / 2) * uv_stride;
+        uint8_t* l_row = Lightness.data() + y * width;
+        float* s_row = LogSaturation.data() + y * width;
+        uint16_t* bin_row = SaturationBin.data() + y * width;
+
+        for (int x = 0; x < width; ++x) {
+            const uint8_t* uv = uv_row + (x / 2) * 2;
+            row_cb[x] = static_cast<float>( uv[0] - 128 );
+            row_cr[x] = static_cast<float>( uv[1] - 128 );
+        }
+
+        int x = 0;
+        for (; x + kLanes <= width; x += kLanes)
+        {
+            const FloatP Y = FloatP(enoki::load_unaligned<UInt8P>(y_row + x));
+            const FloatP Cb = enoki::load_unaligned<FloatP>(row_cb.data() + x);
+            const FloatP Cr = enoki::load_unaligned<FloatP>(row_cr.data() + x);
+
+            const FloatP R = Y + 1.402f * Cr;
+            const FloatP G = Y - 0.344136f * Cb - 0.714136f * Cr;
+            const FloatP B = Y + 1.772f * Cb;
+
+            const FloatP Cmax = enoki::max(R, enoki::max(G, B));
+            const FloatP Cmin = enoki::min(R, enoki::min(G, B));
+
+            const FloatP L = (Cmax + Cmin) * 0.5f;
+            const FloatP S = (Cmax - Cmin) / (255.f - enoki::abs(2.f * L - 255.f));
+
+            // Lanes that fail the test may take the log of garbage
+            const MaskP has_s = (L >= 1.f) & (L <= 254.f) & (S > 0.001f);
+            const FloatP log_s = enoki::select(has_s, enoki::log(S), FloatP(kNoSaturation));
+
+            const Int32P index = enoki::min(enoki::max(Int32P(L), 0), 255);
+            const Int32P bin = enoki::min(enoki::max(Int32P((log_s - kSaturationBinMin) * kSaturationBinScale), 0), kSaturationBins - 2);
+
+            enoki::store_unaligned(l_row + x, UInt8P(index));
+            enoki::store_unaligned(s_row + x, log_s);
+            enoki::store_unaligned(bin_row + x, UInt16P(enoki::select(has_s, bin + 1, Int32P(0))));
         }
-        else if (index < 0) {
-            index = 0;
+
+        for (; x < width; ++x)
+        {
+            const uint8_t* uv = uv_row + (x / 2) * 2;
+            ConvertLightingPixel(y_row[x], uv[0], uv[1], l_row[x], s_row[x]);
+            bin_row[x] = GetSaturationBin(s_row[x]);
         }
+    }
+}
+
+void LightingWindow::Reset(const LightingMaps* maps)
+{
+    Maps = maps;
+    Valid = false;
+}
 
-        Histogram[index]++;
-        ++Count;
+void LightingWindow::UpdateRect(int x0, int x1, int y0, int y1, int sign)
+{
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, Maps->Width);
+    y1 = std::min(y1, Maps->Height);
+    if (x0 >= x1 || y0 >= y1) {
+        return;
     }
 
-    bool Median(unsigned& result)
+    const int width = Maps->Width;
+    for (int y = y0; y < y1; ++y)
     {
-        if (Count <= 0) {
-            return false;
+        const uint8_t* l_row = Maps->Lightness.data() + y * width;
+        const uint16_t* s_row = Maps->SaturationBin.data() + y * width;
+
+        for (int x = x0; x < x1; ++x)
+        {
+            const unsigned l = l_row[x];
+            Lightness[l] = static_cast<uint16_t>( Lightness[l] + sign );
+            LightnessCoarse[l / 16] = static_cast<uint16_t>( LightnessCoarse[l / 16] + sign );
+
+            const unsigned s = s_row[x];
+            Saturation[s] = static_cast<uint16_t>( Saturation[s] + sign );
+            SaturationCoarse[s / 64] = static_cast<uint16_t>( SaturationCoarse[s / 64] + sign );
         }
+    }
+    Count += sign * (x1 - x0) * (y1 - y0);
+}
 
-        // Calculate median Y value
-        unsigned accum = 0;
-        const unsigned target = (Count + 1) / 2;
-        unsigned median = 0;
-        for (; median < 255; ++median) {
-            accum += Histogram[median];
-            if (accum >= target) {
-                break;
+float LightingWindow::MedianSaturation()
+{
+    // Pixels with no saturation are all in bin 0
+    const unsigned count = Count - Saturation[0];
+    if (count == 0) {
+        return 0.f;
+    }
+
+    // Rank of the median over all bins, like GetPercentile(0.5)
+    const unsigned rank = Saturation[0] + count / 2;
+
+    unsigned accum = 0;
+    unsigned bin = 0;
+    for (unsigned coarse = 0;; ++coarse) {
+        if (accum + SaturationCoarse[coarse] > rank) {
+            bin = coarse * 64;
+            break;
+        }
+        accum += SaturationCoarse[coarse];
+    }
+    for (;; ++bin) {
+        if (accum + Saturation[bin] > rank) {
+            break;
+        }
+        accum += Saturation[bin];
+    }
+
+    // Select the median from the pixels in its bin
+    SaturationWork.clear();
+    const int size = kRadius * 2;
+    const int x0 = std::max(X0, 0), x1 = std::min(X0 + size, Maps->Width);
+    const int y0 = std::max(Y0, 0), y1 = std::min(Y0 + size, Maps->Height);
+    for (int y = y0; y < y1; ++y)
+    {
+        const uint16_t* bin_row = Maps->SaturationBin.data() + y * Maps->Width;
+        const float* s_row = Maps->LogSaturation.data() + y * Maps->Width;
+        for (int x = x0; x < x1; ++x) {
+            if (bin_row[x] == bin) {
+                SaturationWork.push_back(s_row[x]);
             }
         }
+    }
 
-        result = median;
-        return true;
+    const auto nth = SaturationWork.begin() + (rank - accum);
+    std::nth_element(SaturationWork.begin(), nth, SaturationWork.end());
+    return *nth;
+}
+
+bool LightingWindow::Sample(float u, float v, float& median_l, float& median_s)
+{
+    const int size = kRadius * 2;
+
+    // Same window as the per-point loop this replaces
+    const int x0 = static_cast<int>( u * Maps->Width ) + kRadius - size;
+    const int y0 = static_cast<int>( v * Maps->Height ) + kRadius - size;
+
+    if (!Valid || std::abs(x0 - X0) >= size || std::abs(y0 - Y0) >= size)
+    {
+        memset(Lightness, 0, sizeof(Lightness));
+        memset(LightnessCoarse, 0, sizeof(LightnessCoarse));
+        memset(Saturation, 0, sizeof(Saturation));
+        memset(SaturationCoarse, 0, sizeof(SaturationCoarse));
+        Count = 0;
+        UpdateRect(x0, x0 + size, y0, y0 + size, 1);
+        Valid = true;
     }
-};
+    else
+    {
+        // Slide horizontally, then vertically
+        if (x0 > X0) {
+            UpdateRect(X0, x0, Y0, Y0 + size, -1);
+            UpdateRect(X0 + size, x0 + size, Y0, Y0 + size, 1);
+        } else if (x0 < X0) {
+            UpdateRect(x0 + size, X0 + size, Y0, Y0 + size, -1);
+            UpdateRect(x0, X0, Y0, Y0 + size, 1);
+        }
+        if (y0 > Y0) {
+            UpdateRect(x0, x0 + size, Y0, y0, -1);
+            UpdateRect(x0, x0 + size, Y0 + size, y0 + size, 1);
+        } else if (y0 < Y0) {
+            UpdateRect(x0, x0 + size, y0 + size, Y0 + size, -1);
+            UpdateRect(x0, x0 + size, y0, Y0, 1);
+        }
+    }
+    X0 = x0;
+    Y0 = y0;
+
+    if (Count == 0) {
+        return false;
+    }
+
+    // Median lightness: First bin where the count reaches half
+    const unsigned target = (Count + 1) / 2;
+    unsigned accum = 0;
+    unsigned bin = 0;
+    for (unsigned coarse = 0;; ++coarse) {
+        if (accum + LightnessCoarse[coarse] >= target) {
+            bin = coarse * 16;
+            break;
+        }
+        accum += LightnessCoarse[coarse];
+    }
+    for (;; ++bin) {
+        accum += Lightness[bin];
+        if (accum >= target) {
+            break;
+        }
+    }
+    median_l = static_cast<float>( bin );
+
+    median_s = MedianSaturation();
+
+    return true;
+}
+
+// Rows of image per conversion task
+static const int kLightingRowsPerTask = 64;
+
+// Points per sampling task
+static const int kLightingPointsPerTask = 4096;
+
+// Run task(0) .. task(count - 1), in parallel if possible
+static void RunLightingTasks(
+    const DepthMesher::ParallelForCallback& parallel_for,
+    int count,
+    const std::function<void(int)>& task)
+{
+    if (parallel_for && count > 1) {
+        parallel_for(count, task);
+    } else {
+        for (int i = 0; i < count; ++i) {
+            task(i);
+        }
+    }
+}
 
 void ExtractCloudLighting(
-    std::vector<std::shared_ptr<KdtreePointCloud>>& clouds)
+    std::vector<std::shared_ptr<KdtreePointCloud>>& clouds,
+    const DepthMesher::ParallelForCallback& parallel_for)
 {
-    for (auto& cloud : clouds)
+    const int cloud_count = static_cast<int>( clouds.size() );
+
+    // Tasks are (cloud, first row or point) pairs
+    struct LightingTask
+    {
+        int Cloud;
+        int First;
+    };
+    std::vector<LightingTask> tasks;
+
+    // Convert images to lighting maps
+
+    std::vector<LightingMaps> maps(cloud_count);
+
+    for (int i = 0; i < cloud_count; ++i)
+    {
+        auto& info = clouds[i]->Input.Info;
+        maps[i].Resize(info.Width, info.Height);
+
+        for (int row = 0; row < info.Height; row += kLightingRowsPerTask) {
+            tasks.push_back({ i, row });
+        }
+    }
+
+    RunLightingTasks(parallel_for, static_cast<int>( tasks.size() ), [&](int t) {
+        const LightingTask& task = tasks[t];
+        auto& cloud = clouds[task.Cloud];
+        LightingMaps& cloud_maps = maps[task.Cloud];
+
+        cloud_maps.ConvertRows(
+            cloud->YPlane.data(),
+            cloud->UVPlane.data(),
+            task.First,
+            std::min(task.First + kLightingRowsPerTask, cloud_maps.Height));
+    });
+
+    // Sample the maps around each point
+
+    // 1 for each point that has lighting
+    std::vector<std::vector<uint8_t>> filled(cloud_count);
+
+    tasks.clear();
+    for (int i = 0; i < cloud_count; ++i)
     {
+        auto& cloud = clouds[i];
         auto& info = cloud->Input.Info;
 
         cloud->PointCount = info.FloatsCount / 5;
-        cloud->Floats.resize(info.FloatsCount * KdtreePointCloud::kStride);
-        unsigned filled_point_count = 0;
+        cloud->Floats.resize(cloud->PointCount * KdtreePointCloud::kStride);
+        filled[i].resize(cloud->PointCount);
 
-        const float* vertices = cloud->XyzuvVertices.data();
+        for (unsigned point = 0; point < cloud->PointCount; point += kLightingPointsPerTask) {
+            tasks.push_back({ i, static_cast<int>( point ) });
+        }
+    }
 
-        const int width = info.Width;
-        const int height = info.Height;
-        const uint8_t* y_plane = cloud->YPlane.data();
-        const uint8_t* uv_plane = cloud->UVPlane.data();
+    RunLightingTasks(parallel_for, static_cast<int>( tasks.size() ), [&](int t) {
+        const LightingTask& task = tasks[t];
+        auto& cloud = clouds[task.Cloud];
+        uint8_t* cloud_filled = filled[task.Cloud].data();
 
-        std::vector<float> median_work_s;
+        LightingWindow window;
+        window.Reset(&maps[task.Cloud]);
 
-        const unsigned count = cloud->PointCount;
-        for (unsigned i = 0; i < count; ++i)
+        const unsigned end = std::min(task.First + kLightingPointsPerTask, static_cast<int>( cloud->PointCount ));
+        for (unsigned i = task.First; i < end; ++i)
         {
-            const float* input = vertices + i * 5;
-            const float u = input[3];
-            const float v = input[4];
+            const float* input = cloud->XyzuvVertices.data() + i * 5;
             // FIXME: Is v flipped?
 
-            ColorHistogram hist_l;
-            median_work_s.clear();
-
-            const int radius = 6;
-            const int end_x = static_cast<int>( u * width ) + radius;
-            const int end_y = static_cast<int>( v * height ) + radius;
-            for (int y = end_y - radius * 2; y < end_y; ++y)
-            {
-                if (y < 0 || y >= height) {
-                    continue;
-                }
-                const uint8_t* y_ptr = y_plane + y * width;
-                const uint8_t* uv_ptr = uv_plane + (y / 2) * (width / 2) * 2;
-
-                for (int x = end_x - radius * 2; x < end_x; ++x)
-                {
-                    if (x < 0 || x >= width) {
-                        continue;
-                    }
-                    const uint8_t Y = y_ptr[x];
-                    const uint8_t* uv = uv_ptr + (x / 2) * 2;
-                    const uint8_t Cb = uv[0];
-                    const uint8_t Cr = uv[1];
-
-                    float R, G, B;
-                    YCbCrToRGB(Y, Cb, Cr, R, G, B);
-
-                    const float Cmax = std::max(R, std::max(G, B));
-                    const float Cmin = std::min(R, std::min(G, B));
-
-                    float S, L = (Cmax + Cmin) * 0.5f;
-
-                    if (L < 1.f || L > 254.0f) {
-                        S = 0.f;
-                    } else {
-                        S = (Cmax - Cmin) / (255.f - std::abs(2.f * L - 255.f));
-
-                        if (S > 0.001f) {
-                            const float log_s = std::logf(S);
-                            median_work_s.push_back(log_s);
-                        }
-                    }
-
-                    hist_l.Insert(L);
-                }
-            }
-
-            unsigned median_l;
-            if (!hist_l.Median(median_l)) {
+            float median_l, median_s;
+            if (!window.Sample(input[3], input[4], median_l, median_s)) {
+                cloud_filled[i] = 0;
                 continue;
             }
+            cloud_filled[i] = 1;
 
-            const float median_s = GetPercentile(median_work_s, 0.5f);
-
-            float* output = &cloud->Floats[filled_point_count * KdtreePointCloud::kStride];
+            float* output = &cloud->Floats[i * KdtreePointCloud::kStride];
             output[0] = input[0];
             output[1] = input[1];
             output[2] = input[2];
-            output[3] = static_cast<float>( median_l );
+            output[3] = median_l;
             output[4] = median_s;
+        }
+    });
 
+    // Remove points without lighting
+
+    RunLightingTasks(parallel_for, cloud_count, [&](int i) {
+        auto& cloud = clouds[i];
+        const uint8_t* cloud_filled = filled[i].data();
+        float* floats = cloud->Floats.data();
+
+        unsigned filled_point_count = 0;
+        for (unsigned j = 0; j < cloud->PointCount; ++j)
+        {
+            if (!cloud_filled[j]) {
+                continue;
+            }
+            if (filled_point_count != j) {
+                memcpy(
+                    floats + filled_point_count * KdtreePointCloud::kStride,
+                    floats + j * KdtreePointCloud::kStride,
+                    KdtreePointCloud::kStride * sizeof(float));
+            }
             ++filled_point_count;
         }
 
@@ -353,7 +628,7 @@ void ExtractCloudLighting(
         cloud->PointCount = filled_point_count;
 
         cloud->ApplyTransforms();
-    }
+    });
 }
 
 // One of these for Saturation and Lightness
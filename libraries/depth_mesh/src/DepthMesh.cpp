@@ -9,104 +9,36 @@
 
 #include <core_logging.hpp>
 
-namespace core {
-
-
-/*
-    // Only 73% of data is non-zero, so first compress it:
-
-    Workspace.resize(n * 3 + kLanes * 3); // Pad to packet size
-    float* workspace_next = Workspace.data();
-    for (int i = 0; i < n; ++i)
-    {
-        const uint16_t depth_mm = depth[i];
-        if (depth_mm == 0) {
-            continue;
-        }
-
-        const k4a_float2_t scale = lookup[i];
-        if (isnan(scale.xy.x)) {
-            depth[i] = 0;
-            continue;
-        }
-
-        // Convert to 3D (millimeters) relative to depth camera
-        workspace_next[0] = depth_mm * scale.xy.x;
-        workspace_next[1] = depth_mm * scale.xy.y;
-        workspace_next[2] = depth_mm;
-        workspace_next += 3;
-    }
-    uintptr_t workspace_size = static_cast<uintptr_t>( workspace_next - Workspace.data() );
-    workspace_next = Workspace.data();
-
-    coordinates.clear();
-    coordinates.resize(n * 5 + kLanes * 5); // Pad to packet size
-    float* coordinates_data = coordinates.data();
-
-    Indices3 midx(0, 1, 2);
-    const Matrix3f unif_R = enoki::gather<Matrix3f>(R, midx);
-    const Vector3f unif_t = enoki::load_unaligned<Vector3f>(t);
-    const IndicesP index = enoki::arange<IndicesP>();
+#include <algorithm> // std::max
+#include <cmath> // std::sqrt
+#include <cstring> // memmove
 
-    // For each workspace packet to process:
-    for (unsigned i = 0; i < workspace_size; i += 3 * kLanes)
-    {
-        const Vector3fP input = enoki::gather<Vector3fP>(workspace_next + i, index);
-
-        Vector3fP color_pos = unif_R * input + unif_t;
-
-        FloatP inv_z = 1.f / color_pos.z();
-        FloatP x_proj = color_pos.x() * inv_z;
-        FloatP y_proj = color_pos.y() * inv_z;
-
-        FloatP xp = x_proj - codx;
-        FloatP yp = y_proj - cody;
-
-        FloatP xp2 = xp * xp;
-        FloatP yp2 = yp * yp;
-        FloatP xyp = xp * yp;
-        FloatP rs = xp2 + yp2;
-
-        // If mask = 0, then we should invalidate this later
-        //enoki::mask_t<FloatP> mask = (rs <= max_radius_for_projection * max_radius_for_projection);
-
-        FloatP rss = rs * rs;
-        FloatP rsc = rss * rs;
-        FloatP a = 1.f + k1 * rs + k2 * rss + k3 * rsc;
-        FloatP b = 1.f + k4 * rs + k5 * rss + k6 * rsc;
-        FloatP bi = enoki::select(b != 0.f, 1.f / b, 1.f);
-        FloatP d = a * bi;
-
-        FloatP xp_d = xp * d;
-        FloatP yp_d = yp * d;
+#include <enoki/array.h>
 
-        FloatP rs_2xp2 = rs + 2.f * xp2;
-        FloatP rs_2yp2 = rs + 2.f * yp2;
-
-        xp_d += rs_2xp2 * p2 + dist_coeff * xyp * p1;
-        yp_d += rs_2yp2 * p1 + dist_coeff * xyp * p2;
-
-        FloatP xp_d_cx = xp_d + codx;
-        FloatP yp_d_cy = yp_d + cody;
-
-        // Convert xyz to meters and normalized uv
-        FloatP u = xp_d_cx * fx + cx;
-        FloatP v = yp_d_cy * fy + cy;
+namespace core {
 
-        Vector5fP temp;
-        temp.x() = color_pos.x() * kInverseMeters;
-        temp.y() = color_pos.y() * kInverseMeters;
-        temp.z() = color_pos.z() * kInverseMeters;
-        temp[3] = u * inv_color_width;
-        temp[4] = v * inv_color_height;
 
-        enoki::scatter(coordinates_data, temp, index);
-        coordinates_data += 5 * kLanes;
-    } // next packet
+//------------------------------------------------------------------------------
+// SIMD
 
-    coordinates.resize((workspace_size / 3) * 5);
+/*
+    GenerateCoordinatesRowsSimd() projects one row of depth pixels at a time with
+    enoki packets, kLanes pixels per instruction (8 for AVX2, 16 for AVX512,
+    4 for SSE/NEON), and then walks the row from right to left with the
+    sequential face painting logic, which only needs the depth values.
+
+    The vector path does the same float operations in the same order as the
+    scalar path, but the compiler is free to fuse multiply-adds differently
+    for each, so the outputs match to within kMeshSimdEpsilon (relative).
 */
 
+using FloatP = enoki::Packet<float>;
+using MaskP = enoki::mask_t<FloatP>;
+using Int32P = enoki::Packet<int32_t, FloatP::Size>;
+using UInt16P = enoki::Packet<uint16_t, FloatP::Size>;
+using UInt8P = enoki::Packet<uint8_t, FloatP::Size>;
+static const int kLanes = static_cast<int>( FloatP::Size );
+
 
 //------------------------------------------------------------------------------
 // Tools
@@ -410,7 +342,8 @@ void DepthMesher::Initialize(const CameraCalibration& calibration)
 
     const int n = width * height;
     DepthLookup.resize(n * 2);
-    float* lookup = DepthLookup.data();
+    float* lookup_x = DepthLookup.data();
+    float* lookup_y = lookup_x + n;
 
     int invalids = 0;
 
@@ -431,8 +364,8 @@ void DepthMesher::Initialize(const CameraCalibration& calibration)
                 ++invalids;
             }
 
-            lookup[index * 2] = xy[0];
-            lookup[index * 2 + 1] = xy[1];
+            lookup_x[index] = xy[0];
+            lookup_y[index] = xy[1];
             ++index;
         }
     }
@@ -442,6 +375,108 @@ void DepthMesher::Initialize(const CameraCalibration& calibration)
     }
 }
 
+void DepthMesher::SetBandCount(int band_count)
+{
+    BandCount = band_count < 1 ? 1 : band_count;
+}
+
+void DepthMesher::SetParallelFor(ParallelForCallback parallel_for)
+{
+    ParallelFor = parallel_for;
+}
+
+int DepthMesher::GetBandCount() const
+{
+    int band_count = Calibration.Depth.Height / kMinBandRows;
+    if (band_count > BandCount) {
+        band_count = BandCount;
+    }
+    return band_count < 1 ? 1 : band_count;
+}
+
+void DepthMesher::ForEachBand(int count, const std::function<void(int)>& task)
+{
+    if (ParallelFor && count > 1) {
+        ParallelFor(count, task);
+    } else {
+        for (int i = 0; i < count; ++i) {
+            task(i);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Compact Vertices
+
+static inline uint16_t QuantizeUnorm16(float x)
+{
+    if (!(x > 0.f)) {
+        return 0; // Also handles NaN
+    }
+    if (x >= 1.f) {
+        return 65535;
+    }
+    return static_cast<uint16_t>( x * 65535.f + 0.5f );
+}
+
+// Round meters to int16_t units of kCompactPositionScale
+static inline uint16_t QuantizeCompactPosition(float meters)
+{
+    const float x = meters * (1.f / kCompactPositionScale);
+    if (!(x > -32767.f)) {
+        return static_cast<uint16_t>( -32767 ); // Also handles NaN
+    }
+    if (x >= 32767.f) {
+        return 32767;
+    }
+    const int32_t q = static_cast<int32_t>( x + (x < 0.f ? -0.5f : 0.5f) );
+    return static_cast<uint16_t>( q );
+}
+
+// Write the x, y, z, u, v float vertex in the compact format
+static inline void WriteCompactVertex(const float* xyzuv, uint16_t* compact)
+{
+    compact[0] = QuantizeCompactPosition(xyzuv[0]);
+    compact[1] = QuantizeCompactPosition(xyzuv[1]);
+    compact[2] = QuantizeCompactPosition(xyzuv[2]);
+    compact[3] = QuantizeUnorm16(xyzuv[3]);
+    compact[4] = QuantizeUnorm16(xyzuv[4]);
+}
+
+// Vectorized QuantizeCompactPosition(), as int32_t lanes
+static inline Int32P QuantizeCompactPositionP(const FloatP& meters)
+{
+    const FloatP x = enoki::min(enoki::max(meters * (1.f / kCompactPositionScale), FloatP(-32767.f)), FloatP(32767.f));
+    return Int32P(x + enoki::select(x < 0.f, FloatP(-0.5f), FloatP(0.5f)));
+}
+
+// Vectorized QuantizeUnorm16(), as int32_t lanes
+static inline Int32P QuantizeUnorm16P(const FloatP& x)
+{
+    const FloatP c = enoki::min(enoki::max(x, FloatP(0.f)), FloatP(1.f));
+    return Int32P(c * 65535.f + 0.5f);
+}
+
+
+//------------------------------------------------------------------------------
+// DepthMesher : Banded Coordinates
+
+/*
+    Banded meshing:
+
+    Band i covers rows [H * i / B, H * (i + 1) / B).  Rows are meshed
+    independently, so each band writes its vertices into the part of the
+    output that its rows would use if every pixel produced a vertex, and the
+    bands are then packed down in order.  This yields exactly the serial
+    output without knowing in advance how many pixels each band culls.
+
+    Triangles reference vertex indices, which are a running count of the
+    non-zero depth pixels.  A first pass counts the non-zero pixels in each
+    band, and a prefix sum gives the first vertex index for each band.  Each
+    band re-derives the vertex indices for the row above it to stitch the
+    triangles across the seam, and then the bands are packed as above.
+*/
+
 void DepthMesher::GenerateCoordinates(
     uint16_t* depth,
     const ClipRegion* clip,
@@ -449,18 +484,139 @@ void DepthMesher::GenerateCoordinates(
     std::vector<float>& coordinates,
     bool face_painting_fix,
     bool cull_depth)
+{
+    GenerateVertices(depth, clip, coordinates, nullptr, face_painting_fix, cull_depth);
+}
+
+void DepthMesher::GenerateCoordinates(
+    uint16_t* depth,
+    const ClipRegion* clip,
+    std::vector<float>& coordinates,
+    CompactVertices& compact,
+    bool face_painting_fix,
+    bool cull_depth)
+{
+    GenerateVertices(depth, clip, coordinates, &compact, face_painting_fix, cull_depth);
+}
+
+void DepthMesher::GenerateVertices(
+    uint16_t* depth,
+    const ClipRegion* clip,
+    std::vector<float>& coordinates,
+    CompactVertices* compact,
+    bool face_painting_fix,
+    bool cull_depth)
 {
     const int width = Calibration.Depth.Width;
     const int height = Calibration.Depth.Height;
     const int n = width * height;
 
-    const float* lookup = DepthLookup.data();
+    coordinates.clear();
+    coordinates.resize(n * 5);
+    if (compact) {
+        compact->Vertices.resize(n * kCompactVertexShorts);
+    }
 
-    const float kInverseMeters = 1.f / 1000.f;
-    const float inv_color_width = 1.f / static_cast<float>( Calibration.Color.Width );
-    const float inv_color_height = 1.f / static_cast<float>( Calibration.Color.Height );
+    const int band_count = GetBandCount();
+    std::vector<int> band_vertices(band_count);
 
-    Eigen::Vector3f clip_p0, clip_d;
+    ForEachBand(band_count, [&](int band) {
+        const int first_row = height * band / band_count;
+        const int end_row = height * (band + 1) / band_count;
+        float* band_coordinates = coordinates.data() + first_row * width * 5;
+        uint16_t* band_compact = nullptr;
+        if (compact) {
+            band_compact = compact->Vertices.data() + first_row * width * kCompactVertexShorts;
+        }
+
+        if (SimdEnabled) {
+            band_vertices[band] = GenerateCoordinatesRowsSimd(
+                depth, clip, first_row, end_row, band_coordinates, band_compact, face_painting_fix, cull_depth);
+        } else {
+            band_vertices[band] = GenerateCoordinatesRows(
+                depth, clip, first_row, end_row, band_coordinates, band_compact, face_painting_fix, cull_depth);
+        }
+    });
+
+    // Pack bands together
+    int vertex_count = band_vertices[0];
+    for (int band = 1; band < band_count; ++band)
+    {
+        const int first_row = height * band / band_count;
+        const int first_vertex = first_row * width;
+        if (vertex_count != first_vertex)
+        {
+            memmove(
+                coordinates.data() + vertex_count * 5,
+                coordinates.data() + first_vertex * 5,
+                band_vertices[band] * 5 * sizeof(float));
+            if (compact) {
+                memmove(
+                    compact->Vertices.data() + vertex_count * kCompactVertexShorts,
+                    compact->Vertices.data() + first_vertex * kCompactVertexShorts,
+                    band_vertices[band] * kCompactVertexShorts * sizeof(uint16_t));
+            }
+        }
+        vertex_count += band_vertices[band];
+    }
+
+    // Resize to fit
+    coordinates.resize(vertex_count * 5);
+    if (compact) {
+        compact->VertexCount = vertex_count;
+        compact->Vertices.resize(vertex_count * kCompactVertexShorts);
+    }
+}
+
+//------------------------------------------------------------------------------
+// DepthMesher::ScalarProjector
+
+struct DepthMesher::ScalarProjector
+{
+    ScalarProjector(const DepthMesher& mesher, const ClipRegion* clip);
+
+    // Writes x, y, z in meters relative to the color camera,
+    // and the same point in millimeters to color_mm
+    inline void Position(
+        int depth_index,
+        uint16_t depth_mm,
+        float* xyz,
+        float* color_mm) const;
+
+    // Writes u, v, or returns false if the point is outside of the clip
+    // region or samples off the edge of the color image
+    inline bool TexCoord(
+        const float* xyz,
+        const float* color_mm,
+        float* uv) const;
+
+    const float* LookupX = nullptr;
+    const float* LookupY = nullptr;
+
+    const ClipRegion* Clip = nullptr;
+    Eigen::Vector3f ClipP0, ClipD;
+    float ClipRadius2 = 0.f;
+
+    // Extrinsics transform from depth -> color camera
+    const float* R = nullptr;
+    const float* T = nullptr;
+
+    float cx, cy, fx, fy;
+    float k1, k2, k3, k4, k5, k6;
+    float codx, cody, p1, p2;
+    float DistCoeff = 1.f;
+    float InvColorWidth, InvColorHeight;
+};
+
+DepthMesher::ScalarProjector::ScalarProjector(const DepthMesher& mesher, const ClipRegion* clip)
+{
+    const CameraCalibration& calibration = mesher.Calibration;
+    const int n = calibration.Depth.Width * calibration.Depth.Height;
+
+    LookupX = mesher.DepthLookup.data();
+    LookupY = LookupX + n;
+
+    Clip = clip;
     if (clip)
     {
         // define pt2 as 1 meter from pt1
@@ -469,52 +625,164 @@ void DepthMesher::GenerateCoordinates(
 
         Eigen::Vector4f q0 = inv_exstrinsics * Eigen::Vector4f(0.f, 0.f, 0.f, 1.f);
         // TBD: We do not support skewed matrix
-        clip_p0 = Eigen::Vector3f(q0(0), q0(1), q0(2));
+        ClipP0 = Eigen::Vector3f(q0(0), q0(1), q0(2));
 
         Eigen::Vector4f q1 = inv_exstrinsics * Eigen::Vector4f(0.f, 1.f, 0.f, 1.f);
         // TBD: We do not support skewed matrix
-        clip_d = Eigen::Vector3f(q1(0), q1(1), q1(2)) - clip_p0;
-    }
+        ClipD = Eigen::Vector3f(q1(0), q1(1), q1(2)) - ClipP0;
 
-    // Extrinsics transform from depth -> color camera
-    const float* R = Calibration.RotationFromDepth;
-    const float* T = Calibration.TranslationFromDepth;
+        // Compared against squared distance from the axis
+        ClipRadius2 = clip->Radius * clip->Radius;
+    }
 
-    const CameraIntrinsics& intrinsics = Calibration.Color;
-    const float cx = intrinsics.cx;
-    const float cy = intrinsics.cy;
-    const float fx = intrinsics.fx;
-    const float fy = intrinsics.fy;
-    const float k1 = intrinsics.k[0];
-    const float k2 = intrinsics.k[1];
-    const float k3 = intrinsics.k[2];
-    const float k4 = intrinsics.k[3];
-    const float k5 = intrinsics.k[4];
-    const float k6 = intrinsics.k[5];
-    const float codx = intrinsics.codx; // center of distortion is set to 0 for Brown Conrady model
-    const float cody = intrinsics.cody;
-    const float p1 = intrinsics.p1;
-    const float p2 = intrinsics.p2;
-    //const float max_radius_for_projection2 = intrinsics.MaxRadiusForProjection * intrinsics.MaxRadiusForProjection;
+    R = calibration.RotationFromDepth;
+    T = calibration.TranslationFromDepth;
+
+    const CameraIntrinsics& intrinsics = calibration.Color;
+    cx = intrinsics.cx;
+    cy = intrinsics.cy;
+    fx = intrinsics.fx;
+    fy = intrinsics.fy;
+    k1 = intrinsics.k[0];
+    k2 = intrinsics.k[1];
+    k3 = intrinsics.k[2];
+    k4 = intrinsics.k[3];
+    k5 = intrinsics.k[4];
+    k6 = intrinsics.k[5];
+    codx = intrinsics.codx; // center of distortion is set to 0 for Brown Conrady model
+    cody = intrinsics.cody;
+    p1 = intrinsics.p1;
+    p2 = intrinsics.p2;
 
-    float dist_coeff = 1.f;
     if (intrinsics.LensModel != LensModel_Rational_6KT) {
         // the only difference from Rational6ktCameraModel is 2 multiplier for the tangential coefficient term xyp*p1
         // and xyp*p2
-        dist_coeff = 2.f;
+        DistCoeff = 2.f;
     }
 
-    coordinates.clear();
-    coordinates.resize(n * 5);
-    float* coordinates_next = coordinates.data();
+    InvColorWidth = 1.f / static_cast<float>( intrinsics.Width );
+    InvColorHeight = 1.f / static_cast<float>( intrinsics.Height );
+}
+
+inline void DepthMesher::ScalarProjector::Position(
+    int depth_index,
+    uint16_t depth_mm,
+    float* xyz,
+    float* color_mm) const
+{
+    const float kInverseMeters = 1.f / 1000.f;
+
+    const float scale_x = LookupX[depth_index];
+    const float scale_y = LookupY[depth_index];
+    CORE_DEBUG_ASSERT(!isnan(scale_x));
+
+    // Convert to 3D (millimeters) relative to depth camera
+    const float depth_z_mm = depth_mm;
+    const float depth_x_mm = depth_z_mm * scale_x;
+    const float depth_y_mm = depth_z_mm * scale_y;
+
+    // Convert to 3D relative to color camera
+    color_mm[0] = R[0] * depth_x_mm + R[1] * depth_y_mm + R[2] * depth_z_mm + T[0];
+    color_mm[1] = R[3] * depth_x_mm + R[4] * depth_y_mm + R[5] * depth_z_mm + T[1];
+    color_mm[2] = R[6] * depth_x_mm + R[7] * depth_y_mm + R[8] * depth_z_mm + T[2];
+
+    xyz[0] = color_mm[0] * kInverseMeters;
+    xyz[1] = color_mm[1] * kInverseMeters;
+    xyz[2] = color_mm[2] * kInverseMeters;
+}
+
+inline bool DepthMesher::ScalarProjector::TexCoord(
+    const float* xyz,
+    const float* color_mm,
+    float* uv) const
+{
+    // Cylinder clip:
+    if (Clip)
+    {
+        Eigen::Vector3f testpt(xyz[0], xyz[1], xyz[2]);
+        const Eigen::Vector3f pd = testpt - ClipP0;
+        const float dot = -pd.dot(ClipD);
+        if (dot < Clip->Floor || dot > Clip->Ceiling || (pd.squaredNorm() - dot*dot) > ClipRadius2) {
+            return false;
+        }
+    }
+
+    const float inv_z = 1.f / color_mm[2];
+    const float x_proj = color_mm[0] * inv_z;
+    const float y_proj = color_mm[1] * inv_z;
+
+    const float xp = x_proj - codx;
+    const float yp = y_proj - cody;
+
+    const float xp2 = xp * xp;
+    const float yp2 = yp * yp;
+    const float xyp = xp * yp;
+    const float rs = xp2 + yp2;
+
+    const float rss = rs * rs;
+    const float rsc = rss * rs;
+    const float a = 1.f + k1 * rs + k2 * rss + k3 * rsc;
+    const float b = 1.f + k4 * rs + k5 * rss + k6 * rsc;
+    float bi = 1.f;
+    if (b != 0.f) {
+        bi /= b;
+    }
+    const float d = a * bi;
+
+    float xp_d = xp * d;
+    float yp_d = yp * d;
+
+    const float rs_2xp2 = rs + 2.f * xp2;
+    const float rs_2yp2 = rs + 2.f * yp2;
+
+    xp_d += rs_2xp2 * p2 + DistCoeff * xyp * p1;
+    yp_d += rs_2yp2 * p1 + DistCoeff * xyp * p2;
+
+    const float xp_d_cx = xp_d + codx;
+    const float yp_d_cy = yp_d + cody;
+
+    // Convert xyz to meters and normalized uv
+    const float u_pixels = xp_d_cx * fx + cx;
+    const float v_pixels = yp_d_cy * fy + cy;
+
+    const float u = u_pixels * InvColorWidth;
+    const float v = v_pixels * InvColorHeight;
+
+    // If it is sampling off the edge of the image:
+    if (v < 0.0001f || v >= 1.0001f ||
+        u < 0.0001f || u >= 1.0001f)
+    {
+        return false;
+    }
+
+    uv[0] = u;
+    uv[1] = v;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// DepthMesher : Scalar Coordinates
+
+int DepthMesher::GenerateCoordinatesRows(
+    uint16_t* depth,
+    const ClipRegion* clip,
+    int first_row,
+    int end_row,
+    float* coordinates,
+    uint16_t* compact,
+    bool face_painting_fix,
+    bool cull_depth)
+{
+    const int width = Calibration.Depth.Width;
+
+    const ScalarProjector projector(*this, clip);
 
-    //float u_min = Calibration.Color.Width;
-    //float u_max = 0.f;
-    //float v_min = Calibration.Color.Height;
-    //float v_max = 0.f;
+    float* coordinates_next = coordinates;
+    uint16_t* compact_next = compact;
 
-    int depth_row_offset = 0;
-    for (int depth_y = 0; depth_y < height; ++depth_y, depth_row_offset += width)
+    int depth_row_offset = first_row * width;
+    for (int depth_y = first_row; depth_y < end_row; ++depth_y, depth_row_offset += width)
     {
         // This is used to avoid painting foreground on background due to disocclusion.
         // The depth/RGB cameras are physically separated by a few mm distance, so the
@@ -535,211 +803,381 @@ void DepthMesher::GenerateCoordinates(
                 continue;
             }
 
-            const float* scale = &lookup[depth_index * 2];
-            CORE_DEBUG_ASSERT(!isnan(scale[0]));
-#if 0
-            if (isnan(scale[0])) {
-                depth[depth_index] = 0;
-                continue;
-            }
-#endif
-
             // 73% of data is non-zero:
 
-            // Convert to 3D (millimeters) relative to depth camera
-            const float depth_x_mm = depth_mm * scale[0];
-            const float depth_y_mm = depth_mm * scale[1];
-            const float depth_z_mm = depth_mm;
-
-            // Convert to 3D relative to color camera
-            const float color_x_mm = R[0] * depth_x_mm + R[1] * depth_y_mm + R[2] * depth_z_mm + T[0];
-            const float color_y_mm = R[3] * depth_x_mm + R[4] * depth_y_mm + R[5] * depth_z_mm + T[1];
-            const float color_z_mm = R[6] * depth_x_mm + R[7] * depth_y_mm + R[8] * depth_z_mm + T[2];
-
-            const float x = color_x_mm * kInverseMeters;
-            const float y = color_y_mm * kInverseMeters;
-            const float z = color_z_mm * kInverseMeters;
+            // Vertex is written in place and kept if it is not culled
+            float color_mm[3];
+            projector.Position(depth_index, depth_mm, coordinates_next, color_mm);
 
+            bool culled = false;
             if (face_painting_fix)
             {
                 if (depth_mm > depth_limit) {
-                    if (cull_depth) {
-                        depth[depth_index] = 0;
-                    } else {
-                        coordinates_next[0] = x;
-                        coordinates_next[1] = y;
-                        coordinates_next[2] = z;
-                        coordinates_next[3] = 0.f;
-                        coordinates_next[4] = 0.f;
-                        coordinates_next += 5;
-                    }
-                    continue;
+                    culled = true;
                 } else {
                     depth_limit = depth_mm;
                     limit_increment = (depth_mm * 44) / 1000;
                 }
             }
 
-            // Cylinder clip:
-            if (clip)
-            {
-                Eigen::Vector3f testpt(x, y, z);
-                const Eigen::Vector3f pd = testpt - clip_p0;
-                const float dot = -pd.dot(clip_d);
-                if (dot < clip->Floor || dot > clip->Ceiling || (pd.squaredNorm() - dot*dot) > clip->Radius) {
-                    if (cull_depth) {
-                        depth[depth_index] = 0;
-                    } else {
-                        coordinates_next[0] = x;
-                        coordinates_next[1] = y;
-                        coordinates_next[2] = z;
-                        coordinates_next[3] = 0.f;
-                        coordinates_next[4] = 0.f;
-                        coordinates_next += 5;
-                    }
-                    continue;
-                }
+            if (!culled) {
+                culled = !projector.TexCoord(coordinates_next, color_mm, coordinates_next + 3);
             }
 
-            const float inv_z = 1.f / color_z_mm;
-            const float x_proj = color_x_mm * inv_z;
-            const float y_proj = color_y_mm * inv_z;
-
-            const float xp = x_proj - codx;
-            const float yp = y_proj - cody;
-
-            const float xp2 = xp * xp;
-            const float yp2 = yp * yp;
-            const float xyp = xp * yp;
-            const float rs = xp2 + yp2;
-
-#if 0
-            if (rs > max_radius_for_projection2) {
+            if (culled)
+            {
                 if (cull_depth) {
                     depth[depth_index] = 0;
-                } else {
-                    coordinates_next[0] = x;
-                    coordinates_next[1] = y;
-                    coordinates_next[2] = z;
-                    coordinates_next[3] = 0.f;
-                    coordinates_next[4] = 0.f;
-                    coordinates_next += 5;
+                    continue;
                 }
-                continue;
+                coordinates_next[3] = 0.f;
+                coordinates_next[4] = 0.f;
             }
-#endif
 
-            const float rss = rs * rs;
-            const float rsc = rss * rs;
-            const float a = 1.f + k1 * rs + k2 * rss + k3 * rsc;
-            const float b = 1.f + k4 * rs + k5 * rss + k6 * rsc;
-            float bi = 1.f;
-            if (b != 0.f) {
-                bi /= b;
+            if (compact_next) {
+                WriteCompactVertex(coordinates_next, compact_next);
+                compact_next += kCompactVertexShorts;
             }
-            const float d = a * bi;
-
-            float xp_d = xp * d;
-            float yp_d = yp * d;
+            coordinates_next += 5;
+        } // next x
+    } // next y
 
-            const float rs_2xp2 = rs + 2.f * xp2;
-            const float rs_2yp2 = rs + 2.f * yp2;
+    return static_cast<int>( coordinates_next - coordinates ) / 5;
+}
 
-            xp_d += rs_2xp2 * p2 + dist_coeff * xyp * p1;
-            yp_d += rs_2yp2 * p1 + dist_coeff * xyp * p2;
+void DepthMesher::GenerateFacePaintingMask(
+    const uint16_t* depth,
+    int first_row,
+    int end_row,
+    uint8_t* mask)
+{
+    const int width = Calibration.Depth.Width;
 
-            const float xp_d_cx = xp_d + codx;
-            const float yp_d_cy = yp_d + cody;
+    // See GenerateCoordinatesRows() for the face painting fix
+    int depth_row_offset = first_row * width;
+    for (int depth_y = first_row; depth_y < end_row; ++depth_y, depth_row_offset += width)
+    {
+        unsigned depth_limit = 65536;
+        unsigned limit_increment = 40;
 
-            // Convert xyz to meters and normalized uv
-            const float u_pixels = xp_d_cx * fx + cx;
-            const float v_pixels = yp_d_cy * fy + cy;
+        for (int depth_x = width - 1; depth_x >= 0; --depth_x, depth_limit += limit_increment)
+        {
+            const int depth_index = depth_row_offset + depth_x;
+            const uint16_t depth_mm = depth[depth_index];
 
-    #if 0
-            if (u_min > u_pixels) {
-                u_min = u_pixels;
-            }
-            if (u_max < u_pixels) {
-                u_max = u_pixels;
-            }
-            if (v_min > v_pixels) {
-                v_min = v_pixels;
+            uint8_t culled = 0;
+            if (depth_mm != 0)
+            {
+                if (depth_mm > depth_limit) {
+                    culled = 1;
+                } else {
+                    depth_limit = depth_mm;
+                    limit_increment = (depth_mm * 44) / 1000;
+                }
             }
-            if (v_max < v_pixels) {
-                v_max = v_pixels;
+            mask[depth_index] = culled;
+        }
+    }
+}
+
+void DepthMesher::GenerateCoordinatesSpans(
+    uint16_t* depth,
+    const ClipRegion* clip,
+    const uint8_t* face_painting_mask,
+    bool cull_depth,
+    const DepthSpan* spans,
+    int span_count)
+{
+    const int width = Calibration.Depth.Width;
+
+    const ScalarProjector projector(*this, clip);
+
+    for (int i = 0; i < span_count; ++i)
+    {
+        const DepthSpan& span = spans[i];
+        float* coordinates_next = span.Coordinates;
+        const int depth_row_offset = span.Y * width;
+
+        for (int depth_x = span.X0; depth_x < span.X1; ++depth_x, coordinates_next += 5)
+        {
+            const int depth_index = depth_row_offset + depth_x;
+            const uint16_t depth_mm = depth[depth_index];
+            if (depth_mm == 0) {
+                memset(coordinates_next, 0, 5 * sizeof(float));
+                continue;
             }
-    #endif
 
-            const float u = u_pixels * inv_color_width;
-            const float v = v_pixels * inv_color_height;
+            float color_mm[3];
+            projector.Position(depth_index, depth_mm, coordinates_next, color_mm);
 
-            // If it is sampling off the edge of the image:
-            if (v < 0.0001f || v >= 1.0001f ||
-                u < 0.0001f || u >= 1.0001f)
+            bool culled = face_painting_mask && face_painting_mask[depth_index] != 0;
+            if (!culled) {
+                culled = !projector.TexCoord(coordinates_next, color_mm, coordinates_next + 3);
+            }
+
+            if (culled)
             {
                 if (cull_depth) {
                     depth[depth_index] = 0;
-                } else {
-                    coordinates_next[0] = x;
-                    coordinates_next[1] = y;
-                    coordinates_next[2] = z;
-                    coordinates_next[3] = 0.f;
-                    coordinates_next[4] = 0.f;
-                    coordinates_next += 5;
+                    memset(coordinates_next, 0, 5 * sizeof(float));
+                    continue;
                 }
-                continue;
+                coordinates_next[3] = 0.f;
+                coordinates_next[4] = 0.f;
             }
+        }
+    }
+}
 
-            coordinates_next[0] = x;
-            coordinates_next[1] = y;
-            coordinates_next[2] = z;
-            coordinates_next[3] = u;
-            coordinates_next[4] = v;
-            coordinates_next += 5;
-        } // next x
-    } // next y
 
-    // Resize to fit
-    const uintptr_t size = static_cast<uintptr_t>( coordinates_next - coordinates.data() );
-    coordinates.resize(size);
+//------------------------------------------------------------------------------
+// DepthMesher : SIMD Coordinates
+
+int DepthMesher::GenerateCoordinatesRowsSimd(
+    uint16_t* depth,
+    const ClipRegion* clip,
+    int first_row,
+    int end_row,
+    float* coordinates,
+    uint16_t* compact,
+    bool face_painting_fix,
+    bool cull_depth)
+{
+    const int width = Calibration.Depth.Width;
+    const int height = Calibration.Depth.Height;
+    const int n = width * height;
+
+    const float* lookup_x = DepthLookup.data();
+    const float* lookup_y = lookup_x + n;
 
-#if 0
-    if (crop)
+    const float kInverseMeters = 1.f / 1000.f;
+    const float inv_color_width = 1.f / static_cast<float>( Calibration.Color.Width );
+    const float inv_color_height = 1.f / static_cast<float>( Calibration.Color.Height );
+
+    Eigen::Vector3f clip_p0(0.f, 0.f, 0.f), clip_d(0.f, 0.f, 0.f);
+    float clip_radius2 = 0.f;
+    if (clip)
     {
-        const int fuzz = 16; // pixels
-        int x_max = static_cast<int>(u_max) + fuzz;
-        if (x_max > Calibration.Color.Width) {
-            x_max = Calibration.Color.Width;
-        }
-        int x_min = static_cast<int>(u_min) - fuzz;
-        if (x_min < 0) {
-            x_min = 0;
-        }
-        int y_max = static_cast<int>(v_max) + fuzz;
-        if (y_max > Calibration.Color.Height) {
-            y_max = Calibration.Color.Height;
-        }
-        int y_min = static_cast<int>(v_min) - fuzz;
-        if (y_min < 0) {
-            y_min = 0;
+        // define pt2 as 1 meter from pt1
+
+        Eigen::Matrix4f inv_exstrinsics = clip->Extrinsics.inverse();
+
+        Eigen::Vector4f q0 = inv_exstrinsics * Eigen::Vector4f(0.f, 0.f, 0.f, 1.f);
+        clip_p0 = Eigen::Vector3f(q0(0), q0(1), q0(2));
+
+        Eigen::Vector4f q1 = inv_exstrinsics * Eigen::Vector4f(0.f, 1.f, 0.f, 1.f);
+        clip_d = Eigen::Vector3f(q1(0), q1(1), q1(2)) - clip_p0;
+
+        // Compared against squared distance from the axis
+        clip_radius2 = clip->Radius * clip->Radius;
+    }
+
+    // Extrinsics transform from depth -> color camera
+    const float* R = Calibration.RotationFromDepth;
+    const float* T = Calibration.TranslationFromDepth;
+
+    const CameraIntrinsics& intrinsics = Calibration.Color;
+    const float cx = intrinsics.cx;
+    const float cy = intrinsics.cy;
+    const float fx = intrinsics.fx;
+    const float fy = intrinsics.fy;
+    const float k1 = intrinsics.k[0];
+    const float k2 = intrinsics.k[1];
+    const float k3 = intrinsics.k[2];
+    const float k4 = intrinsics.k[3];
+    const float k5 = intrinsics.k[4];
+    const float k6 = intrinsics.k[5];
+    const float codx = intrinsics.codx;
+    const float cody = intrinsics.cody;
+    const float p1 = intrinsics.p1;
+    const float p2 = intrinsics.p2;
+
+    float dist_coeff = 1.f;
+    if (intrinsics.LensModel != LensModel_Rational_6KT) {
+        dist_coeff = 2.f;
+    }
+
+    // Row workspace, padded to a whole number of packets
+    const int padded_width = (width + kLanes - 1) / kLanes * kLanes;
+    std::vector<float> workspace(padded_width * 7 + kLanes * 2, 0.f);
+    float* row_depth = workspace.data();
+    float* row_x = row_depth + padded_width;
+    float* row_y = row_x + padded_width;
+    float* row_z = row_y + padded_width;
+    float* row_u = row_z + padded_width;
+    float* row_v = row_u + padded_width;
+    float* row_culled = row_v + padded_width;
+    float* tail_scale_x = row_culled + padded_width;
+    float* tail_scale_y = tail_scale_x + kLanes;
+
+    // Compact x, y, z, u, v for the row, quantized while projecting
+    std::vector<int32_t> compact_workspace(compact ? padded_width * 5 : 0);
+    int32_t* row_qx = compact_workspace.data();
+    int32_t* row_qy = row_qx + padded_width;
+    int32_t* row_qz = row_qy + padded_width;
+    int32_t* row_qu = row_qz + padded_width;
+    int32_t* row_qv = row_qu + padded_width;
+
+    float* coordinates_next = coordinates;
+    uint16_t* compact_next = compact;
+
+    int depth_row_offset = first_row * width;
+    for (int depth_y = first_row; depth_y < end_row; ++depth_y, depth_row_offset += width)
+    {
+        const uint16_t* depth_row = depth + depth_row_offset;
+        for (int depth_x = 0; depth_x < width; ++depth_x) {
+            row_depth[depth_x] = depth_row[depth_x];
         }
 
-        // If the entire image is cropped:
-        if (x_max <= x_min || y_max <= y_min)
+        // Project the whole row including zeroes, which are skipped below
+        for (int depth_x = 0; depth_x < width; depth_x += kLanes)
         {
-            // Show something near the center of the image
-            x_min = Calibration.Color.Width / 2;
-            y_min = Calibration.Color.Height / 2;
-            x_max = x_min + 32;
-            y_max = y_min + 32;
+            const float* scale_x = lookup_x + depth_row_offset + depth_x;
+            const float* scale_y = lookup_y + depth_row_offset + depth_x;
+
+            // Last partial packet reads from a zero-padded copy
+            const int remaining = width - depth_x;
+            if (remaining < kLanes) {
+                for (int i = 0; i < kLanes; ++i) {
+                    tail_scale_x[i] = i < remaining ? scale_x[i] : 0.f;
+                    tail_scale_y[i] = i < remaining ? scale_y[i] : 0.f;
+                }
+                scale_x = tail_scale_x;
+                scale_y = tail_scale_y;
+            }
+
+            // Convert to 3D (millimeters) relative to depth camera
+            const FloatP depth_z_mm = enoki::load_unaligned<FloatP>(row_depth + depth_x);
+            const FloatP depth_x_mm = depth_z_mm * enoki::load_unaligned<FloatP>(scale_x);
+            const FloatP depth_y_mm = depth_z_mm * enoki::load_unaligned<FloatP>(scale_y);
+
+            // Convert to 3D relative to color camera
+            const FloatP color_x_mm = R[0] * depth_x_mm + R[1] * depth_y_mm + R[2] * depth_z_mm + T[0];
+            const FloatP color_y_mm = R[3] * depth_x_mm + R[4] * depth_y_mm + R[5] * depth_z_mm + T[1];
+            const FloatP color_z_mm = R[6] * depth_x_mm + R[7] * depth_y_mm + R[8] * depth_z_mm + T[2];
+
+            const FloatP x = color_x_mm * kInverseMeters;
+            const FloatP y = color_y_mm * kInverseMeters;
+            const FloatP z = color_z_mm * kInverseMeters;
+
+            MaskP culled(false);
+
+            // Cylinder clip:
+            if (clip)
+            {
+                const FloatP pd_x = x - clip_p0.x();
+                const FloatP pd_y = y - clip_p0.y();
+                const FloatP pd_z = z - clip_p0.z();
+                const FloatP dot = -(pd_x * clip_d.x() + pd_y * clip_d.y() + pd_z * clip_d.z());
+                const FloatP pd_norm2 = pd_x * pd_x + pd_y * pd_y + pd_z * pd_z;
+                culled = (dot < clip->Floor) | (dot > clip->Ceiling) | ((pd_norm2 - dot * dot) > clip_radius2);
+            }
+
+            const FloatP inv_z = 1.f / color_z_mm;
+            const FloatP x_proj = color_x_mm * inv_z;
+            const FloatP y_proj = color_y_mm * inv_z;
+
+            const FloatP xp = x_proj - codx;
+            const FloatP yp = y_proj - cody;
+
+            const FloatP xp2 = xp * xp;
+            const FloatP yp2 = yp * yp;
+            const FloatP xyp = xp * yp;
+            const FloatP rs = xp2 + yp2;
+
+            const FloatP rss = rs * rs;
+            const FloatP rsc = rss * rs;
+            const FloatP a = 1.f + k1 * rs + k2 * rss + k3 * rsc;
+            const FloatP b = 1.f + k4 * rs + k5 * rss + k6 * rsc;
+            const FloatP bi = enoki::select(enoki::neq(b, 0.f), 1.f / b, FloatP(1.f));
+            const FloatP d = a * bi;
+
+            FloatP xp_d = xp * d;
+            FloatP yp_d = yp * d;
+
+            const FloatP rs_2xp2 = rs + 2.f * xp2;
+            const FloatP rs_2yp2 = rs + 2.f * yp2;
+
+            xp_d += rs_2xp2 * p2 + dist_coeff * xyp * p1;
+            yp_d += rs_2yp2 * p1 + dist_coeff * xyp * p2;
+
+            const FloatP xp_d_cx = xp_d + codx;
+            const FloatP yp_d_cy = yp_d + cody;
+
+            const FloatP u_pixels = xp_d_cx * fx + cx;
+            const FloatP v_pixels = yp_d_cy * fy + cy;
+
+            const FloatP u = u_pixels * inv_color_width;
+            const FloatP v = v_pixels * inv_color_height;
+
+            // If it is sampling off the edge of the image:
+            culled |= (v < 0.0001f) | (v >= 1.0001f) | (u < 0.0001f) | (u >= 1.0001f);
+
+            enoki::store_unaligned(row_x + depth_x, x);
+            enoki::store_unaligned(row_y + depth_x, y);
+            enoki::store_unaligned(row_z + depth_x, z);
+            enoki::store_unaligned(row_u + depth_x, u);
+            enoki::store_unaligned(row_v + depth_x, v);
+            enoki::store_unaligned(row_culled + depth_x, enoki::select(culled, FloatP(1.f), FloatP(0.f)));
+
+            if (compact)
+            {
+                enoki::store_unaligned(row_qx + depth_x, QuantizeCompactPositionP(x));
+                enoki::store_unaligned(row_qy + depth_x, QuantizeCompactPositionP(y));
+                enoki::store_unaligned(row_qz + depth_x, QuantizeCompactPositionP(z));
+                enoki::store_unaligned(row_qu + depth_x, QuantizeUnorm16P(u));
+                enoki::store_unaligned(row_qv + depth_x, QuantizeUnorm16P(v));
+            }
         }
 
-        crop->CropX = static_cast<unsigned>( x_min );
-        crop->CropY = static_cast<unsigned>( y_min );
-        crop->CropW = static_cast<unsigned>( x_max - x_min );
-        crop->CropH = static_cast<unsigned>( y_max - y_min );
-    }
-#endif
+        // See GenerateCoordinates() for the face painting fix
+        unsigned depth_limit = 65536;
+        unsigned limit_increment = 40;
+
+        for (int depth_x = width - 1; depth_x >= 0; --depth_x, depth_limit += limit_increment)
+        {
+            const int depth_index = depth_row_offset + depth_x;
+            const uint16_t depth_mm = depth[depth_index];
+            if (depth_mm == 0) {
+                continue;
+            }
+
+            bool culled = row_culled[depth_x] != 0.f;
+            if (face_painting_fix)
+            {
+                if (depth_mm > depth_limit) {
+                    culled = true;
+                } else {
+                    depth_limit = depth_mm;
+                    limit_increment = (depth_mm * 44) / 1000;
+                }
+            }
+
+            if (culled && cull_depth) {
+                depth[depth_index] = 0;
+                continue;
+            }
+
+            coordinates_next[0] = row_x[depth_x];
+            coordinates_next[1] = row_y[depth_x];
+            coordinates_next[2] = row_z[depth_x];
+            coordinates_next[3] = culled ? 0.f : row_u[depth_x];
+            coordinates_next[4] = culled ? 0.f : row_v[depth_x];
+            coordinates_next += 5;
+
+            if (compact_next)
+            {
+                compact_next[0] = static_cast<uint16_t>( row_qx[depth_x] );
+                compact_next[1] = static_cast<uint16_t>( row_qy[depth_x] );
+                compact_next[2] = static_cast<uint16_t>( row_qz[depth_x] );
+                compact_next[3] = culled ? 0 : static_cast<uint16_t>( row_qu[depth_x] );
+                compact_next[4] = culled ? 0 : static_cast<uint16_t>( row_qv[depth_x] );
+                compact_next += kCompactVertexShorts;
+            }
+        } // next x
+    } // next y
+
+    return static_cast<int>( coordinates_next - coordinates ) / 5;
 }
 
 // Throw out triangles with too much depth mismatch
@@ -761,6 +1199,15 @@ static bool CheckDepth(
     return true;
 }
 
+static unsigned CountNonZero(const uint16_t* depth, int count)
+{
+    unsigned nonzero = 0;
+    for (int i = 0; i < count; ++i) {
+        nonzero += depth[i] != 0 ? 1 : 0;
+    }
+    return nonzero;
+}
+
 void DepthMesher::GenerateTriangleIndices(
     const uint16_t* depth,
     std::vector<uint32_t>& indices)
@@ -771,20 +1218,83 @@ void DepthMesher::GenerateTriangleIndices(
 
     indices.clear();
     indices.resize(n * 2 * 3);
-    unsigned* indices_next = indices.data();
+
+    const int band_count = GetBandCount();
+    std::vector<unsigned> band_first_index(band_count + 1);
+    std::vector<int> band_indices(band_count);
+
+    // Count vertices in each band
+    if (band_count > 1)
+    {
+        ForEachBand(band_count, [&](int band) {
+            const int first_row = height * band / band_count;
+            const int end_row = height * (band + 1) / band_count;
+            band_first_index[band + 1] = CountNonZero(depth + first_row * width, (end_row - first_row) * width);
+        });
+        for (int band = 0; band < band_count; ++band) {
+            band_first_index[band + 1] += band_first_index[band];
+        }
+    }
+
+    ForEachBand(band_count, [&](int band) {
+        const int first_row = height * band / band_count;
+        const int end_row = height * (band + 1) / band_count;
+
+        // Vertex indices for the row above the band start before the band
+        unsigned first_index = band_first_index[band];
+        if (first_row > 0) {
+            first_index -= CountNonZero(depth + (first_row - 1) * width, width);
+        }
+
+        band_indices[band] = GenerateTriangleRows(
+            depth, first_row, end_row, first_index,
+            indices.data() + first_row * width * 2 * 3);
+    });
+
+    // Pack bands together
+    uint32_t* indices_next = indices.data() + band_indices[0];
+    for (int band = 1; band < band_count; ++band)
+    {
+        const int first_row = height * band / band_count;
+        const uint32_t* band_indices_data = indices.data() + first_row * width * 2 * 3;
+        if (indices_next != band_indices_data) {
+            memmove(indices_next, band_indices_data, band_indices[band] * sizeof(uint32_t));
+        }
+        indices_next += band_indices[band];
+    }
+
+    // Resize to fit
+    const uintptr_t size = static_cast<uintptr_t>( indices_next - indices.data() );
+    indices.resize(size);
+}
+
+int DepthMesher::GenerateTriangleRows(
+    const uint16_t* depth,
+    int first_row,
+    int end_row,
+    unsigned first_index,
+    uint32_t* indices)
+{
+    const int width = Calibration.Depth.Width;
+
+    unsigned* indices_next = indices;
 
     std::vector<unsigned> RowIndices(width * 2);
     unsigned* row_indices = RowIndices.data();
 
-    unsigned index = 0;
-    for (int y = 0; y < height; ++y, depth += width)
+    // Start from the row above the band to stitch the seam
+    const int start_row = first_row > 0 ? first_row - 1 : 0;
+    depth += start_row * width;
+
+    unsigned index = first_index;
+    for (int y = start_row; y < end_row; ++y, depth += width)
     {
         // Offset into row_indices for current and previous rows
         const unsigned current_row_offset = (y % 2 == 0) ? width : 0;
         const unsigned prev_row_offset = (y % 2 != 0) ? width : 0;
 
         // Unroll first loop
-        if (y == 0) {
+        if (y == start_row) {
             for (int x = width - 1; x >= 0; --x) {
                 if (depth[x] != 0) {
                     row_indices[x + current_row_offset] = index++;
@@ -859,22 +1369,49 @@ void DepthMesher::GenerateTriangleIndices(
         } // next x
     } // next y
 
-    // Resize to fit
-    const uintptr_t size = static_cast<uintptr_t>( indices_next - indices.data() );
-    indices.resize(size);
+    return static_cast<int>( indices_next - indices );
 }
 
-void DepthMesher::CalculateCrop(
+unsigned GetCellTriangles(const uint16_t* c, int width)
+{
+    // Same tests as GenerateTriangleIndices()
+    const uint16_t depth_mm = c[0];
+    const uint16_t a_depth = c[-width];
+    const uint16_t b_depth = c[1 - width];
+    const uint16_t d_depth = c[1];
+    const int thresh_mm = depth_mm * 22 / 1000;
+
+    unsigned bits = 0;
+    if (b_depth != 0) {
+        if (a_depth != 0 && CheckDepth(a_depth, b_depth, depth_mm, thresh_mm)) {
+            bits |= kCellTriangleCBA;
+        }
+        if (CheckDepth(b_depth, d_depth, depth_mm, thresh_mm)) {
+            bits |= kCellTriangleCDB;
+        }
+    } else if (a_depth != 0 && d_depth != 0 &&
+        CheckDepth(a_depth, d_depth, depth_mm, thresh_mm))
+    {
+        bits |= kCellTriangleCDA;
+    }
+    return bits;
+}
+
+// Project the clip cylinder into the image of a camera.
+// to_camera: Transforms from color camera meters to the camera's meters.
+// radius: Cylinder radius to sample around.
+static void ProjectClipRegion(
     const ClipRegion& clip,
+    const CameraIntrinsics& intrinsics,
+    const Eigen::Matrix4f& to_camera,
     ImageCropRegion& crop)
 {
     // Evaluate u,v coordinates for vertex coordinates around ring
     // cross-sections of the crop cylinder.  The range of u,v becomes
     // the crop region for the video.
 
-    const Eigen::Matrix4f inv_exstrinsics = clip.Extrinsics.inverse();
+    const Eigen::Matrix4f inv_exstrinsics = to_camera * clip.Extrinsics.inverse();
 
-    const CameraIntrinsics& intrinsics = Calibration.Color;
     const float cx = intrinsics.cx;
     const float cy = intrinsics.cy;
     const float fx = intrinsics.fx;
@@ -899,14 +1436,18 @@ void DepthMesher::CalculateCrop(
     }
 
     float u_max = 0.f;
-    float u_min = static_cast<float>( Calibration.Color.Width );
+    float u_min = static_cast<float>( intrinsics.Width );
     float v_max = 0.f;
-    float v_min = static_cast<float>( Calibration.Color.Height );
+    float v_min = static_cast<float>( intrinsics.Height );
 
-    // For each slice of cylinder:
+    // For each slice of cylinder, including the ceiling:
     const float y_iter = 0.2f;
-    for (float y = clip.Floor; y < clip.Ceiling; y += y_iter)
+    for (float y = clip.Floor; y < clip.Ceiling + y_iter; y += y_iter)
     {
+        if (y > clip.Ceiling) {
+            y = clip.Ceiling;
+        }
+
         // Parametric form of circle
         const float t_samples = 64.f;
         const float t_iter = 3.1415926535f * 2.f / t_samples;
@@ -917,6 +1458,15 @@ void DepthMesher::CalculateCrop(
 
             Eigen::Vector4f q = inv_exstrinsics * Eigen::Vector4f(x, -y, z, 1.f);
 
+            // If the cylinder reaches behind the camera, use the whole image
+            if (q(2) <= 0.f) {
+                crop.CropX = 0;
+                crop.CropY = 0;
+                crop.CropW = static_cast<unsigned>( intrinsics.Width );
+                crop.CropH = static_cast<unsigned>( intrinsics.Height );
+                return;
+            }
+
             // Convert to u,v
 
             const float inv_z = 1.f / q(2);
@@ -977,16 +1527,16 @@ void DepthMesher::CalculateCrop(
 
     const int fuzz = 4; // pixels
     int x_max = static_cast<int>(u_max) + fuzz;
-    if (x_max > Calibration.Color.Width) {
-        x_max = Calibration.Color.Width;
+    if (x_max > intrinsics.Width) {
+        x_max = intrinsics.Width;
     }
     int x_min = static_cast<int>(u_min) - fuzz;
     if (x_min < 0) {
         x_min = 0;
     }
     int y_max = static_cast<int>(v_max) + fuzz;
-    if (y_max > Calibration.Color.Height) {
-        y_max = Calibration.Color.Height;
+    if (y_max > intrinsics.Height) {
+        y_max = intrinsics.Height;
     }
     int y_min = static_cast<int>(v_min) - fuzz;
     if (y_min < 0) {
@@ -995,8 +1545,8 @@ void DepthMesher::CalculateCrop(
 
     // If crop would be empty:
     if (x_max <= x_min || y_max <= y_min) {
-        x_min = Calibration.Color.Width / 2;
-        y_min = Calibration.Color.Height / 2;
+        x_min = intrinsics.Width / 2;
+        y_min = intrinsics.Height / 2;
         x_max = x_min + 32;
         y_max = y_min + 32;
     }
@@ -1008,85 +1558,173 @@ void DepthMesher::CalculateCrop(
 }
 
 
+void DepthMesher::CalculateCrop(
+    const ClipRegion& clip,
+    ImageCropRegion& crop)
+{
+    ProjectClipRegion(
+        clip,
+        Calibration.Color,
+        Eigen::Matrix4f::Identity(),
+        crop);
+}
+
+void DepthMesher::CalculateDepthCrop(
+    const ClipRegion& clip,
+    ImageCropRegion& crop)
+{
+    // Invert the depth -> color camera extrinsics (millimeters)
+    const float* R = Calibration.RotationFromDepth;
+    const float* T = Calibration.TranslationFromDepth;
+    Eigen::Matrix4f to_depth = Eigen::Matrix4f::Identity();
+    for (int row = 0; row < 3; ++row) {
+        float t = 0.f;
+        for (int col = 0; col < 3; ++col) {
+            to_depth(row, col) = R[col * 3 + row];
+            t += R[col * 3 + row] * T[col];
+        }
+        to_depth(row, 3) = -t * 0.001f;
+    }
+
+    ProjectClipRegion(
+        clip,
+        Calibration.Depth,
+        to_depth,
+        crop);
+}
+
+
 //------------------------------------------------------------------------------
 // TemporalDepthFilter
 
+void TemporalDepthFilter::SetHistoryFrames(int frames)
+{
+    frames = std::min(std::max(frames, kMinHistoryFrames), kMaxHistoryFrames);
+    if (HistoryFrames != frames) {
+        HistoryFrames = frames;
+        Width = Height = 0; // Reset on next Filter()
+    }
+}
+
+// Filter pixels [first, end) one at a time
+static void TemporalFilterScalar(
+    uint16_t* depth,
+    uint16_t* history,
+    int n,
+    int frames,
+    int index,
+    int first,
+    int end)
+{
+    for (int i = first; i < end; ++i)
+    {
+        const uint16_t x = depth[i];
+
+        unsigned sum = x;
+        unsigned nonzero_count = sum != 0;
+        unsigned h_min = sum;
+        unsigned h_max = sum;
+        for (int j = 0; j < frames; ++j) {
+            const uint16_t y = history[j * n + i];
+            if (y == 0) {
+                continue;
+            }
+            sum += y;
+            ++nonzero_count;
+            if (h_max < y) {
+                h_max = y;
+            }
+            if (h_min > y) {
+                h_min = y;
+            }
+        }
+
+        history[index * n + i] = x;
+
+        if (nonzero_count < static_cast<unsigned>( frames / 2 )) {
+            continue;
+        }
+
+        const unsigned h_avg = sum / nonzero_count;
+        const unsigned range = h_max - h_min;
+
+        // Static objects are identified by max-min < 0.4% of avg range
+        const unsigned uncertainty = h_avg / 256;
+
+        // If the depth value is static:
+        if (range < uncertainty) {
+            depth[i] = static_cast<uint16_t>( h_avg );
+        }
+        // Otherwise allow the deviation through
+    }
+}
+
 void TemporalDepthFilter::Filter(uint16_t* depth, int w, int h)
 {
     const int n = w * h;
+    const int frames = HistoryFrames;
     if (Width != w || Height != h) {
         Width = w;
         Height = h;
         Count = 0;
         Index = 0;
-        History.resize(kStride * n);
+        History.resize(frames * n);
     }
 
     uint16_t* history = History.data();
     const int index = Index;
 
     // If history is still filling:
-    if (Count < kStride)
+    if (Count < frames)
     {
         ++Count;
-        history += index;
-        for (int i = 0; i < n; ++i) {
-            history[i * kStride] = depth[i];
-        }
+        memcpy(history + index * n, depth, n * sizeof(uint16_t));
     }
     else
     {
-        for (int i = 0; i < n; ++i)
+        const int min_count = frames / 2;
+        const int simd_end = n - n % kLanes;
+
+        for (int i = 0; i < simd_end; i += kLanes)
         {
-            const uint16_t x = depth[i];
-            uint16_t* hist = history + i * kStride;
-
-            unsigned sum = x;
-            unsigned nonzero_count = sum != 0;
-            unsigned h_min = sum;
-            unsigned h_max = sum;
-            for (int j = 0; j < kStride; ++j) {
-                const uint16_t y = hist[j];
-                if (y == 0) {
-                    continue;
-                }
+            const Int32P x = Int32P(enoki::load_unaligned<UInt16P>(depth + i));
+
+            // Zeroes do not count towards the sum or the min
+            Int32P sum = x;
+            Int32P nonzero_count = enoki::select(enoki::neq(x, 0), Int32P(1), Int32P(0));
+            Int32P h_min = x;
+            Int32P h_max = x;
+            for (int j = 0; j < frames; ++j)
+            {
+                const Int32P y = Int32P(enoki::load_unaligned<UInt16P>(history + j * n + i));
+                const auto nonzero = enoki::neq(y, 0);
                 sum += y;
-                ++nonzero_count;
-                if (h_max < y) {
-                    h_max = y;
-                }
-                if (h_min > y) {
-                    h_min = y;
-                }
+                nonzero_count += enoki::select(nonzero, Int32P(1), Int32P(0));
+                h_max = enoki::max(h_max, y);
+                h_min = enoki::select(nonzero, enoki::min(h_min, y), h_min);
             }
 
-            // Shortcut for all zeroes:
-            if (nonzero_count <= 0) {
-                continue;
-            }
-
-            hist[index] = x;
-
-            if (nonzero_count < kStride / 2) {
-                continue;
-            }
+            enoki::store_unaligned(history + index * n + i, UInt16P(x));
 
-            const unsigned h_avg = sum / nonzero_count;
-            const unsigned range = h_max - h_min;
+            // Average: Truncated sum * (1 / count), then fix off-by-one
+            // rounding so the result is exactly sum / count
+            const Int32P count = enoki::max(nonzero_count, Int32P(1));
+            Int32P h_avg = Int32P(FloatP(sum) * enoki::rcp(FloatP(count)));
+            const Int32P remainder = sum - h_avg * count;
+            h_avg += enoki::select(remainder >= count, Int32P(1), Int32P(0));
+            h_avg -= enoki::select(remainder < 0, Int32P(1), Int32P(0));
 
-            // Static objects are identified by max-min < 0.4% of avg range
-            const unsigned uncertainty = h_avg / 256;
+            const auto is_static = (nonzero_count >= min_count) &
+                ((h_max - h_min) < enoki::sr<8>(h_avg));
 
-            // If the depth value is static:
-            if (range < uncertainty) {
-                depth[i] = static_cast<uint16_t>( h_avg );
-            }
-            // Otherwise allow the deviation through
+            enoki::store_unaligned(depth + i, UInt16P(enoki::select(is_static, h_avg, x)));
         }
+
+        TemporalFilterScalar(depth, history, n, frames, index, simd_end, n);
     }
 
     ++Index;
-    if (Index >= kStride) {
+    if (Index >= frames) {
         Index = 0;
     }
 }
@@ -1095,162 +1733,152 @@ void TemporalDepthFilter::Filter(uint16_t* depth, int w, int h)
 //------------------------------------------------------------------------------
 // DepthEdgeFilter
 
-void DepthEdgeFilter::Filter(uint16_t* depth, int w, int h)
+void DepthEdgeFilter::FilterRowGradients(uint16_t* depth, int w, int y)
 {
-    const int end_y = h - 1;
     const int end_x = w - 1;
+    const int T = static_cast<int>( GradientThresholdMm );
 
-    uint16_t* prior_row = depth;
-    uint16_t* row = depth + w;
-    uint16_t* next_row = depth + w * 2;
-
-    // First step: Filter gradients beyond some limit, and build integral image
+    const uint16_t* prior_row = depth + (y - 1) * w;
+    uint16_t* row = depth + y * w;
+    const uint16_t* next_row = row + w;
 
-    const unsigned T = 200;
+    /*
+        The tests against right, up and down neighbors are independent, since
+        those have their final values already: The row above was filtered, and
+        the row below and right side have not been yet.
 
-    const int ii_w = w + 1;
-    const int ii_h = h + 1;
-    IntegralImage.resize(ii_w * ii_h);
-    uint16_t* ii_row = IntegralImage.data();
+        The left neighbor test only applies if the left neighbor was not itself
+        removed, so packets that have any left neighbor hits are resolved from
+        left to right.
+    */
+    bool left_removed = false;
 
-    // First row of integral image is all zeroes
-    for (int ii_x = 0; ii_x < ii_w; ++ii_x) {
-        ii_row[ii_x] = 0;
-    }
-    ii_row += ii_w;
-
-    // Second row of integral image is unrolled
+    int x = 1;
+    for (; x + kLanes <= end_x; x += kLanes)
     {
-        ii_row[0] = 0;
-        ++ii_row;
-
-        uint16_t row_sum = prior_row[0] != 0 ? 1 : 0;
-        ii_row[0] = row_sum + ii_row[0 - ii_w];
-
-        for (int x = 1; x < w; ++x) {
-            row_sum += prior_row[x] != 0 ? 1 : 0;
-            ii_row[x] = row_sum + ii_row[x - ii_w];
-        }
-        ii_row += w; // Note: Incremented by one above
-    }
-
-    for (int y = 1; y < end_y; ++y)
-    {
-        uint16_t left, current, right;
-
-        left = row[0];
-        current = row[1];
-
-        uint16_t row_sum;
-
-        // Unroll first column
+        const Int32P current = Int32P(enoki::load_unaligned<UInt16P>(row + x));
+        const Int32P left = Int32P(enoki::load_unaligned<UInt16P>(row + x - 1));
+        const Int32P right = Int32P(enoki::load_unaligned<UInt16P>(row + x + 1));
+        const Int32P up = Int32P(enoki::load_unaligned<UInt16P>(prior_row + x));
+        const Int32P down = Int32P(enoki::load_unaligned<UInt16P>(next_row + x));
+
+        // Note: current > neighbor + T implies current != 0
+        const auto closer_other =
+            (enoki::neq(right, 0) & (current > right + T)) |
+            (enoki::neq(up, 0) & (current > up + T)) |
+            (enoki::neq(down, 0) & (current > down + T));
+        const auto closer_left = enoki::neq(left, 0) & (current > left + T);
+
+        if (enoki::none(closer_left))
         {
-            ii_row[0] = 0;
-            ii_row++;
-
-            row_sum = left != 0 ? 1 : 0;
-            ii_row[0] = row_sum + ii_row[0 - ii_w];
+            enoki::store_unaligned(row + x, UInt16P(enoki::select(closer_other, Int32P(0), current)));
+            left_removed = closer_other[kLanes - 1];
+            continue;
         }
 
-        int x;
-        for (x = 1; x < end_x; ++x)
+        for (int i = 0; i < kLanes; ++i)
         {
-            // Access this here to avoid reading off the right side
-            right = row[x + 1];
-
-            if (current != 0) {
-                // Remove foreground in the case of a level transition
-                if (left != 0 && current > left + T) {
-                    row[x] = 0;
-                    current = 0;
-                }
-                else if (right != 0 && current > right + T) {
-                    row[x] = 0;
-                    current = 0;
-                }
-                else
-                {
-                    const uint16_t up = prior_row[x];
-                    if (up != 0 && current > up + T) {
-                        row[x] = 0;
-                        current = 0;
-                    } else {
-                        const uint16_t down = next_row[x];
-                        if (down != 0 && current > down + T) {
-                            row[x] = 0;
-                            current = 0;
-                        }
-                    }
-                }
+            const bool removed = closer_other[i] || (closer_left[i] && !left_removed);
+            if (removed) {
+                row[x + i] = 0;
             }
-
-            row_sum += current != 0 ? 1 : 0;
-            ii_row[x] = row_sum + ii_row[x - ii_w];
-
-            left = current;
-            current = right;
+            left_removed = removed;
         }
-
-        // Unroll last column
-        {
-            row_sum += current != 0 ? 1 : 0;
-            ii_row[x] = row_sum + ii_row[x - ii_w];
+    }
+    for (; x < end_x; ++x)
+    {
+        const int current = row[x];
+        const int left = row[x - 1];
+        const int right = row[x + 1];
+        const int up = prior_row[x];
+        const int down = next_row[x];
+
+        left_removed = (left != 0 && current > left + T) ||
+            (right != 0 && current > right + T) ||
+            (up != 0 && current > up + T) ||
+            (down != 0 && current > down + T);
+        if (left_removed) {
+            row[x] = 0;
         }
-
-        prior_row = row;
-        row = next_row;
-        next_row += w;
-
-        ii_row += w; // Note: Already incremented by 1 above
     }
+}
+
+// Store counts of non-zero pixels in each horizontal 3-pixel window
+static void CountRowNeighbors(const uint16_t* row, int w, uint8_t* counts)
+{
+    counts[0] = (row[0] != 0) + (row[1] != 0);
 
-    // Unroll last row
+    int x = 1;
+    for (; x + kLanes < w; x += kLanes)
     {
-        ii_row[0] = 0;
-        ++ii_row;
+        const Int32P sum =
+            enoki::select(enoki::neq(Int32P(enoki::load_unaligned<UInt16P>(row + x - 1)), 0), Int32P(1), Int32P(0)) +
+            enoki::select(enoki::neq(Int32P(enoki::load_unaligned<UInt16P>(row + x)), 0), Int32P(1), Int32P(0)) +
+            enoki::select(enoki::neq(Int32P(enoki::load_unaligned<UInt16P>(row + x + 1)), 0), Int32P(1), Int32P(0));
+        enoki::store_unaligned(counts + x, UInt8P(sum));
+    }
+    for (; x < w - 1; ++x) {
+        counts[x] = (row[x - 1] != 0) + (row[x] != 0) + (row[x + 1] != 0);
+    }
 
-        uint16_t row_sum = row[0] != 0 ? 1 : 0;
-        ii_row[0] = row_sum + ii_row[0 - ii_w];
+    counts[w - 1] = (row[w - 2] != 0) + (row[w - 1] != 0);
+}
 
-        for (int x = 1; x < w; ++x) {
-            row_sum += row[x] != 0 ? 1 : 0;
-            ii_row[x] = row_sum + ii_row[x - ii_w];
-        }
+void DepthEdgeFilter::Filter(uint16_t* depth, int w, int h)
+{
+    // No interior pixels to filter
+    if (w < 3 || h < 3) {
+        return;
     }
 
-    // Second step: Eliminate edges by referencing the integral image
+    const int end_y = h - 1;
+    const int end_x = w - 1;
+
+    RowCounts.resize(w * 3);
 
-    const uint16_t* ii_above = IntegralImage.data() + 1;
-    const uint16_t* ii_below = ii_above + ii_w * 3;
+    // The pixel itself is included in its 3x3 count
+    const int min_count = MinNeighbors + 1;
 
-    row = depth + w;
+    // Window of counts: Row r is at offset (r % 3) * w
+    CountRowNeighbors(depth, w, RowCounts.data());
 
-    for (int y = 1; y < end_y; ++y)
+    for (int y = 1; y <= end_y; ++y)
     {
-        for (int x = 1; x < end_x; ++x)
-        {
-            const uint16_t d = row[x];
-            if (d == 0) {
-                continue;
-            }
+        // Remove foreground in the case of a level transition
+        if (y < end_y) {
+            FilterRowGradients(depth, w, y);
+        }
 
-            const uint16_t ul = ii_above[x - 2];
-            const uint16_t ur = ii_above[x + 1];
-            const uint16_t ll = ii_below[x - 2];
-            const uint16_t lr = ii_below[x + 1];
+        uint8_t* counts_below = RowCounts.data() + (y % 3) * w;
+        CountRowNeighbors(depth + y * w, w, counts_below);
 
-            const uint16_t neighbor_sum = ul + lr - ur - ll;
+        // Once the row below is filtered, cull the row above it
+        if (y < 2) {
+            continue;
+        }
+        const uint8_t* counts_above = RowCounts.data() + ((y + 1) % 3) * w;
+        const uint8_t* counts_center = RowCounts.data() + ((y + 2) % 3) * w;
+        uint16_t* row = depth + (y - 1) * w;
+
+        int x = 1;
+        for (; x + kLanes <= end_x; x += kLanes)
+        {
+            const Int32P neighbor_sum =
+                Int32P(enoki::load_unaligned<UInt8P>(counts_above + x)) +
+                Int32P(enoki::load_unaligned<UInt8P>(counts_center + x)) +
+                Int32P(enoki::load_unaligned<UInt8P>(counts_below + x));
+            const Int32P d = Int32P(enoki::load_unaligned<UInt16P>(row + x));
 
             // Not well connected enough:
-            if (neighbor_sum < 7) {
+            enoki::store_unaligned(row + x, UInt16P(enoki::select(neighbor_sum < min_count, Int32P(0), d)));
+        }
+        for (; x < end_x; ++x)
+        {
+            const int neighbor_sum = counts_above[x] + counts_center[x] + counts_below[x];
+            if (neighbor_sum < min_count) {
                 row[x] = 0;
             }
         }
-
-        ii_above += ii_w;
-        ii_below += ii_w;
-
-        row += w;
     }
 }
 
@@ -0,0 +1,434 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+#include "DepthMeshDelta.hpp"
+
+#include <algorithm> // std::min
+#include <atomic>
+#include <cstring> // memcmp, memcpy
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// DepthMeshDelta
+
+// Stream ids are unique within the process
+static std::atomic<uint32_t> m_NextStreamId = ATOMIC_VAR_INIT(1);
+
+void DepthMeshDelta::Reset()
+{
+    StreamId = m_NextStreamId++;
+    Version = 0;
+
+    // Reallocate on next update
+    Width = Height = 0;
+}
+
+bool DepthMeshDelta::UpdateParameters(
+    DepthMesher& mesher,
+    const ClipRegion* clip,
+    bool face_painting_fix,
+    bool cull_depth)
+{
+    bool changed = false;
+
+    const int width = mesher.GetDepthWidth();
+    const int height = mesher.GetDepthHeight();
+    if (Width != width || Height != height)
+    {
+        Width = width;
+        Height = height;
+        BlocksX = (width + kBlockSize - 1) / kBlockSize;
+        BlocksY = (height + kBlockSize - 1) / kBlockSize;
+        changed = true;
+    }
+
+    if (HasClip != (clip != nullptr) ||
+        (clip && (Clip.Extrinsics != clip->Extrinsics ||
+            Clip.Radius != clip->Radius ||
+            Clip.Floor != clip->Floor ||
+            Clip.Ceiling != clip->Ceiling)))
+    {
+        HasClip = clip != nullptr;
+        if (clip) {
+            Clip = *clip;
+        }
+        changed = true;
+    }
+
+    if (FacePaintingFix != face_painting_fix || CullDepth != cull_depth)
+    {
+        FacePaintingFix = face_painting_fix;
+        CullDepth = cull_depth;
+        changed = true;
+    }
+
+    if (!changed) {
+        return false;
+    }
+
+    // Start a new stream unless one was just started
+    if (Version != 0) {
+        StreamId = m_NextStreamId++;
+        Version = 0;
+    }
+
+    const int n = Width * Height;
+    const int block_count = BlocksX * BlocksY;
+
+    PrevDepth.resize(n);
+    PrevFaceMask.resize(n);
+    CulledDepth.resize(n);
+    FaceMask.assign(n, 0);
+    VertexDirty.resize(block_count);
+    RowDirty.resize(BlocksY);
+
+    // Unused vertices at the right and bottom edges stay zero
+    Coordinates.assign(block_count * kBlockFloats, 0.f);
+    Indices.resize(block_count * kBlockIndices);
+    BlockIndexCounts.resize(block_count);
+    VertexVersions.resize(block_count);
+    IndexVersions.resize(block_count);
+
+    return true;
+}
+
+bool DepthMeshDelta::BlockChanged(const uint16_t* depth, int bx, int by) const
+{
+    const int x0 = bx * kBlockSize;
+    const int x1 = std::min(x0 + kBlockSize, Width);
+    const int y0 = by * kBlockSize;
+    const int y1 = std::min(y0 + kBlockSize, Height);
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const int offset = y * Width + x0;
+        if (0 != memcmp(depth + offset, PrevDepth.data() + offset, (x1 - x0) * sizeof(uint16_t)) ||
+            0 != memcmp(FaceMask.data() + offset, PrevFaceMask.data() + offset, x1 - x0))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DepthMeshDelta::UpdateCoordinates(
+    DepthMesher& mesher,
+    uint16_t* depth,
+    const ClipRegion* clip,
+    bool face_painting_fix,
+    bool cull_depth)
+{
+    const bool full_update = UpdateParameters(mesher, clip, face_painting_fix, cull_depth);
+    ++Version;
+
+    if (face_painting_fix) {
+        mesher.GenerateFacePaintingMask(depth, 0, Height, FaceMask.data());
+    }
+
+    // Save the input for changed blocks and collect their rows to mesh
+    Spans.clear();
+    ChangedVertexBlocks = 0;
+
+    for (int by = 0; by < BlocksY; ++by)
+    {
+        const int y0 = by * kBlockSize;
+        const int y1 = std::min(y0 + kBlockSize, Height);
+
+        // Most rows of blocks are unchanged
+        const int row_offset = y0 * Width;
+        const int row_pixels = (y1 - y0) * Width;
+        if (!full_update &&
+            0 == memcmp(depth + row_offset, PrevDepth.data() + row_offset, row_pixels * sizeof(uint16_t)) &&
+            0 == memcmp(FaceMask.data() + row_offset, PrevFaceMask.data() + row_offset, row_pixels))
+        {
+            memset(VertexDirty.data() + by * BlocksX, 0, BlocksX);
+            RowDirty[by] = 0;
+            continue;
+        }
+        RowDirty[by] = 1;
+
+        for (int bx = 0; bx < BlocksX; ++bx)
+        {
+            const int block = by * BlocksX + bx;
+            const bool dirty = full_update || BlockChanged(depth, bx, by);
+            VertexDirty[block] = dirty ? 1 : 0;
+            if (!dirty) {
+                continue;
+            }
+
+            ++ChangedVertexBlocks;
+            VertexVersions[block] = Version;
+
+            const int x0 = bx * kBlockSize;
+            const int x1 = std::min(x0 + kBlockSize, Width);
+            float* block_coordinates = Coordinates.data() + block * kBlockFloats;
+
+            for (int y = y0; y < y1; ++y)
+            {
+                const int offset = y * Width + x0;
+                memcpy(PrevDepth.data() + offset, depth + offset, (x1 - x0) * sizeof(uint16_t));
+                memcpy(PrevFaceMask.data() + offset, FaceMask.data() + offset, x1 - x0);
+
+                DepthSpan span;
+                span.Y = y;
+                span.X0 = x0;
+                span.X1 = x1;
+                span.Coordinates = block_coordinates + (y - y0) * kBlockSize * 5;
+                Spans.push_back(span);
+            }
+        }
+    }
+
+    mesher.GenerateCoordinatesSpans(
+        depth,
+        clip,
+        face_painting_fix ? FaceMask.data() : nullptr,
+        cull_depth,
+        Spans.data(),
+        static_cast<int>( Spans.size() ));
+
+    // Unchanged blocks get the same culling as last time
+    for (int by = 0; by < BlocksY; ++by)
+    {
+        const int y0 = by * kBlockSize;
+        const int y1 = std::min(y0 + kBlockSize, Height);
+
+        if (!RowDirty[by]) {
+            memcpy(depth + y0 * Width, CulledDepth.data() + y0 * Width, (y1 - y0) * Width * sizeof(uint16_t));
+            continue;
+        }
+
+        for (int bx = 0; bx < BlocksX; ++bx)
+        {
+            const int x0 = bx * kBlockSize;
+            const int bytes = (std::min(x0 + kBlockSize, Width) - x0) * sizeof(uint16_t);
+            const bool dirty = VertexDirty[by * BlocksX + bx] != 0;
+
+            for (int y = y0; y < y1; ++y)
+            {
+                const int offset = y * Width + x0;
+                if (dirty) {
+                    memcpy(CulledDepth.data() + offset, depth + offset, bytes);
+                } else {
+                    memcpy(depth + offset, CulledDepth.data() + offset, bytes);
+                }
+            }
+        }
+    }
+}
+
+void DepthMeshDelta::TriangulateBlock(const uint16_t* depth, int bx, int by)
+{
+    const int block = by * BlocksX + bx;
+    const uint32_t first_vertex = static_cast<uint32_t>( block * kBlockVertices );
+
+    // Vertex number for a pixel in this block or the blocks above and right
+    auto vertex = [this](int x, int y) -> uint32_t {
+        const int b = (y / kBlockSize) * BlocksX + x / kBlockSize;
+        return static_cast<uint32_t>( b * kBlockVertices + (y % kBlockSize) * kBlockSize + x % kBlockSize );
+    };
+
+    uint32_t* indices = Indices.data() + block * kBlockIndices;
+    uint32_t* indices_next = indices;
+
+    // Cells with C in the first row or last column have no triangles
+    const int x0 = bx * kBlockSize;
+    const int x1 = std::min(x0 + kBlockSize, Width - 1);
+    const int y0 = std::max(by * kBlockSize, 1);
+    const int y1 = std::min(by * kBlockSize + kBlockSize, Height);
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const uint16_t* row = depth + y * Width;
+
+        // Right to left like GenerateTriangleIndices()
+        for (int x = x1 - 1; x >= x0; --x)
+        {
+            if (row[x] == 0) {
+                continue;
+            }
+
+            const unsigned bits = GetCellTriangles(row + x, Width);
+            if (bits == 0) {
+                continue;
+            }
+
+            const uint32_t c_index = first_vertex + (y % kBlockSize) * kBlockSize + x % kBlockSize;
+
+            if (bits & kCellTriangleCBA) {
+                indices_next[0] = c_index; // C
+                indices_next[1] = vertex(x + 1, y - 1); // B
+                indices_next[2] = vertex(x, y - 1); // A
+                indices_next += 3;
+            }
+            if (bits & kCellTriangleCDB) {
+                indices_next[0] = c_index; // C
+                indices_next[1] = vertex(x + 1, y); // D
+                indices_next[2] = vertex(x + 1, y - 1); // B
+                indices_next += 3;
+            }
+            if (bits & kCellTriangleCDA) {
+                indices_next[0] = c_index; // C
+                indices_next[1] = vertex(x + 1, y); // D
+                indices_next[2] = vertex(x, y - 1); // A
+                indices_next += 3;
+            }
+        }
+    }
+
+    const int count = static_cast<int>( indices_next - indices );
+    BlockIndexCounts[block] = static_cast<uint32_t>( count );
+
+    // Pad with degenerate triangles
+    std::fill(indices_next, indices + kBlockIndices, first_vertex);
+}
+
+void DepthMeshDelta::UpdateTriangles(const uint16_t* depth)
+{
+    ChangedIndexBlocks = 0;
+
+    for (int by = 0; by < BlocksY; ++by)
+    {
+        for (int bx = 0; bx < BlocksX; ++bx)
+        {
+            const int block = by * BlocksX + bx;
+
+            // Cells in this block use pixels from the blocks to the right and above
+            bool dirty = VertexDirty[block] != 0;
+            if (bx + 1 < BlocksX) {
+                dirty |= VertexDirty[block + 1] != 0;
+            }
+            if (by > 0) {
+                dirty |= VertexDirty[block - BlocksX] != 0;
+                if (bx + 1 < BlocksX) {
+                    dirty |= VertexDirty[block - BlocksX + 1] != 0;
+                }
+            }
+            if (!dirty) {
+                continue;
+            }
+
+            TriangulateBlock(depth, bx, by);
+            IndexVersions[block] = Version;
+            ++ChangedIndexBlocks;
+        }
+    }
+}
+
+// Append the ranges of blocks with a version after since_version
+static void GetBlockRanges(
+    const std::vector<uint32_t>& versions,
+    uint32_t since_version,
+    int block_elements,
+    std::vector<MeshDeltaRange>& ranges)
+{
+    ranges.clear();
+
+    const int block_count = static_cast<int>( versions.size() );
+    for (int block = 0; block < block_count; ++block)
+    {
+        if (versions[block] <= since_version) {
+            continue;
+        }
+
+        const int offset = block * block_elements;
+        if (!ranges.empty() && ranges.back().Offset + ranges.back().Count == offset) {
+            ranges.back().Count += block_elements;
+        } else {
+            MeshDeltaRange range;
+            range.Offset = offset;
+            range.Count = block_elements;
+            ranges.push_back(range);
+        }
+    }
+}
+
+void DepthMeshDelta::GetChangedRanges(
+    uint32_t since_version,
+    std::vector<MeshDeltaRange>& coordinate_ranges,
+    std::vector<MeshDeltaRange>& index_ranges) const
+{
+    GetBlockRanges(VertexVersions, since_version, kBlockFloats, coordinate_ranges);
+    GetBlockRanges(IndexVersions, since_version, kBlockIndices, index_ranges);
+}
+
+std::shared_ptr<const DepthMeshSnapshot> DepthMeshDelta::GetSnapshot()
+{
+    const int block_count = GetBlockCount();
+
+    // Pick a released snapshot to recycle, preferring the most recent one
+    // from this stream since it has the fewest blocks to copy
+    std::shared_ptr<DepthMeshSnapshot> snapshot;
+    for (const auto& pooled : Snapshots)
+    {
+        if (pooled->StreamId == StreamId &&
+            pooled->Version == Version &&
+            pooled->BlockCount == block_count)
+        {
+            return pooled;
+        }
+        if (pooled.use_count() != 1) {
+            continue;
+        }
+        if (!snapshot ||
+            (pooled->StreamId == StreamId &&
+                (snapshot->StreamId != StreamId || pooled->Version > snapshot->Version)))
+        {
+            snapshot = pooled;
+        }
+    }
+
+    if (!snapshot)
+    {
+        snapshot = std::make_shared<DepthMeshSnapshot>();
+
+        // If the application holds onto many frames, then do not keep them
+        // all around after they are released
+        if (static_cast<int>( Snapshots.size() ) < kMaxSnapshots) {
+            Snapshots.push_back(snapshot);
+        }
+    }
+
+    if (snapshot->StreamId != StreamId || snapshot->BlockCount != block_count)
+    {
+        snapshot->BlockCount = block_count;
+        snapshot->Coordinates = Coordinates;
+        snapshot->Indices = Indices;
+        snapshot->BlockIndexCounts = BlockIndexCounts;
+        snapshot->VertexVersions = VertexVersions;
+        snapshot->IndexVersions = IndexVersions;
+    }
+    else
+    {
+        // Copy only the blocks that changed after the version it holds
+        const uint32_t since_version = snapshot->Version;
+        for (int block = 0; block < block_count; ++block)
+        {
+            if (VertexVersions[block] > since_version)
+            {
+                memcpy(
+                    snapshot->Coordinates.data() + block * kBlockFloats,
+                    Coordinates.data() + block * kBlockFloats,
+                    kBlockFloats * sizeof(float));
+                snapshot->VertexVersions[block] = VertexVersions[block];
+            }
+            if (IndexVersions[block] > since_version)
+            {
+                memcpy(
+                    snapshot->Indices.data() + block * kBlockIndices,
+                    Indices.data() + block * kBlockIndices,
+                    kBlockIndices * sizeof(uint32_t));
+                snapshot->BlockIndexCounts[block] = BlockIndexCounts[block];
+                snapshot->IndexVersions[block] = IndexVersions[block];
+            }
+        }
+    }
+
+    snapshot->StreamId = StreamId;
+    snapshot->Version = Version;
+    return snapshot;
+}
+
+
+} // namespace core
@@ -0,0 +1,302 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+#include "DepthMeshLod.hpp"
+#include "DepthMeshDelta.hpp"
+
+#include <algorithm> // std::max
+#include <cmath> // std::fabs
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// DepthMeshLod
+
+// Number of times the error bound may be doubled to fit the triangle budget
+static const int kMaxBudgetPasses = 16;
+
+void DepthMeshLod::Generate(
+    const uint16_t* depth,
+    int width,
+    int height,
+    const float* coordinates,
+    DepthLodLayout layout,
+    const DepthLodParams& params,
+    std::vector<float>& lod_coordinates,
+    std::vector<uint32_t>& lod_indices)
+{
+    Width = width;
+    Height = height;
+    ErrorMm = params.MaxErrorMm;
+
+    int max_cell_size = 1;
+    while (max_cell_size * 2 <= params.MaxCellSize) {
+        max_cell_size *= 2;
+    }
+
+    size_t last_cell_count = 0;
+    for (int pass = 0; pass < kMaxBudgetPasses; ++pass)
+    {
+        BuildCells(depth, max_cell_size, ErrorMm);
+        Triangulate(depth);
+
+        const int triangles = static_cast<int>( PixelTriangles.size() / 3 );
+        if (params.MaxTriangles <= 0 || triangles <= params.MaxTriangles) {
+            break;
+        }
+
+        // Stop if the cells are as large as they can get
+        if (pass > 0 && Cells.size() == last_cell_count) {
+            break;
+        }
+        last_cell_count = Cells.size();
+
+        ErrorMm = std::max(ErrorMm, 1.f) * 2.f;
+    }
+
+    // Number the used vertices in order of use
+
+    const int n = width * height;
+    VertexMap.assign(n, -1);
+
+    if (layout == DepthLodLayout::Packed)
+    {
+        // Rows are packed right to left
+        PackedVertices.resize(n);
+        int32_t count = 0;
+        for (int y = 0; y < height; ++y) {
+            for (int i = y * width + width - 1; i >= y * width; --i) {
+                PackedVertices[i] = count;
+                if (depth[i] != 0) {
+                    ++count;
+                }
+            }
+        }
+    }
+
+    const int blocks_x = (width + DepthMeshDelta::kBlockSize - 1) / DepthMeshDelta::kBlockSize;
+
+    const int index_count = static_cast<int>( PixelTriangles.size() );
+    lod_indices.resize(index_count);
+    lod_coordinates.clear();
+
+    int32_t vertex_count = 0;
+    for (int i = 0; i < index_count; ++i)
+    {
+        const uint32_t pixel = PixelTriangles[i];
+        int32_t& vertex = VertexMap[pixel];
+
+        if (vertex < 0)
+        {
+            vertex = vertex_count++;
+
+            int source;
+            if (layout == DepthLodLayout::Packed) {
+                source = PackedVertices[pixel];
+            } else {
+                const int x = static_cast<int>( pixel ) % width;
+                const int y = static_cast<int>( pixel ) / width;
+                const int block = (y / DepthMeshDelta::kBlockSize) * blocks_x + x / DepthMeshDelta::kBlockSize;
+                source = block * DepthMeshDelta::kBlockVertices +
+                    (y % DepthMeshDelta::kBlockSize) * DepthMeshDelta::kBlockSize +
+                    x % DepthMeshDelta::kBlockSize;
+            }
+
+            const float* xyzuv = coordinates + source * 5;
+            lod_coordinates.insert(lod_coordinates.end(), xyzuv, xyzuv + 5);
+        }
+
+        lod_indices[i] = static_cast<uint32_t>( vertex );
+    }
+}
+
+void DepthMeshLod::BuildCells(const uint16_t* depth, int max_cell_size, float max_error_mm)
+{
+    Cells.clear();
+
+    for (int y0 = 0; y0 < Height - 1; y0 += max_cell_size) {
+        for (int x0 = 0; x0 < Width - 1; x0 += max_cell_size) {
+            SplitCell(depth, x0, y0, max_cell_size, max_error_mm);
+        }
+    }
+}
+
+void DepthMeshLod::SplitCell(const uint16_t* depth, int x0, int y0, int size, float max_error_mm)
+{
+    // Cells must have pixels on all corners
+    if (x0 >= Width - 1 || y0 >= Height - 1) {
+        return;
+    }
+
+    if (size == 1 ||
+        (x0 + size < Width &&
+         y0 + size < Height &&
+         IsCellSmooth(depth, x0, y0, size, max_error_mm)))
+    {
+        LodCell cell;
+        cell.X = x0;
+        cell.Y = y0;
+        cell.Size = size;
+        Cells.push_back(cell);
+        return;
+    }
+
+    const int half = size / 2;
+    SplitCell(depth, x0, y0, half, max_error_mm);
+    SplitCell(depth, x0 + half, y0, half, max_error_mm);
+    SplitCell(depth, x0, y0 + half, half, max_error_mm);
+    SplitCell(depth, x0 + half, y0 + half, half, max_error_mm);
+}
+
+bool DepthMeshLod::IsCellSmooth(const uint16_t* depth, int x0, int y0, int size, float max_error_mm) const
+{
+    const uint16_t* top = depth + y0 * Width + x0;
+    const uint16_t* bottom = top + size * Width;
+
+    const float d00 = top[0], d10 = top[size];
+    const float d01 = bottom[0], d11 = bottom[size];
+    if (d00 == 0.f || d10 == 0.f || d01 == 0.f || d11 == 0.f) {
+        return false;
+    }
+
+    // Triangles through the cell corners, center and edge pixels differ from
+    // the bilinear surface through the corners by up to a quarter of the twist,
+    // plus the error of the center and edge pixels themselves
+    const float twist = std::fabs(d00 + d11 - d10 - d01) * 0.25f;
+    const float limit = (max_error_mm - twist) * 0.5f;
+    if (limit < 0.f) {
+        return false;
+    }
+
+    const float inv_size = 1.f / size;
+    for (int j = 0; j <= size; ++j)
+    {
+        const float fy = j * inv_size;
+        const float left = d00 + (d01 - d00) * fy;
+        const float right = d10 + (d11 - d10) * fy;
+        const uint16_t* row = top + j * Width;
+
+        for (int i = 0; i <= size; ++i)
+        {
+            if (row[i] == 0) {
+                return false;
+            }
+            const float expected = left + (right - left) * (i * inv_size);
+            if (std::fabs(row[i] - expected) > limit) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void DepthMeshLod::AddTriangle(uint32_t a, uint32_t b, uint32_t c)
+{
+    const int ax = static_cast<int>( a ) % Width, ay = static_cast<int>( a ) / Width;
+    const int bx = static_cast<int>( b ) % Width, by = static_cast<int>( b ) / Width;
+    const int cx = static_cast<int>( c ) % Width, cy = static_cast<int>( c ) / Width;
+
+    // Same winding as GenerateTriangleIndices()
+    const int cross = (bx - ax) * (cy - ay) - (by - ay) * (cx - ax);
+    if (cross == 0) {
+        return;
+    }
+    if (cross > 0) {
+        std::swap(b, c);
+    }
+
+    PixelTriangles.push_back(a);
+    PixelTriangles.push_back(b);
+    PixelTriangles.push_back(c);
+}
+
+void DepthMeshLod::Triangulate(const uint16_t* depth)
+{
+    Corners.assign(Width * Height, 0);
+    for (const LodCell& cell : Cells)
+    {
+        const int top = cell.Y * Width + cell.X;
+        const int bottom = top + cell.Size * Width;
+        Corners[top] = 1;
+        Corners[top + cell.Size] = 1;
+        Corners[bottom] = 1;
+        Corners[bottom + cell.Size] = 1;
+    }
+
+    PixelTriangles.clear();
+
+    for (const LodCell& cell : Cells)
+    {
+        const int s = cell.Size;
+        const uint32_t tl = static_cast<uint32_t>( cell.Y * Width + cell.X );
+        const uint32_t tr = tl + s;
+        const uint32_t bl = tl + s * Width;
+        const uint32_t br = bl + s;
+
+        if (s == 1)
+        {
+            // Pixel quad: Same triangles as the full resolution mesh
+            if (depth[bl] == 0) {
+                continue;
+            }
+            const unsigned bits = GetCellTriangles(depth + bl, Width);
+
+            // C = bl, A = tl, B = tr, D = br
+            if (bits & kCellTriangleCBA) {
+                PixelTriangles.insert(PixelTriangles.end(), { bl, tr, tl });
+            }
+            if (bits & kCellTriangleCDB) {
+                PixelTriangles.insert(PixelTriangles.end(), { bl, br, tr });
+            }
+            if (bits & kCellTriangleCDA) {
+                PixelTriangles.insert(PixelTriangles.end(), { bl, br, tl });
+            }
+            continue;
+        }
+
+        // Walk the edges clockwise from the top-left corner,
+        // collecting the corners of neighboring cells
+        Boundary.clear();
+        for (int i = 0; i < s; ++i) {
+            const uint32_t p = tl + i;
+            if (Corners[p]) {
+                Boundary.push_back(p);
+            }
+        }
+        for (int i = 0; i < s; ++i) {
+            const uint32_t p = tr + i * Width;
+            if (Corners[p]) {
+                Boundary.push_back(p);
+            }
+        }
+        for (int i = 0; i < s; ++i) {
+            const uint32_t p = br - i;
+            if (Corners[p]) {
+                Boundary.push_back(p);
+            }
+        }
+        for (int i = 0; i < s; ++i) {
+            const uint32_t p = bl - i * Width;
+            if (Corners[p]) {
+                Boundary.push_back(p);
+            }
+        }
+
+        if (Boundary.size() == 4) {
+            AddTriangle(bl, tr, tl);
+            AddTriangle(bl, br, tr);
+            continue;
+        }
+
+        // Fan around the center to connect to the smaller neighbors
+        const uint32_t center = tl + (s / 2) * Width + s / 2;
+        const size_t count = Boundary.size();
+        for (size_t i = 0; i < count; ++i) {
+            AddTriangle(center, Boundary[i], Boundary[(i + 1) % count]);
+        }
+    }
+}
+
+
+} // namespace core
@@ -0,0 +1,415 @@
+// Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
+
+#include "ExtrinsicsTracker.hpp"
+#include "nanoflann.hpp"
+
+#include <core_logging.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace core {
+
+
+//------------------------------------------------------------------------------
+// Constants
+
+// Fewer correspondences than this are not enough to trust the fit
+static const int kMinInliers = 64;
+
+// Neighbors used to estimate a target normal
+static const int kNormalNeighbors = 10;
+
+static const float kDegreesPerRadian = 180.f / 3.14159265f;
+
+
+//------------------------------------------------------------------------------
+// ExtrinsicsTrackerTarget
+
+enum NormalStates
+{
+    NormalState_Unknown,
+    NormalState_Valid,
+    NormalState_NotPlanar
+};
+
+// nanoflann-compatible sparse copy of camera 0
+struct ExtrinsicsTrackerTarget
+{
+    // [ x, y, z ] per point
+    static const int kStride = 3;
+    std::vector<float> Points;
+    unsigned PointCount = 0;
+
+    // Estimated on first use, since most points never get matched
+    std::vector<Eigen::Vector3f> Normals;
+    std::vector<uint8_t> NormalState;
+
+    typedef nanoflann::KDTreeSingleIndexAdaptor<
+        nanoflann::L2_Simple_Adaptor<float, ExtrinsicsTrackerTarget>,
+        ExtrinsicsTrackerTarget,
+        3> Tree;
+    std::unique_ptr<Tree> Index;
+
+
+    void Set(const VerticesInfo& info, int max_points, unsigned frame_count);
+
+    // Returns -1 if there is no point within the distance
+    int FindNearest(const Eigen::Vector3f& p, float max_dist_sq) const;
+
+    // Returns false if the neighborhood is not a plane
+    bool GetNormal(unsigned index, Eigen::Vector3f& normal);
+
+    inline size_t kdtree_get_point_count() const
+    {
+        return PointCount;
+    }
+    inline float kdtree_get_pt(const size_t idx, const size_t dim) const
+    {
+        return Points[idx * kStride + dim];
+    }
+    template <class BBOX>
+    bool kdtree_get_bbox(BBOX& /* bb */) const { return false; }
+};
+
+void ExtrinsicsTrackerTarget::Set(const VerticesInfo& info, int max_points, unsigned frame_count)
+{
+    const unsigned count = info.FloatsCount / 5;
+    const unsigned stride = std::max(1u, count / static_cast<unsigned>( max_points ));
+    const float* coords = info.XyzuvVertices;
+
+    Points.clear();
+    for (unsigned i = frame_count % stride; i < count; i += stride) {
+        const float* xyz = coords + i * 5;
+        Points.insert(Points.end(), { xyz[0], xyz[1], xyz[2] });
+    }
+    PointCount = static_cast<unsigned>( Points.size() / kStride );
+
+    Normals.resize(PointCount);
+    NormalState.clear();
+    NormalState.resize(PointCount, NormalState_Unknown);
+
+    if (!Index) {
+        const nanoflann::KDTreeSingleIndexAdaptorParams adaptor_params(16);
+        Index = std::make_unique<Tree>(3, *this, adaptor_params);
+    }
+    Index->buildIndex();
+}
+
+int ExtrinsicsTrackerTarget::FindNearest(const Eigen::Vector3f& p, float max_dist_sq) const
+{
+    size_t out_index;
+    float out_dist_sqr;
+    nanoflann::KNNResultSet<float> results(1);
+    results.init(&out_index, &out_dist_sqr);
+    Index->findNeighbors(results, p.data(), nanoflann::SearchParams());
+
+    if (results.size() == 0 || out_dist_sqr > max_dist_sq) {
+        return -1;
+    }
+    return static_cast<int>( out_index );
+}
+
+bool ExtrinsicsTrackerTarget::GetNormal(unsigned index, Eigen::Vector3f& normal)
+{
+    if (NormalState[index] != NormalState_Unknown) {
+        normal = Normals[index];
+        return NormalState[index] == NormalState_Valid;
+    }
+
+    size_t indices[kNormalNeighbors];
+    float dists[kNormalNeighbors];
+    const size_t found = Index->knnSearch(&Points[index * kStride], kNormalNeighbors, indices, dists);
+
+    NormalState[index] = NormalState_NotPlanar;
+    if (found < 5) {
+        return false;
+    }
+
+    Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+    for (size_t i = 0; i < found; ++i) {
+        mean += Eigen::Map<const Eigen::Vector3f>(&Points[indices[i] * kStride]);
+    }
+    mean /= static_cast<float>( found );
+
+    Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+    for (size_t i = 0; i < found; ++i) {
+        const Eigen::Vector3f d = Eigen::Map<const Eigen::Vector3f>(&Points[indices[i] * kStride]) - mean;
+        covariance += d * d.transpose();
+    }
+
+    // Eigenvalues are sorted in increasing order
+    const Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver(covariance);
+    const Eigen::Vector3f& values = solver.eigenvalues();
+    if (values(0) > values(1) * 0.1f) {
+        return false;
+    }
+
+    normal = solver.eigenvectors().col(0);
+    Normals[index] = normal;
+    NormalState[index] = NormalState_Valid;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Point-to-plane ICP
+
+struct TrackerFit
+{
+    int Inliers = 0;
+
+    // RMS point-to-plane distance in meters
+    double Rmse = 0.0;
+};
+
+// Fits `transform` at its input value.
+// If `step` is true, also moves `transform` one Gauss-Newton step closer.
+// Returns false if there were too few correspondences
+static bool PointToPlane(
+    ExtrinsicsTrackerTarget& target,
+    const std::vector<Eigen::Vector3f>& points,
+    float max_distance,
+    bool step,
+    Eigen::Matrix4f& transform,
+    TrackerFit& fit)
+{
+    const Eigen::Matrix3f R = transform.block<3, 3>(0, 0);
+    const Eigen::Vector3f t = transform.block<3, 1>(0, 3);
+    const float max_dist_sq = max_distance * max_distance;
+
+    // Linearized about a small rotation w and translation v:
+    // residual = n . (q - r) + (q x n) . w + n . v
+    Eigen::Matrix<double, 6, 6> JtJ = Eigen::Matrix<double, 6, 6>::Zero();
+    Eigen::Matrix<double, 6, 1> Jte = Eigen::Matrix<double, 6, 1>::Zero();
+    double error_sum = 0.0;
+    int inliers = 0;
+
+    for (const auto& p : points)
+    {
+        const Eigen::Vector3f q = R * p + t;
+
+        const int index = target.FindNearest(q, max_dist_sq);
+        if (index < 0) {
+            continue;
+        }
+
+        Eigen::Vector3f n;
+        if (!target.GetNormal(index, n)) {
+            continue;
+        }
+
+        const Eigen::Vector3f r = Eigen::Map<const Eigen::Vector3f>(&target.Points[index * ExtrinsicsTrackerTarget::kStride]);
+        const double e = n.dot(q - r);
+
+        Eigen::Matrix<double, 6, 1> J;
+        J.head<3>() = q.cross(n).cast<double>();
+        J.tail<3>() = n.cast<double>();
+
+        JtJ.selfadjointView<Eigen::Upper>().rankUpdate(J);
+        Jte += J * e;
+        error_sum += e * e;
+        ++inliers;
+    }
+
+    fit.Inliers = inliers;
+    fit.Rmse = inliers > 0 ? std::sqrt(error_sum / inliers) : 0.0;
+
+    if (inliers < kMinInliers) {
+        return false;
+    }
+    if (!step) {
+        return true;
+    }
+
+    const Eigen::Matrix<double, 6, 6> A = JtJ.selfadjointView<Eigen::Upper>();
+    const Eigen::Matrix<double, 6, 1> x = A.ldlt().solve(-Jte);
+    if (!x.allFinite()) {
+        return false;
+    }
+
+    const Eigen::Vector3f w = x.head<3>().cast<float>();
+    const float angle = w.norm();
+    Eigen::Matrix4f update = Eigen::Matrix4f::Identity();
+    if (angle > 0.f) {
+        update.block<3, 3>(0, 0) = Eigen::AngleAxisf(angle, w / angle).toRotationMatrix();
+    }
+    update.block<3, 1>(0, 3) = x.tail<3>().cast<float>();
+
+    transform = update * transform;
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// ExtrinsicsTracker
+
+void ExtrinsicsTracker::Reset()
+{
+    Published.clear();
+    Working.clear();
+    NextCamera = 1;
+}
+
+bool ExtrinsicsTracker::IsPublished(const std::vector<AlignmentTransform>& extrinsics) const
+{
+    if (extrinsics.size() != Published.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < extrinsics.size(); ++i) {
+        if (extrinsics[i].Identity != Published[i].Identity) {
+            return false;
+        }
+        if (!extrinsics[i].Identity &&
+            0 != memcmp(extrinsics[i].Transform, Published[i].Transform, sizeof(Published[i].Transform)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ExtrinsicsTracker::Restart(const std::vector<AlignmentTransform>& extrinsics)
+{
+    const int camera_count = static_cast<int>( extrinsics.size() );
+
+    Published = extrinsics;
+    Working.resize(camera_count);
+    NextCamera = 1;
+
+    Eigen::Matrix4f center_transform;
+    extrinsics[0].Set(center_transform);
+    const Eigen::Matrix4f inv_center_transform = center_transform.inverse();
+
+    for (int i = 0; i < camera_count; ++i) {
+        Eigen::Matrix4f transform;
+        extrinsics[i].Set(transform);
+        Working[i] = inv_center_transform * transform;
+    }
+
+    spdlog::debug("Extrinsics tracking restarted for {} cameras", camera_count);
+}
+
+void ExtrinsicsTracker::SampleSource(const VerticesInfo& info)
+{
+    const unsigned count = info.FloatsCount / 5;
+    const unsigned stride = std::max(1u, count / static_cast<unsigned>( Settings.SourcePoints ));
+    const float* coords = info.XyzuvVertices;
+
+    SourcePoints.clear();
+    for (unsigned i = FrameCount % stride; i < count; i += stride) {
+        const float* xyz = coords + i * 5;
+        SourcePoints.emplace_back(xyz[0], xyz[1], xyz[2]);
+    }
+}
+
+bool ExtrinsicsTracker::Update(
+    const std::vector<VerticesInfo>& vertices,
+    std::vector<AlignmentTransform>& extrinsics)
+{
+    const int camera_count = static_cast<int>( vertices.size() );
+    if (camera_count < 2 || extrinsics.size() != vertices.size()) {
+        return false;
+    }
+    for (const auto& info : vertices) {
+        if (!info.XyzuvVertices || info.FloatsCount <= 0) {
+            return false;
+        }
+    }
+
+    const uint64_t t0 = GetTimeUsec();
+    const uint64_t budget_usec = static_cast<uint64_t>( Settings.BudgetMsec * 1000.f );
+
+    if (!IsPublished(extrinsics)) {
+        Restart(extrinsics);
+    }
+    ++FrameCount;
+
+    if (!Target) {
+        Target = std::make_shared<ExtrinsicsTrackerTarget>();
+    }
+    Target->Set(vertices[0], Settings.TargetPoints, FrameCount);
+
+    Eigen::Matrix4f center_transform;
+    extrinsics[0].Set(center_transform);
+    const Eigen::Matrix4f inv_center_transform = center_transform.inverse();
+
+    bool updated = false;
+
+    for (int processed = 0; processed < camera_count - 1; ++processed)
+    {
+        if (processed > 0 && GetTimeUsec() - t0 >= budget_usec) {
+            break;
+        }
+
+        const int camera_index = NextCamera;
+        NextCamera = (NextCamera + 1 < camera_count) ? NextCamera + 1 : 1;
+
+        SampleSource(vertices[camera_index]);
+
+        // How well the extrinsics in use fit this frame
+        Eigen::Matrix4f published;
+        extrinsics[camera_index].Set(published);
+        published = inv_center_transform * published;
+
+        TrackerFit published_fit;
+        PointToPlane(*Target, SourcePoints, Settings.MaxDistanceMeters, false, published, published_fit);
+
+        Eigen::Matrix4f& working = Working[camera_index];
+        TrackerFit working_fit;
+        bool tracking = true;
+
+        for (int i = 0; i < Settings.IterationsPerFrame; ++i) {
+            if (!PointToPlane(*Target, SourcePoints, Settings.MaxDistanceMeters, true, working, working_fit)) {
+                tracking = false;
+                break;
+            }
+        }
+
+        if (tracking) {
+            tracking = PointToPlane(*Target, SourcePoints, Settings.MaxDistanceMeters, false, working, working_fit);
+        }
+
+        if (!tracking) {
+            spdlog::debug("Extrinsics tracking lost camera {}: {} inliers", camera_index, working_fit.Inliers);
+            working = published;
+            continue;
+        }
+
+        // Do not accept a better fit that came from shrinking the overlap
+        if (working_fit.Inliers * 10 < published_fit.Inliers * 9) {
+            continue;
+        }
+        if (working_fit.Rmse > published_fit.Rmse * (1.0 - Settings.MinImprovement)) {
+            continue;
+        }
+
+        const Eigen::Matrix4f delta = published.inverse() * working;
+        const float moved_meters = delta.block<3, 1>(0, 3).norm();
+        const float moved_degrees = std::abs(Eigen::AngleAxisf(Eigen::Matrix3f(delta.block<3, 3>(0, 0))).angle()) * kDegreesPerRadian;
+        if (moved_meters < Settings.MinTranslationMeters && moved_degrees < Settings.MinRotationDegrees) {
+            continue;
+        }
+
+        spdlog::info("Extrinsics tracking: Camera {} moved {} mm, {} degrees.  RMSE {} -> {} mm",
+            camera_index,
+            moved_meters * 1000.f,
+            moved_degrees,
+            published_fit.Rmse * 1000.0,
+            working_fit.Rmse * 1000.0);
+
+        extrinsics[camera_index] = center_transform * working;
+        updated = true;
+    }
+
+    Published = extrinsics;
+
+    const uint64_t t1 = GetTimeUsec();
+    spdlog::trace("Extrinsics tracking in {} msec", (t1 - t0) / 1000.f);
+
+    return updated;
+}
+
+
+} // namespace core
@@ -1,9 +1,22 @@
 // Copyright (c) 2019 Christopher A. Taylor.  All rights reserved.
 
 #include <core_logging.hpp>
+#include "CameraExtrinsics.hpp"
 #include "ColorNormalization.hpp"
+#include "DepthMesh.hpp"
+#include "DepthMeshDelta.hpp"
+#include "DepthMeshLod.hpp"
+#include "ExtrinsicsTracker.hpp"
 using namespace core;
 
+#include <algorithm>
+#include <array>
+#include <map>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <thread>
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -249,15 +262,2091 @@ void IlluminationInvariantTest()
 
 
 //------------------------------------------------------------------------------
-// Entrypoint
+// Mesh SIMD test
 
-int main(int argc, char* argv[])
+// Roughly matches a Kinect-style factory calibration
+static void MakeTestCalibration(int depth_width, int depth_height, CameraCalibration& calibration)
 {
-    CORE_UNUSED2(argc, argv);
+    CameraIntrinsics& color = calibration.Color;
+    color.Width = 1280;
+    color.Height = 720;
+    color.LensModel = LensModel_Rational_6KT;
+    color.cx = 638.f;
+    color.cy = 366.f;
+    color.fx = 605.f;
+    color.fy = 604.f;
+    const float color_k[6] = { 0.54f, -2.65f, 1.55f, 0.42f, -2.48f, 1.48f };
+    for (int i = 0; i < 6; ++i) {
+        color.k[i] = color_k[i];
+    }
+    color.codx = 0.f;
+    color.cody = 0.f;
+    color.p1 = 0.0007f;
+    color.p2 = -0.0002f;
 
-    SetCurrentThreadName("Main");
+    CameraIntrinsics& depth = calibration.Depth;
+    depth.Width = depth_width;
+    depth.Height = depth_height;
+    depth.LensModel = LensModel_Rational_6KT;
+    depth.cx = depth_width * 0.5f;
+    depth.cy = depth_height * 0.5f;
+    depth.fx = depth_width > 640 ? 504.f : 504.f * depth_width / 640.f;
+    depth.fy = depth.fx;
+    const float depth_k[6] = { 3.6f, 2.4f, 0.12f, 3.9f, 3.6f, 0.63f };
+    for (int i = 0; i < 6; ++i) {
+        depth.k[i] = depth_k[i];
+    }
+    depth.codx = 0.f;
+    depth.cody = 0.f;
+    depth.p1 = 0.00004f;
+    depth.p2 = -0.00006f;
 
-    SetupAsyncDiskLog("depth_mesh_tests.txt");
+    const float R[9] = {
+        0.99999f, 0.0041f, -0.0009f,
+        -0.0040f, 0.9948f, 0.1016f,
+        0.0013f, -0.1016f, 0.9948f
+    };
+    for (int i = 0; i < 9; ++i) {
+        calibration.RotationFromDepth[i] = R[i];
+    }
+    calibration.TranslationFromDepth[0] = -32.f;
+    calibration.TranslationFromDepth[1] = -2.f;
+    calibration.TranslationFromDepth[2] = 4.f;
+}
+
+// Smooth surfaces with depth discontinuities and dropouts
+static void MakeTestDepth(int width, int height, std::vector<uint16_t>& depth)
+{
+    depth.resize(width * height);
+    uint32_t seed = 1;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            seed = seed * 1103515245 + 12345;
+            float z = 1500.f + 300.f * std::sin(x * 0.02f) * std::cos(y * 0.03f);
+            if (x > width / 3 && x < width / 2 && y > height / 4) {
+                z -= 700.f; // Foreground object
+            }
+            if ((seed >> 24) < 40) {
+                z = 0.f; // Dropout
+            }
+            depth[x + y * width] = static_cast<uint16_t>( z );
+        }
+    }
+}
+
+static bool CompareCoordinates(const std::vector<float>& a, const std::vector<float>& b)
+{
+    if (a.size() != b.size()) {
+        spdlog::error("Vertex count mismatch: {} != {}", a.size() / 5, b.size() / 5);
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        const float tolerance = kMeshSimdEpsilon * std::max(1.f, std::fabs(a[i]));
+        if (std::fabs(a[i] - b[i]) > tolerance) {
+            spdlog::error("Coordinate mismatch at {}: {} != {}", i, a[i], b[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool MeshSimdTest(int width, int height)
+{
+    CameraCalibration calibration;
+    MakeTestCalibration(width, height, calibration);
+
+    DepthMesher mesher;
+    mesher.Initialize(calibration);
+
+    std::vector<uint16_t> depth;
+    MakeTestDepth(width, height, depth);
+
+    ClipRegion clip;
+    clip.Extrinsics = Eigen::Matrix4f::Identity();
+    clip.Radius = 1.f;
+    clip.Floor = -1.f;
+    clip.Ceiling = 1.f;
+
+    std::vector<float> scalar_coordinates, simd_coordinates;
+    std::vector<uint16_t> scalar_depth, simd_depth;
+
+    for (int mode = 0; mode < 4; ++mode)
+    {
+        const ClipRegion* clip_ptr = (mode & 1) ? &clip : nullptr;
+        const bool cull_depth = (mode & 2) == 0;
+
+        scalar_depth = depth;
+        mesher.SetSimdEnabled(false);
+        mesher.GenerateCoordinates(scalar_depth.data(), clip_ptr, scalar_coordinates, true, cull_depth);
+
+        simd_depth = depth;
+        mesher.SetSimdEnabled(true);
+        mesher.GenerateCoordinates(simd_depth.data(), clip_ptr, simd_coordinates, true, cull_depth);
+
+        if (scalar_depth != simd_depth) {
+            spdlog::error("Culled depth mismatch: {}x{} mode={}", width, height, mode);
+            return false;
+        }
+        if (!CompareCoordinates(scalar_coordinates, simd_coordinates)) {
+            spdlog::error("SIMD output mismatch: {}x{} mode={}", width, height, mode);
+            return false;
+        }
+    }
+
+    // Benchmark
+    const int kPasses = 50;
+    uint64_t usec[2] = { 0, 0 };
+    for (int simd = 0; simd < 2; ++simd)
+    {
+        mesher.SetSimdEnabled(simd != 0);
+        for (int i = 0; i < kPasses; ++i)
+        {
+            simd_depth = depth;
+            const uint64_t t0 = GetTimeUsec();
+            mesher.GenerateCoordinates(simd_depth.data(), &clip, simd_coordinates);
+            usec[simd] += GetTimeUsec() - t0;
+        }
+    }
+
+    const double pixels = static_cast<double>( width ) * height * kPasses;
+    spdlog::info("GenerateCoordinates {}x{}: Scalar = {} Mpixels/s, SIMD = {} Mpixels/s",
+        width, height,
+        pixels / static_cast<double>( usec[0] ),
+        pixels / static_cast<double>( usec[1] ));
+    return true;
+}
+
+static bool MeshSimdTests()
+{
+    spdlog::info("Mesh SIMD test");
+
+    // NFOV unbinned and WFOV unbinned
+    return MeshSimdTest(640, 576) && MeshSimdTest(1024, 1024);
+}
+
+
+//------------------------------------------------------------------------------
+// Banded meshing test
+
+// Runs each task on its own thread
+static void ThreadParallelFor(int count, const std::function<void(int)>& task)
+{
+    std::vector<std::thread> threads;
+    for (int i = 0; i < count; ++i) {
+        threads.emplace_back(task, i);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+static bool BandedMeshTest(int width, int height)
+{
+    CameraCalibration calibration;
+    MakeTestCalibration(width, height, calibration);
+
+    DepthMesher serial, banded;
+    serial.Initialize(calibration);
+    banded.Initialize(calibration);
+    banded.SetParallelFor(ThreadParallelFor);
+
+    std::vector<uint16_t> depth;
+    MakeTestDepth(width, height, depth);
+
+    ClipRegion clip;
+    clip.Extrinsics = Eigen::Matrix4f::Identity();
+    clip.Radius = 4.f;
+    clip.Floor = -1.f;
+    clip.Ceiling = 1.f;
+
+    std::vector<uint16_t> serial_depth, banded_depth;
+    std::vector<float> serial_coordinates, banded_coordinates;
+    std::vector<uint32_t> serial_indices, banded_indices;
+
+    for (int bands : { 2, 3, 7, 8 })
+    {
+        banded.SetBandCount(bands);
+
+        for (int mode = 0; mode < 8; ++mode)
+        {
+            const bool simd = (mode & 1) != 0;
+            const ClipRegion* clip_ptr = (mode & 2) ? &clip : nullptr;
+            const bool cull_depth = (mode & 4) == 0;
+            serial.SetSimdEnabled(simd);
+            banded.SetSimdEnabled(simd);
+
+            serial_depth = depth;
+            serial.GenerateCoordinates(serial_depth.data(), clip_ptr, serial_coordinates, true, cull_depth);
+            serial.GenerateTriangleIndices(serial_depth.data(), serial_indices);
+
+            banded_depth = depth;
+            banded.GenerateCoordinates(banded_depth.data(), clip_ptr, banded_coordinates, true, cull_depth);
+            banded.GenerateTriangleIndices(banded_depth.data(), banded_indices);
+
+            if (serial_depth != banded_depth ||
+                serial_coordinates != banded_coordinates ||
+                serial_indices != banded_indices)
+            {
+                spdlog::error("Banded output mismatch: {}x{} bands={} mode={}", width, height, bands, mode);
+                return false;
+            }
+        }
+    }
+
+    // Benchmark
+    const int kPasses = 50;
+    uint64_t usec[2] = { 0, 0 };
+    for (int i = 0; i < kPasses; ++i)
+    {
+        serial_depth = depth;
+        uint64_t t0 = GetTimeUsec();
+        serial.GenerateCoordinates(serial_depth.data(), nullptr, serial_coordinates);
+        serial.GenerateTriangleIndices(serial_depth.data(), serial_indices);
+        usec[0] += GetTimeUsec() - t0;
+
+        banded_depth = depth;
+        t0 = GetTimeUsec();
+        banded.GenerateCoordinates(banded_depth.data(), nullptr, banded_coordinates);
+        banded.GenerateTriangleIndices(banded_depth.data(), banded_indices);
+        usec[1] += GetTimeUsec() - t0;
+    }
+
+    spdlog::info("Mesh {}x{}: Serial = {} msec, 8 bands = {} msec ({} hardware threads)",
+        width, height,
+        usec[0] / 1000.0 / kPasses,
+        usec[1] / 1000.0 / kPasses,
+        std::thread::hardware_concurrency());
+    return true;
+}
+
+static bool BandedMeshTests()
+{
+    spdlog::info("Banded meshing test");
+
+    return BandedMeshTest(320, 288) && BandedMeshTest(640, 576) && BandedMeshTest(1024, 1024);
+}
+
+
+//------------------------------------------------------------------------------
+// Compact vertices test
+
+static bool CompactVerticesTest(bool simd, int band_count)
+{
+    const int width = 640, height = 576;
+    CameraCalibration calibration;
+    MakeTestCalibration(width, height, calibration);
+
+    DepthMesher mesher;
+    mesher.Initialize(calibration);
+    mesher.SetSimdEnabled(simd);
+    mesher.SetBandCount(band_count);
+
+    std::vector<uint16_t> depth, compact_depth;
+    MakeTestDepth(width, height, depth);
+    compact_depth = depth;
+
+    std::vector<float> coordinates, compact_coordinates;
+    mesher.GenerateCoordinates(depth.data(), nullptr, coordinates, true, true);
+
+    // Written in the same pass, so the float vertices must not change
+    CompactVertices compact;
+    mesher.GenerateCoordinates(compact_depth.data(), nullptr, compact_coordinates, compact, true, true);
+    if (compact_coordinates != coordinates || compact_depth != depth) {
+        spdlog::error("Compact meshing changed the float vertices");
+        return false;
+    }
+    const int floats_count = static_cast<int>( coordinates.size() );
+    if (compact.VertexCount * 5 != floats_count ||
+        compact.Vertices.size() != static_cast<size_t>( compact.VertexCount * kCompactVertexShorts ))
+    {
+        spdlog::error("Compact vertex count mismatch");
+        return false;
+    }
+
+    // Half a quantization step of error is allowed, plus float rounding
+    float max_error[5] = { 0.f, 0.f, 0.f, 0.f, 0.f };
+    for (int i = 0; i < compact.VertexCount; ++i)
+    {
+        const float* v = &coordinates[i * 5];
+        const uint16_t* c = &compact.Vertices[i * kCompactVertexShorts];
+        for (int j = 0; j < 3; ++j) {
+            const float x = kCompactPositionScale * static_cast<int16_t>( c[j] );
+            max_error[j] = std::max(max_error[j], std::fabs(x - v[j]));
+        }
+        for (int j = 3; j < 5; ++j) {
+            const float u = std::min(v[j], 1.f);
+            max_error[j] = std::max(max_error[j], std::fabs(c[j] / 65535.f - u));
+        }
+    }
+    for (int j = 0; j < 5; ++j)
+    {
+        const float step = j < 3 ? kCompactPositionScale : 1.f / 65535.f;
+        if (max_error[j] > step * 0.5f + 1e-5f) {
+            spdlog::error("Compact vertex error too high: component={} error={} step={}", j, max_error[j], step);
+            return false;
+        }
+    }
+
+    // Extra cost of writing the compact vertices in the meshing pass
+    const int kPasses = 20;
+    uint64_t usec[2] = { 0, 0 };
+    for (int pass = 0; pass < kPasses; ++pass)
+    {
+        for (int k = 0; k < 2; ++k)
+        {
+            compact_depth = depth;
+            const uint64_t t0 = GetTimeUsec();
+            if (k == 0) {
+                mesher.GenerateCoordinates(compact_depth.data(), nullptr, compact_coordinates, true, true);
+            } else {
+                mesher.GenerateCoordinates(compact_depth.data(), nullptr, compact_coordinates, compact, true, true);
+            }
+            usec[k] += GetTimeUsec() - t0;
+        }
+    }
+
+    spdlog::info("Compact vertices simd={} bands={}: {} bytes -> {} bytes, max position error = {} mm, float = {} msec, float + compact = {} msec",
+        simd,
+        band_count,
+        floats_count * sizeof(float),
+        compact.Vertices.size() * sizeof(uint16_t),
+        std::max(max_error[0], std::max(max_error[1], max_error[2])) * 1000.f,
+        usec[0] / 1000.0 / kPasses,
+        usec[1] / 1000.0 / kPasses);
+    return true;
+}
+
+static bool CompactVerticesTests()
+{
+    spdlog::info("Compact vertices test");
+
+    return CompactVerticesTest(true, 1) &&
+        CompactVerticesTest(false, 1) &&
+        CompactVerticesTest(true, 4) &&
+        CompactVerticesTest(false, 4);
+}
+
+
+//------------------------------------------------------------------------------
+// Clip crop test
+
+// Clip cylinder standing on the color camera z axis, z meters away
+static void MakeTestClip(float z, float radius, ClipRegion& clip)
+{
+    clip.Extrinsics = Eigen::Matrix4f::Identity();
+    clip.Extrinsics(2, 3) = -z;
+    clip.Radius = radius;
+    clip.Floor = -radius;
+    clip.Ceiling = radius;
+}
+
+static bool InsideCrop(const ImageCropRegion& crop, float x, float y)
+{
+    return x >= crop.CropX && x <= crop.CropX + crop.CropW &&
+        y >= crop.CropY && y <= crop.CropY + crop.CropH;
+}
+
+static bool IsFullImage(const ImageCropRegion& crop, const CameraIntrinsics& intrinsics)
+{
+    return crop.CropX == 0 && crop.CropY == 0 &&
+        crop.CropW == static_cast<unsigned>( intrinsics.Width ) &&
+        crop.CropH == static_cast<unsigned>( intrinsics.Height );
+}
+
+static bool ClipCropTest(bool simd)
+{
+    const int width = 640, height = 576;
+    CameraCalibration calibration;
+    MakeTestCalibration(width, height, calibration);
+
+    DepthMesher mesher;
+    mesher.Initialize(calibration);
+    mesher.SetSimdEnabled(simd);
+
+    const float clip_z = 1.5f;
+    ClipRegion clip;
+    MakeTestClip(clip_z, 0.3f, clip);
+
+    std::vector<uint16_t> depth;
+    MakeTestDepth(width, height, depth);
+
+    std::vector<float> coordinates;
+    mesher.GenerateCoordinates(depth.data(), &clip, coordinates, true, true);
+
+    ImageCropRegion color_crop, depth_crop;
+    mesher.CalculateCrop(clip, color_crop);
+    mesher.CalculateDepthCrop(clip, depth_crop);
+
+    if (IsFullImage(color_crop, calibration.Color) ||
+        IsFullImage(depth_crop, calibration.Depth))
+    {
+        spdlog::error("Clip in front of the camera should not use the whole image");
+        return false;
+    }
+
+    // Vertices the mesh keeps are within Radius meters of the clip axis,
+    // and inside the color crop
+    const int vertex_count = static_cast<int>( coordinates.size() / 5 );
+    if (vertex_count <= 0) {
+        spdlog::error("Clip removed every vertex");
+        return false;
+    }
+    for (int i = 0; i < vertex_count; ++i)
+    {
+        const float* v = &coordinates[i * 5];
+        const float dz = v[2] - clip_z;
+        const float r = std::sqrt(v[0] * v[0] + dz * dz);
+        if (r > clip.Radius + 1e-4f || std::fabs(v[1]) > clip.Ceiling + 1e-4f) {
+            spdlog::error("Vertex outside of clip: radius={} y={}", r, v[1]);
+            return false;
+        }
+        if (!InsideCrop(color_crop, v[3] * calibration.Color.Width, v[4] * calibration.Color.Height)) {
+            spdlog::error("Vertex outside of color crop: u={} v={}", v[3], v[4]);
+            return false;
+        }
+    }
+
+    // Culled depth pixels are zeroed, so the rest must be inside the depth crop
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            if (depth[x + y * width] != 0 &&
+                !InsideCrop(depth_crop, static_cast<float>( x ), static_cast<float>( y )))
+            {
+                spdlog::error("Kept depth pixel outside of depth crop: x={} y={}", x, y);
+                return false;
+            }
+        }
+    }
+
+    // A cylinder around the camera reaches behind it, where the ring samples
+    // cannot be projected, so both crops must cover the whole image
+    ImageCropRegion around_color_crop, around_depth_crop;
+    MakeTestClip(0.f, 2.f, clip);
+    mesher.CalculateCrop(clip, around_color_crop);
+    mesher.CalculateDepthCrop(clip, around_depth_crop);
+    if (!IsFullImage(around_color_crop, calibration.Color) ||
+        !IsFullImage(around_depth_crop, calibration.Depth))
+    {
+        spdlog::error("Clip behind the camera should use the whole image");
+        return false;
+    }
+
+    spdlog::info("Clip crop simd={}: {} vertices, color crop {}x{} of {}x{}, depth crop {}x{} of {}x{}",
+        simd,
+        vertex_count,
+        color_crop.CropW, color_crop.CropH,
+        calibration.Color.Width, calibration.Color.Height,
+        depth_crop.CropW, depth_crop.CropH,
+        width, height);
+    return true;
+}
+
+static bool ClipCropTests()
+{
+    spdlog::info("Clip crop test");
+
+    return ClipCropTest(true) && ClipCropTest(false);
+}
+
+
+//------------------------------------------------------------------------------
+// Temporal Filter Test
+
+// Original TemporalDepthFilter with interleaved history, for reference
+template<int kStride>
+class ReferenceTemporalFilter
+{
+public:
+    void Filter(uint16_t* depth, int w, int h)
+    {
+        const int n = w * h;
+        if (Width != w || Height != h) {
+            Width = w;
+            Height = h;
+            Count = 0;
+            Index = 0;
+            History.resize(kStride * n);
+        }
+
+        uint16_t* history = History.data();
+        const int index = Index;
+
+        if (Count < kStride)
+        {
+            ++Count;
+            history += index;
+            for (int i = 0; i < n; ++i) {
+                history[i * kStride] = depth[i];
+            }
+        }
+        else
+        {
+            for (int i = 0; i < n; ++i)
+            {
+                const uint16_t x = depth[i];
+                uint16_t* hist = history + i * kStride;
+
+                unsigned sum = x;
+                unsigned nonzero_count = sum != 0;
+                unsigned h_min = sum;
+                unsigned h_max = sum;
+                for (int j = 0; j < kStride; ++j) {
+                    const uint16_t y = hist[j];
+                    if (y == 0) {
+                        continue;
+                    }
+                    sum += y;
+                    ++nonzero_count;
+                    if (h_max < y) {
+                        h_max = y;
+                    }
+                    if (h_min > y) {
+                        h_min = y;
+                    }
+                }
+
+                if (nonzero_count <= 0) {
+                    continue;
+                }
+
+                hist[index] = x;
+
+                if (nonzero_count < kStride / 2) {
+                    continue;
+                }
+
+                const unsigned h_avg = sum / nonzero_count;
+                const unsigned range = h_max - h_min;
+                const unsigned uncertainty = h_avg / 256;
+                if (range < uncertainty) {
+                    depth[i] = static_cast<uint16_t>( h_avg );
+                }
+            }
+        }
+
+        ++Index;
+        if (Index >= kStride) {
+            Index = 0;
+        }
+    }
+
+protected:
+    int Width = 0, Height = 0, Count = 0, Index = 0;
+    std::vector<uint16_t> History;
+};
+
+// Frame of a mostly static scene with sensor noise, dropouts and motion
+static void MakeTemporalTestFrame(
+    const std::vector<uint16_t>& scene,
+    int width,
+    int frame,
+    uint32_t& seed,
+    std::vector<uint16_t>& depth)
+{
+    depth = scene;
+    const int n = static_cast<int>( depth.size() );
+    for (int i = 0; i < n; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        const unsigned r = seed >> 16;
+        if (depth[i] == 0) {
+            continue;
+        }
+        if ((r & 31) == 0) {
+            depth[i] = 0; // Flicker
+            continue;
+        }
+        // Moving object
+        const int x = i % width;
+        if (x > frame * 7 && x < frame * 7 + 40) {
+            depth[i] = static_cast<uint16_t>( depth[i] - 400 );
+        }
+        // Noise up to about 0.2%, exercising both sides of the threshold
+        depth[i] = static_cast<uint16_t>( depth[i] + ((r >> 5) % 7) - 3 );
+        if ((r >> 8) % 16 == 0) {
+            depth[i] = static_cast<uint16_t>( 65535 - (r >> 12) ); // Far
+        }
+    }
+}
+
+template<int kFrames>
+static bool TemporalFilterTest(int width, int height)
+{
+    std::vector<uint16_t> scene;
+    MakeTestDepth(width, height, scene);
+
+    TemporalDepthFilter filter;
+    filter.SetHistoryFrames(kFrames);
+    ReferenceTemporalFilter<kFrames> reference;
+
+    std::vector<uint16_t> frame, expected;
+    uint32_t seed = 1;
+    uint64_t usec[2] = { 0, 0 };
+    const int kFramesTested = 40;
+    for (int i = 0; i < kFramesTested; ++i)
+    {
+        MakeTemporalTestFrame(scene, width, i, seed, frame);
+        expected = frame;
+
+        uint64_t t0 = GetTimeUsec();
+        reference.Filter(expected.data(), width, height);
+        usec[0] += GetTimeUsec() - t0;
+
+        t0 = GetTimeUsec();
+        filter.Filter(frame.data(), width, height);
+        usec[1] += GetTimeUsec() - t0;
+
+        if (frame != expected) {
+            spdlog::error("Temporal filter mismatch: {}x{} history={} frame={}", width, height, kFrames, i);
+            return false;
+        }
+    }
+
+    spdlog::info("Temporal filter {}x{} history={}: Reference = {} msec, SIMD = {} msec",
+        width, height, kFrames,
+        usec[0] / 1000.0 / kFramesTested,
+        usec[1] / 1000.0 / kFramesTested);
+    return true;
+}
+
+static bool TemporalFilterTests()
+{
+    spdlog::info("Temporal filter test");
+
+    // 321x287 leaves a tail that is not a multiple of the SIMD width
+    return TemporalFilterTest<8>(321, 287) &&
+        TemporalFilterTest<8>(640, 576) &&
+        TemporalFilterTest<8>(1024, 1024) &&
+        TemporalFilterTest<4>(321, 287) &&
+        TemporalFilterTest<4>(640, 576);
+}
+
+
+//------------------------------------------------------------------------------
+// Edge Filter Test
+
+// Original two-pass DepthEdgeFilter with a full integral image, for reference
+static void ReferenceEdgeFilter(uint16_t* depth, int w, int h, unsigned T, int min_neighbors)
+{
+    const int end_y = h - 1;
+    const int end_x = w - 1;
+
+    uint16_t* prior_row = depth;
+    uint16_t* row = depth + w;
+    uint16_t* next_row = depth + w * 2;
+
+    const int ii_w = w + 1;
+    const int ii_h = h + 1;
+    std::vector<uint16_t> IntegralImage(ii_w * ii_h);
+    uint16_t* ii_row = IntegralImage.data();
+
+    for (int ii_x = 0; ii_x < ii_w; ++ii_x) {
+        ii_row[ii_x] = 0;
+    }
+    ii_row += ii_w;
+
+    {
+        ii_row[0] = 0;
+        ++ii_row;
+
+        uint16_t row_sum = prior_row[0] != 0 ? 1 : 0;
+        ii_row[0] = row_sum + ii_row[0 - ii_w];
+
+        for (int x = 1; x < w; ++x) {
+            row_sum += prior_row[x] != 0 ? 1 : 0;
+            ii_row[x] = row_sum + ii_row[x - ii_w];
+        }
+        ii_row += w;
+    }
+
+    for (int y = 1; y < end_y; ++y)
+    {
+        uint16_t left, current, right;
+
+        left = row[0];
+        current = row[1];
+
+        uint16_t row_sum;
+        {
+            ii_row[0] = 0;
+            ii_row++;
+
+            row_sum = left != 0 ? 1 : 0;
+            ii_row[0] = row_sum + ii_row[0 - ii_w];
+        }
+
+        int x;
+        for (x = 1; x < end_x; ++x)
+        {
+            right = row[x + 1];
+
+            if (current != 0) {
+                if (left != 0 && current > left + T) {
+                    row[x] = 0;
+                    current = 0;
+                }
+                else if (right != 0 && current > right + T) {
+                    row[x] = 0;
+                    current = 0;
+                }
+                else
+                {
+                    const uint16_t up = prior_row[x];
+                    if (up != 0 && current > up + T) {
+                        row[x] = 0;
+                        current = 0;
+                    } else {
+                        const uint16_t down = next_row[x];
+                        if (down != 0 && current > down + T) {
+                            row[x] = 0;
+                            current = 0;
+                        }
+                    }
+                }
+            }
+
+            row_sum += current != 0 ? 1 : 0;
+            ii_row[x] = row_sum + ii_row[x - ii_w];
+
+            left = current;
+            current = right;
+        }
+
+        {
+            row_sum += current != 0 ? 1 : 0;
+            ii_row[x] = row_sum + ii_row[x - ii_w];
+        }
+
+        prior_row = row;
+        row = next_row;
+        next_row += w;
+
+        ii_row += w;
+    }
+
+    {
+        ii_row[0] = 0;
+        ++ii_row;
+
+        uint16_t row_sum = row[0] != 0 ? 1 : 0;
+        ii_row[0] = row_sum + ii_row[0 - ii_w];
+
+        for (int x = 1; x < w; ++x) {
+            row_sum += row[x] != 0 ? 1 : 0;
+            ii_row[x] = row_sum + ii_row[x - ii_w];
+        }
+    }
+
+    const uint16_t* ii_above = IntegralImage.data() + 1;
+    const uint16_t* ii_below = ii_above + ii_w * 3;
+
+    row = depth + w;
+
+    for (int y = 1; y < end_y; ++y)
+    {
+        for (int x = 1; x < end_x; ++x)
+        {
+            const uint16_t d = row[x];
+            if (d == 0) {
+                continue;
+            }
+
+            const uint16_t ul = ii_above[x - 2];
+            const uint16_t ur = ii_above[x + 1];
+            const uint16_t ll = ii_below[x - 2];
+            const uint16_t lr = ii_below[x + 1];
+
+            const uint16_t neighbor_sum = ul + lr - ur - ll;
+            if (neighbor_sum < min_neighbors + 1) {
+                row[x] = 0;
+            }
+        }
+
+        ii_above += ii_w;
+        ii_below += ii_w;
+
+        row += w;
+    }
+}
+
+// Test depth with many level transitions and holes
+static void MakeEdgeTestDepth(int width, int height, std::vector<uint16_t>& depth)
+{
+    MakeTestDepth(width, height, depth);
+    uint32_t seed = 7;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            seed = seed * 1103515245 + 12345;
+            const unsigned r = seed >> 16;
+            uint16_t& d = depth[x + y * width];
+            if (d == 0) {
+                continue;
+            }
+            // Striped steps and speckle, including runs of closer pixels
+            if (((x / 5) + (y / 7)) % 4 == 0) {
+                d = static_cast<uint16_t>( d - 250 );
+            }
+            if (r % 23 == 0) {
+                d = static_cast<uint16_t>( d + 300 - (r % 600) );
+            }
+        }
+    }
+}
+
+static bool EdgeFilterTest(int width, int height, unsigned threshold_mm, int min_neighbors)
+{
+    std::vector<uint16_t> depth;
+    MakeEdgeTestDepth(width, height, depth);
+
+    DepthEdgeFilter filter;
+    filter.SetGradientThreshold(threshold_mm);
+    filter.SetMinNeighbors(min_neighbors);
+
+    std::vector<uint16_t> expected, actual;
+    uint64_t usec[2] = { 0, 0 };
+    const int kPasses = 20;
+    for (int i = 0; i < kPasses; ++i)
+    {
+        expected = depth;
+        uint64_t t0 = GetTimeUsec();
+        ReferenceEdgeFilter(expected.data(), width, height, threshold_mm, min_neighbors);
+        usec[0] += GetTimeUsec() - t0;
+
+        actual = depth;
+        t0 = GetTimeUsec();
+        filter.Filter(actual.data(), width, height);
+        usec[1] += GetTimeUsec() - t0;
+
+        if (actual != expected) {
+            spdlog::error("Edge filter mismatch: {}x{} T={} neighbors={}", width, height, threshold_mm, min_neighbors);
+            return false;
+        }
+    }
+
+    spdlog::info("Edge filter {}x{} T={} neighbors={}: Two-pass = {} msec, streaming = {} msec",
+        width, height, threshold_mm, min_neighbors,
+        usec[0] / 1000.0 / kPasses,
+        usec[1] / 1000.0 / kPasses);
+    return true;
+}
+
+static bool EdgeFilterTests()
+{
+    spdlog::info("Edge filter test");
+
+    return EdgeFilterTest(3, 3, 200, 6) &&
+        EdgeFilterTest(17, 5, 200, 6) &&
+        EdgeFilterTest(321, 287, 200, 6) &&
+        EdgeFilterTest(640, 576, 200, 6) &&
+        EdgeFilterTest(1024, 1024, 200, 6) &&
+        EdgeFilterTest(640, 576, 100, 4) &&
+        EdgeFilterTest(640, 576, 400, 8);
+}
+
+
+//------------------------------------------------------------------------------
+// DepthMeshDelta Test
+
+// Static scene with a moving object, and every fourth frame repeated
+static void MakeDeltaTestFrame(
+    const std::vector<uint16_t>& scene,
+    int width,
+    int height,
+    int frame,
+    std::vector<uint16_t>& depth)
+{
+    depth = scene;
+    frame -= (frame + 1) / 4;
+    const int x0 = (frame * 9) % (width - 40);
+    const int y0 = height / 3 + frame % 5;
+    for (int y = y0; y < y0 + 40 && y < height; ++y) {
+        for (int x = x0; x < x0 + 32; ++x) {
+            uint16_t& d = depth[x + y * width];
+            if (d != 0) {
+                d = static_cast<uint16_t>( d - 500 );
+            }
+        }
+    }
+}
+
+// Compare delta mesh with the packed mesh from the same depth
+static bool CheckDeltaMesh(
+    const DepthMeshDelta& delta,
+    int width,
+    int height,
+    const std::vector<uint16_t>& depth,
+    const std::vector<float>& coordinates,
+    const std::vector<uint32_t>& indices)
+{
+    const int bs = DepthMeshDelta::kBlockSize;
+    const int blocks_x = (width + bs - 1) / bs;
+    const std::vector<float>& dense = delta.GetCoordinates();
+
+    // Packed vertex number -> dense vertex number
+    std::vector<uint32_t> dense_index;
+    for (int y = 0; y < height; ++y) {
+        for (int x = width - 1; x >= 0; --x) {
+            const uint32_t v = ((y / bs) * blocks_x + x / bs) * DepthMeshDelta::kBlockVertices + (y % bs) * bs + x % bs;
+            if (depth[x + y * width] != 0) {
+                dense_index.push_back(v);
+            } else {
+                for (int i = 0; i < 5; ++i) {
+                    if (dense[v * 5 + i] != 0.f) {
+                        spdlog::error("Delta vertex for zero depth is not zero");
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    if (dense_index.size() * 5 != coordinates.size()) {
+        spdlog::error("Delta vertex count mismatch");
+        return false;
+    }
+    for (size_t i = 0; i < dense_index.size(); ++i) {
+        if (0 != memcmp(&coordinates[i * 5], &dense[dense_index[i] * 5], 5 * sizeof(float))) {
+            spdlog::error("Delta vertex mismatch at {}", i);
+            return false;
+        }
+    }
+
+    // Same triangles in a different order
+    std::vector<std::array<uint32_t, 3>> expected, actual;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        expected.push_back({ dense_index[indices[i]], dense_index[indices[i + 1]], dense_index[indices[i + 2]] });
+    }
+    const std::vector<uint32_t>& dense_indices = delta.GetIndices();
+    for (int block = 0; block < delta.GetBlockCount(); ++block)
+    {
+        const uint32_t* block_indices = dense_indices.data() + block * DepthMeshDelta::kBlockIndices;
+        const uint32_t count = delta.GetBlockIndexCounts()[block];
+        for (uint32_t i = 0; i < count; i += 3) {
+            actual.push_back({ block_indices[i], block_indices[i + 1], block_indices[i + 2] });
+        }
+        for (uint32_t i = count; i < DepthMeshDelta::kBlockIndices; ++i) {
+            if (block_indices[i] != static_cast<uint32_t>( block * DepthMeshDelta::kBlockVertices )) {
+                spdlog::error("Delta index padding is not degenerate");
+                return false;
+            }
+        }
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    if (expected != actual) {
+        spdlog::error("Delta triangle mismatch: {} != {}", expected.size(), actual.size());
+        return false;
+    }
+    return true;
+}
+
+static bool DeltaMeshTest(int width, int height)
+{
+    CameraCalibration calibration;
+    MakeTestCalibration(width, height, calibration);
+
+    // Dense meshing uses the scalar path, so compare it with the scalar path
+    DepthMesher mesher;
+    mesher.Initialize(calibration);
+    mesher.SetSimdEnabled(false);
+
+    std::vector<uint16_t> scene;
+    MakeTestDepth(width, height, scene);
+
+    ClipRegion clip;
+    clip.Extrinsics = Eigen::Matrix4f::Identity();
+    clip.Radius = 4.f;
+    clip.Floor = -1.f;
+    clip.Ceiling = 1.f;
+
+    std::vector<uint16_t> frame, expected_depth, delta_depth, fresh_depth;
+    std::vector<float> coordinates, uploaded_coordinates;
+    std::vector<uint32_t> indices, uploaded_indices;
+    std::vector<MeshDeltaRange> coordinate_ranges, index_ranges;
+    std::vector<float> held_coordinates;
+    std::vector<uint32_t> held_indices;
+
+    for (int mode = 0; mode < 8; ++mode)
+    {
+        const ClipRegion* clip_ptr = (mode & 1) ? &clip : nullptr;
+        const bool face_painting_fix = (mode & 2) == 0;
+        const bool cull_depth = (mode & 4) == 0;
+
+        DepthMeshDelta delta;
+        uint32_t uploaded_version = 0;
+        std::shared_ptr<const DepthMeshSnapshot> held;
+
+        for (int i = 0; i < 12; ++i)
+        {
+            MakeDeltaTestFrame(scene, width, height, i, frame);
+
+            expected_depth = frame;
+            mesher.GenerateCoordinates(expected_depth.data(), clip_ptr, coordinates, face_painting_fix, cull_depth);
+            mesher.GenerateTriangleIndices(expected_depth.data(), indices);
+
+            delta_depth = frame;
+            delta.UpdateCoordinates(mesher, delta_depth.data(), clip_ptr, face_painting_fix, cull_depth);
+            delta.UpdateTriangles(delta_depth.data());
+
+            if (delta_depth != expected_depth ||
+                !CheckDeltaMesh(delta, width, height, expected_depth, coordinates, indices))
+            {
+                spdlog::error("Delta mesh mismatch: {}x{} mode={} frame={}", width, height, mode, i);
+                return false;
+            }
+
+            // Repeated frames change nothing
+            if (i % 4 == 3 && (delta.GetChangedVertexBlocks() != 0 || delta.GetChangedIndexBlocks() != 0)) {
+                spdlog::error("Delta mesh changed for a repeated frame: {}x{} mode={} frame={}", width, height, mode, i);
+                return false;
+            }
+
+            // Incremental output matches meshing from scratch
+            DepthMeshDelta fresh;
+            fresh_depth = frame;
+            fresh.UpdateCoordinates(mesher, fresh_depth.data(), clip_ptr, face_painting_fix, cull_depth);
+            fresh.UpdateTriangles(fresh_depth.data());
+            if (fresh.GetCoordinates() != delta.GetCoordinates() ||
+                fresh.GetIndices() != delta.GetIndices() ||
+                fresh.GetBlockIndexCounts() != delta.GetBlockIndexCounts())
+            {
+                spdlog::error("Delta mesh differs from full update: {}x{} mode={} frame={}", width, height, mode, i);
+                return false;
+            }
+
+            // Snapshots match the mesh, including recycled ones, and do not
+            // change while they are held
+            const auto snapshot = delta.GetSnapshot();
+            if (snapshot->Version != delta.GetVersion() ||
+                snapshot->Coordinates != delta.GetCoordinates() ||
+                snapshot->Indices != delta.GetIndices() ||
+                snapshot->BlockIndexCounts != delta.GetBlockIndexCounts() ||
+                snapshot->VertexVersions != delta.GetVertexVersions() ||
+                snapshot->IndexVersions != delta.GetIndexVersions())
+            {
+                spdlog::error("Delta mesh snapshot mismatch: {}x{} mode={} frame={}", width, height, mode, i);
+                return false;
+            }
+            if (held && (held->Coordinates != held_coordinates || held->Indices != held_indices)) {
+                spdlog::error("Held delta mesh snapshot changed: {}x{} mode={} frame={}", width, height, mode, i);
+                return false;
+            }
+            if (i % 3 == 0) {
+                held = snapshot;
+                held_coordinates = snapshot->Coordinates;
+                held_indices = snapshot->Indices;
+            }
+
+            // Partial uploads every other frame reproduce the buffers
+            if (i % 2 == 0) {
+                continue;
+            }
+            if (uploaded_version == 0) {
+                uploaded_coordinates = delta.GetCoordinates();
+                uploaded_indices = delta.GetIndices();
+            } else {
+                delta.GetChangedRanges(uploaded_version, coordinate_ranges, index_ranges);
+                for (const auto& range : coordinate_ranges) {
+                    memcpy(&uploaded_coordinates[range.Offset], &delta.GetCoordinates()[range.Offset], range.Count * sizeof(float));
+                }
+                for (const auto& range : index_ranges) {
+                    memcpy(&uploaded_indices[range.Offset], &delta.GetIndices()[range.Offset], range.Count * sizeof(uint32_t));
+                }
+            }
+            uploaded_version = delta.GetVersion();
+
+            if (uploaded_coordinates != delta.GetCoordinates() || uploaded_indices != delta.GetIndices()) {
+                spdlog::error("Delta mesh partial upload mismatch: {}x{} mode={} frame={}", width, height, mode, i);
+                return false;
+            }
+        }
+    }
+
+    // Benchmark: Mostly static scene
+    mesher.SetSimdEnabled(true);
+    DepthMeshDelta delta;
+
+    const int kPasses = 30;
+    uint64_t usec[2] = { 0, 0 };
+    int changed_blocks = 0;
+    for (int i = 0; i < kPasses; ++i)
+    {
+        MakeDeltaTestFrame(scene, width, height, i * 4 / 3, frame);
+
+        expected_depth = frame;
+        uint64_t t0 = GetTimeUsec();
+        mesher.GenerateCoordinates(expected_depth.data(), nullptr, coordinates);
+        mesher.GenerateTriangleIndices(expected_depth.data(), indices);
+        usec[0] += GetTimeUsec() - t0;
+
+        delta_depth = frame;
+        t0 = GetTimeUsec();
+        delta.UpdateCoordinates(mesher, delta_depth.data(), nullptr);
+        delta.UpdateTriangles(delta_depth.data());
+        usec[1] += GetTimeUsec() - t0;
+
+        changed_blocks += delta.GetChangedIndexBlocks();
+    }
+
+    spdlog::info("Delta mesh {}x{}: Full = {} msec, delta = {} msec ({}% of blocks changed)",
+        width, height,
+        usec[0] / 1000.0 / kPasses,
+        usec[1] / 1000.0 / kPasses,
+        changed_blocks * 100.0 / kPasses / delta.GetBlockCount());
+    return true;
+}
+
+static bool DeltaMeshTests()
+{
+    spdlog::info("Delta mesh test");
+
+    return DeltaMeshTest(320, 288) && DeltaMeshTest(203, 101) && DeltaMeshTest(640, 576);
+}
+
+
+//------------------------------------------------------------------------------
+// DepthMeshLod Test
+
+// Smooth surfaces with a foreground object, a hole and sparse dropouts
+static void MakeLodTestDepth(int width, int height, std::vector<uint16_t>& depth)
+{
+    depth.resize(width * height);
+    uint32_t seed = 3;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            seed = seed * 1103515245 + 12345;
+            float z = 1500.f + 300.f * std::sin(x * 0.02f) * std::cos(y * 0.03f);
+            if (x > width / 3 && x < width / 2 && y > height / 4) {
+                z -= 700.f; // Foreground object
+            }
+            if (x > width * 2 / 3 && x < width * 3 / 4 && y > height / 2 && y < height * 3 / 4) {
+                z = 0.f; // Hole
+            }
+            if ((seed >> 24) < 2) {
+                z = 0.f; // Dropout
+            }
+            depth[x + y * width] = static_cast<uint16_t>( z );
+        }
+    }
+}
+
+// Map LOD mesh vertices back to depth pixels, using the packed vertex order
+static bool GetLodPixels(
+    const std::vector<uint16_t>& depth,
+    int width,
+    int height,
+    const std::vector<float>& coordinates,
+    const std::vector<float>& lod_coordinates,
+    std::vector<int>& lod_pixels)
+{
+    std::map<std::array<float, 5>, int> pixel_of_vertex;
+    size_t vertex = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = width - 1; x >= 0; --x) {
+            if (depth[x + y * width] != 0) {
+                std::array<float, 5> v;
+                std::copy(&coordinates[vertex * 5], &coordinates[vertex * 5] + 5, v.begin());
+                pixel_of_vertex[v] = x + y * width;
+                ++vertex;
+            }
+        }
+    }
+
+    lod_pixels.clear();
+    for (size_t i = 0; i < lod_coordinates.size(); i += 5) {
+        std::array<float, 5> v;
+        std::copy(&lod_coordinates[i], &lod_coordinates[i] + 5, v.begin());
+        auto it = pixel_of_vertex.find(v);
+        if (it == pixel_of_vertex.end()) {
+            spdlog::error("LOD vertex {} is not an input vertex", i / 5);
+            return false;
+        }
+        lod_pixels.push_back(it->second);
+    }
+    return true;
+}
+
+// Check winding, T-junctions and the error bound of a LOD mesh
+static bool CheckLodMesh(
+    const std::vector<uint16_t>& depth,
+    int width,
+    const std::vector<int>& lod_pixels,
+    const std::vector<uint32_t>& lod_indices,
+    float max_error_mm)
+{
+    std::vector<uint8_t> used(depth.size(), 0);
+    for (int pixel : lod_pixels) {
+        used[pixel] = 1;
+    }
+
+    for (size_t i = 0; i < lod_indices.size(); i += 3)
+    {
+        int px[3], py[3];
+        for (int j = 0; j < 3; ++j) {
+            const int pixel = lod_pixels[lod_indices[i + j]];
+            px[j] = pixel % width;
+            py[j] = pixel / width;
+        }
+
+        const int cross = (px[1] - px[0]) * (py[2] - py[0]) - (py[1] - py[0]) * (px[2] - px[0]);
+        if (cross >= 0) {
+            spdlog::error("LOD triangle {} has the wrong winding", i / 3);
+            return false;
+        }
+
+        // No used vertex may sit inside a horizontal or vertical edge
+        for (int j = 0; j < 3; ++j)
+        {
+            const int k = (j + 1) % 3;
+            if (px[j] != px[k] && py[j] != py[k]) {
+                continue;
+            }
+            const int dx = (px[k] > px[j]) - (px[k] < px[j]);
+            const int dy = (py[k] > py[j]) - (py[k] < py[j]);
+            for (int x = px[j] + dx, y = py[j] + dy; x != px[k] || y != py[k]; x += dx, y += dy) {
+                if (used[x + y * width]) {
+                    spdlog::error("LOD T-junction at {}, {}", x, y);
+                    return false;
+                }
+            }
+        }
+
+        // Every pixel covered by the triangle is within the error bound
+        const int x0 = std::min({ px[0], px[1], px[2] }), x1 = std::max({ px[0], px[1], px[2] });
+        const int y0 = std::min({ py[0], py[1], py[2] }), y1 = std::max({ py[0], py[1], py[2] });
+        for (int y = y0; y <= y1; ++y)
+        {
+            for (int x = x0; x <= x1; ++x)
+            {
+                const float w0 = static_cast<float>( (px[1] - x) * (py[2] - y) - (py[1] - y) * (px[2] - x) ) / cross;
+                const float w1 = static_cast<float>( (px[2] - x) * (py[0] - y) - (py[2] - y) * (px[0] - x) ) / cross;
+                const float w2 = 1.f - w0 - w1;
+                if (w0 < 0.f || w1 < 0.f || w2 < 0.f) {
+                    continue;
+                }
+                const float expected =
+                    w0 * depth[px[0] + py[0] * width] +
+                    w1 * depth[px[1] + py[1] * width] +
+                    w2 * depth[px[2] + py[2] * width];
+                if (std::fabs(depth[x + y * width] - expected) > max_error_mm + 0.01f) {
+                    spdlog::error("LOD error at {}, {}: {} mm", x, y, depth[x + y * width] - expected);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool LodMeshTest(int width, int height)
+{
+    CameraCalibration calibration;
+    MakeTestCalibration(width, height, calibration);
+
+    DepthMesher mesher;
+    mesher.Initialize(calibration);
+
+    std::vector<uint16_t> depth;
+    MakeLodTestDepth(width, height, depth);
+
+    std::vector<float> coordinates, lod_coordinates;
+    std::vector<uint32_t> indices, lod_indices;
+    mesher.GenerateCoordinates(depth.data(), nullptr, coordinates);
+    mesher.GenerateTriangleIndices(depth.data(), indices);
+
+    const int full_triangles = static_cast<int>( indices.size() / 3 );
+
+    DepthMeshLod lod;
+    std::vector<int> lod_pixels;
+
+    // Cell size 1 reproduces the full mesh
+    DepthLodParams params;
+    params.MaxCellSize = 1;
+    lod.Generate(depth.data(), width, height, coordinates.data(), DepthLodLayout::Packed, params, lod_coordinates, lod_indices);
+    if (!GetLodPixels(depth, width, height, coordinates, lod_coordinates, lod_pixels)) {
+        return false;
+    }
+
+    std::vector<int> vertex_pixels;
+    GetLodPixels(depth, width, height, coordinates, coordinates, vertex_pixels);
+
+    std::vector<std::array<int, 3>> expected, actual;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        expected.push_back({ vertex_pixels[indices[i]], vertex_pixels[indices[i + 1]], vertex_pixels[indices[i + 2]] });
+    }
+    for (size_t i = 0; i < lod_indices.size(); i += 3) {
+        actual.push_back({ lod_pixels[lod_indices[i]], lod_pixels[lod_indices[i + 1]], lod_pixels[lod_indices[i + 2]] });
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    if (expected != actual) {
+        spdlog::error("LOD cell size 1 does not match the full mesh: {} != {}", actual.size(), expected.size());
+        return false;
+    }
+
+    for (float max_error_mm : { 2.f, 8.f, 32.f })
+    {
+        params = DepthLodParams();
+        params.MaxErrorMm = max_error_mm;
+
+        const uint64_t t0 = GetTimeUsec();
+        lod.Generate(depth.data(), width, height, coordinates.data(), DepthLodLayout::Packed, params, lod_coordinates, lod_indices);
+        const uint64_t t1 = GetTimeUsec();
+
+        if (!GetLodPixels(depth, width, height, coordinates, lod_coordinates, lod_pixels) ||
+            !CheckLodMesh(depth, width, lod_pixels, lod_indices, max_error_mm))
+        {
+            spdlog::error("LOD mesh check failed: {}x{} error={}", width, height, max_error_mm);
+            return false;
+        }
+
+        spdlog::info("LOD {}x{} error={} mm: {} -> {} triangles, {} -> {} vertices in {} msec",
+            width, height, max_error_mm,
+            full_triangles, lod_indices.size() / 3,
+            coordinates.size() / 5, lod_coordinates.size() / 5,
+            (t1 - t0) / 1000.0);
+    }
+
+    // Triangle budget
+    params = DepthLodParams();
+    params.MaxErrorMm = 1.f;
+    params.MaxTriangles = full_triangles / 4;
+    lod.Generate(depth.data(), width, height, coordinates.data(), DepthLodLayout::Packed, params, lod_coordinates, lod_indices);
+    if (static_cast<int>( lod_indices.size() / 3 ) > params.MaxTriangles) {
+        spdlog::error("LOD triangle budget exceeded: {} > {}", lod_indices.size() / 3, params.MaxTriangles);
+        return false;
+    }
+    if (!GetLodPixels(depth, width, height, coordinates, lod_coordinates, lod_pixels) ||
+        !CheckLodMesh(depth, width, lod_pixels, lod_indices, lod.GetErrorMm()))
+    {
+        spdlog::error("LOD budget mesh check failed: {}x{}", width, height);
+        return false;
+    }
+
+    // Block layout from DepthMeshDelta gives the same mesh
+    std::vector<uint16_t> delta_depth;
+    MakeLodTestDepth(width, height, delta_depth);
+    DepthMeshDelta delta;
+    delta.UpdateCoordinates(mesher, delta_depth.data(), nullptr);
+
+    std::vector<float> block_coordinates;
+    std::vector<uint32_t> block_indices;
+    lod.Generate(delta_depth.data(), width, height, delta.GetCoordinates().data(), DepthLodLayout::Blocks, params, block_coordinates, block_indices);
+    if (block_indices != lod_indices || block_coordinates.size() != lod_coordinates.size()) {
+        spdlog::error("LOD from block layout does not match");
+        return false;
+    }
+
+    return true;
+}
+
+static bool LodMeshTests()
+{
+    spdlog::info("LOD mesh test");
+
+    return LodMeshTest(320, 288) && LodMeshTest(203, 101) && LodMeshTest(640, 576);
+}
+
+
+//------------------------------------------------------------------------------
+// Cloud lighting test
+
+// Per-point windows as ExtractCloudLighting() did before the lighting maps.
+// Writes [ x, y, z, median L, median log S ] for each point with lighting
+static void ReferenceCloudLighting(const KdtreePointCloud& cloud, std::vector<float>& floats)
+{
+    const int width = cloud.Input.Info.Width;
+    const int height = cloud.Input.Info.Height;
+    const uint8_t* y_plane = cloud.YPlane.data();
+    const uint8_t* uv_plane = cloud.UVPlane.data();
+
+    floats.clear();
+    std::vector<float> work_s;
+
+    const unsigned count = cloud.Input.Info.FloatsCount / 5;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const float* input = cloud.XyzuvVertices.data() + i * 5;
+
+        unsigned histogram[256] = { 0 };
+        unsigned hist_count = 0;
+        work_s.clear();
+
+        const int radius = 6;
+        const int end_x = static_cast<int>( input[3] * width ) + radius;
+        const int end_y = static_cast<int>( input[4] * height ) + radius;
+        for (int y = end_y - radius * 2; y < end_y; ++y)
+        {
+            if (y < 0 || y >= height) {
+                continue;
+            }
+            for (int x = end_x - radius * 2; x < end_x; ++x)
+            {
+                if (x < 0 || x >= width) {
+                    continue;
+                }
+                const uint8_t* uv = uv_plane + (y / 2) * (width / 2) * 2 + (x / 2) * 2;
+
+                float R, G, B;
+                YCbCrToRGB(y_plane[y * width + x], uv[0], uv[1], R, G, B);
+
+                const float Cmax = std::max(R, std::max(G, B));
+                const float Cmin = std::min(R, std::min(G, B));
+                const float L = (Cmax + Cmin) * 0.5f;
+
+                if (L >= 1.f && L <= 254.0f) {
+                    const float S = (Cmax - Cmin) / (255.f - std::abs(2.f * L - 255.f));
+                    if (S > 0.001f) {
+                        work_s.push_back(logf(S));
+                    }
+                }
+
+                histogram[std::min(std::max(static_cast<int>( L ), 0), 255)]++;
+                ++hist_count;
+            }
+        }
+
+        if (hist_count == 0) {
+            continue;
+        }
+
+        unsigned median_l = 0, accum = 0;
+        for (; median_l < 255; ++median_l) {
+            accum += histogram[median_l];
+            if (accum >= (hist_count + 1) / 2) {
+                break;
+            }
+        }
+
+        float median_s = 0.f;
+        if (!work_s.empty()) {
+            std::nth_element(work_s.begin(), work_s.begin() + work_s.size() / 2, work_s.end());
+            median_s = work_s[work_s.size() / 2];
+        }
+
+        floats.insert(floats.end(), { input[0], input[1], input[2], static_cast<float>( median_l ), median_s });
+    }
+}
+
+static bool CloudLightingTest(int width, int height)
+{
+    // NV12 image with smooth gradients, noise and clipped regions.
+    // Width must be even for the chroma plane
+    std::vector<uint8_t> y_plane(width * height);
+    std::vector<uint8_t> uv_plane((width / 2) * ((height + 1) / 2) * 2);
+
+    uint32_t seed = 1;
+    auto next_random = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) & 0x7fff;
+    };
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int value = (x * 255) / width + static_cast<int>( next_random() % 32 ) - 16;
+            if (y < height / 8) {
+                value = 255;
+            } else if (y > height - height / 8) {
+                value = 0;
+            }
+            y_plane[y * width + x] = static_cast<uint8_t>( std::min(std::max(value, 0), 255) );
+        }
+    }
+    for (size_t i = 0; i < uv_plane.size(); i += 2) {
+        const int row = static_cast<int>( i / ((width / 2) * 2) );
+        uv_plane[i] = static_cast<uint8_t>( 64 + (row * 128) / height + next_random() % 16 );
+        uv_plane[i + 1] = static_cast<uint8_t>( 64 + next_random() % 128 );
+    }
+
+    // Vertices in mesh order (rows right to left), some outside the image
+    std::vector<float> vertices;
+    for (int y = -16; y < height + 16; y += 3) {
+        for (int x = width + 16; x >= -16; x -= 2) {
+            vertices.insert(vertices.end(), {
+                static_cast<float>( x ), static_cast<float>( y ), 1000.f,
+                (x + 0.5f) / width, (y + 0.5f) / height
+            });
+        }
+    }
+    for (int i = 0; i < 1000; ++i) {
+        const float u = (next_random() % 1200) / 1000.f - 0.1f;
+        const float v = (next_random() % 1200) / 1000.f - 0.1f;
+        vertices.insert(vertices.end(), { u, v, 2000.f, u, v });
+    }
+
+    LightCloudInputs input;
+    input.Info.FloatsCount = static_cast<uint32_t>( vertices.size() );
+    input.Info.XyzuvVertices = vertices.data();
+    input.Info.Width = width;
+    input.Info.Height = height;
+    input.Info.Y = y_plane.data();
+    input.Info.ChromaWidth = width / 2;
+    input.Info.ChromaHeight = (height + 1) / 2;
+    input.Info.UV = uv_plane.data();
+    input.Extrinsics = Eigen::Matrix4f::Identity().eval();
+
+    std::vector<LightCloudInputs> inputs(2, input);
+    std::vector<std::shared_ptr<KdtreePointCloud>> clouds;
+    ForegroundCreateClouds(inputs, clouds);
+
+    std::vector<float> expected;
+    uint64_t t0 = GetTimeUsec();
+    ReferenceCloudLighting(*clouds[0], expected);
+    uint64_t t1 = GetTimeUsec();
+    const uint64_t reference_usec = t1 - t0;
+
+    for (int parallel = 0; parallel < 2; ++parallel)
+    {
+        ForegroundCreateClouds(inputs, clouds);
+
+        t0 = GetTimeUsec();
+        ExtractCloudLighting(clouds, parallel ? ThreadParallelFor : nullptr);
+        t1 = GetTimeUsec();
+
+        for (auto& cloud : clouds)
+        {
+            if (cloud->Floats != expected)
+            {
+                if (cloud->Floats.size() != expected.size()) {
+                    spdlog::error("Cloud lighting point count mismatch: {} != {}",
+                        cloud->Floats.size() / 5, expected.size() / 5);
+                    return false;
+                }
+
+                // SIMD may round L differently from the scalar code, which
+                // can move a pixel to the next bin or across the saturation
+                // cutoffs, so allow a few points to differ slightly
+                int mismatches = 0;
+                for (size_t i = 0; i < expected.size(); i += 5)
+                {
+                    const float* actual = cloud->Floats.data() + i;
+                    if (actual[0] != expected[i] || actual[1] != expected[i + 1] || actual[2] != expected[i + 2] ||
+                        std::fabs(actual[3] - expected[i + 3]) > 1.f ||
+                        std::fabs(actual[4] - expected[i + 4]) > 0.1f)
+                    {
+                        spdlog::error("Cloud lighting mismatch at point {}: L={} S={} expected L={} S={}",
+                            i / 5, actual[3], actual[4], expected[i + 3], expected[i + 4]);
+                        return false;
+                    }
+                    if (actual[3] != expected[i + 3] || std::fabs(actual[4] - expected[i + 4]) > 0.0001f) {
+                        ++mismatches;
+                    }
+                }
+                if (mismatches * 100 > static_cast<int>( expected.size() / 5 )) {
+                    spdlog::error("Cloud lighting has {} mismatched points", mismatches);
+                    return false;
+                }
+            }
+        }
+
+        spdlog::info("Cloud lighting {}x{} parallel={}: {} points in {} msec (reference {} msec per cloud)",
+            width, height, parallel, expected.size() / 5, (t1 - t0) / 1000.0, reference_usec / 1000.0);
+    }
+
+    return true;
+}
+
+static bool CloudLightingTests()
+{
+    spdlog::info("Cloud lighting test");
+
+    return CloudLightingTest(320, 288) && CloudLightingTest(202, 101) && CloudLightingTest(1280, 720);
+}
+
+
+//------------------------------------------------------------------------------
+// Extrinsics test
+
+// Corner of a room with a row of boxes on the floor, in camera 0 coordinates:
+// (x, y, z) = (+right, -up, +forward)
+static void GenerateRoomScene(std::vector<Eigen::Vector3f>& points)
+{
+    points.clear();
+
+    const float step = 0.005f;
+    std::mt19937 prng(1234);
+    std::uniform_real_distribution<float> noise(-0.001f, 0.001f);
+
+    auto add_point = [&](float x, float y, float z) {
+        points.emplace_back(x + noise(prng), y + noise(prng), z + noise(prng));
+    };
+
+    for (float a = -1.f; a < 1.f; a += step) {
+        for (float b = 1.f; b < 2.5f; b += step) {
+            add_point(a, 0.8f, b); // Floor
+        }
+        for (float b = -0.8f; b < 0.8f; b += step) {
+            add_point(a, b, 2.5f); // Back wall
+        }
+    }
+    for (float a = -0.8f; a < 0.8f; a += step) {
+        for (float b = 1.f; b < 2.5f; b += step) {
+            add_point(-1.f, a, b); // Left wall
+        }
+    }
+
+    // Each box has a front, top and left side so any part of the room
+    // constrains all six degrees of freedom
+    for (float x = -0.8f; x < 1.f; x += 0.4f)
+    {
+        const float size = 0.2f;
+        const float top = 0.8f - size - (x + 1.f) * 0.1f;
+        for (float a = x; a < x + size; a += step) {
+            for (float b = top; b < 0.8f; b += step) {
+                add_point(a, b, 1.6f); // Box front
+            }
+            for (float b = 1.6f; b < 1.6f + size; b += step) {
+                add_point(a, top, b); // Box top
+            }
+        }
+        for (float a = top; a < 0.8f; a += step) {
+            for (float b = 1.6f; b < 1.6f + size; b += step) {
+                add_point(x, a, b); // Box side
+            }
+        }
+    }
+}
+
+static Eigen::Matrix4f MakeTestTransform(float yaw_degrees, float pitch_degrees, float tx, float ty, float tz)
+{
+    const float degrees = 3.14159265f / 180.f;
+    Eigen::Affine3f transform(
+        Eigen::Translation3f(tx, ty, tz) *
+        Eigen::AngleAxisf(yaw_degrees * degrees, Eigen::Vector3f::UnitY()) *
+        Eigen::AngleAxisf(pitch_degrees * degrees, Eigen::Vector3f::UnitX()));
+    return transform.matrix();
+}
+
+static bool CheckTransform(int camera_index, const Eigen::Matrix4f& result, const Eigen::Matrix4f& expected)
+{
+    const Eigen::Matrix4f error = expected.inverse() * result;
+
+    const float translation_error = error.block<3, 1>(0, 3).norm();
+    const Eigen::AngleAxisf rotation_error(Eigen::Matrix3f(error.block<3, 3>(0, 0)));
+    const float angle_error = std::abs(rotation_error.angle()) * 180.f / 3.14159265f;
+
+    spdlog::info("Camera {} error: translation={} mm rotation={} degrees",
+        camera_index, translation_error * 1000.f, angle_error);
+
+    if (translation_error > 0.003f || angle_error > 0.15f) {
+        spdlog::error("Camera {} registration is too far from the expected transform", camera_index);
+        return false;
+    }
+    return true;
+}
+
+static bool CheckResiduals(const std::vector<float>& residuals, int camera_count)
+{
+    if ((int)residuals.size() != camera_count) {
+        spdlog::error("Missing residuals");
+        return false;
+    }
+    for (int i = 0; i < camera_count; ++i) {
+        // Sample noise is up to 1 mm on each axis
+        if (residuals[i] <= 0.f || residuals[i] > 0.003f) {
+            spdlog::error("Camera {} residual {} mm is out of range", i, residuals[i] * 1000.f);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ExtrinsicsTest(int camera_count)
+{
+    std::vector<Eigen::Vector3f> scene;
+    GenerateRoomScene(scene);
+
+    // Ground truth: Transform from camera i to camera 0
+    std::vector<Eigen::Matrix4f> expected(camera_count);
+    for (int i = 0; i < camera_count; ++i) {
+        const float sign = (i % 2 == 0) ? 1.f : -1.f;
+        expected[i] = MakeTestTransform(sign * 2.f * i, 0.5f * i, 0.03f * i, -0.01f * i, 0.02f * i);
+    }
+
+    CameraCalibration calibration{};
+    calibration.Color.Width = 64;
+    calibration.Color.Height = 48;
+    calibration.Color.cx = 32.f;
+    calibration.Color.cy = 24.f;
+    calibration.Color.fx = 50.f;
+    calibration.Color.fy = 50.f;
+
+    struct TestCamera
+    {
+        std::vector<float> Floats;
+        std::vector<uint8_t> Y, UV;
+    };
+    std::vector<TestCamera> cameras(camera_count);
+    std::vector<VerticesInfo> vertices(camera_count);
+
+    for (int i = 0; i < camera_count; ++i)
+    {
+        auto& camera = cameras[i];
+        const Eigen::Matrix4f to_camera = expected[i].inverse();
+
+        camera.Floats.reserve(scene.size() * 5);
+        for (const auto& p : scene) {
+            const Eigen::Vector4f q = to_camera * Eigen::Vector4f(p.x(), p.y(), p.z(), 1.f);
+            camera.Floats.insert(camera.Floats.end(), { q.x(), q.y(), q.z(), 0.5f, 0.5f });
+        }
+        camera.Y.resize(64 * 48);
+        camera.UV.resize(32 * 24 * 2);
+        for (size_t j = 0; j < camera.Y.size(); ++j) {
+            camera.Y[j] = static_cast<uint8_t>( j * 7 + i );
+        }
+        for (size_t j = 0; j < camera.UV.size(); ++j) {
+            camera.UV[j] = static_cast<uint8_t>( j * 3 + i );
+        }
+
+        auto& info = vertices[i];
+        info.FloatsCount = static_cast<uint32_t>( camera.Floats.size() );
+        info.XyzuvVertices = camera.Floats.data();
+        info.Accelerometer[0] = 0.f;
+        info.Accelerometer[1] = 0.f;
+        info.Accelerometer[2] = 9.8f;
+        info.Width = 64;
+        info.Height = 48;
+        info.Y = camera.Y.data();
+        info.ChromaWidth = 32;
+        info.ChromaHeight = 24;
+        info.UV = camera.UV.data();
+
+        // Leave one camera without calibration to exercise the older format
+        info.Calibration = (i == 1) ? nullptr : &calibration;
+    }
+
+    // Calibrate offline from the saved dump:
+
+    const std::string dump_path = "extrinsics_test_dump.bin";
+    if (!SaveVerticesDump(dump_path, vertices)) {
+        spdlog::error("SaveVerticesDump failed");
+        return false;
+    }
+
+    std::vector<std::shared_ptr<VerticesDump>> dumps;
+    if (!LoadVerticesDump(dump_path, dumps) || (int)dumps.size() != camera_count) {
+        spdlog::error("LoadVerticesDump failed");
+        return false;
+    }
+
+    std::vector<VerticesInfo> loaded;
+    for (int i = 0; i < camera_count; ++i)
+    {
+        const VerticesInfo& a = vertices[i];
+        const VerticesInfo& b = dumps[i]->Info;
+
+        if (a.FloatsCount != b.FloatsCount ||
+            a.Width != b.Width || a.Height != b.Height ||
+            a.ChromaWidth != b.ChromaWidth || a.ChromaHeight != b.ChromaHeight ||
+            0 != memcmp(a.Accelerometer, b.Accelerometer, sizeof(a.Accelerometer)) ||
+            0 != memcmp(a.XyzuvVertices, b.XyzuvVertices, a.FloatsCount * sizeof(float)) ||
+            0 != memcmp(a.Y, b.Y, a.Width * a.Height) ||
+            0 != memcmp(a.UV, b.UV, a.ChromaWidth * a.ChromaHeight * 2))
+        {
+            spdlog::error("Loaded camera {} does not match", i);
+            return false;
+        }
+        if (!a.Calibration != !b.Calibration || (a.Calibration && *a.Calibration != *b.Calibration)) {
+            spdlog::error("Loaded camera {} calibration does not match", i);
+            return false;
+        }
+
+        loaded.push_back(b);
+    }
+
+    // Initial guess is a bit off from the truth, and camera 0 has a center transform
+    const Eigen::Matrix4f center_transform = MakeTestTransform(30.f, -5.f, 0.1f, 0.5f, -2.f);
+
+    std::vector<AlignmentTransform> extrinsics(camera_count);
+    extrinsics[0] = center_transform;
+    for (int i = 1; i < camera_count; ++i) {
+        extrinsics[i] = center_transform * expected[i] * MakeTestTransform(0.2f, -0.2f, 0.004f, -0.003f, 0.004f);
+    }
+
+    const uint64_t t0 = GetTimeUsec();
+
+    std::vector<float> residuals;
+    if (!RefineExtrinsics(loaded, extrinsics, &residuals)) {
+        spdlog::error("RefineExtrinsics failed");
+        return false;
+    }
+
+    const uint64_t t1 = GetTimeUsec();
+
+    if (!CheckResiduals(residuals, camera_count)) {
+        return false;
+    }
+
+    const Eigen::Matrix4f inv_center_transform = center_transform.inverse();
+    for (int i = 1; i < camera_count; ++i)
+    {
+        Eigen::Matrix4f result;
+        extrinsics[i].Set(result);
+        if (!CheckTransform(i, inv_center_transform * result, expected[i])) {
+            return false;
+        }
+    }
+
+    spdlog::info("Registered {} cameras of {} points in {} msec",
+        camera_count, scene.size(), (t1 - t0) / 1000.0);
+
+    return true;
+}
+
+// Cameras in a row that each see a window of the room, so only neighbors
+// overlap and the far cameras cannot be registered to camera 0 directly
+static bool ExtrinsicsRingTest(int camera_count)
+{
+    std::vector<Eigen::Vector3f> scene;
+    GenerateRoomScene(scene);
+
+    const float window = 0.8f;
+    const float spacing = (2.f - window) / (camera_count - 1);
+
+    std::vector<Eigen::Matrix4f> expected(camera_count);
+    std::vector<std::vector<float>> floats(camera_count);
+    std::vector<VerticesInfo> vertices(camera_count);
+
+    for (int i = 0; i < camera_count; ++i)
+    {
+        expected[i] = MakeTestTransform(-1.f * i, 0.3f * i, 0.02f * i, 0.f, -0.01f * i);
+        const Eigen::Matrix4f to_camera = expected[i].inverse();
+
+        const float x_min = -1.f + spacing * i;
+        for (const auto& p : scene) {
+            if (p.x() < x_min - 0.01f || p.x() >= x_min + window) {
+                continue;
+            }
+            const Eigen::Vector4f q = to_camera * Eigen::Vector4f(p.x(), p.y(), p.z(), 1.f);
+            floats[i].insert(floats[i].end(), { q.x(), q.y(), q.z(), 0.5f, 0.5f });
+        }
+
+        vertices[i].FloatsCount = static_cast<uint32_t>( floats[i].size() );
+        vertices[i].XyzuvVertices = floats[i].data();
+    }
+
+    std::vector<AlignmentTransform> extrinsics(camera_count);
+    extrinsics[0] = Eigen::Matrix4f::Identity();
+    for (int i = 1; i < camera_count; ++i) {
+        extrinsics[i] = expected[i] * MakeTestTransform(-0.2f, 0.2f, -0.004f, 0.003f, 0.004f);
+    }
+
+    const uint64_t t0 = GetTimeUsec();
+
+    std::vector<float> residuals;
+    if (!RefineExtrinsics(vertices, extrinsics, &residuals)) {
+        spdlog::error("RefineExtrinsics failed");
+        return false;
+    }
+
+    const uint64_t t1 = GetTimeUsec();
+
+    if (!CheckResiduals(residuals, camera_count)) {
+        return false;
+    }
+    for (int i = 1; i < camera_count; ++i)
+    {
+        Eigen::Matrix4f result;
+        extrinsics[i].Set(result);
+        if (!CheckTransform(i, result, expected[i])) {
+            return false;
+        }
+    }
+
+    spdlog::info("Registered ring of {} cameras in {} msec", camera_count, (t1 - t0) / 1000.0);
+
+    return true;
+}
+
+static bool ExtrinsicsTests()
+{
+    spdlog::info("Extrinsics test");
+
+    return ExtrinsicsTest(2) && ExtrinsicsTest(5) && ExtrinsicsRingTest(4);
+}
+
+// Camera 1 is bumped after calibration, and the tracker should follow it
+static bool ExtrinsicsTrackerTest()
+{
+    spdlog::info("Extrinsics tracker test");
+
+    std::vector<Eigen::Vector3f> scene;
+    GenerateRoomScene(scene);
+
+    const Eigen::Matrix4f calibrated = MakeTestTransform(-3.f, 1.f, 0.05f, 0.01f, 0.02f);
+    const Eigen::Matrix4f drifted = calibrated * MakeTestTransform(0.3f, -0.2f, 0.004f, 0.002f, -0.003f);
+    const Eigen::Matrix4f center_transform = MakeTestTransform(10.f, 0.f, 0.f, 0.5f, -1.f);
+
+    std::vector<float> floats_0, floats_1;
+    for (const auto& p : scene) {
+        floats_0.insert(floats_0.end(), { p.x(), p.y(), p.z(), 0.5f, 0.5f });
+    }
+
+    std::vector<VerticesInfo> vertices(2);
+    vertices[0].FloatsCount = static_cast<uint32_t>( floats_0.size() );
+    vertices[0].XyzuvVertices = floats_0.data();
+
+    auto set_camera_1 = [&](const Eigen::Matrix4f& transform) {
+        const Eigen::Matrix4f to_camera = transform.inverse();
+        floats_1.clear();
+        for (const auto& p : scene) {
+            const Eigen::Vector4f q = to_camera * Eigen::Vector4f(p.x(), p.y(), p.z(), 1.f);
+            floats_1.insert(floats_1.end(), { q.x(), q.y(), q.z(), 0.5f, 0.5f });
+        }
+        vertices[1].FloatsCount = static_cast<uint32_t>( floats_1.size() );
+        vertices[1].XyzuvVertices = floats_1.data();
+    };
+
+    std::vector<AlignmentTransform> extrinsics(2);
+    extrinsics[0] = center_transform;
+    extrinsics[1] = center_transform * calibrated;
+
+    ExtrinsicsTracker tracker;
+
+    // Nothing moved: Should not publish
+    set_camera_1(calibrated);
+    for (int frame = 0; frame < 10; ++frame) {
+        if (tracker.Update(vertices, extrinsics)) {
+            spdlog::error("Tracker published an update without drift");
+            return false;
+        }
+    }
+
+    // Bumped
+    set_camera_1(drifted);
+
+    const uint64_t t0 = GetTimeUsec();
+
+    int updates = 0;
+    const int frame_count = 30;
+    for (int frame = 0; frame < frame_count; ++frame) {
+        if (tracker.Update(vertices, extrinsics)) {
+            ++updates;
+        }
+    }
+
+    const uint64_t t1 = GetTimeUsec();
+
+    if (updates == 0) {
+        spdlog::error("Tracker did not publish an update after drift");
+        return false;
+    }
+
+    Eigen::Matrix4f result;
+    extrinsics[1].Set(result);
+    if (!CheckTransform(1, center_transform.inverse() * result, drifted)) {
+        return false;
+    }
+
+    spdlog::info("Tracked drift with {} updates in {} msec per frame",
+        updates, (t1 - t0) / 1000.0 / frame_count);
+
+    return true;
+}
+
+// Full calibration of a dump saved from the viewer
+static bool DumpCalibrationTest(const char* dump_path)
+{
+    spdlog::info("Calibrating from {}", dump_path);
+
+    std::vector<std::shared_ptr<VerticesDump>> dumps;
+    if (!LoadVerticesDump(dump_path, dumps)) {
+        spdlog::error("LoadVerticesDump failed");
+        return false;
+    }
+
+    std::vector<VerticesInfo> vertices;
+    for (auto& dump : dumps) {
+        vertices.push_back(dump->Info);
+    }
+
+    std::vector<AlignmentTransform> extrinsics;
+    const uint64_t t0 = GetTimeUsec();
+    if (!CalculateExtrinsics(vertices, extrinsics)) {
+        spdlog::error("CalculateExtrinsics failed");
+        return false;
+    }
+    const uint64_t t1 = GetTimeUsec();
+    if (!RefineExtrinsics(vertices, extrinsics)) {
+        spdlog::error("RefineExtrinsics failed");
+        return false;
+    }
+    const uint64_t t2 = GetTimeUsec();
+
+    spdlog::info("Calibrated {} cameras: full={} msec refine={} msec",
+        vertices.size(), (t1 - t0) / 1000.0, (t2 - t1) / 1000.0);
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Entrypoint
+
+int main(int argc, char* argv[])
+{
+    SetCurrentThreadName("Main");
+
+    SetupAsyncDiskLog("depth_mesh_tests.txt");
+
+    if (!MeshSimdTests()) {
+        spdlog::error("Mesh SIMD test failed");
+        return -1;
+    }
+    if (!BandedMeshTests()) {
+        spdlog::error("Banded meshing test failed");
+        return -1;
+    }
+    if (!CompactVerticesTests()) {
+        spdlog::error("Compact vertices test failed");
+        return -1;
+    }
+    if (!ClipCropTests()) {
+        spdlog::error("Clip crop test failed");
+        return -1;
+    }
+    if (!TemporalFilterTests()) {
+        spdlog::error("Temporal filter test failed");
+        return -1;
+    }
+    if (!EdgeFilterTests()) {
+        spdlog::error("Edge filter test failed");
+        return -1;
+    }
+    if (!DeltaMeshTests()) {
+        spdlog::error("Delta mesh test failed");
+        return -1;
+    }
+    if (!LodMeshTests()) {
+        spdlog::error("LOD mesh test failed");
+        return -1;
+    }
+    if (!CloudLightingTests()) {
+        spdlog::error("Cloud lighting test failed");
+        return -1;
+    }
+    if (!ExtrinsicsTests()) {
+        spdlog::error("Extrinsics test failed");
+        return -1;
+    }
+    if (!ExtrinsicsTrackerTest()) {
+        spdlog::error("Extrinsics tracker test failed");
+        return -1;
+    }
+
+    // Optional: Saved raw_mesh.bin from the viewer
+    if (argc >= 2 && !DumpCalibrationTest(argv[1])) {
+        spdlog::error("Dump calibration test failed");
+        return -1;
+    }
 
     IlluminationInvariantTest();
 
@@ -6,9 +6,86 @@
 
 #include <vectormath.hpp>
 
+#include <vector>
+
 namespace core {
 
 
+//------------------------------------------------------------------------------
+// Delta Mesh
+
+/*
+    Delta mesh mode keeps the mesh in GPU buffers between frames and only
+    uploads the blocks of vertices and indices that changed since the last
+    upload (see DepthMeshDelta in depth_mesh).  Each block of indices is
+    drawn up to its used count with one glMultiDrawElements() call.
+*/
+
+// One update of a delta mesh.  Mirrors DepthMeshDelta in depth_mesh
+struct MeshDeltaUpdate
+{
+    // Versions are only comparable within a stream
+    uint32_t StreamId = 0;
+
+    // Blocks with versions after the last uploaded version are uploaded
+    uint32_t Version = 0;
+
+    int BlockCount = 0;
+    int BlockFloats = 0; // x,y,z,u,v floats per block
+    int BlockIndices = 0; // Indices per block
+
+    const float* Coordinates = nullptr; // BlockCount * BlockFloats
+    const uint32_t* Indices = nullptr; // BlockCount * BlockIndices
+    const uint32_t* BlockIndexCounts = nullptr; // Used indices per block
+
+    // Version of the update in which each block last changed
+    const uint32_t* VertexVersions = nullptr;
+    const uint32_t* IndexVersions = nullptr;
+};
+
+// Tracks the blocks of a delta mesh held in a renderer's mesh buffers
+class MeshDeltaUploader
+{
+public:
+    // Upload the blocks that changed, or everything if the buffers hold a
+    // different stream or a later version
+    void Upload(
+        GLuint vao,
+        GLuint vbo,
+        GLuint ebo,
+        const MeshDeltaUpdate& update);
+
+    // Call when the mesh buffers are replaced with a regular mesh
+    void Invalidate()
+    {
+        BlockCount = 0;
+    }
+
+    bool IsValid() const
+    {
+        return BlockCount > 0;
+    }
+
+    // Draw the used indices of every block from the bound element buffer
+    void Draw();
+
+    // Bytes uploaded by the last Upload()
+    size_t GetUploadBytes() const
+    {
+        return UploadBytes;
+    }
+
+protected:
+    uint32_t StreamId = 0;
+    uint32_t Version = 0;
+    int BlockCount = 0;
+    size_t UploadBytes = 0;
+
+    std::vector<GLsizei> DrawCounts;
+    std::vector<const void*> DrawOffsets;
+};
+
+
 //------------------------------------------------------------------------------
 // OpenGL YUV Multi-plane Video Frame Renderer
 
@@ -35,6 +112,18 @@ public:
         const uint32_t* indices_ptr,
         int indices_count); // Number of uint32_t's
 
+    // Compact vertices: Repeated uint16_t x,y,z,u,v
+    // Position = position_scale * (int16_t)(x,y,z), texture coordinate = (u,v) / 65535
+    bool UpdateCompactMesh(
+        const uint16_t* vertices_ptr,
+        int vertex_count, // Number of vertices
+        float position_scale,
+        const uint32_t* indices_ptr,
+        int indices_count); // Number of uint32_t's
+
+    // Delta mesh mode, see MeshDeltaUploader
+    bool UpdateMeshDelta(const MeshDeltaUpdate& update);
+
     // Render the texture to the screen
     bool Render(Matrix4& mvp);
 
@@ -44,6 +133,7 @@ protected:
     GLuint TexY = 0, TexU = 0, TexV = 0;
     GLuint UniformTexY = 0, UniformTexU = 0, UniformTexV = 0;
     GLuint UniformMVPMatrix = 0;
+    GLuint UniformPositionScale = 0;
     Program MyProgram;
 
     GLuint VAO = 0;
@@ -51,6 +141,12 @@ protected:
     GLuint EBO = 0;
 
     int TriangleIndexCount = 0;
+
+    // Vertex format of the last mesh update
+    bool CompactMesh = false;
+    float PositionScale = 1.f;
+
+    MeshDeltaUploader Delta;
 };
 
 
@@ -79,6 +175,18 @@ public:
         const uint32_t* indices_ptr,
         int indices_count); // Number of uint32_t's
 
+    // Compact vertices: Repeated uint16_t x,y,z,u,v
+    // Position = position_scale * (int16_t)(x,y,z), texture coordinate = (u,v) / 65535
+    bool UpdateCompactMesh(
+        const uint16_t* vertices_ptr,
+        int vertex_count, // Number of vertices
+        float position_scale,
+        const uint32_t* indices_ptr,
+        int indices_count); // Number of uint32_t's
+
+    // Delta mesh mode, see MeshDeltaUploader
+    bool UpdateMeshDelta(const MeshDeltaUpdate& update);
+
     // Render the texture to the screen
     bool Render(Matrix4& mvp, const float* camera_pos);
 
@@ -88,6 +196,7 @@ protected:
     GLuint TexY = 0, TexUV = 0;
     GLuint UniformTexY = 0, UniformTexUV = 0;
     GLuint UniformMVPMatrix = 0;
+    GLuint UniformPositionScale = 0;
     GLuint UniformCameraPos = 0;
     Program MyProgram;
 
@@ -96,6 +205,12 @@ protected:
     GLuint EBO = 0;
 
     int TriangleIndexCount = 0;
+
+    // Vertex format of the last mesh update
+    bool CompactMesh = false;
+    float PositionScale = 1.f;
+
+    MeshDeltaUploader Delta;
 };
 
 
@@ -7,19 +7,211 @@
 namespace core {
 
 
+//------------------------------------------------------------------------------
+// Mesh Tools
+
+// Replace the vertex and index buffers for a mesh
+static void UploadMeshBuffers(
+    GLuint vao,
+    GLuint vbo,
+    GLuint ebo,
+    const void* vertices_ptr,
+    size_t vertex_bytes,
+    const uint32_t* indices_ptr,
+    int indices_count)
+{
+    glBindVertexArray(vao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(
+        GL_ARRAY_BUFFER,
+        vertex_bytes,
+        nullptr,
+        GL_STREAM_DRAW);
+    glBufferData(
+        GL_ARRAY_BUFFER,
+        vertex_bytes,
+        vertices_ptr,
+        GL_STREAM_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(
+        GL_ELEMENT_ARRAY_BUFFER,
+        indices_count * sizeof(uint32_t),
+        nullptr,
+        GL_STREAM_DRAW);
+    glBufferData(
+        GL_ELEMENT_ARRAY_BUFFER,
+        indices_count * sizeof(uint32_t),
+        indices_ptr,
+        GL_STREAM_DRAW);
+
+    glBindVertexArray(0);
+}
+
+// Point attribute 0 (position) and 1 (texture coordinate) at the bound buffer
+static void SetMeshAttributes(bool compact)
+{
+    if (compact)
+    {
+        const GLsizei stride = 5 * sizeof(uint16_t);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(
+            0,
+            3,
+            GL_SHORT,
+            GL_FALSE,
+            stride,
+            GL_VERTEX_ATTRIB_OFFSET(0));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(
+            1,
+            2,
+            GL_UNSIGNED_SHORT,
+            GL_TRUE, // Normalize to 0..1
+            stride,
+            GL_VERTEX_ATTRIB_OFFSET(3 * sizeof(uint16_t)));
+    }
+    else
+    {
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(
+            0,
+            3,
+            GL_FLOAT,
+            GL_FALSE,
+            5 * sizeof(float),
+            GL_VERTEX_ATTRIB_OFFSET(0));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(
+            1,
+            2,
+            GL_FLOAT,
+            GL_FALSE,
+            5 * sizeof(float),
+            GL_VERTEX_ATTRIB_OFFSET(3 * sizeof(float)));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MeshDeltaUploader
+
+// Upload the blocks with versions after since_version, merging adjacent blocks
+static size_t UploadChangedBlocks(
+    GLenum target,
+    const void* data,
+    size_t block_bytes,
+    const uint32_t* versions,
+    int block_count,
+    uint32_t since_version)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>( data );
+    size_t uploaded = 0;
+
+    int block = 0;
+    while (block < block_count)
+    {
+        if (versions[block] <= since_version) {
+            ++block;
+            continue;
+        }
+
+        const int first = block;
+        while (block < block_count && versions[block] > since_version) {
+            ++block;
+        }
+
+        const size_t offset = first * block_bytes;
+        const size_t size = (block - first) * block_bytes;
+        glBufferSubData(target, offset, size, bytes + offset);
+        uploaded += size;
+    }
+
+    return uploaded;
+}
+
+void MeshDeltaUploader::Upload(
+    GLuint vao,
+    GLuint vbo,
+    GLuint ebo,
+    const MeshDeltaUpdate& update)
+{
+    const size_t vertex_block_bytes = update.BlockFloats * sizeof(float);
+    const size_t index_block_bytes = update.BlockIndices * sizeof(uint32_t);
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+
+    if (BlockCount != update.BlockCount ||
+        StreamId != update.StreamId ||
+        Version > update.Version)
+    {
+        // Replace the buffers
+        const size_t vertex_bytes = update.BlockCount * vertex_block_bytes;
+        const size_t index_bytes = update.BlockCount * index_block_bytes;
+        glBufferData(GL_ARRAY_BUFFER, vertex_bytes, update.Coordinates, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, update.Indices, GL_DYNAMIC_DRAW);
+        UploadBytes = vertex_bytes + index_bytes;
+    }
+    else
+    {
+        UploadBytes = UploadChangedBlocks(
+            GL_ARRAY_BUFFER,
+            update.Coordinates,
+            vertex_block_bytes,
+            update.VertexVersions,
+            update.BlockCount,
+            Version);
+        UploadBytes += UploadChangedBlocks(
+            GL_ELEMENT_ARRAY_BUFFER,
+            update.Indices,
+            index_block_bytes,
+            update.IndexVersions,
+            update.BlockCount,
+            Version);
+    }
+
+    glBindVertexArray(0);
+
+    StreamId = update.StreamId;
+    Version = update.Version;
+    BlockCount = update.BlockCount;
+
+    DrawCounts.resize(BlockCount);
+    DrawOffsets.resize(BlockCount);
+    for (int i = 0; i < BlockCount; ++i) {
+        DrawCounts[i] = static_cast<GLsizei>( update.BlockIndexCounts[i] );
+        DrawOffsets[i] = reinterpret_cast<const void*>( i * index_block_bytes );
+    }
+}
+
+void MeshDeltaUploader::Draw()
+{
+    glMultiDrawElements(
+        GL_TRIANGLES,
+        DrawCounts.data(),
+        GL_UNSIGNED_INT,
+        DrawOffsets.data(),
+        BlockCount);
+}
+
+
 //------------------------------------------------------------------------------
 // OpenGL YUV Multi-plane Video Frame Renderer
 
 static const char* m_YUVVideoVertexShader = R"(
     #version 330 core
     uniform mat4 MVPMatrix;
-    layout (location = 0) in vec4 aPos;
+    uniform float PositionScale;
+    layout (location = 0) in vec3 aPos;
     layout (location = 1) in vec2 aTexCoord;
     out vec2 TexCoord;
     out vec4 TexPos;
     void main()
     {
-        gl_Position = MVPMatrix * aPos;
+        gl_Position = MVPMatrix * vec4(PositionScale * aPos, 1.0);
         TexPos = gl_Position;
         TexCoord = aTexCoord;
     }
@@ -90,6 +282,7 @@ bool YUVVideoMeshRender::Initialize()
     UniformTexU = glGetUniformLocation(MyProgram.ProgramId, "TexU");
     UniformTexV = glGetUniformLocation(MyProgram.ProgramId, "TexV");
     UniformMVPMatrix = glGetUniformLocation(MyProgram.ProgramId, "MVPMatrix");
+    UniformPositionScale = glGetUniformLocation(MyProgram.ProgramId, "PositionScale");
 
     return IsGLOkay();
 }
@@ -173,35 +366,53 @@ bool YUVVideoMeshRender::UpdateMesh(
     const uint32_t* indices_ptr,
     int indices_count)
 {
-    glBindVertexArray(VAO);
-
-    glBindBuffer(GL_ARRAY_BUFFER, VBO_Coords);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        floats_count * sizeof(float),
-        nullptr,
-        GL_STREAM_DRAW);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        floats_count * sizeof(float),
+    UploadMeshBuffers(
+        VAO,
+        VBO_Coords,
+        EBO,
         xyzuv_ptr,
-        GL_STREAM_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        indices_count * sizeof(uint32_t),
-        nullptr,
-        GL_STREAM_DRAW);
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        indices_count * sizeof(uint32_t),
+        floats_count * sizeof(float),
         indices_ptr,
-        GL_STREAM_DRAW);
+        indices_count);
 
-    glBindVertexArray(0);
+    TriangleIndexCount = indices_count;
+    Delta.Invalidate();
+    CompactMesh = false;
+    PositionScale = 1.f;
+
+    return IsGLOkay();
+}
+
+bool YUVVideoMeshRender::UpdateCompactMesh(
+    const uint16_t* vertices_ptr,
+    int vertex_count,
+    float position_scale,
+    const uint32_t* indices_ptr,
+    int indices_count)
+{
+    UploadMeshBuffers(
+        VAO,
+        VBO_Coords,
+        EBO,
+        vertices_ptr,
+        vertex_count * 5 * sizeof(uint16_t),
+        indices_ptr,
+        indices_count);
 
     TriangleIndexCount = indices_count;
+    Delta.Invalidate();
+    CompactMesh = true;
+    PositionScale = position_scale;
+
+    return IsGLOkay();
+}
+
+bool YUVVideoMeshRender::UpdateMeshDelta(const MeshDeltaUpdate& update)
+{
+    Delta.Upload(VAO, VBO_Coords, EBO, update);
+
+    CompactMesh = false;
+    PositionScale = 1.f;
 
     return IsGLOkay();
 }
@@ -236,29 +447,20 @@ bool YUVVideoMeshRender::Render(Matrix4& mvp)
     float* m = mvp.GetPtr();
     glUniformMatrix4fv(UniformMVPMatrix, 1, GL_FALSE, m);
 
+    glUniform1f(UniformPositionScale, PositionScale);
+
     glBindBuffer(GL_ARRAY_BUFFER, VBO_Coords);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(
-        0,
-        3,
-        GL_FLOAT,
-        GL_FALSE,
-        5 * sizeof(float),
-        GL_VERTEX_ATTRIB_OFFSET(0));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(
-        1,
-        2,
-        GL_FLOAT,
-        GL_FALSE,
-        5 * sizeof(float),
-        GL_VERTEX_ATTRIB_OFFSET(3 * sizeof(float)));
-
-    glDrawElements(
-        GL_TRIANGLES,
-        TriangleIndexCount,
-        GL_UNSIGNED_INT,
-        0);
+    SetMeshAttributes(CompactMesh);
+
+    if (Delta.IsValid()) {
+        Delta.Draw();
+    } else {
+        glDrawElements(
+            GL_TRIANGLES,
+            TriangleIndexCount,
+            GL_UNSIGNED_INT,
+            0);
+    }
 
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
@@ -293,13 +495,14 @@ static const char* m_NV12VideoVertexShader = R"(
     #version 330 core
     uniform mat4 MVPMatrix;
     uniform vec4 CameraPos;
-    layout (location = 0) in vec4 aPos;
+    uniform float PositionScale;
+    layout (location = 0) in vec3 aPos;
     layout (location = 1) in vec2 aTexCoord;
     out vec2 TexCoord;
     out vec4 TexPos;
     void main()
     {
-        vec4 p = MVPMatrix * aPos;
+        vec4 p = MVPMatrix * vec4(PositionScale * aPos, 1.0);
 
         //float offset = length(CameraPos.xyz - p.xyz) / CameraPos.w;
         //p.z = (p.z * 0.5) - 0.5 + offset;
@@ -373,6 +576,7 @@ bool NV12VideoMeshRender::Initialize()
     UniformTexY = glGetUniformLocation(MyProgram.ProgramId, "TexY");
     UniformTexUV = glGetUniformLocation(MyProgram.ProgramId, "TexUV");
     UniformMVPMatrix = glGetUniformLocation(MyProgram.ProgramId, "MVPMatrix");
+    UniformPositionScale = glGetUniformLocation(MyProgram.ProgramId, "PositionScale");
     UniformCameraPos = glGetUniformLocation(MyProgram.ProgramId, "CameraPos");
 
     return IsGLOkay();
@@ -442,35 +646,53 @@ bool NV12VideoMeshRender::UpdateMesh(
     const uint32_t* indices_ptr,
     int indices_count)
 {
-    glBindVertexArray(VAO);
-
-    glBindBuffer(GL_ARRAY_BUFFER, VBO_Coords);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        floats_count * sizeof(float),
-        nullptr,
-        GL_STREAM_DRAW);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        floats_count * sizeof(float),
+    UploadMeshBuffers(
+        VAO,
+        VBO_Coords,
+        EBO,
         xyzuv_ptr,
-        GL_STREAM_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        indices_count * sizeof(uint32_t),
-        nullptr,
-        GL_STREAM_DRAW);
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        indices_count * sizeof(uint32_t),
+        floats_count * sizeof(float),
         indices_ptr,
-        GL_STREAM_DRAW);
+        indices_count);
 
-    glBindVertexArray(0);
+    TriangleIndexCount = indices_count;
+    Delta.Invalidate();
+    CompactMesh = false;
+    PositionScale = 1.f;
+
+    return IsGLOkay();
+}
+
+bool NV12VideoMeshRender::UpdateCompactMesh(
+    const uint16_t* vertices_ptr,
+    int vertex_count,
+    float position_scale,
+    const uint32_t* indices_ptr,
+    int indices_count)
+{
+    UploadMeshBuffers(
+        VAO,
+        VBO_Coords,
+        EBO,
+        vertices_ptr,
+        vertex_count * 5 * sizeof(uint16_t),
+        indices_ptr,
+        indices_count);
 
     TriangleIndexCount = indices_count;
+    Delta.Invalidate();
+    CompactMesh = true;
+    PositionScale = position_scale;
+
+    return IsGLOkay();
+}
+
+bool NV12VideoMeshRender::UpdateMeshDelta(const MeshDeltaUpdate& update)
+{
+    Delta.Upload(VAO, VBO_Coords, EBO, update);
+
+    CompactMesh = false;
+    PositionScale = 1.f;
 
     return IsGLOkay();
 }
@@ -503,29 +725,20 @@ bool NV12VideoMeshRender::Render(Matrix4& mvp, const float* camera_pos)
 
     glUniform4fv(UniformCameraPos, 1, camera_pos);
 
+    glUniform1f(UniformPositionScale, PositionScale);
+
     glBindBuffer(GL_ARRAY_BUFFER, VBO_Coords);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(
-        0,
-        3,
-        GL_FLOAT,
-        GL_FALSE,
-        5 * sizeof(float),
-        GL_VERTEX_ATTRIB_OFFSET(0));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(
-        1,
-        2,
-        GL_FLOAT,
-        GL_FALSE,
-        5 * sizeof(float),
-        GL_VERTEX_ATTRIB_OFFSET(3 * sizeof(float)));
-
-    glDrawElements(
-        GL_TRIANGLES,
-        TriangleIndexCount,
-        GL_UNSIGNED_INT,
-        0);
+    SetMeshAttributes(CompactMesh);
+
+    if (Delta.IsValid()) {
+        Delta.Draw();
+    } else {
+        glDrawElements(
+            GL_TRIANGLES,
+            TriangleIndexCount,
+            GL_UNSIGNED_INT,
+            0);
+    }
 
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);